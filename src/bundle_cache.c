@@ -37,141 +37,526 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "sync.h"
 #include "lbard.h"
 #include "util.h"
 
+// The cache holds several recently sent bundles, so that when we alternate
+// between peers that are being sent different bundles, each packet doesn't
+// evict the previous bundle and fetch it all again from servald.
+// The cached_* globals always describe the entry that prime_bundle_cache()
+// most recently returned.
+struct cached_bundle {
+  char bid_hex[32*2+1];
+  long long version;
+  int manifest_len;
+  unsigned char *manifest;
+  int manifest_encoded_len;
+  unsigned char *manifest_encoded;
+  // Only a window of the body is held, starting at body_offset.
+  int body_offset;
+  int body_len;
+  unsigned char *body;
+  // Length of the whole body, or -1 if we haven't asked servald yet.
+  int body_total_len;
+  // Where the sender is up to in the body, and so what of the window we
+  // still need when more of the body arrives.
+  int keep_from;
+  // Set while the window that follows this one is being fetched in the
+  // background (see bundle_cache_prefetch()).
+  int prefetching;
+  // Value of bundle_cache_clock when this entry was last used
+  long long last_used;
+};
+
+#define BUNDLE_CACHE_ENTRIES 16
+
+// Bodies are fetched from servald in windows of this many bytes, using HTTP
+// range requests, so that we don't hold all of a large bundle in memory just
+// to send it a piece at a time.
+#define BUNDLE_CACHE_WINDOW (64*1024)
+// Start fetching the next window once the cursor is this close to the end of
+// the current one.
+#define BUNDLE_CACHE_PREFETCH (16*1024)
+// What we must have in hand to build the next packet: no piece is longer
+// than a packet.
+#define BUNDLE_CACHE_NEED LINK_MTU
+struct cached_bundle bundle_cache[BUNDLE_CACHE_ENTRIES];
+long long bundle_cache_clock=0;
+
+// Total bytes of manifests and bodies we will keep, not counting the entry
+// currently in use, which is kept regardless of size.
+long long bundle_cache_budget=BUNDLE_CACHE_DEFAULT_BUDGET;
+long long bundle_cache_hits=0;
+long long bundle_cache_misses=0;
+long long bundle_cache_evictions=0;
+
 char *bid_of_cached_bundle=NULL;
 long long cached_version=0;
 int cached_manifest_len=0;
 unsigned char *cached_manifest=NULL;
 int cached_manifest_encoded_len=0;
 unsigned char *cached_manifest_encoded=NULL;
+// cached_body holds cached_body_window_len bytes of the body, starting at
+// cached_body_offset. cached_body_len is the length of the whole body.
 int cached_body_len=0;
+int cached_body_offset=0;
+int cached_body_window_len=0;
 unsigned char *cached_body=NULL;
 
-int prime_bundle_cache(int bundle_number,char *sid_prefix_hex,
-		       char *servald_server, char *credential)
+long long bundle_cache_entry_size(struct cached_bundle *c)
 {
-  if (bundle_number<0) return -1;
-  
-  if ((!bid_of_cached_bundle)
-      ||strcasecmp(bundles[bundle_number].bid_hex,bid_of_cached_bundle)
-      ||(cached_version!=bundles[bundle_number].version)
-      ) {
-    // Cache is invalid - release
-    if (bid_of_cached_bundle) {
-      free(bid_of_cached_bundle); bid_of_cached_bundle=NULL;
-      free(cached_manifest); cached_manifest=NULL;
-      free(cached_manifest_encoded); cached_manifest_encoded=NULL;
-      free(cached_body); cached_body=NULL;
+  return c->manifest_len+c->manifest_encoded_len+c->body_len;
+}
+
+long long bundle_cache_memory_usage()
+{
+  long long total=0;
+  for(int i=0;i<BUNDLE_CACHE_ENTRIES;i++)
+    if (bundle_cache[i].bid_hex[0]) total+=bundle_cache_entry_size(&bundle_cache[i]);
+  return total;
+}
+
+int bundle_cache_release(struct cached_bundle *c)
+{
+  if (c->prefetching) bundle_fetch_cancel(c);
+  if (c->bid_hex==bid_of_cached_bundle) {
+    bid_of_cached_bundle=NULL;
+    cached_version=0;
+    cached_manifest=NULL; cached_manifest_len=0;
+    cached_manifest_encoded=NULL; cached_manifest_encoded_len=0;
+    cached_body=NULL; cached_body_len=0;
+    cached_body_offset=0; cached_body_window_len=0;
+  }
+  free(c->manifest);
+  free(c->manifest_encoded);
+  free(c->body);
+  bzero(c,sizeof(struct cached_bundle));
+  return 0;
+}
+
+// Evict least recently used entries until there is a free entry, or if keep
+// is supplied, until the entries other than keep fit in the budget.
+int bundle_cache_make_room(struct cached_bundle *keep)
+{
+  while(1) {
+    struct cached_bundle *oldest=NULL;
+    int free_entries=0;
+    long long used=0;
+    for(int i=0;i<BUNDLE_CACHE_ENTRIES;i++) {
+      struct cached_bundle *c=&bundle_cache[i];
+      if (!c->bid_hex[0]) { free_entries++; continue; }
+      if (c==keep) continue;
+      used+=bundle_cache_entry_size(c);
+      if ((!oldest)||(c->last_used<oldest->last_used)) oldest=c;
     }
+    if (!oldest) return 0;
+    if (keep&&(used<=bundle_cache_budget)) return 0;
+    if ((!keep)&&free_entries) return 0;
+    bundle_cache_release(oldest);
+    bundle_cache_evictions++;
+  }
+}
 
-    // Load bundle into cache
-    char path[8192];
-    char filename[1024];
-    
-    snprintf(path,8192,"/restful/rhizome/%s.rhm",
-	     bundles[bundle_number].bid_hex);
+int bundle_cache_select(struct cached_bundle *c)
+{
+  c->last_used=++bundle_cache_clock;
+  bid_of_cached_bundle=c->bid_hex;
+  cached_version=c->version;
+  cached_manifest=c->manifest;
+  cached_manifest_len=c->manifest_len;
+  cached_manifest_encoded=c->manifest_encoded;
+  cached_manifest_encoded_len=c->manifest_encoded_len;
+  cached_body=c->body;
+  cached_body_len=c->body_total_len;
+  cached_body_offset=c->body_offset;
+  cached_body_window_len=c->body_len;
+  return 0;
+}
 
-    long long t1=gettime_ms();
+int bundle_cache_fill(struct cached_bundle *c,int bundle_number,
+		      char *servald_server, char *credential)
+{
+  // Load manifest into cache, straight from servald into memory.
+  // The body is fetched separately, as required.
+  char path[8192];
     
-    snprintf(filename,1024,"%smanifest",sid_prefix_hex);
-    unlink(filename);
-    FILE *f=fopen(filename,"w");
-    if (!f) {
-      fprintf(stderr,"could not open output file '%s'.\n",filename);
-      perror("fopen");
-      return -1;
-    }
-    int result_code=http_get_simple(servald_server,
-				    credential,path,f,5000,NULL);
-    fclose(f);
-    if(result_code!=200) {
-      fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
-      return -1;
-    }
-    long long t2=gettime_ms();
-
-    f=fopen(filename,"r");
-    if (cached_manifest) free(cached_manifest);
-    cached_manifest=malloc(8192);
-    assert(cached_manifest);
-    cached_manifest_len=fread(cached_manifest,1,8192,f);
-    cached_manifest=realloc(cached_manifest,cached_manifest_len);
-    assert(cached_manifest);
-    fclose(f);
-    unlink(filename);
-    if (0) fprintf(stderr,"  manifest is %d bytes long.\n",cached_manifest_len);
-
-    // Reject over-length manifests
-    if (cached_manifest_len>1024) return -1;
+  snprintf(path,8192,"/restful/rhizome/%s.rhm",
+	   bundles[bundle_number].bid_hex);
+
+  long long t1=gettime_ms();
     
-    // Generate binary encoded manifest from plain text version
-    fprintf(stderr,"About to binary encode manifest of %d bytes\n",
-	    cached_manifest_len);
-    if (cached_manifest_encoded) free(cached_manifest_encoded);
-    cached_manifest_encoded=malloc(1024);
-    assert(cached_manifest_encoded);
-    cached_manifest_encoded_len=0;
-    if (manifest_text_to_binary(cached_manifest,cached_manifest_len,
-				cached_manifest_encoded,
-				&cached_manifest_encoded_len)) {
-      // Failed to binary encode manifest, so just copy it
-      bcopy(cached_manifest,cached_manifest_encoded,cached_manifest_len);
-      cached_manifest_encoded_len = cached_manifest_len;	
-    }        
-    fprintf(stderr,"Encoded manifest in %d bytes\n",
-	    cached_manifest_encoded_len);
+  int result_code=http_get_buffer(servald_server,credential,path,
+				  &c->manifest,&c->manifest_len,5000,NULL);
+  if(result_code!=200) {
+    fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
+    return -1;
+  }
+  long long t2=gettime_ms();
+
+  if (0) fprintf(stderr,"  manifest is %d bytes long.\n",c->manifest_len);
+
+  // Reject over-length manifests
+  if (c->manifest_len>1024) return -1;
     
-    snprintf(path,8192,"/restful/rhizome/%s/raw.bin",
-	     bundles[bundle_number].bid_hex);
-    snprintf(filename,1024,"%sraw",sid_prefix_hex);
-    unlink(filename);
-    f=fopen(filename,"w");
-    if (!f) {
-      fprintf(stderr,"could not open output file '%s'.\n",filename);
-      perror("fopen");
-      return -1;
+  // Generate binary encoded manifest from plain text version
+  fprintf(stderr,"About to binary encode manifest of %d bytes\n",
+	  c->manifest_len);
+  c->manifest_encoded=malloc(1024);
+  assert(c->manifest_encoded);
+  c->manifest_encoded_len=0;
+  if (manifest_text_to_binary(c->manifest,c->manifest_len,
+			      c->manifest_encoded,
+			      &c->manifest_encoded_len)) {
+    // Failed to binary encode manifest, so just copy it
+    bcopy(c->manifest,c->manifest_encoded,c->manifest_len);
+    c->manifest_encoded_len = c->manifest_len;	
+  }        
+  fprintf(stderr,"Encoded manifest in %d bytes\n",
+	  c->manifest_encoded_len);
+
+  if (0)
+    fprintf(stderr,"  HTTP pre-fetching of manifest took %lldms\n",t2-t1);
+
+  snprintf(c->bid_hex,sizeof(c->bid_hex),"%s",bundles[bundle_number].bid_hex);
+  c->version=bundles[bundle_number].version;
+  // Empty bodies don't need fetching
+  c->body_total_len=bundles[bundle_number].length?-1:0;
+
+  if (0)
+    fprintf(stderr,"Cached manifest for %s\n",
+	    bundles[bundle_number].bid_hex);
+  return 0;
+}
+
+// Put bytes of the body that we have fetched from offset into the window,
+// after what we already have if they follow on from it.
+static void bundle_cache_store_body(struct cached_bundle *c,unsigned char *data,
+				    int data_len,int offset)
+{
+  int window_end=c->body_offset+c->body_len;
+  if (c->body&&(offset==window_end)&&(offset>0)) {
+    // Append to the bytes we already have, dropping any we no longer need
+    int keep=window_end-c->keep_from;
+    if (keep>c->body_len) keep=c->body_len;
+    if (keep<0) keep=0;
+    unsigned char *body=malloc(keep+data_len);
+    assert(body);
+    bcopy(&c->body[c->body_len-keep],body,keep);
+    bcopy(data,&body[keep],data_len);
+    free(data);
+    free(c->body);
+    c->body=body;
+    c->body_offset=window_end-keep;
+    c->body_len=keep+data_len;
+  } else {
+    free(c->body);
+    c->body=data;
+    c->body_offset=offset;
+    c->body_len=data_len;
+  }
+
+  if (bid_of_cached_bundle==c->bid_hex) {
+    cached_body=c->body;
+    cached_body_len=c->body_total_len;
+    cached_body_offset=c->body_offset;
+    cached_body_window_len=c->body_len;
+  }
+}
+
+static void bundle_cache_prefetch_done(void *context,unsigned char *data,int len,
+				       long long offset,long long total_len,
+				       char *servald_server,char *credential)
+{
+  struct cached_bundle *c=context;
+  c->prefetching=0;
+  // Only of use if it still follows on from what we have
+  if ((!data)||(offset!=c->body_offset+c->body_len)) {
+    free(data);
+    return;
+  }
+  if (total_len>-1) c->body_total_len=total_len;
+  bundle_cache_store_body(c,data,len,offset);
+  bundle_cache_make_room(c);
+}
+
+/* Once the cursor gets within BUNDLE_CACHE_PREFETCH of the end of the window,
+   start fetching the next window in the background, so that it has arrived by
+   the time we get there, instead of stopping to wait for servald while we
+   have a packet to send. */
+static void bundle_cache_prefetch(struct cached_bundle *c,int offset)
+{
+  int window_end=c->body_offset+c->body_len;
+  if (c->prefetching||(!c->body)||(c->body_total_len<0)) return;
+  if ((window_end>=c->body_total_len)||(offset+BUNDLE_CACHE_PREFETCH<window_end))
+    return;
+  if (!bundle_fetch_start(c->bid_hex,0,window_end,BUNDLE_CACHE_WINDOW,
+			  bundle_cache_prefetch_done,c))
+    c->prefetching=1;
+}
+
+// Make sure that the body window holds the bytes from offset up to offset+length
+// (or the end of the body). Bytes before keep_from are discarded if more of the
+// body has to be fetched. A length of -1 means the whole body.
+int bundle_cache_fetch_body(struct cached_bundle *c,int offset,int length,int keep_from,
+			    char *servald_server, char *credential)
+{
+  int window_end=c->body_offset+c->body_len;
+  int whole=(length<0);
+  if (c->body_total_len>-1) {
+    if (length<0||(offset+length>c->body_total_len)) length=c->body_total_len-offset;
+    // Nothing left to send
+    if (length<=0) return 0;
+  }
+  c->keep_from=keep_from;
+  if (c->body&&(length>0)&&(offset>=c->body_offset)&&(offset+length<=window_end)) {
+    bundle_cache_prefetch(c,offset);
+    return 0;
+  }
+  // We need bytes that we don't have yet, and can't send without them, so
+  // fetch them now, rather than waiting for any fetch in the background.
+  if (c->prefetching) {
+    bundle_fetch_cancel(c);
+    c->prefetching=0;
+  }
+
+  char path[8192];
+  snprintf(path,8192,"/restful/rhizome/%s/raw.bin",c->bid_hex);
+  
+  long long t1=gettime_ms();
+  unsigned char *data=NULL;
+  int data_len=0;
+  long long total_len=-1;
+  int fetch_offset=offset;
+  int result_code;
+  if (whole) {
+    // Whole body
+    fetch_offset=0;
+    result_code=http_get_buffer(servald_server,credential,path,
+				&data,&data_len,5000,NULL);
+    total_len=data_len;
+  } else {
+    // Continue on from the end of the window, if it overlaps what we need
+    if (c->body&&(keep_from>=c->body_offset)&&(offset<=window_end)
+	&&(offset+length>window_end))
+      fetch_offset=window_end;
+    result_code=http_get_buffer_range(servald_server,credential,path,
+				      fetch_offset,BUNDLE_CACHE_WINDOW,
+				      &data,&data_len,&total_len,5000,NULL);
+    if (result_code==200) fetch_offset=0;
+    // A short read means that we have reached the end of the body
+    if ((result_code==206)&&(total_len<0)&&(data_len<BUNDLE_CACHE_WINDOW))
+      total_len=fetch_offset+data_len;
+  }
+  if ((result_code!=200)&&(result_code!=206)) {
+    fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
+    return -1;
+  }
+  if (0)
+    fprintf(stderr,"  HTTP fetch of %d body bytes from offset %d took %lldms\n",
+	    data_len,fetch_offset,gettime_ms()-t1);
+  
+  if (total_len>-1) c->body_total_len=total_len;
+  bundle_cache_store_body(c,data,data_len,fetch_offset);
+  bundle_cache_prefetch(c,offset);
+  return 0;
+}
+
+struct cached_bundle *bundle_cache_find(int bundle_number,
+					char *servald_server, char *credential)
+{
+  struct cached_bundle *c=NULL;
+  for(int i=0;i<BUNDLE_CACHE_ENTRIES;i++) {
+    if (!bundle_cache[i].bid_hex[0]) continue;
+    if (strcasecmp(bundles[bundle_number].bid_hex,bundle_cache[i].bid_hex)) continue;
+    if (bundle_cache[i].version==bundles[bundle_number].version) {
+      bundle_cache_hits++;
+      return &bundle_cache[i];
     }
-    result_code=http_get_simple(servald_server,
-				credential,path,f,5000,NULL);
-    fclose(f);
-    if(result_code!=200) {
-      fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,path);
+    // An old version of this bundle is no use to anyone
+    bundle_cache_release(&bundle_cache[i]);
+  }
+  bundle_cache_misses++;
+
+  bundle_cache_make_room(NULL);
+  for(int i=0;i<BUNDLE_CACHE_ENTRIES;i++)
+    if (!bundle_cache[i].bid_hex[0]) { c=&bundle_cache[i]; break; }
+  assert(c);
+
+  if (bundle_cache_fill(c,bundle_number,servald_server,credential)) {
+    bundle_cache_release(c);
+    return NULL;
+  }
+  return c;
+}
+
+int bundle_cache_prime_body(int bundle_number,int offset,int length,int keep_from,
+			    char *servald_server, char *credential)
+{
+  if (bundle_number<0) return -1;
+
+  struct cached_bundle *c=bundle_cache_find(bundle_number,servald_server,credential);
+  if (!c) return -1;
+  
+  if (bundle_cache_fetch_body(c,offset,length,keep_from,servald_server,credential)) {
+    bundle_cache_release(c);
+    return -1;
+  }
+  bundle_cache_select(c);
+  
+  // Now that we know how much we are holding, drop older bundles if we need to.
+  bundle_cache_make_room(c);
+  
+  return 0;
+}
+
+// Load the manifest and the whole of the body of this bundle
+int prime_bundle_cache(int bundle_number,char *sid_prefix_hex,
+		       char *servald_server, char *credential)
+{
+  return bundle_cache_prime_body(bundle_number,0,-1,0,servald_server,credential);
+}
+
+// Load the manifest and a window of the body that includes the next piece
+// we will send from body_offset. When the cursor gets close to the end of the
+// window, the next window is fetched in the background and appended, so that
+// we normally have the bytes for the next few pieces in hand. Only the first
+// window of a bundle, or a jump to a part of the body that we don't have, has
+// to be waited for.
+int prime_bundle_cache_window(int bundle_number,int body_offset,char *sid_prefix_hex,
+			      char *servald_server, char *credential)
+{
+  return bundle_cache_prime_body(bundle_number,body_offset,
+				 BUNDLE_CACHE_NEED,body_offset,
+				 servald_server,credential);
+}
+
+/*
+  Fetches from servald that the radio shouldn't have to wait for: the next
+  window of a body that we are sending, and the parts of older versions of
+  bundles that let us make use of what we are being sent.  bundle_fetch_start()
+  queues a fetch, and bundle_fetch_service() is called from the main loop to
+  run them one at a time.  Once a fetch is over, done() is called with the
+  bytes and the offset of the first of them (or with NULL if the fetch failed),
+  and must free them.  It is also passed the servald details, in case it has
+  more to do with what it fetched.
+*/
+#define BUNDLE_FETCH_QUEUE_LEN 16
+#define BUNDLE_FETCH_TIMEOUT 15000
+
+struct bundle_fetch {
+  char path[128];
+  long long offset;
+  int length;
+  bundle_fetch_done_t done;
+  void *context;
+};
+
+struct bundle_fetch bundle_fetches[BUNDLE_FETCH_QUEUE_LEN];
+int bundle_fetch_count=0;
+int bundle_fetch_socket=-1;
+long long bundle_fetch_timeout=0;
+
+// Fetch length bytes of the body of a bundle from offset (or all of it if
+// length<0), or if manifest is set, its manifest.
+int bundle_fetch_start(char *bid_hex,int manifest,long long offset,int length,
+		       bundle_fetch_done_t done,void *context)
+{
+  if (bundle_fetch_count>=BUNDLE_FETCH_QUEUE_LEN) return -1;
+  struct bundle_fetch *f=&bundle_fetches[bundle_fetch_count];
+  bzero(f,sizeof(struct bundle_fetch));
+  if (manifest)
+    snprintf(f->path,sizeof(f->path),"/restful/rhizome/%s.rhm",bid_hex);
+  else
+    snprintf(f->path,sizeof(f->path),"/restful/rhizome/%s/raw.bin",bid_hex);
+  f->offset=manifest?0:offset;
+  f->length=manifest?-1:length;
+  f->done=done;
+  f->context=context;
+  bundle_fetch_count++;
+  return 0;
+}
+
+// Forget any fetches for context, without telling it.
+void bundle_fetch_cancel(void *context)
+{
+  for(int i=0;i<bundle_fetch_count;) {
+    if (bundle_fetches[i].context!=context) { i++; continue; }
+    if ((!i)&&(bundle_fetch_socket>=0)) {
+      http_close_async(bundle_fetch_socket);
+      bundle_fetch_socket=-1;
+    }
+    bundle_fetch_count--;
+    memmove(&bundle_fetches[i],&bundle_fetches[i+1],
+	    (bundle_fetch_count-i)*sizeof(struct bundle_fetch));
+  }
+}
+
+static void bundle_fetch_finished(int result_code,unsigned char *data,int len,
+				  long long total_len,
+				  char *servald_server,char *credential)
+{
+  // Take it off the queue first, so that done() can start or cancel fetches
+  struct bundle_fetch f=bundle_fetches[0];
+  bundle_fetch_count--;
+  memmove(&bundle_fetches[0],&bundle_fetches[1],
+	  bundle_fetch_count*sizeof(struct bundle_fetch));
+
+  long long offset=f.offset;
+  if (result_code==200)
+    // servald sent the whole thing
+    offset=0;
+  else if (result_code==206) {
+    // A short read means that we have reached the end of the body
+    if ((total_len<0)&&(len<f.length)) total_len=f.offset+len;
+  } else {
+    fprintf(stderr,"http request failed (%d). URLPATH:%s\n",result_code,f.path);
+    free(data);
+    data=NULL;
+    len=0;
+  }
+  f.done(f.context,data,len,offset,total_len,servald_server,credential);
+}
+
+int bundle_fetch_service(char *servald_server,char *credential)
+{
+  if (!bundle_fetch_count) return 0;
+  struct bundle_fetch *f=&bundle_fetches[0];
+
+  if (bundle_fetch_socket<0) {
+    bundle_fetch_timeout=gettime_ms()+BUNDLE_FETCH_TIMEOUT;
+    bundle_fetch_socket=http_get_buffer_async(servald_server,credential,f->path,
+					      f->offset,f->length);
+    if (bundle_fetch_socket<0) {
+      bundle_fetch_finished(-1,NULL,0,-1,servald_server,credential);
       return -1;
     }
-    long long t3=gettime_ms();
+  }
 
-    if (0)
-      fprintf(stderr,"  HTTP pre-fetching of next bundle to send took %lldms + %lldms\n",
-	      t2-t1,t3-t2);
-    
-    // XXX - This transport only allows bundles upto 5MB!
-    // (and that is probably pushing it a bit for a mesh extender with only 32MB RAM
-    // for everything!)
-    f=fopen(filename,"r");
-    if (cached_body) free(cached_body);
-    cached_body=malloc(5*1024*1024);
-    assert(cached_body);
-    // XXX - Should check that we read all the bytes
-    cached_body_len=fread(cached_body,1,5*1024*1024,f);
-    cached_body=realloc(cached_body,cached_body_len);
-    assert(cached_body);
-    fclose(f);
-    unlink(filename);
-    if (0)
-      fprintf(stderr,"  body is %d bytes long.\n",cached_body_len);
-
-    bid_of_cached_bundle=strdup(bundles[bundle_number].bid_hex);
-
-    cached_version=bundles[bundle_number].version;
-
-    if (0)
-      fprintf(stderr,"Cached manifest and body for %s\n",
-	      bundles[bundle_number].bid_hex);
+  int result_code=-1;
+  unsigned char *data=NULL;
+  int len=0;
+  long long total_len=-1;
+  if (!http_get_buffer_continue(bundle_fetch_socket,&result_code,
+				&data,&len,&total_len)) {
+    if (gettime_ms()<bundle_fetch_timeout) return 0;
+    printf("Timeout fetching %s\n",f->path);
+    http_close_async(bundle_fetch_socket);
+    result_code=-1;
   }
-  
+  bundle_fetch_socket=-1;
+  bundle_fetch_finished(result_code,data,len,total_len,
+			servald_server,credential);
   return 0;
 }
+
+// When bundle_fetch_service() next needs calling, if nothing happens on
+// bundle_fetch_socket before then.
+long long bundle_fetch_next_service_time()
+{
+  if (bundle_fetch_socket>=0) return bundle_fetch_timeout;
+  if (bundle_fetch_count) return gettime_ms();
+  return LLONG_MAX;
+}
@@ -39,6 +39,7 @@ extern char *my_sid_hex;
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "sync.h"
 #include "lbard.h"
@@ -125,7 +126,11 @@ int sync_tree_receive_message(struct peer_state *p,unsigned char *msg)
   }
 
   
-  sync_recv_message(sync_state,(void *)p,&msg[SYNC_MSG_HEADER_LEN], sync_bytes);
+  // 'S' messages from older peers hold fixed length records
+  if (msg[0]=='S')
+    sync_recv_fixed_message(sync_state,(void *)p,&msg[SYNC_MSG_HEADER_LEN], sync_bytes);
+  else
+    sync_recv_message(sync_state,(void *)p,&msg[SYNC_MSG_HEADER_LEN], sync_bytes);
   
   return 0;
 }
@@ -138,13 +143,17 @@ int sync_tree_send_message(int *offset,int mtu, unsigned char *msg_out)
   int bytes_available=mtu-SYNC_MSG_HEADER_LEN-(*offset);
   if (bytes_available<1) return -1;
   
-  /* Send sync status message */
-  msg[len++]='S'; // Sync message
+  /* Send sync status message, with bit-packed records if everyone in range
+     understands them */
+  int packed=peers_have_capability(LBARD_CAP_PACKED_SYNC);
+  msg[len++]=packed?'s':'S'; // Sync message
   int length_byte_offset=len;
   msg[len++]=0; // place holder for length
   assert(len==SYNC_MSG_HEADER_LEN);
 
-  int used=sync_build_message(sync_state,&msg[len],bytes_available);
+  int used;
+  if (packed) used=sync_build_message(sync_state,&msg[len],bytes_available);
+  else used=sync_build_fixed_message(sync_state,&msg[len],bytes_available);
 
   if (debug_sync_keys) {
     char filename[1024];
@@ -168,12 +177,101 @@ int sync_tree_send_message(int *offset,int mtu, unsigned char *msg_out)
   return 0;
 }
 
+// Bundles (plus one, so that zero is free) and versions bound to our handles
+static int session_bundles[MAX_SESSION_HANDLES];
+static long long session_versions[MAX_SESSION_HANDLES];
+static int next_session_handle=0;
+
+static int sync_session_handle_in_use(int handle)
+{
+  for(int pn=0;pn<peer_count;pn++)
+    if (peer_records[pn]&&peer_records[pn]->tx_session_bound
+	&&(peer_records[pn]->tx_session_handle==handle))
+      return 1;
+  return 0;
+}
+
+// Get the session handle for a bundle version, handing out a new one if need be
+int sync_session_handle(int bundle_number,long long version)
+{
+  for(int h=0;h<MAX_SESSION_HANDLES;h++)
+    if ((session_bundles[h]==bundle_number+1)&&(session_versions[h]==version))
+      return h;
+
+  // Hand out the handles in turn, so that a handle is reused as rarely as
+  // possible, but don't take one from a transfer that is still going.
+  for(int tries=0;tries<MAX_SESSION_HANDLES;tries++) {
+    int h=next_session_handle;
+    next_session_handle=(next_session_handle+1)%MAX_SESSION_HANDLES;
+    if (sync_session_handle_in_use(h)) continue;
+    session_bundles[h]=bundle_number+1;
+    session_versions[h]=version;
+    return h;
+  }
+  return -1;
+}
+
+/* Bind a session handle to the bundle we are sending this peer, so that we can
+   use compact pieces.  This also tells the peer the length of the body, so is
+   sent in place of an 'L' message:
+     'l', handle, BID prefix (8), version (8), body length (4) */
+int sync_append_session_binding(int peer,int bundle_number,int *offset,int mtu,
+				unsigned char *msg)
+{
+  if ((mtu-*offset)<(1+1+8+8+4)) return -1;
+  int handle=sync_session_handle(bundle_number,cached_version);
+  if (handle<0) return -1;
+
+  msg[(*offset)++]='l';
+  msg[(*offset)++]=handle;
+  // Bundle prefix (8 bytes)
+  for(int i=0;i<8;i++) msg[(*offset)++]=bundles[bundle_number].bid_bin[i];
+  // Bundle version (8 bytes)
+  for(int i=0;i<8;i++)
+    msg[(*offset)++]=(cached_version>>(i*8))&0xff;
+  // Length (4 bytes)
+  msg[(*offset)++]=(bundles[bundle_number].length>>0)&0xff;
+  msg[(*offset)++]=(bundles[bundle_number].length>>8)&0xff;
+  msg[(*offset)++]=(bundles[bundle_number].length>>16)&0xff;
+  msg[(*offset)++]=(bundles[bundle_number].length>>24)&0xff;
+
+  peer_records[peer]->tx_session_bound=1;
+  peer_records[peer]->tx_session_bundle=bundle_number;
+  peer_records[peer]->tx_session_handle=handle;
+  return 0;
+}
+
+// Announce the length of the body to peers that don't know session handles:
+//   'L', BID prefix (8), version (8), body length (4)
+int sync_append_length(int bundle_number,int *offset,int mtu,unsigned char *msg)
+{
+  if ((mtu-*offset)<=(1+8+8+4)) return -1;
+  msg[(*offset)++]='L';
+  // Bundle prefix (8 bytes)
+  for(int i=0;i<8;i++) msg[(*offset)++]=bundles[bundle_number].bid_bin[i];
+  // Bundle version (8 bytes)
+  for(int i=0;i<8;i++)
+    msg[(*offset)++]=(cached_version>>(i*8))&0xff;
+  // Length (4 bytes)
+  msg[(*offset)++]=(bundles[bundle_number].length>>0)&0xff;
+  msg[(*offset)++]=(bundles[bundle_number].length>>8)&0xff;
+  msg[(*offset)++]=(bundles[bundle_number].length>>16)&0xff;
+  msg[(*offset)++]=(bundles[bundle_number].length>>24)&0xff;
+  return 0;
+}
+
 int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
+				  int limit,
 				  unsigned char *p, int is_manifest,
 				  int *offset,int mtu,unsigned char *msg,
 				  int target_peer)
 {
-  int max_bytes=mtu-(*offset)-21;
+  // Use the compact header once we have bound a session handle, and only
+  // while everyone listening understands it
+  int compact=peer_records[target_peer]->tx_session_bound
+    &&(peer_records[target_peer]->tx_session_bundle==bundle_number)
+    &&peer_has_capability(peer_records[target_peer],LBARD_CAP_SESSIONS);
+  int max_bytes=mtu-(*offset)-(compact?7:21);
   int bytes_available=len-start_offset;
   int actual_bytes=0;
   int end_of_item=0;
@@ -184,6 +282,13 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
   }
   if (max_bytes<1) return -1;
 
+  // Don't run past limit (e.g., into bytes the peer already has), but without
+  // claiming that this is the end of the item.
+  if ((limit<len)&&((limit-start_offset)<max_bytes)) {
+    max_bytes=limit-start_offset;
+    if (max_bytes<1) return -1;
+  }
+
   // Work out number of bytes to include in announcement
   if (bytes_available<max_bytes) {
     actual_bytes=bytes_available;
@@ -204,21 +309,32 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
   if (is_manifest) offset_compound|=0x80000000;
   offset_compound|=((start_offset>>20LL)&0xffffLL)<<32LL;
 
-  // Now write the 23/25 byte header and actual bytes into output message
-  // BID prefix (8 bytes)
-  if (start_offset>0xfffff)
-    msg[(*offset)++]='P'+end_of_item;
-  else 
-    msg[(*offset)++]='p'+end_of_item;
-
-  // Intended recipient
-  msg[(*offset)++]=peer_records[target_peer]->sid_prefix[0];
-  msg[(*offset)++]=peer_records[target_peer]->sid_prefix[1];
+  if (compact) {
+    // Write the 7/9 byte compact header: session handle and check byte in
+    // place of the recipient, BID prefix and version.
+    if (start_offset>0xfffff)
+      msg[(*offset)++]='J'+end_of_item;
+    else
+      msg[(*offset)++]='j'+end_of_item;
+    msg[(*offset)++]=peer_records[target_peer]->tx_session_handle;
+    msg[(*offset)++]=bundles[bundle_number].bid_bin[0];
+  } else {
+    // Now write the 23/25 byte header and actual bytes into output message
+    // BID prefix (8 bytes)
+    if (start_offset>0xfffff)
+      msg[(*offset)++]='P'+end_of_item;
+    else 
+      msg[(*offset)++]='p'+end_of_item;
+
+    // Intended recipient
+    msg[(*offset)++]=peer_records[target_peer]->sid_prefix[0];
+    msg[(*offset)++]=peer_records[target_peer]->sid_prefix[1];
   
-  for(int i=0;i<8;i++) msg[(*offset)++]=bundles[bundle_number].bid_bin[i];
-  // Bundle version (8 bytes)
-  for(int i=0;i<8;i++)
-    msg[(*offset)++]=(cached_version>>(i*8))&0xff;
+    for(int i=0;i<8;i++) msg[(*offset)++]=bundles[bundle_number].bid_bin[i];
+    // Bundle version (8 bytes)
+    for(int i=0;i<8;i++)
+      msg[(*offset)++]=(cached_version>>(i*8))&0xff;
+  }
   // offset_compound (4 bytes)
   for(int i=0;i<4;i++)
     msg[(*offset)++]=(offset_compound>>(i*8))&0xff;
@@ -280,6 +396,183 @@ int sync_append_some_bundle_bytes(int bundle_number,int start_offset,int len,
 }
 
 
+/* Send a coded symbol of the body of a bundle (see fountain.c), instead of a
+   piece of it.  The whole body must be in the cache.  Symbols are picked at
+   random, so that different senders are unlikely to send the same ones. */
+#define CODED_SYMBOL_HEADER_LEN (1+2+8+8+4+2)
+int sync_append_coded_symbol(int bundle_number,int *offset,int mtu,
+			     unsigned char *msg,int target_peer)
+{
+  if ((mtu-(*offset))<(CODED_SYMBOL_HEADER_LEN+FOUNTAIN_BLOCK_SIZE)) return -1;
+  if ((cached_body_offset>0)||(cached_body_window_len<cached_body_len))
+    return -1;
+  int blocks=fountain_block_count(cached_body_len);
+  int symbol=blocks+random()%(FOUNTAIN_MAX_SYMBOL+1-blocks);
+
+  msg[(*offset)++]='f';
+  // Intended recipient
+  msg[(*offset)++]=peer_records[target_peer]->sid_prefix[0];
+  msg[(*offset)++]=peer_records[target_peer]->sid_prefix[1];
+  // BID prefix (8 bytes)
+  for(int i=0;i<8;i++) msg[(*offset)++]=bundles[bundle_number].bid_bin[i];
+  // Bundle version (8 bytes)
+  for(int i=0;i<8;i++)
+    msg[(*offset)++]=(cached_version>>(i*8))&0xff;
+  // Body length (4 bytes)
+  for(int i=0;i<4;i++)
+    msg[(*offset)++]=(cached_body_len>>(i*8))&0xff;
+  // Symbol number (2 bytes)
+  msg[(*offset)++]=symbol&0xff;
+  msg[(*offset)++]=(symbol>>8)&0xff;
+  if (fountain_encode(cached_body,cached_body_len,symbol,&msg[*offset])) {
+    (*offset)-=CODED_SYMBOL_HEADER_LEN;
+    return -1;
+  }
+  (*offset)+=FOUNTAIN_BLOCK_SIZE;
+
+  if (debug_announce)
+    printf("T+%lldms : Announcing for %s* coded symbol #%d of %s* version %lld\n",
+	   gettime_ms()-start_time,peer_records[target_peer]->sid_prefix,
+	   symbol,bundles[bundle_number].bid_hex,bundles[bundle_number].version);
+
+  return FOUNTAIN_BLOCK_SIZE;
+}
+
+/* A peer that has an older version of a journal bundle can rebuild the new
+   manifest from its own copy, so we first offer it just the fields that
+   changed and the new signature.  If it can't use them, it asks for the
+   manifest from the start, and gets the whole thing.
+   Returns the number of bytes of delta sent, 0 if there wasn't room in this
+   packet, or -1 if the delta can't be used. */
+#define MANIFEST_DELTA_HEADER_LEN (1+2+8+8+MANIFEST_DIGEST_LEN+1)
+int sync_append_manifest_delta(int bundle_number,int *offset,int mtu,
+			       unsigned char *msg,int target_peer)
+{
+  if (!cached_manifest) return -1;
+  unsigned char delta[1024];
+  int delta_len=0;
+  if (manifest_delta_encode(cached_manifest,cached_manifest_len,
+			    delta,&delta_len))
+    return -1;
+  // Not worth it if it saves nothing, and it has to fit in one message,
+  // alongside the packet header, a time stamp and a session binding.
+  if ((delta_len>255)||(delta_len>=cached_manifest_encoded_len)) return -1;
+  if ((MANIFEST_DELTA_HEADER_LEN+delta_len)>(mtu-48)) return -1;
+  if ((mtu-(*offset))<(MANIFEST_DELTA_HEADER_LEN+delta_len)) return 0;
+
+  msg[(*offset)++]='m';
+  // Intended recipient
+  msg[(*offset)++]=peer_records[target_peer]->sid_prefix[0];
+  msg[(*offset)++]=peer_records[target_peer]->sid_prefix[1];
+  // BID prefix (8 bytes)
+  for(int i=0;i<8;i++) msg[(*offset)++]=bundles[bundle_number].bid_bin[i];
+  // Bundle version (8 bytes)
+  for(int i=0;i<8;i++)
+    msg[(*offset)++]=(cached_version>>(i*8))&0xff;
+  // Digest of the whole manifest, so that the peer can check what it rebuilds
+  manifest_digest(cached_manifest,cached_manifest_len,&msg[*offset]);
+  (*offset)+=MANIFEST_DIGEST_LEN;
+  msg[(*offset)++]=delta_len;
+  bcopy(delta,&msg[*offset],delta_len);
+  (*offset)+=delta_len;
+
+  if (debug_announce)
+    printf("T+%lldms : Announcing for %s* %d byte manifest delta of %s* version %lld (manifest is %d bytes)\n",
+	   gettime_ms()-start_time,peer_records[target_peer]->sid_prefix,
+	   delta_len,bundles[bundle_number].bid_hex,cached_version,
+	   cached_manifest_encoded_len);
+
+  return delta_len;
+}
+
+/* Block signatures of the body, for a peer that has an older version of the
+   bundle and has asked for them (see delta.c).  Returns the number of blocks
+   signed. */
+#define DELTA_SIGNATURES_HEADER_LEN (1+8+8+4+2+1)
+int sync_append_delta_signatures(int bundle_number,int *offset,int mtu,
+				 unsigned char *msg,int target_peer)
+{
+  struct peer_state *p=peer_records[target_peer];
+  int blocks=delta_block_count(cached_body_len);
+  int first=p->tx_delta_block;
+  int count=(mtu-(*offset)-DELTA_SIGNATURES_HEADER_LEN)/DELTA_SIGNATURE_LEN;
+  if (count>blocks-first) count=blocks-first;
+  if (count>255) count=255;
+  // We can only sign the blocks that we have in hand
+  while((count>0)&&(((first+count)*DELTA_BLOCK_SIZE)
+		    >(cached_body_offset+cached_body_window_len)))
+    count--;
+  if (first*DELTA_BLOCK_SIZE<cached_body_offset) count=0;
+
+  if (first>=blocks) {
+    // All done, so back to sending the body, from the first hole the peer
+    // has left once it has used what it can of its older version.
+    p->tx_delta_pending=0;
+    p->tx_bundle_body_offset=0;
+    return 0;
+  }
+  if (count<1) return 0;
+
+  msg[(*offset)++]='d';
+  // BID prefix (8 bytes)
+  for(int i=0;i<8;i++) msg[(*offset)++]=bundles[bundle_number].bid_bin[i];
+  // Bundle version (8 bytes)
+  for(int i=0;i<8;i++)
+    msg[(*offset)++]=(cached_version>>(i*8))&0xff;
+  // Body length (4 bytes)
+  for(int i=0;i<4;i++)
+    msg[(*offset)++]=(cached_body_len>>(i*8))&0xff;
+  // First block and number of blocks
+  msg[(*offset)++]=first&0xff;
+  msg[(*offset)++]=(first>>8)&0xff;
+  msg[(*offset)++]=count;
+  for(int b=first;b<first+count;b++)
+    (*offset)+=delta_sign_block(&cached_body[b*DELTA_BLOCK_SIZE-cached_body_offset],
+				&msg[*offset]);
+  p->tx_delta_block+=count;
+
+  if (debug_announce)
+    printf("T+%lldms : Announcing for %s* signatures of blocks %d..%d of %s* version %lld\n",
+	   gettime_ms()-start_time,p->sid_prefix,first,first+count-1,
+	   bundles[bundle_number].bid_hex,cached_version);
+
+  return count;
+}
+
+/* Selective acknowledgements let the sender skip the parts of the body that
+   the receiver already has, instead of resending everything from the offset
+   it asked for. */
+
+// Manifest bytes that we have sent to peers that had told us they had it all
+long long manifest_bytes_after_sack=0;
+
+static int sync_sack_applies(struct peer_state *p)
+{
+  return p->tx_sack_valid&&(p->tx_sack_bundle==p->tx_bundle);
+}
+
+// Find the first byte at or after offset that the peer lacks
+static int sync_sack_next_missing(struct peer_state *p,int offset)
+{
+  if (!sync_sack_applies(p)) return offset;
+  for(int i=0;i<p->tx_sack_ranges;i++) {
+    if (offset<p->tx_sack_start[i]) return p->tx_sack_start[i];
+    if (offset<p->tx_sack_end[i]) return offset;
+  }
+  if (offset<p->tx_sack_tail) return p->tx_sack_tail;
+  return offset;
+}
+
+// Find the end of the hole in the peer's copy that offset falls in
+static int sync_sack_missing_run_end(struct peer_state *p,int offset)
+{
+  if (!sync_sack_applies(p)) return INT_MAX;
+  for(int i=0;i<p->tx_sack_ranges;i++)
+    if ((offset>=p->tx_sack_start[i])&&(offset<p->tx_sack_end[i]))
+      return p->tx_sack_end[i];
+  return INT_MAX;
+}
+
 int sync_announce_bundle_piece(int peer,int *offset,int mtu,
 			       unsigned char *msg,
 			       char *sid_prefix_hex,
@@ -287,9 +580,29 @@ int sync_announce_bundle_piece(int peer,int *offset,int mtu,
 {
   int bundle_number=peer_records[peer]->tx_bundle;
   if (bundle_number<0) return -1;
+
+  // Skip over anything the peer has told us it already has, going back to
+  // the first hole if we have run off the end.
+  struct peer_state *p=peer_records[peer];
+  p->tx_bundle_body_offset=sync_sack_next_missing(p,p->tx_bundle_body_offset);
+  if (p->tx_bundle_body_offset>=bundles[bundle_number].length) {
+    p->tx_bundle_body_offset=sync_sack_next_missing(p,0);
+    p->tx_bundle_repair=1;
+  }
+  if (p->tx_bundle_body_offset>bundles[bundle_number].length)
+    p->tx_bundle_body_offset=bundles[bundle_number].length;
   
-  if (prime_bundle_cache(bundle_number,
-			 sid_prefix_hex,servald_server,credential)) {
+  // Forget a request for block signatures if someone in range wouldn't
+  // understand them.  The peer will ask again later.
+  if (p->tx_delta_pending&&(!peer_has_capability(p,LBARD_CAP_DELTA)))
+    p->tx_delta_pending=0;
+
+  // We only need the part of the body around where we are up to (or the
+  // blocks we are signing, if the peer asked for signatures)
+  int window_offset=p->tx_bundle_body_offset;
+  if (p->tx_delta_pending) window_offset=p->tx_delta_block*DELTA_BLOCK_SIZE;
+  if (prime_bundle_cache_window(bundle_number,window_offset,
+				sid_prefix_hex,servald_server,credential)) {
     peer_records[peer]->tx_cache_errors++;
     if (peer_records[peer]->tx_cache_errors>MAX_CACHE_ERRORS)
       {
@@ -302,24 +615,56 @@ int sync_announce_bundle_piece(int peer,int *offset,int mtu,
 
 
   
+  // Bind a session handle to the bundle first, so that pieces can be compact
+  int sessions=peer_has_capability(p,LBARD_CAP_SESSIONS);
+  if (sessions&&((!p->tx_session_bound)||(p->tx_session_bundle!=bundle_number)))
+    sync_append_session_binding(peer,bundle_number,offset,mtu,msg);
+  
   // Mark manifest all sent once we get to the end
   if (peer_records[peer]->tx_bundle_manifest_offset>=cached_manifest_encoded_len)
     peer_records[peer]->tx_bundle_manifest_offset=1024;
 
+  // Try sending only the changed fields of the manifest of a journal bundle
+  int manifest_delta_waiting=0;
+  if ((p->tx_manifest_delta_tries<MANIFEST_DELTA_TRIES)
+      &&peer_has_capability(p,LBARD_CAP_MANIFEST_DELTA)
+      &&(!p->tx_bundle_manifest_offset)
+      &&(cached_version<0x100000000LL)) {
+    int bytes=sync_append_manifest_delta(bundle_number,offset,mtu,msg,peer);
+    if (bytes) p->tx_manifest_delta_tries=MANIFEST_DELTA_TRIES;
+    else {
+      // No room in this packet: try again in the next one
+      p->tx_manifest_delta_tries++;
+      manifest_delta_waiting=1;
+    }
+    if (bytes>0) p->tx_bundle_manifest_offset=cached_manifest_encoded_len;
+  }
+
   // Send piece of manifest, if required
-  if (peer_records[peer]->tx_bundle_manifest_offset<cached_manifest_encoded_len) {
+  if ((!manifest_delta_waiting)
+      &&(peer_records[peer]->tx_bundle_manifest_offset<cached_manifest_encoded_len)) {
     fprintf(stderr,"  manifest_offset=%d, manifest_len=%d\n",
 	    peer_records[peer]->tx_bundle_manifest_offset,
 	    cached_manifest_encoded_len);
     int start_offset=peer_records[peer]->tx_bundle_manifest_offset;
     int bytes =
       sync_append_some_bundle_bytes(bundle_number,start_offset,
+				    cached_manifest_encoded_len,
 				    cached_manifest_encoded_len,
 				    &cached_manifest_encoded[start_offset],1,
 				    offset,mtu,msg,peer);
     if (bytes>0)
       peer_records[peer]->tx_bundle_manifest_offset+=bytes;
 
+    // We should never need to do this once the peer has said it has it all
+    if ((bytes>0)&&sync_sack_applies(p)
+	&&(p->tx_sack_manifest_offset>=cached_manifest_encoded_len)) {
+      manifest_bytes_after_sack+=bytes;
+      fprintf(stderr,"T+%lldms : Sent %d manifest bytes of %s to %s*, which has acknowledged all of it.\n",
+	      gettime_ms()-start_time,bytes,bundles[bundle_number].bid_hex,
+	      p->sid_prefix);
+    }
+
   }
 
   // Announce the length of the body if we have finished sending the manifest,
@@ -336,27 +681,34 @@ int sync_announce_bundle_piece(int peer,int *offset,int mtu,
 		bundles[bundle_number].bid_hex,
 		bundle_number,bundles[bundle_number].version,
 		cached_version);
-	if ((mtu-*offset)>(1+8+8+4)) {
-	  // Announce length of bundle
-	  msg[(*offset)++]='L';
-	  // Bundle prefix (8 bytes)
-	  for(int i=0;i<8;i++) msg[(*offset)++]=bundles[bundle_number].bid_bin[i];
-	  // Bundle version (8 bytes)
-	  for(int i=0;i<8;i++)
-	    msg[(*offset)++]=(cached_version>>(i*8))&0xff;
-	  // Length (4 bytes)
-	  msg[(*offset)++]=(bundles[bundle_number].length>>0)&0xff;
-	  msg[(*offset)++]=(bundles[bundle_number].length>>8)&0xff;
-	  msg[(*offset)++]=(bundles[bundle_number].length>>16)&0xff;
-	  msg[(*offset)++]=(bundles[bundle_number].length>>24)&0xff;
-	}
+	// Announce length of bundle (and renew the session binding, in case
+	// the peer missed it)
+	if (sessions)
+	  sync_append_session_binding(peer,bundle_number,offset,mtu,msg);
+	else
+	  sync_append_length(bundle_number,offset,mtu,msg);
       }
-    {
-      // Send some of the body
+    if (p->tx_delta_pending) {
+      // Send the block signatures the peer asked for, before any more of the
+      // body
+      sync_append_delta_signatures(bundle_number,offset,mtu,msg,peer);
+    }
+    // Once we have been through the body, send coded symbols that can fill
+    // any hole for any peer, if we can.
+    else if (fountain_mode&&p->tx_bundle_repair
+	&&peer_has_capability(p,LBARD_CAP_CODED_SYMBOLS)
+	&&(cached_version>=0x100000000LL)
+	&&fountain_suitable(cached_body_len)
+	&&(sync_append_coded_symbol(bundle_number,offset,mtu,msg,peer)>0))
+      ;
+    else {
+      // Send some of the body, up to the end of the hole the peer has there
       int start_offset=peer_records[peer]->tx_bundle_body_offset;
+      int limit=sync_sack_missing_run_end(peer_records[peer],start_offset);
       int bytes =
 	sync_append_some_bundle_bytes(bundle_number,start_offset,cached_body_len,
-				      &cached_body[start_offset],0,
+				      limit,
+				      &cached_body[start_offset-cached_body_offset],0,
 				      offset,mtu,msg,peer);
 
       if (bytes>0)
@@ -367,12 +719,16 @@ int sync_announce_bundle_piece(int peer,int *offset,int mtu,
   
   // If we have sent to the end of the bundle, then start again from the beginning,
   // until the peer acknowledges that they have received it all (or tells us to
-  // start sending again from a different part of the bundle).
+  // start sending again from a different part of the bundle).  If the peer has
+  // sent us a selective acknowledgement, it has told us how much of the
+  // manifest it has, so we only go back over the manifest if it asks.
   if ((peer_records[peer]->tx_bundle_body_offset>=bundles[bundle_number].length)
       &&(peer_records[peer]->tx_bundle_manifest_offset>=cached_manifest_encoded_len))
     {
       peer_records[peer]->tx_bundle_body_offset=0;
-      peer_records[peer]->tx_bundle_manifest_offset=0;
+      if (!sync_sack_applies(p))
+	peer_records[peer]->tx_bundle_manifest_offset=0;
+      peer_records[peer]->tx_bundle_repair=1;
       fprintf(stderr,"T+%lldms : Resending bundle %s from the start.\n",
 	      gettime_ms()-start_time,
 	      bundles[bundle_number].bid_hex);
@@ -392,6 +748,11 @@ int sync_tree_send_data(int *offset,int mtu, unsigned char *msg_out,int peer,
     to advance to the next bundle.)
 
   */
+  // Nothing queued for this peer, so see if there is anything the sync tree
+  // says they still lack, that has fallen out of the queue.
+  if (peer_records[peer]->tx_bundle==-1)
+    sync_requeue_missing_bundles(peer_records[peer]);
+
   if (peer_records[peer]->tx_bundle>-1)
     {
       // Try to also send a piece of body, even if we have already stuffed some
@@ -474,8 +835,18 @@ int sync_by_tree_stuff_packet(int *offset,int mtu, unsigned char *msg_out,
 
 int sync_tree_populate_with_our_bundles()
 {
-  for(int i=0;i<bundle_count;i++)
-    sync_add_key(sync_state,&bundles[i].sync_key,&bundles[i]);
+  sync_key_t *keys=malloc(sizeof(sync_key_t)*(bundle_count+1));
+  void **contexts=malloc(sizeof(void *)*(bundle_count+1));
+  if ((!keys)||(!contexts)) {
+    free(keys); free(contexts);
+    return -1;
+  }
+  for(int i=0;i<bundle_count;i++) {
+    keys[i]=bundles[i].sync_key;
+    contexts[i]=BUNDLE_KEY_CONTEXT(i);
+  }
+  sync_add_keys(sync_state,keys,contexts,bundle_count);
+  free(keys); free(contexts);
   return 0;
 }
 
@@ -512,6 +883,8 @@ int sync_tell_peer_we_have_bundle_by_id(int peer,unsigned char *bid,long long ve
     if (report_queue_peers[i]==peer_records[peer]) {
       // We already want to tell this peer something.
       // We should only need to tell a peer one thing at a time.
+      // A request for block signatures goes first, though.
+      if (report_queue[i][0]=='D') return 0;
       slot=i; break;
     }
   }
@@ -538,6 +911,117 @@ int sync_tell_peer_we_have_bundle_by_id(int peer,unsigned char *bid,long long ve
   return 0;
 }
 
+/* Ask a peer to bind one of its session handles again, because we have seen a
+   compact piece that uses a handle we don't know:
+     'h', recipient (2), handle */
+int sync_schedule_session_rebind(int peer,int handle)
+{
+  int slot=report_queue_length;
+
+  for(int i=0;i<report_queue_length;i++) {
+    if (report_queue_peers[i]==peer_records[peer]) {
+      // We already want to tell this peer something.
+      // A progress report is more use to it than this.
+      if (report_queue[i][0]!='h') return 0;
+      slot=i; break;
+    }
+  }
+  
+  if (slot>=REPORT_QUEUE_LEN) slot=random()%REPORT_QUEUE_LEN;
+
+  report_queue_partials[slot]=-1;
+  report_queue_peers[slot]=peer_records[peer];
+
+  int ofs=0;
+  report_queue[slot][ofs++]='h';
+  report_queue[slot][ofs++]=peer_records[peer]->sid_prefix[0];
+  report_queue[slot][ofs++]=peer_records[peer]->sid_prefix[1];
+  report_queue[slot][ofs++]=handle;
+  report_lengths[slot]=ofs;
+
+  if (report_queue_message[slot]) {
+    free(report_queue_message[slot]);
+    report_queue_message[slot]=NULL;
+  }
+  report_queue_message[slot]=strdup("session rebind");
+  
+  if (slot>=report_queue_length) report_queue_length=slot+1;
+
+  return 0;
+}
+
+/* Ask the peer for the block signatures of the body of a bundle, of which we
+   have an older version (see delta.c). */
+int sync_schedule_delta_request(int peer,int partial)
+{
+  int slot=report_queue_length;
+
+  for(int i=0;i<report_queue_length;i++) {
+    if (report_queue_peers[i]==peer_records[peer]) {
+      // We already want to tell this peer something, but this matters more
+      // than a progress report, which we will send again soon enough.
+      slot=i; break;
+    }
+  }
+  
+  if (slot>=REPORT_QUEUE_LEN) slot=random()%REPORT_QUEUE_LEN;
+
+  report_queue_partials[slot]=partial;
+  report_queue_peers[slot]=peer_records[peer];
+
+  int ofs=0;
+  report_queue[slot][ofs++]='D';
+  report_queue[slot][ofs++]=peer_records[peer]->sid_prefix[0];
+  report_queue[slot][ofs++]=peer_records[peer]->sid_prefix[1];
+  unsigned char *bid_prefix_bin=
+    bid_prefix_hex_to_bin(peer_records[peer]->partials[partial].bid_prefix);
+  for(int i=0;i<8;i++) report_queue[slot][ofs++]=bid_prefix_bin[i];
+  report_lengths[slot]=ofs;
+
+  if (report_queue_message[slot]) {
+    free(report_queue_message[slot]);
+    report_queue_message[slot]=NULL;
+  }
+  report_queue_message[slot]=strdup("delta request");
+  
+  if (slot>=report_queue_length) report_queue_length=slot+1;
+
+  return 0;
+}
+
+int sync_parse_delta_request(struct peer_state *p,unsigned char *msg)
+{
+  if (!delta_mode) return 0;
+
+  char bid_prefix_hex[8*2+1];
+  snprintf(bid_prefix_hex,17,"%02X%02X%02X%02X%02X%02X%02X%02X",
+	   msg[3],msg[4],msg[5],msg[6],msg[7],msg[8],msg[9],msg[10]);
+  int bundle=lookup_bundle_by_prefix_hex(bid_prefix_hex);
+  if ((bundle<0)||(bundle!=p->tx_bundle)) return -1;
+  // We are already on to it
+  if (p->tx_delta_pending) return 0;
+
+  fprintf(stderr,"T+%lldms : %s* asked for block signatures of bundle #%d.\n",
+	  gettime_ms()-start_time,p->sid_prefix,bundle);
+  p->tx_delta_pending=1;
+  p->tx_delta_block=0;
+  return 0;
+}
+
+// Bind the handle again for whichever peers we are using it for
+int sync_parse_session_rebind(struct peer_state *p,unsigned char *msg)
+{
+  int handle=msg[3];
+  for(int pn=0;pn<peer_count;pn++)
+    if (peer_records[pn]&&peer_records[pn]->tx_session_bound
+	&&(peer_records[pn]->tx_session_handle==handle)) {
+      fprintf(stderr,"T+%lldms : %s* asked us to rebind session handle %d.\n",
+	      gettime_ms()-start_time,p->sid_prefix,handle);
+      peer_records[pn]->tx_session_bound=0;
+    }
+  return 0;
+}
+
 unsigned char bin_prefix[8];
 unsigned char *bid_prefix_hex_to_bin(char *hex)
 {
@@ -557,9 +1041,9 @@ int sync_tell_peer_we_have_the_bundle_of_this_partial(int peer, int partial)
 }
 
 
-/* Find the first byte missing in the following segment list.
+/* Find the first byte missing in the following reassembly buffer.
    Basically this boils down to being either byte 0, or the
-   first byte after the first segment. 
+   first byte after the first received run. 
 
    However, we actually want to randomise the byte we ask for,
    so that if a peer is sending to multiple peers, that we can
@@ -569,31 +1053,70 @@ int sync_tell_peer_we_have_the_bundle_of_this_partial(int peer, int partial)
    to one of our partial pieces.  However, we need to take care to
    not make the sender think that we have it all.
 */
-int partial_first_missing_byte(struct segment_list *s)
+int partial_first_missing_byte(struct reassembly_buffer *r)
 {
-  int add_zero=1;
-  
   int candidates[16];
   int candidate_count=0;
+  int highest=-1;
   
-  // Walk the segment list. Adjacent segments should be merged,
-  // so the offset following each segment is a valid candidate,
+  // The offset following each run of received bytes is a valid candidate,
   // except if a candidate is the end of the file.
-  while(s) {
-    if (!s->start_offset) add_zero=0;
-    if (candidate_count<16)
-      candidates[candidate_count++]=s->start_offset+s->length;
-    s=s->next;
+  int start,end=0;
+  if (!reassembly_has_byte(r,0)) candidates[candidate_count++]=0;
+  while(!reassembly_next_run(r,end,&start,&end)) {
+    if ((highest>=0)&&(candidate_count<16))
+      candidates[candidate_count++]=highest;
+    highest=end;
   }
-  if ((candidate_count<16)&&(add_zero)) candidates[candidate_count++]=0;
   
-  // The values should be in descending order. Don't ask for highest value,
-  // incase it signals the end of the bundle (we don't necessarily know the
-  // payload length during reception).  Thus only ask for the end point if
-  // there are no other alternatives.
-  if (candidate_count>1)
-    return candidates[1+random()%(candidate_count-1)];
-  else return candidates[0];
+  // Don't ask for highest value, incase it signals the end of the bundle (we
+  // don't necessarily know the payload length during reception).  Thus only
+  // ask for the end point if there are no other alternatives.
+  if (candidate_count)
+    return candidates[random()%candidate_count];
+  else return highest;
+}
+
+static int sync_sack_write_number(unsigned char *out,int space,int *ofs,int value)
+{
+  do {
+    if (*ofs>=space) return -1;
+    out[(*ofs)++]=(value&0x7f)|((value>0x7f)?0x80:0);
+    value>>=7;
+  } while(value);
+  return 0;
+}
+
+/* Describe the holes in what we have received of a body, for the sender, as
+   many as will fit.  Returns the number of bytes written to out. */
+static int sync_build_sack(struct reassembly_buffer *r,int stream_length,
+			   unsigned char *out)
+{
+  unsigned char list[MAX_SACK_BYTES];
+  int count=0;
+  int end=(stream_length>=0)?stream_length:r->size;
+  int position=0;
+
+  while(position<end) {
+    int missing_start=reassembly_first_missing_byte(r,position);
+    int run_start,run_end;
+    int ofs=count;
+    if (reassembly_next_run(r,missing_start,&run_start,&run_end)) {
+      // Everything from here on is missing, so we only need say where that is
+      if (!sync_sack_write_number(list,MAX_SACK_BYTES,&ofs,missing_start-position))
+	count=ofs;
+      break;
+    }
+    if (sync_sack_write_number(list,MAX_SACK_BYTES,&ofs,missing_start-position)
+	||sync_sack_write_number(list,MAX_SACK_BYTES,&ofs,run_start-missing_start))
+      break;
+    count=ofs;
+    position=run_start;
+  }
+
+  out[0]=count;
+  bcopy(list,&out[1],count);
+  return 1+count;
 }
 
 int sync_schedule_progress_report(int peer, int partial)
@@ -614,8 +1137,10 @@ int sync_schedule_progress_report(int peer, int partial)
   report_queue_partials[slot]=partial;
   report_queue_peers[slot]=peer_records[peer];
 
+  // Only peers that understand selective acknowledgements get them
+  int sack=peer_has_capability(peer_records[peer],LBARD_CAP_SACK);
   int ofs=0;
-  report_queue[slot][ofs++]='A';
+  report_queue[slot][ofs++]=sack?'a':'A';
 
   if (report_queue_message[slot]) {
     fprintf(stderr,"Replacing report_queue message '%s' with 'progress report'\n",
@@ -639,11 +1164,15 @@ int sync_schedule_progress_report(int peer, int partial)
   
   // manifest and body offset
   int first_required_manifest_offset
-    =partial_first_missing_byte(peer_records[peer]
-				->partials[partial].manifest_segments);
+    =partial_first_missing_byte(&peer_records[peer]
+				->partials[partial].assembly->manifest);
   int first_required_body_offset
-    =partial_first_missing_byte(peer_records[peer]
-				->partials[partial].body_segments);
+    =partial_first_missing_byte(&peer_records[peer]
+				->partials[partial].assembly->body);
+  // If we are waiting on the body to rebuild the manifest from a delta, we
+  // don't need the sender to send the manifest.
+  if (peer_records[peer]->partials[partial].assembly->manifest_delta)
+    first_required_manifest_offset=0xffff;
   report_queue[slot][ofs++]=first_required_manifest_offset&0xff;
   report_queue[slot][ofs++]=(first_required_manifest_offset>>8)&0xff;
   report_queue[slot][ofs++]=first_required_body_offset&0xff;
@@ -651,6 +1180,13 @@ int sync_schedule_progress_report(int peer, int partial)
   report_queue[slot][ofs++]=(first_required_body_offset>>16)&0xff;
   report_queue[slot][ofs++]=(first_required_body_offset>>24)&0xff;
 
+  // Selective acknowledgement of the body, so that the sender can skip what we
+  // already have.
+  if (sack)
+    ofs+=sync_build_sack(&peer_records[peer]->partials[partial].assembly->body,
+			 peer_records[peer]->partials[partial].assembly->body_length,
+			 &report_queue[slot][ofs]);
+
   report_lengths[slot]=ofs;
   assert(ofs<MAX_REPORT_LEN);
   if (slot>=report_queue_length) report_queue_length=slot+1;
@@ -668,20 +1204,8 @@ int sync_schedule_progress_report(int peer, int partial)
 
 int lookup_bundle_by_prefix_hex(char *prefix)
 {
-  int best_bundle=-1;
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if ((best_bundle==-1)||(bundles[bundle].version>bundles[best_bundle].version))
-	best_bundle=bundle;      
-      printf("  %s* could be bundle #%d (after check it is bundle #%d)\n",
-	     prefix,bundle,best_bundle);
-    }
-  }
+  // The bundle index returns the highest version for a prefix first.
+  int best_bundle=bundle_index_first(bid_prefix_hex_to_bin(prefix));
   printf("  %s* is bundle #%d of %d\n",prefix,best_bundle,bundle_count);
   return best_bundle;
 }
@@ -689,15 +1213,10 @@ int lookup_bundle_by_prefix_hex(char *prefix)
 int lookup_bundle_by_prefix_bin_and_version_exact(unsigned char *prefix, long long version)
 {
   int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version==version)
-	return bundle;
-    }
+  for(bundle=bundle_index_first(prefix);bundle!=-1;
+      bundle=bundles[bundle].next_with_same_prefix) {
+    if (bundles[bundle].version==version)
+      return bundle;
   }
   return -1;
 }
@@ -705,36 +1224,19 @@ int lookup_bundle_by_prefix_bin_and_version_exact(unsigned char *prefix, long lo
 // Returns newest bundle version of relevance
 int lookup_bundle_by_prefix_bin_and_version_or_newer(unsigned char *prefix, long long version)
 {
-  int best_bundle=-1;
-  int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version>=version) {
-	if ((best_bundle==-1)||(bundles[bundle].version>bundles[best_bundle].version))
-	  best_bundle=bundle;
-      }
-      
-    }
-  }
-  return best_bundle;
+  // Chain is in descending version order, so the head is the best candidate
+  int bundle=bundle_index_first(prefix);
+  if ((bundle!=-1)&&(bundles[bundle].version>=version)) return bundle;
+  return -1;
 }
 
 int lookup_bundle_by_prefix_bin_and_version_or_older(unsigned char *prefix, long long version)
 {
   int bundle;
-  int i;
-  for(bundle=0;bundle<bundle_count;bundle++) {
-    for(i=0;i<8;i++) {
-      if (prefix[i]!=bundles[bundle].bid_bin[i]) break;
-    }
-    if (i==8) {
-      if (bundles[bundle].version<=version)
-	return bundle;
-    }
+  for(bundle=bundle_index_first(prefix);bundle!=-1;
+      bundle=bundles[bundle].next_with_same_prefix) {
+    if (bundles[bundle].version<=version)
+      return bundle;
   }
   return -1;
 }
@@ -743,14 +1245,19 @@ int lookup_bundle_by_prefix_bin_and_version_or_older(unsigned char *prefix, long
 int sync_queue_bundle(struct peer_state *p,int bundle)
 {
   struct bundle_record *b=&bundles[bundle];
+  char recipient[64*2+1];
 
   int priority=calculate_bundle_intrinsic_priority(b->bid_hex,
 						   b->length,
 						   b->version,
-						   b->service,
-						   b->recipient,
+						   (char *)b->service,
+						   bundle_field_hex(b,BUNDLE_HAS_RECIPIENT,
+								    recipient),
 						   0);
 
+  // Already being sent
+  if (p->tx_bundle==bundle) return 0;
+
   // TX queue has something in it.
   if (p->tx_bundle>=0) {
     if (priority>p->tx_bundle_priority) {
@@ -769,6 +1276,8 @@ int sync_queue_bundle(struct peer_state *p,int bundle)
   // (also used to putting new bundle in the current TX slot if there was something
   // lower priority in there previously.)
   if (p->tx_bundle==-1) {
+    // It might have been waiting in the queue at a lower priority
+    peer_queue_remove(p,bundle);
     p->tx_bundle=bundle;
     // Start body transmission at a random point, so that if we are sending the
     // bundle to multiple peers, we at least have a chance of not sending the same
@@ -780,6 +1289,11 @@ int sync_queue_bundle(struct peer_state *p,int bundle)
     p->tx_bundle_body_offset=random()%bundles[bundle].length;
     p->tx_bundle_manifest_offset=0;
     p->tx_bundle_priority=priority;
+    p->tx_sack_valid=0;
+    p->tx_bundle_repair=0;
+    p->tx_session_bound=0;
+    p->tx_manifest_delta_tries=0;
+    p->tx_delta_pending=0;
   }
 
   // peer_queue_list_dump(p);
@@ -787,6 +1301,40 @@ int sync_queue_bundle(struct peer_state *p,int bundle)
 }
 
 
+/* Queue again bundles that the sync tree says that a peer still lacks, but
+   which are no longer in its TX queue, e.g., because we couldn't fetch them
+   from Rhizome at the time.  We go through all of them before sending any, so
+   that the TX queue can put them in order of priority, rather than sending the
+   first few in key order.  Once we have been through them all, we wait a while
+   before starting again. */
+#define SYNC_REQUEUE_BATCH 16
+#define SYNC_REQUEUE_INTERVAL 30
+int sync_requeue_missing_bundles(struct peer_state *p)
+{
+  if (p->tx_cursor.finished) {
+    if (time(0)<(p->tx_cursor_pass_time+SYNC_REQUEUE_INTERVAL)) return 0;
+    sync_cursor_reset(&p->tx_cursor);
+  }
+
+  sync_key_t keys[SYNC_REQUEUE_BATCH];
+  void *contexts[SYNC_REQUEUE_BATCH];
+  int count,total=0;
+  while((count=sync_peer_missing_keys(sync_state,p,&p->tx_cursor,
+				      keys,contexts,SYNC_REQUEUE_BATCH))>0) {
+    for(int i=0;i<count;i++) {
+      int bundle=BUNDLE_FROM_KEY_CONTEXT(contexts[i]);
+      if ((bundle>=0)&&(bundle<bundle_count)) sync_queue_bundle(p,bundle);
+    }
+    total+=count;
+  }
+  p->tx_cursor_pass_time=time(0);
+
+  if (total)
+    printf("T+%lldms : Requeued %d bundles that %s* still lacks.\n",
+	   gettime_ms()-start_time,total,p->sid_prefix);
+  return total;
+}
+
 int sync_dequeue_bundle(struct peer_state *p,int bundle)
 {
   if (bundle==p->tx_bundle) {
@@ -794,56 +1342,22 @@ int sync_dequeue_bundle(struct peer_state *p,int bundle)
     p->tx_bundle=-1;
     // Advance next in queue, if there is anything
     if (p->tx_queue_len) {
+      int priority;
+      p->tx_bundle=peer_queue_pop(p,&priority);
       printf("DEQUEUING:\n     %d more bundles in the queue. Next is bundle #%d\n",
-	     p->tx_queue_len,p->tx_queue_bundles[0]);
-      p->tx_bundle=p->tx_queue_bundles[0];
-      p->tx_bundle_priority=p->tx_queue_priorities[0];
+	     p->tx_queue_len,p->tx_bundle);
+      p->tx_bundle_priority=priority;
       p->tx_bundle_manifest_offset=0;
       p->tx_bundle_body_offset=0;      
-      bcopy(&p->tx_queue_bundles[1],
-	    &p->tx_queue_bundles[0],
-	    sizeof(int)*p->tx_queue_len-1);
-      bcopy(&p->tx_queue_priorities[1],
-	    &p->tx_queue_priorities[0],
-	    sizeof(int)*p->tx_queue_len-1);
-      p->tx_queue_len--;
-    } else {
-      if (p->tx_queue_overflow) {
-	/* TX queue overflowed at some point, and now we have
-	   emptied the queue. This means that we need to restart
-	   the tree synchronisation with this peer.  
-	   XXX - In time, Jeremy will implement sync tree enumeration,
-	   which will be a more efficient solution to this problem.
-	   In the meantime, we will just change our instance ID, and also
-	   the instance ID we have recorded for this peer, so that we
-	   force a re-sync.
-	*/
-	p->instance_id=0xffffffff;
-	my_instance_id=0;
-	while(my_instance_id==0)
-	  urandombytes((unsigned char *)&my_instance_id,sizeof(unsigned int));
-      }
+      p->tx_sack_valid=0;
+      p->tx_bundle_repair=0;
+      p->tx_session_bound=0;
+      p->tx_manifest_delta_tries=0;
+      p->tx_delta_pending=0;
     }
   } else {
     // Wasn't the bundle on the list right now, so delete from in list.
-    for(int i=0;i<p->tx_queue_len;i++) {
-      if (bundle==p->tx_queue_bundles[i]) {
-	// printf("Before deletion from in queue:\n");
-	// peer_queue_list_dump(p);
-	// Delete this entry in queue
-	bcopy(&p->tx_queue_bundles[i+1],
-	      &p->tx_queue_bundles[i],
-	      sizeof(int)*p->tx_queue_len-i-1);
-	bcopy(&p->tx_queue_priorities[i+1],
-	      &p->tx_queue_priorities[i],
-	      sizeof(int)*p->tx_queue_len-i-1);
-	p->tx_queue_len--;
-	// printf("After deletion from in queue:\n");
-	// peer_queue_list_dump(p);
-	return 0;
-      }
-    }
-    
+    peer_queue_remove(p,bundle);
   }
 
   return 0;
@@ -890,6 +1404,92 @@ int sync_parse_ack(struct peer_state *p,unsigned char *msg)
   return 0;
 }
 
+/* A selective acknowledgement ('a') is an 'A' message, with a list of the ranges of
+   the body that are still missing appended, as a run-length encoding of the
+   bitmap of received bytes:
+     1 byte  : length of the list in bytes
+     n bytes : pairs of variable length integers, giving the number of bytes
+               the receiver has, followed by the number it is missing,
+               optionally ending with a lone number of bytes it has.
+   Everything beyond the end of the list is missing. */
+#define SACK_NUMBER_MAX_BYTES 5
+static int sync_sack_read_number(unsigned char *in,int len,int *ofs,int *value)
+{
+  uint32_t v=0;
+  for(int i=0;(*ofs<len)&&(i<SACK_NUMBER_MAX_BYTES);i++) {
+    uint32_t b=in[(*ofs)++];
+    v|=(b&0x7f)<<(i*7);
+    if (!(b&0x80)) {
+      // Bits lost off the top in the last byte, or too big to be an offset
+      if ((i==SACK_NUMBER_MAX_BYTES-1)&&(b>>4)) return -1;
+      if (v>INT_MAX) return -1;
+      *value=v;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int sync_parse_sack(struct peer_state *p,unsigned char *msg)
+{
+  int manifest_offset=msg[9]|(msg[10]<<8);
+  int count=msg[15];
+  if (count>MAX_SACK_BYTES) return -1;
+
+  char bid_prefix_hex[8*2+1];
+  snprintf(bid_prefix_hex,17,"%02X%02X%02X%02X%02X%02X%02X%02X",
+	   msg[1],msg[2],msg[3],msg[4],msg[5],msg[6],msg[7],msg[8]);
+  int bundle=lookup_bundle_by_prefix_hex(bid_prefix_hex);
+
+  if ((bundle<0)||(bundle!=p->tx_bundle)) {
+    fprintf(stderr,"SYNC SACK: Ignoring, because we are sending bundle #%d, and request is for bundle #%d\n",p->tx_bundle,bundle);
+    return -1;
+  }
+
+  // Don't act on a half-parsed list
+  p->tx_sack_valid=0;
+
+  int ranges=0;
+  int position=0;
+  int ofs=0;
+  while(ofs<count) {
+    int have,missing;
+    if (sync_sack_read_number(&msg[16],count,&ofs,&have)
+	||(have>INT_MAX-position))
+      return -1;
+    if (ofs==count) {
+      // Just the start of the missing tail
+      position+=have;
+      break;
+    }
+    if (sync_sack_read_number(&msg[16],count,&ofs,&missing)
+	||(missing>INT_MAX-position-have)
+	||(ranges>=MAX_SACK_RANGES))
+      return -1;
+    p->tx_sack_start[ranges]=position+have;
+    p->tx_sack_end[ranges]=position+have+missing;
+    position=p->tx_sack_end[ranges++];
+  }
+
+  fprintf(stderr,"T+%lldms : SYNC SACK: %s* lacks %d ranges of bundle #%d, and everything from %d on.\n",
+	  gettime_ms()-start_time,p->sid_prefix,ranges,bundle,position);
+
+  /* We keep our place in the body, rather than going back to where the peer
+     asks (which may be stale by the time we hear it), and just skip over
+     what the peer has as we go.  When we get to the end, we go back to the
+     first hole.  The manifest is short, so we simply carry on from where the
+     peer says it is up to, which is past the end once it has all of it (or
+     0xffff if it is rebuilding it from a delta). */
+  p->tx_bundle_manifest_offset=manifest_offset;
+  p->tx_sack_manifest_offset=manifest_offset;
+  p->tx_sack_valid=1;
+  p->tx_sack_bundle=bundle;
+  p->tx_sack_ranges=ranges;
+  p->tx_sack_tail=position;
+
+  return 0;
+}
+
 void peer_has_this_key(void *context, void *peer_context, const sync_key_t *key)
 {
   struct peer_state *p=(struct peer_state *)peer_context;
@@ -907,15 +1507,13 @@ void peer_now_has_this_key(void *context, void *peer_context,void *key_context,
   // We should stop sending it to them, if we were trying.
 
   struct peer_state *p=(struct peer_state *)peer_context;
-  struct bundle_record *b=(struct bundle_record*)key_context;
+  struct bundle_record *b=&bundles[BUNDLE_FROM_KEY_CONTEXT(key_context)];
 
   if (0)
     printf(">>> Peer %s* is now has bundle %s*\n"
-	   "    service=%s, version=%lld\n"
-	   "    sender=%s,\n"
-	   "    recipient=%s\n",
+	   "    service=%s, version=%lld\n",
 	   p->sid_prefix,
-	   b->bid_hex,b->service,b->version,b->sender,b->recipient);
+	   b->bid_hex,b->service,b->version);
 
   sync_dequeue_bundle(p,b->index);
 
@@ -928,15 +1526,13 @@ void peer_does_not_have_this_key(void *context, void *peer_context,void *key_con
   // We need to send something to a peer
   
   struct peer_state *p=(struct peer_state *)peer_context;
-  struct bundle_record *b=(struct bundle_record*)key_context;
+  struct bundle_record *b=&bundles[BUNDLE_FROM_KEY_CONTEXT(key_context)];
 
   if (0)
     printf(">>> Peer %s* is missing bundle %s*\n"
-	   "    service=%s, version=%lld\n"
-	   "    sender=%s,\n"
-	   "    recipient=%s\n",
+	   "    service=%s, version=%lld\n",
 	   p->sid_prefix,
-	   b->bid_hex,b->service,b->version,b->sender,b->recipient);
+	   b->bid_hex,b->service,b->version);
 
   if (debug_sync_keys) {
     char filename[1024];
@@ -44,10 +44,247 @@ extern char *my_sid_hex;
 #include "sync.h"
 #include "lbard.h"
 
-struct bundle_record bundles[MAX_BUNDLES];
+struct bundle_record *bundles=NULL;
 int bundle_count=0;
+int bundles_alloc=0;
 int ignored_bundles=0;
 
+#define BUNDLES_INITIAL_ALLOC 1024
+
+static int bundle_store_grow()
+{
+  int new_alloc=bundles_alloc?bundles_alloc*2:BUNDLES_INITIAL_ALLOC;
+  struct bundle_record *new_bundles=realloc(bundles,sizeof(struct bundle_record)*new_alloc);
+  if (!new_bundles) {
+    fprintf(stderr,"Could not grow bundle list to %d entries.\n",new_alloc);
+    return -1;
+  }
+  bzero(&new_bundles[bundles_alloc],
+	sizeof(struct bundle_record)*(new_alloc-bundles_alloc));
+  bundles=new_bundles;
+  bundles_alloc=new_alloc;
+  return 0;
+}
+
+/* Keys of newly registered bundles, waiting to be added to the sync tree.
+   Adding the keys in one go is much cheaper than adding them one at a time,
+   when we load the whole bundle list at start up.
+*/
+sync_key_t *pending_sync_keys=NULL;
+void **pending_sync_key_contexts=NULL;
+int pending_sync_key_count=0;
+int pending_sync_keys_alloc=0;
+
+static int bundle_queue_sync_key(sync_key_t *key,int bundle_number)
+{
+  if (pending_sync_key_count>=pending_sync_keys_alloc) {
+    int new_alloc=pending_sync_keys_alloc?pending_sync_keys_alloc*2:BUNDLES_INITIAL_ALLOC;
+    sync_key_t *new_keys=realloc(pending_sync_keys,sizeof(sync_key_t)*new_alloc);
+    if (new_keys) pending_sync_keys=new_keys;
+    void **new_contexts=realloc(pending_sync_key_contexts,sizeof(void *)*new_alloc);
+    if (new_contexts) pending_sync_key_contexts=new_contexts;
+    if ((!new_keys)||(!new_contexts)) {
+      // Can't queue it, so add it straight away instead
+      sync_add_key(sync_state,key,BUNDLE_KEY_CONTEXT(bundle_number));
+      return -1;
+    }
+    pending_sync_keys_alloc=new_alloc;
+  }
+  pending_sync_keys[pending_sync_key_count]=*key;
+  pending_sync_key_contexts[pending_sync_key_count]=BUNDLE_KEY_CONTEXT(bundle_number);
+  pending_sync_key_count++;
+  return 0;
+}
+
+// Add the keys of all bundles registered since last time to the sync tree
+int bundle_flush_sync_keys()
+{
+  if (!pending_sync_key_count) return 0;
+  sync_add_keys(sync_state,pending_sync_keys,pending_sync_key_contexts,
+		pending_sync_key_count);
+  pending_sync_key_count=0;
+  return 0;
+}
+
+/* There are only a handful of distinct service names, so rather than keeping
+   a copy of the name in every bundle, we keep a single copy of each, and have
+   the bundles point to that.
+*/
+#define MAX_INTERNED_SERVICES 64
+#define MAX_SERVICE_NAME_LEN 40
+char interned_services[MAX_INTERNED_SERVICES][MAX_SERVICE_NAME_LEN];
+int interned_service_count=0;
+
+const char *bundle_intern_service(char *service)
+{
+  for(int i=0;i<interned_service_count;i++)
+    if (!strcmp(interned_services[i],service)) return interned_services[i];
+  // Too many services (or too long a name) means that someone is making them up,
+  // so lump them all together.
+  if ((interned_service_count>=MAX_INTERNED_SERVICES)
+      ||(strlen(service)>=MAX_SERVICE_NAME_LEN))
+    return "other";
+  strcpy(interned_services[interned_service_count],service);
+  return interned_services[interned_service_count++];
+}
+
+// Convert a hex string to binary, returning 1 if the string was exactly the
+// expected length.
+static int bundle_hex_to_bin(char *hex,unsigned char *bin,int len)
+{
+  if (!hex||(strlen(hex)!=len*2)) {
+    bzero(bin,len);
+    return 0;
+  }
+  for(int i=0;i<len;i++) {
+    char h[3]={hex[i*2+0],hex[i*2+1],0};
+    bin[i]=strtoll(h,NULL,16);
+  }
+  return 1;
+}
+
+// Returns one of the binary fields of a bundle as an upper-case hex string,
+// or an empty string if the bundle doesn't have that field.
+// hex_out must have room for 64*2+1 bytes.
+char *bundle_field_hex(struct bundle_record *b,int field,char *hex_out)
+{
+  unsigned char *bin=NULL;
+  int len=32;
+  switch(field) {
+  case BUNDLE_HAS_AUTHOR: bin=b->author; break;
+  case BUNDLE_HAS_FILEHASH: bin=b->filehash; len=64; break;
+  case BUNDLE_HAS_SENDER: bin=b->sender; break;
+  case BUNDLE_HAS_RECIPIENT: bin=b->recipient; break;
+  }
+  hex_out[0]=0;
+  if (bin&&(b->fields_present&field)) {
+    for(int i=0;i<len;i++) {
+      hex_out[i*2+0]=hextochar(bin[i]>>4);
+      hex_out[i*2+1]=hextochar(bin[i]&0xf);
+    }
+    hex_out[len*2]=0;
+  }
+  return hex_out;
+}
+
+/* Index of bundles by the first 8 bytes of their BID, so that we don't have to
+   search linearly through all bundles every time a piece, ACK or new bundle
+   arrives.
+   This is an open-addressed hash table with linear probing.  Each slot holds the
+   number of the bundle with the highest version for a given prefix. Other bundles
+   that share the same prefix (i.e., distinct BIDs that collide in the first 64 bits)
+   are chained from there via next_with_same_prefix, in descending version order.
+   Bundles are never removed from the bundle list, so no deletion markers are
+   required.
+*/
+#define BUNDLE_INDEX_INITIAL_SIZE 1024
+int *bundle_index=NULL;
+int bundle_index_size=0;
+int bundle_index_used=0;
+
+static unsigned int bundle_index_hash(unsigned char *prefix)
+{
+  uint64_t v=0;
+  for(int i=0;i<8;i++) v=(v<<8)|prefix[i];
+  // The BID is a public key, and so is already pretty random, but mixing the bits
+  // protects us against any structure in the low bits.
+  v*=0x9E3779B97F4A7C15ULL;
+  return (unsigned int)(v>>32);
+}
+
+// Return the slot that holds the given prefix, or the empty slot where it would go.
+static int bundle_index_slot(unsigned char *prefix)
+{
+  int mask=bundle_index_size-1;
+  int slot=bundle_index_hash(prefix)&mask;
+  while(bundle_index[slot]!=-1) {
+    if (!memcmp(bundles[bundle_index[slot]].bid_bin,prefix,8)) break;
+    slot=(slot+1)&mask;
+  }
+  return slot;
+}
+
+static int bundle_index_grow()
+{
+  int old_size=bundle_index_size;
+  int *old_index=bundle_index;
+
+  bundle_index_size=old_size?old_size*2:BUNDLE_INDEX_INITIAL_SIZE;
+  bundle_index=malloc(sizeof(int)*bundle_index_size);
+  if (!bundle_index) {
+    fprintf(stderr,"Could not allocate %d slots for bundle index.\n",bundle_index_size);
+    exit(-1);
+  }
+  for(int i=0;i<bundle_index_size;i++) bundle_index[i]=-1;
+
+  // Re-insert the head of each chain. The chains themselves are unaffected.
+  for(int i=0;i<old_size;i++)
+    if (old_index[i]!=-1)
+      bundle_index[bundle_index_slot(bundles[old_index[i]].bid_bin)]=old_index[i];
+  free(old_index);
+  return 0;
+}
+
+// Returns the bundle with the highest version with this 8-byte BID prefix, or -1.
+// Use next_with_same_prefix to iterate through any others.
+int bundle_index_first(unsigned char *bid_prefix_bin)
+{
+  if (!bundle_index_size) return -1;
+  return bundle_index[bundle_index_slot(bid_prefix_bin)];
+}
+
+static int bundle_index_insert(int bundle)
+{
+  if ((bundle_index_used+1)*2>bundle_index_size) bundle_index_grow();
+
+  int slot=bundle_index_slot(bundles[bundle].bid_bin);
+  if (bundle_index[slot]==-1) bundle_index_used++;
+
+  // Keep the chain sorted by descending version
+  int *link=&bundle_index[slot];
+  while((*link!=-1)&&(bundles[*link].version>bundles[bundle].version))
+    link=&bundles[*link].next_with_same_prefix;
+  bundles[bundle].next_with_same_prefix=*link;
+  *link=bundle;
+  return 0;
+}
+
+static int bundle_index_remove(int bundle)
+{
+  if (!bundle_index_size) return -1;
+  int slot=bundle_index_slot(bundles[bundle].bid_bin);
+  int *link=&bundle_index[slot];
+  while(*link!=-1) {
+    if (*link==bundle) {
+      *link=bundles[bundle].next_with_same_prefix;
+      bundles[bundle].next_with_same_prefix=-1;
+      // Slot stays occupied if other bundles remain, otherwise we have to
+      // re-insert any entries displaced by this one, so that probing still finds them.
+      if (bundle_index[slot]==-1) {
+	int mask=bundle_index_size-1;
+	bundle_index_used--;
+	for(int s=(slot+1)&mask;bundle_index[s]!=-1;s=(s+1)&mask) {
+	  int b=bundle_index[s];
+	  bundle_index[s]=-1;
+	  bundle_index[bundle_index_slot(bundles[b].bid_bin)]=b;
+	}
+      }
+      return 0;
+    }
+    link=&bundles[*link].next_with_same_prefix;
+  }
+  return -1;
+}
+
+// Find the bundle with exactly this BID
+static int bundle_index_lookup_bid(unsigned char *bid_bin,char *bid_hex)
+{
+  int b=bundle_index_first(bid_bin);
+  while((b!=-1)&&strcasecmp(bundles[b].bid_hex,bid_hex))
+    b=bundles[b].next_with_same_prefix;
+  return b;
+}
+
 int register_bundle(char *service,
 		    char *bid,
 		    char *version,
@@ -112,18 +349,19 @@ int register_bundle(char *service,
     }
   }
   
-  // XXX - Linear search through bundles!
-  // Use a hash table or something so that it doesn't cost O(n^2) with number
-  // of bundles.
-  int bundle_number=bundle_count;
-  for(i=0;i<bundle_count;i++) {
-    if (!strcmp(bundles[i].bid_hex,bid)) {
-      // Updating an existing bundle
-      bundle_number=i; break;
-    }
+  unsigned char bid_bin[32];
+  if (!bundle_hex_to_bin(bid,bid_bin,32)) {
+    rhizome_log(service,bid,version,author,originated_here,length,filehash,sender,recipient,
+		"Rejected bundle with malformed BID");
+    ignored_bundles++;
+    return -1;
   }
+  
+  int bundle_number=bundle_index_lookup_bid(bid_bin,bid);
+  if (bundle_number<0) bundle_number=bundle_count;
 
-  if (bundle_number>=MAX_BUNDLES) return -1;
+  if (bundle_number>=bundles_alloc)
+    if (bundle_store_grow()) return -1;
   
   if (bundle_number<bundle_count) {
     // Replace old bundle values, ...
@@ -134,25 +372,13 @@ int register_bundle(char *service,
       return 0;
     }
     
-    free(bundles[bundle_number].service);
-    bundles[bundle_number].service=NULL;
-    free(bundles[bundle_number].author);
-    bundles[bundle_number].author=NULL;
-    free(bundles[bundle_number].filehash);
-    bundles[bundle_number].filehash=NULL;
-    free(bundles[bundle_number].sender);
-    bundles[bundle_number].sender=NULL;
-    free(bundles[bundle_number].recipient);
-    bundles[bundle_number].recipient=NULL;
+    // The version is changing, so it may need to move within its index chain
+    bundle_index_remove(bundle_number);
   } else {    
     // New bundle
-    bundles[bundle_number].bid_hex=strdup(bid);
-    {
-      for(int i=0;i<32;i++) {
-	char hex[3]={bid[i*2+0],bid[i*2+1],0};
-	bundles[bundle_number].bid_bin[i]=strtoll(hex,NULL,16);
-      }
-    }
+    snprintf(bundles[bundle_number].bid_hex,sizeof(bundles[bundle_number].bid_hex),
+	     "%s",bid);
+    bcopy(bid_bin,bundles[bundle_number].bid_bin,32);
     // Never announced
     bundles[bundle_number].last_offset_announced=0;
     bundles[bundle_number].last_version_of_manifest_announced=0;
@@ -168,19 +394,26 @@ int register_bundle(char *service,
     bundles[bundle_number].last_announced_time=0;
   }
   
-  bundles[bundle_number].service=strdup(service);
-  bundles[bundle_number].version=strtoll(version,NULL,10);
-  bundles[bundle_number].author=strdup(author);
-  bundles[bundle_number].originated_here_p=atoi(originated_here);
-  bundles[bundle_number].length=length;
-  bundles[bundle_number].filehash=strdup(filehash);
-  bundles[bundle_number].sender=strdup(sender);
-  bundles[bundle_number].recipient=strdup(recipient);
+  struct bundle_record *b=&bundles[bundle_number];
+  b->service=bundle_intern_service(service);
+  b->version=strtoll(version,NULL,10);
+  b->originated_here_p=atoi(originated_here);
+  b->length=length;
+  b->fields_present=0;
+  if (bundle_hex_to_bin(author,b->author,32)) b->fields_present|=BUNDLE_HAS_AUTHOR;
+  if (bundle_hex_to_bin(filehash,b->filehash,64)) b->fields_present|=BUNDLE_HAS_FILEHASH;
+  if (bundle_hex_to_bin(sender,b->sender,32)) b->fields_present|=BUNDLE_HAS_SENDER;
+  if (bundle_hex_to_bin(recipient,b->recipient,32)) b->fields_present|=BUNDLE_HAS_RECIPIENT;
+#ifndef SYNC_BY_BAR
+  b->sync_key=bundle_sync_key;
+#endif
 
   bundles[bundle_number].index=bundle_number;
+  bundle_index_insert(bundle_number);
   
-  // Add bundle to the sync tree 
-  sync_add_key(sync_state,&bundle_sync_key,&bundles[bundle_number]);
+  // Add bundle to the sync tree, once we have finished registering bundles
+  // for now (see bundle_flush_sync_keys())
+  bundle_queue_sync_key(&bundle_sync_key,bundle_number);
   if (debug_sync_keys) {
     char filename[1024];
     snprintf(filename,1024,"lbardkeys.%s.has",my_sid_hex);
@@ -212,6 +445,17 @@ int register_bundle(char *service,
 int we_have_this_bundle_or_newer(char *bid_prefix, long long version)
 {
   int i;
+  if (strlen(bid_prefix)>=16) {
+    // The index holds the highest version first, so only one check is required
+    // (unless there are distinct BIDs that share this 8-byte prefix).
+    int b=bundle_index_first(bid_prefix_hex_to_bin(bid_prefix));
+    for(;b!=-1;b=bundles[b].next_with_same_prefix)
+      if (!strncasecmp(bundles[b].bid_hex,bid_prefix,strlen(bid_prefix)))
+	return bundles[b].version>=version;
+    return 0;
+  }
+  
+  // Short prefixes can't use the index
   for(i=0;i<bundle_count;i++) {
     if (!strncasecmp(bundles[i].bid_hex,bid_prefix,strlen(bid_prefix))) {
       // We have this bundle, but do we have this version?
@@ -230,15 +474,31 @@ int we_have_this_bundle_or_newer(char *bid_prefix, long long version)
 // because BARs don't contain the recipient (maybe they should contain a prefix?)
 // and so we see if we have an older version of a bundle in our store, and if so,
 // then use the recipient from there.
+char recipient_hex[64*2+1];
 char *bundle_recipient_if_known(char *bid_prefix)
 {
   int i;
+  if (strlen(bid_prefix)>=16) {
+    int b=bundle_index_first(bid_prefix_hex_to_bin(bid_prefix));
+    for(;b!=-1;b=bundles[b].next_with_same_prefix)
+      if (!strncasecmp(bundles[b].bid_hex,bid_prefix,strlen(bid_prefix)))
+	return bundle_field_hex(&bundles[b],BUNDLE_HAS_RECIPIENT,recipient_hex);
+    return NULL;
+  }
+  
   for(i=0;i<bundle_count;i++) {
     if (!strncasecmp(bundles[i].bid_hex,bid_prefix,strlen(bid_prefix))) {
-      return bundles[i].recipient;
+      return bundle_field_hex(&bundles[i],BUNDLE_HAS_RECIPIENT,recipient_hex);
     }
   }
 
   return NULL;
 }
+
+// Memory used by the bundle list and its index.
+long long bundle_store_memory_usage()
+{
+  return sizeof(struct bundle_record)*(long long)bundles_alloc
+    +sizeof(int)*(long long)bundle_index_size;
+}
   
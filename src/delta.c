@@ -0,0 +1,250 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015 Serval Project Inc.
+
+This program monitors a local Rhizome database and attempts
+to synchronise it over low-bandwidth declarative transports, 
+such as bluetooth name or wifi-direct service information
+messages.  It is intended to give a high priority to MeshMS
+converations among nearby nodes.
+
+The design is fully asynchronous, so a call to the update_my_message()
+function from time to time should be all that is required.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*
+  Delta transfer of new versions of file bundles.
+
+  When a peer already has an older version of a bundle, much of the new body
+  is often the same, just moved about.  Rather than having the receiver send
+  signatures of what it has back over the radio, the sender broadcasts a
+  signature of each DELTA_BLOCK_SIZE byte block of the new body (a weak rolling
+  checksum, and a few bytes of a strong hash), and each receiver runs the weak
+  checksum over every offset of its older version, looking for blocks it
+  already has.  Those it copies into place, and the selective acknowledgement
+  tells the sender not to bother sending them.  What is left arrives as ordinary
+  pieces, and the body is checked against the filehash as usual once complete.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sync.h"
+#include "lbard.h"
+#include "sha512.h"
+
+// Offer and use block signatures for new versions of bundles (the delta option)
+int delta_mode=0;
+
+// Only whole blocks are signed: the ragged end of a body is sent as is.
+int delta_block_count(int length)
+{
+  if (length<0) return 0;
+  return length/DELTA_BLOCK_SIZE;
+}
+
+// The rolling checksum of rsync: a sum of the bytes, and a sum of those sums
+unsigned int delta_weak_checksum(unsigned char *data,int len)
+{
+  unsigned int a=0,b=0;
+  for(int i=0;i<len;i++) {
+    a+=data[i];
+    b+=(len-i)*data[i];
+  }
+  return (a&0xffff)|(b<<16);
+}
+
+unsigned int delta_strong_checksum(unsigned char *data,int len)
+{
+  sha512nfo s;
+  sha512_init(&s);
+  sha512_write(&s,data,len);
+  uint8_t *hash=sha512_result(&s);
+  return hash[0]|(hash[1]<<8)|(hash[2]<<16)|((unsigned int)hash[3]<<24);
+}
+
+int delta_sign_block(unsigned char *block,unsigned char *out)
+{
+  unsigned int weak=delta_weak_checksum(block,DELTA_BLOCK_SIZE);
+  unsigned int strong=delta_strong_checksum(block,DELTA_BLOCK_SIZE);
+  for(int i=0;i<4;i++) out[i]=(weak>>(i*8))&0xff;
+  for(int i=0;i<4;i++) out[4+i]=(strong>>(i*8))&0xff;
+  return DELTA_SIGNATURE_LEN;
+}
+
+/* Look through old for the blocks first_block onwards that sigs describe, and
+   copy any we find into r.  Returns the number of bytes filled in. */
+#define DELTA_HASH_BUCKETS 256
+int delta_match_blocks(unsigned char *old,int old_len,
+		       struct reassembly_buffer *r,int body_length,
+		       int first_block,int count,unsigned char *sigs)
+{
+  if ((old_len<DELTA_BLOCK_SIZE)||(count<1)) return 0;
+
+  // Hash the weak checksums of the blocks we still need
+  int bucket[DELTA_HASH_BUCKETS];
+  int next[256];
+  unsigned int weak[256];
+  unsigned char found[256];
+  if (count>256) count=256;
+  for(int i=0;i<DELTA_HASH_BUCKETS;i++) bucket[i]=-1;
+  bzero(found,sizeof(found));
+  for(int b=0;b<count;b++) {
+    unsigned char *s=&sigs[b*DELTA_SIGNATURE_LEN];
+    weak[b]=s[0]|(s[1]<<8)|(s[2]<<16)|((unsigned int)s[3]<<24);
+    int start=(first_block+b)*DELTA_BLOCK_SIZE;
+    if (reassembly_first_missing_byte(r,start)>=start+DELTA_BLOCK_SIZE)
+      continue;
+    int h=(weak[b]^(weak[b]>>16))&(DELTA_HASH_BUCKETS-1);
+    next[b]=bucket[h];
+    bucket[h]=b;
+  }
+
+  int filled=0;
+  unsigned int a=0,s=0;
+  for(int i=0;i<DELTA_BLOCK_SIZE;i++) {
+    a+=old[i];
+    s+=(DELTA_BLOCK_SIZE-i)*old[i];
+  }
+  for(int offset=0;;offset++) {
+    unsigned int w=(a&0xffff)|(s<<16);
+    for(int b=bucket[(w^(w>>16))&(DELTA_HASH_BUCKETS-1)];b!=-1;b=next[b]) {
+      if (found[b]||(weak[b]!=w)) continue;
+      unsigned char *sig=&sigs[b*DELTA_SIGNATURE_LEN];
+      unsigned int strong=sig[4]|(sig[5]<<8)|(sig[6]<<16)|((unsigned int)sig[7]<<24);
+      if (delta_strong_checksum(&old[offset],DELTA_BLOCK_SIZE)!=strong) continue;
+      int new_bytes=reassembly_add(r,body_length,
+				   (first_block+b)*DELTA_BLOCK_SIZE,
+				   DELTA_BLOCK_SIZE,&old[offset]);
+      if (new_bytes>0) filled+=new_bytes;
+      found[b]=1;
+    }
+    if (offset+DELTA_BLOCK_SIZE>=old_len) break;
+    // Roll the window on by one byte
+    a+=old[offset+DELTA_BLOCK_SIZE]-old[offset];
+    s+=a-DELTA_BLOCK_SIZE*old[offset];
+  }
+  return filled;
+}
+
+#ifdef TEST
+// partials.c looks through the peers for partial bundles, and there are none
+struct peer_state *peer_records[MAX_PEERS];
+int peer_count=0;
+
+/* Make a new version of a body from an older one: whole blocks taken from odd
+   places in the old body, one block that isn't in it anywhere, and a short
+   block at the end.  Then match the signatures of the new blocks against the
+   old body in two goes, send what is left as ordinary pieces, and check that
+   we end up with the new body. */
+#define TEST_BLOCKS 8
+#define TEST_NEW_BLOCK 5
+#define TEST_TAIL 100
+int test_match_and_apply(void)
+{
+  int failed=0;
+  int old_len=TEST_BLOCKS*DELTA_BLOCK_SIZE+1000;
+  int new_len=TEST_BLOCKS*DELTA_BLOCK_SIZE+TEST_TAIL;
+  unsigned char *old=malloc(old_len);
+  unsigned char *new=malloc(new_len);
+  for(int i=0;i<old_len;i++) old[i]=random();
+  for(int b=0;b<TEST_BLOCKS;b++) {
+    if (b==TEST_NEW_BLOCK)
+      for(int i=0;i<DELTA_BLOCK_SIZE;i++) new[b*DELTA_BLOCK_SIZE+i]=random();
+    else {
+      // Blocks out of order, and not on block boundaries in the old body
+      int from=((TEST_BLOCKS-1-b)*DELTA_BLOCK_SIZE)+b*37;
+      bcopy(&old[from],&new[b*DELTA_BLOCK_SIZE],DELTA_BLOCK_SIZE);
+    }
+  }
+  for(int i=0;i<TEST_TAIL;i++) new[TEST_BLOCKS*DELTA_BLOCK_SIZE+i]=random();
+
+  if (delta_block_count(new_len)!=TEST_BLOCKS) {
+    printf("  FAILED: %d bytes counted as %d blocks, not %d\n",
+	   new_len,delta_block_count(new_len),TEST_BLOCKS);
+    failed=1;
+  }
+  unsigned char sigs[TEST_BLOCKS*DELTA_SIGNATURE_LEN];
+  for(int b=0;b<TEST_BLOCKS;b++)
+    delta_sign_block(&new[b*DELTA_BLOCK_SIZE],&sigs[b*DELTA_SIGNATURE_LEN]);
+
+  struct reassembly_buffer r;
+  bzero(&r,sizeof(r));
+  // One block has already arrived as a piece, so it shouldn't count
+  reassembly_add(&r,new_len,DELTA_BLOCK_SIZE,DELTA_BLOCK_SIZE,
+		 &new[DELTA_BLOCK_SIZE]);
+  int filled=delta_match_blocks(old,old_len,&r,new_len,0,3,sigs)
+    +delta_match_blocks(old,old_len,&r,new_len,3,TEST_BLOCKS-3,
+			&sigs[3*DELTA_SIGNATURE_LEN]);
+  int expected=(TEST_BLOCKS-2)*DELTA_BLOCK_SIZE;
+  if (filled!=expected) {
+    printf("  FAILED: found %d bytes in the old body, not %d\n",filled,expected);
+    failed=1;
+  }
+  for(int b=0;b<TEST_BLOCKS;b++) {
+    int start=b*DELTA_BLOCK_SIZE;
+    int have=reassembly_first_missing_byte(&r,start)>=start+DELTA_BLOCK_SIZE;
+    if (have!=(b!=TEST_NEW_BLOCK)) {
+      printf("  FAILED: block %d %s\n",b,have?"matched":"not matched");
+      failed=1;
+    }
+  }
+  if (reassembly_has_byte(&r,TEST_BLOCKS*DELTA_BLOCK_SIZE)) {
+    printf("  FAILED: short last block matched\n");
+    failed=1;
+  }
+
+  // The rest arrives as ordinary pieces
+  reassembly_add(&r,new_len,TEST_NEW_BLOCK*DELTA_BLOCK_SIZE,DELTA_BLOCK_SIZE,
+		 &new[TEST_NEW_BLOCK*DELTA_BLOCK_SIZE]);
+  reassembly_add(&r,new_len,TEST_BLOCKS*DELTA_BLOCK_SIZE,TEST_TAIL,
+		 &new[TEST_BLOCKS*DELTA_BLOCK_SIZE]);
+  if ((!reassembly_complete(&r,new_len))||bcmp(r.data,new,new_len)) {
+    printf("  FAILED: new body put together wrongly\n");
+    failed=1;
+  }
+
+  // An old body shorter than a block has nothing to offer
+  struct reassembly_buffer empty;
+  bzero(&empty,sizeof(empty));
+  if (delta_match_blocks(old,DELTA_BLOCK_SIZE-1,&empty,new_len,0,TEST_BLOCKS,sigs)) {
+    printf("  FAILED: matched blocks in a body shorter than a block\n");
+    failed=1;
+  }
+
+  reassembly_free(&r);
+  reassembly_free(&empty);
+  free(old);
+  free(new);
+  printf("Delta of %d bytes from %d: %s\n",new_len,old_len,
+	 failed?"FAILED":"put together correctly");
+  return failed;
+}
+
+int main(int argc,char **argv)
+{
+  unsigned seed=argc>1?atoi(argv[1]):1;
+  srandom(seed);
+  return test_match_and_apply();
+}
+#endif
@@ -0,0 +1,390 @@
+/*
+Serval Low-bandwidth asychronous Rhizome Demonstrator.
+Copyright (C) 2015 Serval Project Inc.
+
+This program monitors a local Rhizome database and attempts
+to synchronise it over low-bandwidth declarative transports, 
+such as bluetooth name or wifi-direct service information
+messages.  It is intended to give a high priority to MeshMS
+converations among nearby nodes.
+
+The design is fully asynchronous, so a call to the update_my_message()
+function from time to time should be all that is required.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+  Rateless erasure coding of bundle bodies.
+
+  The body is split into blocks of FOUNTAIN_BLOCK_SIZE bytes (the last one
+  zero padded), and each coded symbol is a linear combination of all of the
+  blocks over GF(256), with coefficients generated from the 16-bit symbol
+  number.  Symbols below the block count are the blocks themselves, so ordinary
+  pieces of the body count towards decoding too.  Because a symbol is useful to
+  anyone missing any part of the body, one broadcast symbol can fill different
+  holes for different receivers, and a receiver can finish from any set of
+  symbols that spans the blocks (usually just one more than the block count),
+  no matter which peer they were sent for.
+
+  The GF(256) arithmetic uses the log/antilog tables of the CCSDS Reed-Solomon
+  code in fec-3.0.1.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sync.h"
+#include "lbard.h"
+
+extern unsigned char CCSDS_alpha_to[];
+extern unsigned char CCSDS_index_of[];
+
+// Send coded symbols when going round a body again (the fountain option)
+int fountain_mode=0;
+
+static inline int gf_mod255(int x)
+{
+  while (x>=255) {
+    x-=255;
+    x=(x>>8)+(x&255);
+  }
+  return x;
+}
+
+static inline unsigned char gf_inverse(unsigned char a)
+{
+  return CCSDS_alpha_to[gf_mod255(255-CCSDS_index_of[a])];
+}
+
+// dst ^= c * src, for len bytes
+static void gf_add_multiple(unsigned char *dst,unsigned char *src,int len,
+			    unsigned char c)
+{
+  if (!c) return;
+  if (c==1) {
+    for(int i=0;i<len;i++) dst[i]^=src[i];
+    return;
+  }
+  int log_c=CCSDS_index_of[c];
+  for(int i=0;i<len;i++)
+    if (src[i]) dst[i]^=CCSDS_alpha_to[gf_mod255(log_c+CCSDS_index_of[src[i]])];
+}
+
+// dst = c * dst, for len bytes
+static void gf_scale(unsigned char *dst,int len,unsigned char c)
+{
+  int log_c=CCSDS_index_of[c];
+  for(int i=0;i<len;i++)
+    if (dst[i]) dst[i]=CCSDS_alpha_to[gf_mod255(log_c+CCSDS_index_of[dst[i]])];
+}
+
+int fountain_block_count(int length)
+{
+  return (length+FOUNTAIN_BLOCK_SIZE-1)/FOUNTAIN_BLOCK_SIZE;
+}
+
+// Can a body of this length be sent as coded symbols?
+int fountain_suitable(int length)
+{
+  return (length>0)&&(fountain_block_count(length)<=FOUNTAIN_MAX_BLOCKS);
+}
+
+// The coefficients of each block in a symbol
+static void fountain_coefficients(int symbol,int blocks,unsigned char *coefficients)
+{
+  if (symbol<blocks) {
+    bzero(coefficients,blocks);
+    coefficients[symbol]=1;
+    return;
+  }
+  /* Hash the symbol and block numbers together for each coefficient.  (This
+     has to be non-linear: the rows from a linear generator such as xorshift
+     only span as many dimensions as it has bits of state.) */
+  for(int i=0;i<blocks;i++) {
+    unsigned int x=((unsigned int)symbol<<16)^i;
+    x^=x>>16; x*=0x85ebca6bU;
+    x^=x>>13; x*=0xc2b2ae35U;
+    x^=x>>16;
+    coefficients[i]=x>>24;
+  }
+}
+
+/* Write FOUNTAIN_BLOCK_SIZE bytes of the given symbol of body into out.
+   Returns 0 on success. */
+int fountain_encode(unsigned char *body,int length,int symbol,unsigned char *out)
+{
+  int blocks=fountain_block_count(length);
+  if ((!fountain_suitable(length))||(symbol<0)||(symbol>FOUNTAIN_MAX_SYMBOL))
+    return -1;
+
+  unsigned char coefficients[FOUNTAIN_MAX_BLOCKS];
+  fountain_coefficients(symbol,blocks,coefficients);
+
+  bzero(out,FOUNTAIN_BLOCK_SIZE);
+  for(int b=0;b<blocks;b++) {
+    int bytes=length-b*FOUNTAIN_BLOCK_SIZE;
+    if (bytes>FOUNTAIN_BLOCK_SIZE) bytes=FOUNTAIN_BLOCK_SIZE;
+    gf_add_multiple(out,&body[b*FOUNTAIN_BLOCK_SIZE],bytes,coefficients[b]);
+  }
+  return 0;
+}
+
+struct fountain_decoder *fountain_decoder_new(int length)
+{
+  if (!fountain_suitable(length)) return NULL;
+  struct fountain_decoder *d=calloc(1,sizeof(struct fountain_decoder));
+  if (!d) return NULL;
+  d->length=length;
+  d->blocks=fountain_block_count(length);
+  d->row_len=d->blocks+FOUNTAIN_BLOCK_SIZE;
+  d->rows=calloc(d->blocks,d->row_len);
+  d->have=calloc(d->blocks,1);
+  if ((!d->rows)||(!d->have)) {
+    fountain_decoder_free(d);
+    return NULL;
+  }
+  return d;
+}
+
+void fountain_decoder_free(struct fountain_decoder *d)
+{
+  if (!d) return;
+  free(d->rows);
+  free(d->have);
+  free(d);
+}
+
+/* The decoder keeps its rows in echelon form, indexed by their leading column,
+   which is normalised to 1.  So a new symbol is reduced against the rows in
+   order of column, and if anything is left, it becomes the row for its first
+   non-zero column.
+   Returns 1 if the symbol told us something new, 0 if not, -1 on error. */
+static int fountain_add_row(struct fountain_decoder *d,unsigned char *row)
+{
+  for(int col=0;col<d->blocks;col++) {
+    if (!row[col]) continue;
+    if (d->have[col]) {
+      gf_add_multiple(&row[col],&d->rows[col*d->row_len+col],
+		      d->row_len-col,row[col]);
+      continue;
+    }
+    gf_scale(&row[col],d->row_len-col,gf_inverse(row[col]));
+    bcopy(row,&d->rows[col*d->row_len],d->row_len);
+    d->have[col]=1;
+    d->rank++;
+    return 1;
+  }
+  return 0;
+}
+
+int fountain_add_symbol(struct fountain_decoder *d,int symbol,unsigned char *payload)
+{
+  if ((symbol<0)||(symbol>FOUNTAIN_MAX_SYMBOL)) return -1;
+  if (fountain_decoded(d)) return 0;
+  if ((symbol<d->blocks)&&d->have[symbol]
+      &&(d->rows[symbol*d->row_len+symbol]==1)) {
+    // Cheap test for a block we have already been sent as-is
+    int only_pivot=1;
+    for(int col=symbol+1;col<d->blocks;col++)
+      if (d->rows[symbol*d->row_len+col]) { only_pivot=0; break; }
+    if (only_pivot) return 0;
+  }
+
+  unsigned char row[FOUNTAIN_MAX_BLOCKS+FOUNTAIN_BLOCK_SIZE];
+  fountain_coefficients(symbol,d->blocks,row);
+  bcopy(payload,&row[d->blocks],FOUNTAIN_BLOCK_SIZE);
+  return fountain_add_row(d,row);
+}
+
+// Feed in any blocks that have arrived whole as ordinary pieces of the body
+int fountain_add_received_blocks(struct fountain_decoder *d,
+				 struct reassembly_buffer *r)
+{
+  unsigned char block[FOUNTAIN_BLOCK_SIZE];
+  int added=0;
+  for(int b=0;(b<d->blocks)&&(!fountain_decoded(d));b++) {
+    if (d->have[b]) continue;
+    int start=b*FOUNTAIN_BLOCK_SIZE;
+    int bytes=d->length-start;
+    if (bytes>FOUNTAIN_BLOCK_SIZE) bytes=FOUNTAIN_BLOCK_SIZE;
+    if (reassembly_first_missing_byte(r,start)<start+bytes) continue;
+    bzero(block,FOUNTAIN_BLOCK_SIZE);
+    bcopy(&r->data[start],block,bytes);
+    if (fountain_add_symbol(d,b,block)>0) added++;
+  }
+  return added;
+}
+
+int fountain_decoded(struct fountain_decoder *d)
+{
+  return d->rank==d->blocks;
+}
+
+/* Once we have as many independent symbols as blocks, solve for the blocks by
+   back substitution, and copy them into the body. */
+int fountain_recover(struct fountain_decoder *d,struct reassembly_buffer *r)
+{
+  if (!fountain_decoded(d)) return -1;
+
+  for(int col=d->blocks-1;col>=0;col--) {
+    unsigned char *pivot_row=&d->rows[col*d->row_len];
+    for(int above=0;above<col;above++) {
+      unsigned char *row=&d->rows[above*d->row_len];
+      if (row[col]) {
+	gf_add_multiple(&row[d->blocks],&pivot_row[d->blocks],
+			FOUNTAIN_BLOCK_SIZE,row[col]);
+	row[col]=0;
+      }
+    }
+  }
+
+  for(int b=0;b<d->blocks;b++) {
+    int start=b*FOUNTAIN_BLOCK_SIZE;
+    int bytes=d->length-start;
+    if (bytes>FOUNTAIN_BLOCK_SIZE) bytes=FOUNTAIN_BLOCK_SIZE;
+    if (reassembly_add(r,d->length,start,bytes,
+		       &d->rows[b*d->row_len+d->blocks])<0)
+      return -1;
+  }
+  return 0;
+}
+
+#ifdef TEST
+// partials.c looks through the peers for partial bundles, and there are none
+struct peer_state *peer_records[MAX_PEERS];
+int peer_count=0;
+
+/* Receive a body of the given length with some of its blocks arriving as
+   ordinary pieces, and the rest made up from coded symbols, and check that we
+   end up with the body we started with.  Returns the number of symbols needed
+   beyond the number of blocks that were missing, or -1 on failure. */
+int test_round_trip(int length,int percent_received)
+{
+  int blocks=fountain_block_count(length);
+  unsigned char *body=malloc(length);
+  for(int i=0;i<length;i++) body[i]=random();
+
+  struct fountain_decoder *d=fountain_decoder_new(length);
+  if (!d) {
+    printf("  FAILED to make a decoder for %d bytes\n",length);
+    free(body);
+    return -1;
+  }
+
+  // Blocks that get through as ordinary pieces
+  struct reassembly_buffer r;
+  bzero(&r,sizeof(r));
+  int missing=0;
+  for(int b=0;b<blocks;b++) {
+    int start=b*FOUNTAIN_BLOCK_SIZE;
+    int bytes=length-start;
+    if (bytes>FOUNTAIN_BLOCK_SIZE) bytes=FOUNTAIN_BLOCK_SIZE;
+    if ((random()%100)<percent_received)
+      reassembly_add(&r,length,start,bytes,&body[start]);
+    else missing++;
+  }
+  fountain_add_received_blocks(d,&r);
+
+  // Then coded symbols, until we can decode
+  int failed=0;
+  int symbols=0;
+  unsigned char payload[FOUNTAIN_BLOCK_SIZE];
+  while((!fountain_decoded(d))&&(symbols<missing+32)) {
+    int symbol=blocks+random()%(FOUNTAIN_MAX_SYMBOL+1-blocks);
+    if (fountain_encode(body,length,symbol,payload)) {
+      printf("  FAILED to encode symbol #%d of %d bytes\n",symbol,length);
+      failed=1;
+      break;
+    }
+    fountain_add_symbol(d,symbol,payload);
+    symbols++;
+    // The same symbol again tells us nothing
+    if ((!fountain_decoded(d))&&fountain_add_symbol(d,symbol,payload)) {
+      printf("  FAILED: symbol #%d counted twice\n",symbol);
+      failed=1;
+    }
+  }
+  if (!failed) {
+    if ((!fountain_decoded(d))||fountain_recover(d,&r)) {
+      printf("  FAILED to decode %d bytes from %d symbols\n",length,symbols);
+      failed=1;
+    } else if ((!reassembly_complete(&r,length))||bcmp(r.data,body,length)) {
+      printf("  FAILED: %d bytes decoded differently\n",length);
+      failed=1;
+    }
+  }
+
+  fountain_decoder_free(d);
+  reassembly_free(&r);
+  free(body);
+  return failed?-1:symbols-missing;
+}
+
+// Symbols below the block count are the blocks themselves (zero padded)
+int test_systematic(int length)
+{
+  unsigned char *body=malloc(length);
+  for(int i=0;i<length;i++) body[i]=random();
+  unsigned char block[FOUNTAIN_BLOCK_SIZE];
+  unsigned char out[FOUNTAIN_BLOCK_SIZE];
+  int failed=0;
+  for(int b=0;b<fountain_block_count(length);b++) {
+    int start=b*FOUNTAIN_BLOCK_SIZE;
+    int bytes=length-start;
+    if (bytes>FOUNTAIN_BLOCK_SIZE) bytes=FOUNTAIN_BLOCK_SIZE;
+    bzero(block,FOUNTAIN_BLOCK_SIZE);
+    bcopy(&body[start],block,bytes);
+    if (fountain_encode(body,length,b,out)||bcmp(out,block,FOUNTAIN_BLOCK_SIZE))
+      failed=1;
+  }
+  free(body);
+  printf("Symbols below the block count of %d bytes: %s\n",length,
+	 failed?"FAILED, not the blocks themselves":"the blocks themselves");
+  return failed;
+}
+
+int main(int argc,char **argv)
+{
+  unsigned seed=argc>1?atoi(argv[1]):1;
+  srandom(seed);
+
+  int failed=0;
+  int lengths[]={1,FOUNTAIN_BLOCK_SIZE,5*FOUNTAIN_BLOCK_SIZE+37,
+		 FOUNTAIN_MAX_BLOCKS*FOUNTAIN_BLOCK_SIZE,-1};
+  int percents[]={0,50,90,-1};
+  for(int l=0;lengths[l]>=0;l++) {
+    if (test_systematic(lengths[l])) failed=1;
+    for(int p=0;percents[p]>=0;p++) {
+      int extra=test_round_trip(lengths[l],percents[p]);
+      if (extra<0) failed=1;
+      else
+	printf("%d bytes with %d%% of blocks received: decoded with %d extra symbols\n",
+	       lengths[l],percents[p],extra);
+    }
+  }
+  if (fountain_suitable(FOUNTAIN_MAX_BLOCKS*FOUNTAIN_BLOCK_SIZE+1)
+      ||fountain_decoder_new(FOUNTAIN_MAX_BLOCKS*FOUNTAIN_BLOCK_SIZE+1)) {
+    printf("FAILED: bodies of more than %d blocks accepted\n",FOUNTAIN_MAX_BLOCKS);
+    failed=1;
+  }
+  return failed;
+}
+#endif
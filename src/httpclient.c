@@ -8,6 +8,8 @@
 #include <time.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
 
 #include "sync.h"
 #include "lbard.h"
@@ -187,35 +189,6 @@ int json_flatten(struct json_parse_state *p, char *body, int body_len)
   return 0;
 }
 
-int json_body(int sock, long long timeout_time)
-{
-  // Now output the JSON lines
-  struct json_parse_state parse_state;
-  bzero(&parse_state, sizeof(parse_state));
-
-  while (1)
-  {
-    char line[1024];
-    int r = read_nonblock(sock, line, 1024);
-    if (r > 0)
-    {
-      if (json_flatten(&parse_state, line, r))
-        break;
-    }
-    else
-      usleep(1000);
-    if (gettime_ms() > timeout_time)
-    {
-      // Quit on timeout
-      close(sock);
-      return -1;
-    }
-  }
-  json_new_line(&parse_state);
-  close(sock);
-  return 0;
-}
-
 int connect_to_port(char *host, int port)
 {
   struct hostent *hostent;
@@ -309,172 +282,698 @@ int base64_append(char *out, int *out_offset, unsigned char *bytes, int count)
   return 0;
 }
 
-int http_get_simple(char *server_and_port, char *auth_token,
-                    char *path, FILE *outfile, int timeout_ms,
-                    long long *last_read_time)
+/*
+  Connections to servald are kept open between requests, so that fetching a
+  bundle or polling the bundle list doesn't cost a TCP handshake each time.
+  Responses are read through a per-connection buffer, rather than a read()
+  per byte, and bodies are delimited by Content-Length or chunked encoding,
+  so that we know when a connection can be used again.
+*/
+#define HTTP_POOL_SIZE 4
+#define HTTP_RXBUF_SIZE 16384
+// servald closes idle connections after a while, so don't bother trying
+// to reuse one that has been sitting around for longer than this.
+#define HTTP_POOL_MAX_IDLE_MS 10000
+
+struct http_connection
 {
-  // Send simple HTTP request to server, and write result into outfile.
+  int open;
+  int in_use;
+  int sock;
+  char server_name[256];
+  int server_port;
+  long long last_used;
+  // Set if the current request was sent on a connection that had already
+  // carried a request, and so might have been closed by servald meanwhile.
+  int reused;
+
+  unsigned char rxbuf[HTTP_RXBUF_SIZE];
+  int rx_offset;
+  int rx_len;
+  // Bytes received for the current response
+  int rx_total;
+  int eof;
+
+  // Request still to be sent, for requests that don't block
+  unsigned char *txbuf;
+  int tx_len;
+  int tx_offset;
+  // Body received so far, for GET requests that don't block
+  unsigned char *body;
+  int body_len;
+  int body_size;
+
+  int response_code;
+  int headers_done;
+  long long content_length;
+  long long total_length;
+  int keep_alive;
+  int chunked;
+  int chunk_trailers;
+  // Bytes left in the body (or in the current chunk if chunked),
+  // or -1 if the body runs until the server closes the connection.
+  long long body_remaining;
+  int body_done;
+};
 
-  char server_name[1024];
-  int server_port = -1;
+static struct http_connection http_pool[HTTP_POOL_SIZE];
+int http_connections_opened = 0;
+int http_connections_reused = 0;
 
-  if (sscanf(server_and_port, "%[^:]:%d", server_name, &server_port) != 2)
+static void http_connection_close(struct http_connection *c)
+{
+  free(c->txbuf);
+  c->txbuf = NULL;
+  free(c->body);
+  c->body = NULL;
+  if (c->open)
+    close(c->sock);
+  c->open = 0;
+  c->in_use = 0;
+  c->sock = -1;
+}
+
+// Check that servald hasn't closed an idle connection on us.
+static int http_connection_alive(struct http_connection *c)
+{
+  if (gettime_ms() - c->last_used > HTTP_POOL_MAX_IDLE_MS)
+    return 0;
+  unsigned char b;
+  ssize_t r = recv(c->sock, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return 1;
+  // Either the connection was closed, or servald sent us something we
+  // didn't ask for. Either way, it can't be used.
+  return 0;
+}
+
+static struct http_connection *http_pool_connect(char *server_name, int server_port)
+{
+  struct http_connection *c = NULL;
+
+  for (int i = 0; i < HTTP_POOL_SIZE; i++)
+  {
+    struct http_connection *p = &http_pool[i];
+    if (p->in_use || !p->open)
+      continue;
+    if (p->server_port != server_port || strcmp(p->server_name, server_name))
+      continue;
+    if (!http_connection_alive(p))
+    {
+      http_connection_close(p);
+      continue;
+    }
+    c = p;
+    c->reused = 1;
+    http_connections_reused++;
+    break;
+  }
+
+  if (!c)
+  {
+    // Use a free slot, or else the least recently used idle connection
+    for (int i = 0; i < HTTP_POOL_SIZE; i++)
+    {
+      struct http_connection *p = &http_pool[i];
+      if (p->in_use)
+        continue;
+      if (!p->open)
+      {
+        c = p;
+        break;
+      }
+      if (!c || p->last_used < c->last_used)
+        c = p;
+    }
+    if (!c)
+    {
+      fprintf(stderr, "All %d HTTP connections are busy.\n", HTTP_POOL_SIZE);
+      return NULL;
+    }
+    http_connection_close(c);
+
+    if (strlen(server_name) >= sizeof(c->server_name))
+      return NULL;
+    int sock = connect_to_port(server_name, server_port);
+    if (sock < 0)
+      return NULL;
+    set_nonblock(sock);
+    c->open = 1;
+    c->sock = sock;
+    strcpy(c->server_name, server_name);
+    c->server_port = server_port;
+    c->reused = 0;
+    http_connections_opened++;
+  }
+
+  c->in_use = 1;
+  c->rx_offset = 0;
+  c->rx_len = 0;
+  c->rx_total = 0;
+  c->eof = 0;
+  c->txbuf = NULL;
+  c->tx_len = 0;
+  c->tx_offset = 0;
+  c->body = NULL;
+  c->body_len = 0;
+  c->body_size = 0;
+  c->response_code = -1;
+  c->headers_done = 0;
+  c->content_length = -1;
+  c->total_length = -1;
+  c->keep_alive = 0;
+  c->chunked = 0;
+  c->chunk_trailers = 0;
+  c->body_remaining = -1;
+  c->body_done = 0;
+  return c;
+}
+
+// Return a connection to the pool once we have finished with it. It is only
+// kept open if the whole response has been read, and servald is happy for
+// us to send another request on it.
+static void http_pool_release(struct http_connection *c)
+{
+  if (!c)
+    return;
+  if (c->body_done && c->keep_alive && (!c->eof) && (c->rx_offset == c->rx_len))
+  {
+    free(c->txbuf);
+    c->txbuf = NULL;
+    free(c->body);
+    c->body = NULL;
+    c->in_use = 0;
+    c->last_used = gettime_ms();
+  }
+  else
+    http_connection_close(c);
+}
+
+static struct http_connection *http_pool_find(int sock)
+{
+  for (int i = 0; i < HTTP_POOL_SIZE; i++)
+    if (http_pool[i].in_use && http_pool[i].sock == sock)
+      return &http_pool[i];
+  return NULL;
+}
+
+// Wait until the socket is readable or writeable, or timeout_time passes.
+// A timeout_time in the past just checks without waiting.
+static int http_wait(struct http_connection *c, int events, long long timeout_time)
+{
+  long long wait_ms = timeout_time - gettime_ms();
+  if (wait_ms < 0)
+    wait_ms = 0;
+  struct pollfd fds;
+  fds.fd = c->sock;
+  fds.events = events;
+  fds.revents = 0;
+  int r = poll(&fds, 1, wait_ms);
+  if (r < 0 && errno != EINTR)
     return -1;
+  return r > 0 ? 1 : 0;
+}
 
-  long long timeout_time = gettime_ms() + timeout_ms;
+static int http_send(struct http_connection *c, const void *data, int len,
+                     long long timeout_time)
+{
+  const char *p = data;
+  while (len > 0)
+  {
+    ssize_t w = send(c->sock, p, len, 0
+#ifdef MSG_NOSIGNAL
+                                          | MSG_NOSIGNAL
+#endif
+    );
+    if (w > 0)
+    {
+      p += w;
+      len -= w;
+      continue;
+    }
+    if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      return -1;
+    if (gettime_ms() > timeout_time)
+      return -1;
+    if (http_wait(c, POLLOUT, timeout_time) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Read more data into the connection's buffer.
+// Returns the number of bytes read, 0 if the connection has been closed,
+// or -1 if nothing arrived before timeout_time.
+static int http_fill(struct http_connection *c, long long timeout_time)
+{
+  if (c->eof)
+    return 0;
+  if (c->rx_offset)
+  {
+    memmove(c->rxbuf, &c->rxbuf[c->rx_offset], c->rx_len - c->rx_offset);
+    c->rx_len -= c->rx_offset;
+    c->rx_offset = 0;
+  }
+  if (c->rx_len == HTTP_RXBUF_SIZE)
+    return -1;
+  while (1)
+  {
+    ssize_t r = read(c->sock, &c->rxbuf[c->rx_len], HTTP_RXBUF_SIZE - c->rx_len);
+    if (r > 0)
+    {
+      c->rx_len += r;
+      c->rx_total += r;
+      return r;
+    }
+    if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+      c->eof = 1;
+      return 0;
+    }
+    if (gettime_ms() >= timeout_time)
+      return -1;
+    if (http_wait(c, POLLIN, timeout_time) < 0)
+    {
+      c->eof = 1;
+      return 0;
+    }
+  }
+}
+
+// Take the next complete line from the connection, without its line ending.
+// Returns the length of the line, or -1 if there isn't a complete line
+// before timeout_time (or ever, if the connection has closed).
+static int http_read_line(struct http_connection *c, char *line, int maxlen,
+                          long long timeout_time)
+{
+  while (1)
+  {
+    unsigned char *start = &c->rxbuf[c->rx_offset];
+    unsigned char *eol = memchr(start, '\n', c->rx_len - c->rx_offset);
+    if (eol)
+    {
+      int len = eol - start;
+      c->rx_offset += len + 1;
+      if (len && start[len - 1] == '\r')
+        len--;
+      if (len > maxlen - 1)
+        len = maxlen - 1;
+      memcpy(line, start, len);
+      line[len] = 0;
+      return len;
+    }
+    if (c->rx_offset == 0 && c->rx_len == HTTP_RXBUF_SIZE)
+    {
+      // Absurdly long line
+      c->eof = 1;
+      return -1;
+    }
+    if (http_fill(c, timeout_time) <= 0)
+      return -1;
+  }
+}
+
+// Read the status line and headers of a response. This can be called again
+// to carry on if the headers haven't all arrived by timeout_time.
+// Returns the HTTP response code, -1 on a broken connection, or -2 if the
+// headers are not complete yet.
+static int http_read_headers(struct http_connection *c, long long timeout_time)
+{
+  char line[1024];
+
+  while (!c->headers_done)
+  {
+    int len = http_read_line(c, line, sizeof(line), timeout_time);
+    if (len < 0)
+      return c->eof ? -1 : -2;
+
+    if (c->response_code == -1)
+    {
+      int minor_version = 0;
+      if (sscanf(line, "HTTP/1.%d %d", &minor_version, &c->response_code) != 2)
+      {
+        c->eof = 1;
+        return -1;
+      }
+      // HTTP/1.1 connections are persistent unless the server says otherwise
+      c->keep_alive = minor_version > 0;
+      continue;
+    }
+    if (!len)
+    {
+      c->headers_done = 1;
+      break;
+    }
+    if (sscanf(line, "Content-Length: %lld", &c->content_length) == 1)
+      continue;
+    if (sscanf(line, "Content-Range: bytes %*d-%*d/%lld", &c->total_length) == 1)
+      continue;
+    if (!strncasecmp(line, "Transfer-Encoding:", 18) && strcasestr(line, "chunked"))
+      c->chunked = 1;
+    else if (!strncasecmp(line, "Connection:", 11))
+    {
+      if (strcasestr(line, "close"))
+        c->keep_alive = 0;
+      else if (strcasestr(line, "keep-alive"))
+        c->keep_alive = 1;
+    }
+  }
+
+  if (c->chunked)
+    c->body_remaining = 0;
+  else if (c->content_length >= 0)
+    c->body_remaining = c->content_length;
+  else if (c->response_code == 204 || c->response_code == 304)
+    c->body_remaining = 0;
+  else
+  {
+    // Body runs until the server closes the connection
+    c->body_remaining = -1;
+    c->keep_alive = 0;
+  }
+  if (!c->chunked && !c->body_remaining)
+    c->body_done = 1;
+  return c->response_code;
+}
+
+// Read up to len bytes of the response body, undoing any chunked encoding.
+// Returns the number of bytes read, 0 at the end of the body, -1 if nothing
+// arrived before timeout_time, or -2 if the connection closed early.
+static int http_read_body(struct http_connection *c, unsigned char *out, int len,
+                          long long timeout_time)
+{
+  while (!c->body_done)
+  {
+    if (c->chunked && !c->body_remaining)
+    {
+      char line[1024];
+      int line_len = http_read_line(c, line, sizeof(line), timeout_time);
+      if (line_len < 0)
+        return c->eof ? -2 : -1;
+      if (c->chunk_trailers)
+      {
+        if (!line_len)
+          c->body_done = 1;
+        continue;
+      }
+      // Skip the line ending that follows the data of each chunk
+      if (!line_len)
+        continue;
+      c->body_remaining = strtoll(line, NULL, 16);
+      if (c->body_remaining <= 0)
+      {
+        c->body_remaining = 0;
+        c->chunk_trailers = 1;
+      }
+      continue;
+    }
+
+    int available = c->rx_len - c->rx_offset;
+    if (available)
+    {
+      int n = len;
+      if (n > available)
+        n = available;
+      if (c->body_remaining >= 0 && n > c->body_remaining)
+        n = c->body_remaining;
+      memcpy(out, &c->rxbuf[c->rx_offset], n);
+      c->rx_offset += n;
+      if (c->body_remaining >= 0)
+      {
+        c->body_remaining -= n;
+        if (!c->chunked && !c->body_remaining)
+          c->body_done = 1;
+      }
+      return n;
+    }
+
+    int r = http_fill(c, timeout_time);
+    if (r < 0)
+      return -1;
+    if (!r)
+    {
+      if (c->body_remaining == -1)
+      {
+        c->body_done = 1;
+        return 0;
+      }
+      return -2;
+    }
+  }
+  return 0;
+}
+
+// Send a request to servald, on a pooled connection if we have one,
+// and read the response headers.  If a reused connection turns out to have
+// been closed by servald, try again on a fresh one.
+static struct http_connection *http_request(char *server_name, int server_port,
+                                            char *request, int request_len,
+                                            long long timeout_time)
+{
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    struct http_connection *c = http_pool_connect(server_name, server_port);
+    if (!c)
+      return NULL;
+    if (!http_send(c, request, request_len, timeout_time) && http_read_headers(c, timeout_time) >= 0)
+      return c;
+    int retry = c->reused && !c->rx_total && gettime_ms() < timeout_time;
+    http_connection_close(c);
+    if (!retry)
+      return NULL;
+  }
+  return NULL;
+}
+
+int json_body(struct http_connection *c, long long timeout_time)
+{
+  // Now output the JSON lines
+  struct json_parse_state parse_state;
+  bzero(&parse_state, sizeof(parse_state));
+  char line[1024];
+
+  while (1)
+  {
+    int r = http_read_body(c, (unsigned char *)line, 1024, timeout_time);
+    if (r > 0)
+    {
+      if (json_flatten(&parse_state, line, r))
+        break;
+    }
+    else if (r == -1)
+    {
+      // Quit on timeout
+      http_connection_close(c);
+      return -1;
+    }
+    else
+      break;
+  }
+  json_new_line(&parse_state);
+  // Finish reading the body, so that the connection can be reused
+  while (http_read_body(c, (unsigned char *)line, 1024, 0) > 0)
+    continue;
+  http_pool_release(c);
+  return 0;
+}
+
+// Build a GET request for path, asking for range_length bytes from
+// range_start if range_length > 0. request must have room for 2048 bytes.
+static int http_get_request(char *server_and_port, char *auth_token, char *path,
+                            long long range_start, int range_length,
+                            char *server_name, int *server_port, char *request)
+{
+  if (sscanf(server_and_port, "%1023[^:]:%d", server_name, server_port) != 2)
+    return -1;
 
   if (strlen(auth_token) > 500)
     return -1;
   if (strlen(path) > 500)
     return -1;
 
-  char request[2048];
   char authdigest[1024];
   int zero = 0;
 
   bzero(authdigest, 1024);
   base64_append(authdigest, &zero, (unsigned char *)auth_token, strlen(auth_token));
 
-  // Build request
+  char range[128] = "";
+  if (range_length > 0)
+    snprintf(range, 128, "Range: bytes=%lld-%lld\n",
+             range_start, range_start + range_length - 1);
+
   snprintf(request, 2048,
            "GET %s HTTP/1.1\n"
            "Authorization: Basic %s\n"
            "Host: %s:%d\n"
+           "%s"
            "Accept: */*\n"
            "\n",
            path,
            authdigest,
-           server_name, server_port);
+           server_name, *server_port,
+           range);
+  return 0;
+}
+
+// Send simple HTTP request to server, and write the body either into outfile,
+// or if outfile is NULL, into a buffer that is allocated to suit the length of
+// the body. The caller must free *buffer.
+// If range_length > 0, only ask for that many bytes starting at range_start.
+// If total_length is supplied, it is set to the length of the whole resource,
+// or -1 if the server didn't say.
+static int http_get(char *server_and_port, char *auth_token,
+                    char *path, FILE *outfile,
+                    unsigned char **buffer, int *buffer_len,
+                    long long range_start, int range_length,
+                    long long *total_length,
+                    int timeout_ms, long long *last_read_time)
+{
+
+  char server_name[1024];
+  int server_port = -1;
+  char request[2048];
 
-  int sock = connect_to_port(server_name, server_port);
-  if (sock < 0)
+  if (http_get_request(server_and_port, auth_token, path, range_start, range_length,
+                       server_name, &server_port, request))
     return -1;
-  write_all(sock, request, strlen(request));
 
-  // Read reply, streaming output to file after we have skipped the header
-  int http_response = -1;
-#define LINE_BYTES 65536
-  char line[LINE_BYTES];
-  int len = 0;
-  int empty_count = 0;
-  int content_length = -1;
-  set_nonblock(sock);
-  int r;
-  while (len < 1024)
+  long long timeout_time = gettime_ms() + timeout_ms;
+
+  struct http_connection *c = http_request(server_name, server_port,
+                                           request, strlen(request), timeout_time);
+  if (!c)
   {
-    r = read_nonblock(sock, &line[len], 1);
-    if (r == 1)
-    {
-      if ((line[len] == '\n') || (line[len] == '\r'))
-      {
-        if (len)
-          empty_count = 0;
-        else
-          empty_count++;
-        line[len + 1] = 0;
-        //printf("L: %s\n", line);
-        if (sscanf(line, "Content-Length: %d", &content_length) == 1)
-        {
-          // got content length
-        }
-        if (sscanf(line, "HTTP/1.0 %d", &http_response) == 1)
-        {
-          // got http response
-          printf("RESPONSE: %d\n", http_response);
-        }
-        if (sscanf(line, "HTTP/1.1 %d", &http_response) == 1)
-        {
-          // got http response
-          printf("RESPONSE: %d\n", http_response);
-        }
-        len = 0;
-        // Have we found end of headers?
-        if (empty_count == 3)
-          break;
-      }
-      else
-        len++;
-    }
-    else
-      usleep(1000);
-    if (gettime_ms() > timeout_time)
-    {
-      // If still in header, just quit on timeout
-      close(sock);
-      printf("TIMEOUT!!\n");
-      return -1;
-    }
+    printf("TIMEOUT!!\n");
+    return -1;
   }
+  int http_response = c->response_code;
+  printf("RESPONSE: %d\n", http_response);
+  if (total_length)
+    *total_length = c->total_length;
 
   // Got headers, read body and write to file
   // printf("  reading body...\n");
 
+#define LINE_BYTES 65536
+  unsigned char line[LINE_BYTES];
   int rxlen = 0;
-  r = 0;
-  while (r > -1)
+  int buffer_size = 0;
+  if (!outfile)
   {
-    errno = 0;
-    r = read_nonblock(sock, line, LINE_BYTES);
+    // Read straight into a buffer of the right size, if we know it
+    buffer_size = c->content_length > 0 ? c->content_length : 8192;
+    *buffer = malloc(buffer_size);
+    assert(*buffer);
+    *buffer_len = 0;
+  }
+  while (1)
+  {
+    int r;
+    if (outfile)
+      r = http_read_body(c, line, LINE_BYTES, timeout_time);
+    else
+    {
+      if (rxlen == buffer_size)
+      {
+        // Content-Length was missing, or wrong
+        buffer_size *= 2;
+        *buffer = realloc(*buffer, buffer_size);
+        assert(*buffer);
+      }
+      r = http_read_body(c, &(*buffer)[rxlen], buffer_size - rxlen, timeout_time);
+    }
     if (r > 0)
     {
       printf("read %d body bytes @ T%lld\n", r, timeout_time - gettime_ms());
       if (last_read_time)
         *last_read_time = gettime_ms();
-      fwrite(line, r, 1, outfile);
+      if (outfile)
+        fwrite(line, r, 1, outfile);
       rxlen += r;
-      if (content_length > -1)
-      {
-        if (rxlen >= content_length)
-          break;
-      }
+      if (!outfile)
+        *buffer_len = rxlen;
     }
-    else
+    else if (r == -1)
     {
-      // If no error and no data, then it really is EOF
-      if (!errno)
-        break;
-      // ... else, wait a little while, and try again.
-      usleep(10000);
-    }
-
-    if (gettime_ms() > timeout_time)
-    {
-      close(sock);
+      http_connection_close(c);
       printf("TIMEOUT!!\n");
+      // A partial body in memory is of no use to anyone
+      if (!outfile)
+        return -1;
       return http_response;
     }
+    else
+      // End of body, or servald closed the connection on us
+      break;
   }
 
-  close(sock);
+  http_pool_release(c);
   printf("RES: %d!!\n", http_response);
   return http_response;
 }
 
-int http_post_bundle(char *server_and_port, char *auth_token,
-                     char *path,
-                     unsigned char *manifest_data, int manifest_length,
-                     unsigned char *body_data, int body_length,
-                     int timeout_ms)
+int http_get_simple(char *server_and_port, char *auth_token,
+                    char *path, FILE *outfile, int timeout_ms,
+                    long long *last_read_time)
 {
+  return http_get(server_and_port, auth_token, path, outfile, NULL, NULL,
+                  0, 0, NULL, timeout_ms, last_read_time);
+}
 
-  char server_name[1024];
-  int server_port = -1;
-
-  // Limit bundle size to 5MB via this transport, to limit memory consumption.
-  if (body_length > (5 * 1024 * 1024))
-    return -1;
-
-  if (sscanf(server_and_port, "%[^:]:%d", server_name, &server_port) != 2)
-    return -1;
-
-  long long timeout_time = gettime_ms() + timeout_ms;
+int http_get_buffer(char *server_and_port, char *auth_token,
+                    char *path, unsigned char **buffer, int *buffer_len,
+                    int timeout_ms, long long *last_read_time)
+{
+  *buffer = NULL;
+  *buffer_len = 0;
+  int result = http_get(server_and_port, auth_token, path, NULL, buffer, buffer_len,
+                        0, 0, NULL, timeout_ms, last_read_time);
+  if (result != 200)
+  {
+    free(*buffer);
+    *buffer = NULL;
+    *buffer_len = 0;
+  }
+  return result;
+}
 
-  if (strlen(auth_token) > 500)
-    return -1;
-  if (strlen(path) > 500)
-    return -1;
+// Fetch up to range_length bytes of a resource, starting at range_start.
+// Returns 206 if the server honoured the range. A server that doesn't support
+// ranges returns 200 and the whole resource, so the caller must check.
+int http_get_buffer_range(char *server_and_port, char *auth_token,
+                          char *path, long long range_start, int range_length,
+                          unsigned char **buffer, int *buffer_len,
+                          long long *total_length,
+                          int timeout_ms, long long *last_read_time)
+{
+  *buffer = NULL;
+  *buffer_len = 0;
+  *total_length = -1;
+  int result = http_get(server_and_port, auth_token, path, NULL, buffer, buffer_len,
+                        range_start, range_length, total_length,
+                        timeout_ms, last_read_time);
+  if (result == 200)
+    *total_length = *buffer_len;
+  else if (result != 206)
+  {
+    free(*buffer);
+    *buffer = NULL;
+    *buffer_len = 0;
+  }
+  return result;
+}
 
-  char request[8192 + body_length];
+// Build a multipart POST of a manifest and body to servald.
+// Returns the request in a buffer that the caller must free.
+static char *http_bundle_post_request(char *server_name, int server_port,
+                                      char *auth_token, char *path,
+                                      unsigned char *manifest_data, int manifest_length,
+                                      unsigned char *body_data, int body_length,
+                                      int *request_len)
+{
+  char *request = malloc(8192 + body_length);
+  assert(request);
   char authdigest[1024];
   int zero = 0;
 
@@ -577,62 +1076,256 @@ int http_post_bundle(char *server_and_port, char *auth_token,
           "    subtotal_len=%d, difference+present=%d (should match content_length)\n",
           subtotal_len, total_len - subtotal_len + present_len);
 
-  int sock = connect_to_port(server_name, server_port);
-  if (sock < 0)
+  *request_len = total_len;
+  return request;
+}
+
+int http_post_bundle(char *server_and_port, char *auth_token,
+                     char *path,
+                     unsigned char *manifest_data, int manifest_length,
+                     unsigned char *body_data, int body_length,
+                     int timeout_ms)
+{
+
+  char server_name[1024];
+  int server_port = -1;
+
+  // Limit bundle size to 5MB via this transport, to limit memory consumption.
+  if (body_length > MAX_IMPORT_BODY_LENGTH)
     return -1;
 
-  // Write request
-  write_all(sock, request, total_len);
+  if (sscanf(server_and_port, "%[^:]:%d", server_name, &server_port) != 2)
+    return -1;
 
-  // Read reply, streaming output to file after we have skipped the header
-  int http_response = -1;
-  char line[1024];
-  int len = 0;
-  int empty_count = 0;
-  set_nonblock(sock);
-  int r;
-  while (len < 1024)
+  long long timeout_time = gettime_ms() + timeout_ms;
+
+  if (strlen(auth_token) > 500)
+    return -1;
+  if (strlen(path) > 500)
+    return -1;
+
+  int total_len;
+  char *request = http_bundle_post_request(server_name, server_port, auth_token, path,
+                                           manifest_data, manifest_length,
+                                           body_data, body_length, &total_len);
+  struct http_connection *c = http_request(server_name, server_port,
+                                           request, total_len, timeout_time);
+  free(request);
+  if (!c)
+    return -1;
+  int http_response = c->response_code;
+  // We don't need the body of the response, but have to read it to be
+  // able to use the connection again.
+  unsigned char discard[1024];
+  while (http_read_body(c, discard, sizeof(discard), timeout_time) > 0)
+    continue;
+  http_pool_release(c);
+  return http_response;
+}
+
+// Start posting a bundle to servald, without waiting for it to be sent or
+// for servald to answer. Returns a socket to pass to http_async_continue(),
+// or -1 if the request couldn't be started.
+int http_post_bundle_async(char *server_and_port, char *auth_token,
+                           char *path,
+                           unsigned char *manifest_data, int manifest_length,
+                           unsigned char *body_data, int body_length)
+{
+  char server_name[1024];
+  int server_port = -1;
+
+  // Limit bundle size to 5MB via this transport, to limit memory consumption.
+  if (body_length > MAX_IMPORT_BODY_LENGTH)
+    return -1;
+
+  if (sscanf(server_and_port, "%[^:]:%d", server_name, &server_port) != 2)
+    return -1;
+
+  if (strlen(auth_token) > 500)
+    return -1;
+  if (strlen(path) > 500)
+    return -1;
+
+  struct http_connection *c = http_pool_connect(server_name, server_port);
+  if (!c)
+    return -1;
+  c->txbuf = (unsigned char *)
+      http_bundle_post_request(server_name, server_port, auth_token, path,
+                               manifest_data, manifest_length,
+                               body_data, body_length, &c->tx_len);
+  c->tx_offset = 0;
+  return c->sock;
+}
+
+// Send as much of the request of an asynchronous request as the socket will
+// take. Returns 0 once it has all gone, 1 if there is more to send, or -1 if
+// the connection has failed, in which case it has been closed.
+static int http_async_send(struct http_connection *c)
+{
+  while (c->tx_offset < c->tx_len)
   {
-    r = read_nonblock(sock, &line[len], 1);
-    if (r == 1)
+    ssize_t w = send(c->sock, &c->txbuf[c->tx_offset], c->tx_len - c->tx_offset,
+                     MSG_DONTWAIT
+#ifdef MSG_NOSIGNAL
+                         | MSG_NOSIGNAL
+#endif
+    );
+    if (w > 0)
     {
-      if ((line[len] == '\n') || (line[len] == '\r'))
+      c->tx_offset += w;
+      continue;
+    }
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return 1;
+    http_connection_close(c);
+    return -1;
+  }
+  return 0;
+}
+
+// Make progress on a request from http_post_bundle_async(), without blocking.
+// Returns 0 while the request is still in progress, or 1 once it has finished,
+// in which case *http_response holds the HTTP response code (or -1 if the
+// request failed), and the socket must not be used again.
+int http_async_continue(int sock, int *http_response)
+{
+  struct http_connection *c = http_pool_find(sock);
+  *http_response = -1;
+  if (!c)
+    return 1;
+
+  int r = http_async_send(c);
+  if (r)
+    return r < 0;
+
+  r = http_read_headers(c, 0);
+  if (r == -2)
+    return 0;
+  if (r < 0)
+  {
+    http_connection_close(c);
+    return 1;
+  }
+
+  unsigned char discard[1024];
+  while ((r = http_read_body(c, discard, sizeof(discard), 0)) > 0)
+    continue;
+  if (r == -1)
+    // Rest of the response hasn't arrived yet
+    return 0;
+  *http_response = c->response_code;
+  http_pool_release(c);
+  return 1;
+}
+
+// Which poll() events an asynchronous request is waiting for.
+int http_async_events(int sock)
+{
+  struct http_connection *c = http_pool_find(sock);
+  if (c && c->tx_offset < c->tx_len)
+    return POLLOUT;
+  return POLLIN;
+}
+
+// Start fetching a resource from servald into memory, without waiting for
+// the answer. If range_length > 0, only that many bytes from range_start are
+// asked for. Returns a socket to pass to http_get_buffer_continue(), or -1 if
+// the request couldn't be started.
+int http_get_buffer_async(char *server_and_port, char *auth_token,
+                          char *path, long long range_start, int range_length)
+{
+  char server_name[1024];
+  int server_port = -1;
+  char request[2048];
+
+  if (http_get_request(server_and_port, auth_token, path, range_start, range_length,
+                       server_name, &server_port, request))
+    return -1;
+
+  struct http_connection *c = http_pool_connect(server_name, server_port);
+  if (!c)
+    return -1;
+  c->tx_len = strlen(request);
+  c->txbuf = malloc(c->tx_len);
+  assert(c->txbuf);
+  bcopy(request, c->txbuf, c->tx_len);
+  c->tx_offset = 0;
+  return c->sock;
+}
+
+// Make progress on a request from http_get_buffer_async(), without blocking.
+// Returns 0 while the request is still in progress, or 1 once it has finished,
+// in which case *http_response holds the HTTP response code (or -1 if the
+// request failed), and the socket must not be used again. For a 200 or 206
+// response, *buffer is set to the body, which the caller must free, and
+// *total_length to the length of the whole resource, or -1 if the server
+// didn't say.
+int http_get_buffer_continue(int sock, int *http_response,
+                             unsigned char **buffer, int *buffer_len,
+                             long long *total_length)
+{
+  struct http_connection *c = http_pool_find(sock);
+  *http_response = -1;
+  *buffer = NULL;
+  *buffer_len = 0;
+  *total_length = -1;
+  if (!c)
+    return 1;
+
+  int r = http_async_send(c);
+  if (r)
+    return r < 0;
+
+  r = http_read_headers(c, 0);
+  if (r == -2)
+    return 0;
+  if (r < 0)
+  {
+    http_connection_close(c);
+    return 1;
+  }
+
+  while (1)
+  {
+    if (c->body_len == c->body_size)
+    {
+      // Read straight into a buffer of the right size, if we know it
+      int size = c->body_size ? c->body_size * 2 : (c->content_length > 0 ? c->content_length : 8192);
+      unsigned char *b = realloc(c->body, size);
+      if (!b)
       {
-        if (len)
-          empty_count = 0;
-        else
-          empty_count++;
-        line[len + 1] = 0;
-        // if (len) printf("Line of response: %s\n",line);
-        if (sscanf(line, "HTTP/1.0 %d", &http_response) == 1)
-        {
-          // got http response
-          // fprintf(stderr,"  HTTP response from Rhizome for new bundle is: %d\n",http_response);
-        }
-        if (sscanf(line, "HTTP/1.1 %d", &http_response) == 1)
-        {
-          // got http response
-          // fprintf(stderr,"  HTTP response from Rhizome for new bundle is: %d\n",http_response);
-        }
-        len = 0;
-        // Have we found end of headers?
-        if (empty_count == 3)
-          break;
+        http_connection_close(c);
+        return 1;
       }
-      else
-        len++;
+      c->body = b;
+      c->body_size = size;
     }
-    else
-      usleep(1000);
-    if (gettime_ms() > timeout_time)
+    r = http_read_body(c, &c->body[c->body_len], c->body_size - c->body_len, 0);
+    if (r > 0)
+      c->body_len += r;
+    else if (r == -1)
+      // Rest of the response hasn't arrived yet
+      return 0;
+    else if (r == -2)
     {
-      // If still in header, just quit on timeout
-      close(sock);
-      return -1;
+      // A partial body is of no use to anyone
+      http_connection_close(c);
+      return 1;
     }
+    else
+      break;
   }
-  close(sock);
-  return http_response;
+
+  *http_response = c->response_code;
+  if (c->response_code == 200 || c->response_code == 206)
+  {
+    *buffer = c->body;
+    *buffer_len = c->body_len;
+    *total_length = c->response_code == 200 ? c->body_len : c->total_length;
+    c->body = NULL;
+  }
+  http_pool_release(c);
+  return 1;
 }
 
 int http_post_meshms(char *server_and_port, char *auth_token,
@@ -717,59 +1410,17 @@ int http_post_meshms(char *server_and_port, char *auth_token,
 
   fprintf(stderr, "Request:\n%s\n", request);
 
-  int sock = connect_to_port(server_name, server_port);
-  if (sock < 0)
+  struct http_connection *c = http_request(server_name, server_port,
+                                           request, total_len, timeout_time);
+  if (!c)
     return -1;
-
-  // Write request
-  write_all(sock, request, total_len);
-
-  // Read reply, streaming output to file after we have skipped the header
-  int http_response = -1;
-  char line[1024];
-  int len = 0;
-  int empty_count = 0;
-  set_nonblock(sock);
-  int r;
-  while (len < 1024)
-  {
-    r = read_nonblock(sock, &line[len], 1);
-    if (r == 1)
-    {
-      if ((line[len] == '\n') || (line[len] == '\r'))
-      {
-        if (len)
-          empty_count = 0;
-        else
-          empty_count++;
-        line[len + 1] = 0;
-        // if (len) printf("Line of response: %s\n",line);
-        if (sscanf(line, "HTTP/1.0 %d", &http_response) == 1)
-        {
-          // got http response
-          fprintf(stderr, "  HTTP response from Rhizome for new bundle is: %d\n", http_response);
-        }
-        if (sscanf(line, "HTTP/1.1 %d", &http_response) == 1)
-        {
-        }
-        len = 0;
-        // Have we found end of headers?
-        if (empty_count == 3)
-          break;
-      }
-      else
-        len++;
-    }
-    else
-      usleep(1000);
-    if (gettime_ms() > timeout_time)
-    {
-      // If still in header, just quit on timeout
-      close(sock);
-      return -1;
-    }
-  }
-  close(sock);
+  int http_response = c->response_code;
+  // We don't need the body of the response, but have to read it to be
+  // able to use the connection again.
+  unsigned char discard[1024];
+  while (http_read_body(c, discard, sizeof(discard), timeout_time) > 0)
+    continue;
+  http_pool_release(c);
   return http_response;
 }
 
@@ -816,61 +1467,13 @@ int http_list_meshms_conversations(char *server_and_port, char *auth_token,
 
   // fprintf(stderr,"Request:\n%s\n",request);
 
-  int sock = connect_to_port(server_name, server_port);
-  if (sock < 0)
+  struct http_connection *c = http_request(server_name, server_port,
+                                           request, total_len, timeout_time);
+  if (!c)
     return -1;
+  int http_response = c->response_code;
 
-  // Write request
-  write_all(sock, request, total_len);
-
-  // Read reply, streaming output to file after we have skipped the header
-  int http_response = -1;
-  char line[1024];
-  int len = 0;
-  int empty_count = 0;
-  set_nonblock(sock);
-  int r;
-  while (len < 1024)
-  {
-    r = read_nonblock(sock, &line[len], 1);
-    if (r == 1)
-    {
-
-      if ((line[len] == '\n') || (line[len] == '\r'))
-      {
-        if (len)
-          empty_count = 0;
-        else
-          empty_count++;
-        line[len + 1] = 0;
-        // if (len) printf("Line of response: %s\n",line);
-        if (sscanf(line, "HTTP/1.0 %d", &http_response) == 1)
-        {
-          // got http response
-          // fprintf(stderr,"  HTTP response from Rhizome for new bundle is: %d\n",http_response);
-        }
-        if (sscanf(line, "HTTP/1.1 %d", &http_response) == 1)
-        {
-        }
-        len = 0;
-        // Have we found end of headers?
-        if (empty_count == 3)
-          break;
-      }
-      else
-        len++;
-    }
-    else
-      usleep(1000);
-    if (gettime_ms() > timeout_time)
-    {
-      // If still in header, just quit on timeout
-      close(sock);
-      return -1;
-    }
-  }
-
-  json_body(sock, timeout_time);
+  json_body(c, timeout_time);
 
   return http_response;
 }
@@ -918,59 +1521,14 @@ int http_list_meshms_messages(char *server_and_port, char *auth_token,
 
   // fprintf(stderr,"Request:\n%s\n",request);
 
-  int sock = connect_to_port(server_name, server_port);
-  if (sock < 0)
+  struct http_connection *c = http_request(server_name, server_port,
+                                           request, total_len, timeout_time);
+  if (!c)
     return -1;
+  int http_response = c->response_code;
 
-  // Write request
-  write_all(sock, request, total_len);
+  json_body(c, timeout_time);
 
-  // Read reply, streaming output to file after we have skipped the header
-  int http_response = -1;
-  char line[1024];
-  int len = 0;
-  int empty_count = 0;
-  set_nonblock(sock);
-  int r;
-  while (len < 1024)
-  {
-    r = read_nonblock(sock, &line[len], 1);
-    if (r == 1)
-    {
-      if ((line[len] == '\n') || (line[len] == '\r'))
-      {
-        if (len)
-          empty_count = 0;
-        else
-          empty_count++;
-        line[len + 1] = 0;
-        // if (len) printf("Line of response: %s\n",line);
-        if (sscanf(line, "HTTP/1.0 %d", &http_response) == 1)
-        {
-          // got http response
-          // fprintf(stderr,"  HTTP response from Rhizome for new bundle is: %d\n",http_response);
-        }
-        if (sscanf(line, "HTTP/1.1 %d", &http_response) == 1)
-        {
-        }
-        len = 0;
-        // Have we found end of headers?
-        if (empty_count == 3)
-          break;
-      }
-      else
-        len++;
-    }
-    else
-      usleep(1000);
-    if (gettime_ms() > timeout_time)
-    {
-      // If still in header, just quit on timeout
-      close(sock);
-      return -1;
-    }
-  }
-  json_body(sock, timeout_time);
   return http_response;
 }
 
@@ -1011,79 +1569,31 @@ int http_get_async(char *server_and_port, char *auth_token,
            authdigest,
            server_name, server_port);
 
-  int sock = connect_to_port(server_name, server_port);
-  if (sock < 0)
+  struct http_connection *c = http_request(server_name, server_port,
+                                           request, strlen(request), timeout_time);
+  if (!c)
     return -1;
 
-  write_all(sock, request, strlen(request));
-
-  // Read reply, streaming output to file after we have skipped the header
-  int http_response = -1;
-#define LINE_BYTES 65536
-  char line[LINE_BYTES];
-  int len = 0;
-  int empty_count = 0;
-  int content_length = -1;
-  int header_bytes = 0;
-  set_nonblock(sock);
-  int r;
-  while (len < 1024)
-  {
-    header_bytes++;
-    r = read_nonblock(sock, &line[len], 1);
-    if (r == 1)
-    {
-      if ((line[len] == '\n') || (line[len] == '\r'))
-      {
-        if (len)
-          empty_count = 0;
-        else
-          empty_count++;
-        line[len + 1] = 0;
-        if (sscanf(line, "Content-Length: %d", &content_length) == 1)
-        {
-          // got content length
-        }
-        if (sscanf(line, "HTTP/1.0 %d", &http_response) == 1)
-        {
-          // got http response
-        }
-        if (sscanf(line, "HTTP/1.1 %d", &http_response) == 1)
-        {
-        }
-        len = 0;
-        // Have we found end of headers?
-        if (empty_count == 3)
-          break;
-      }
-      else
-        len++;
-    }
-    else
-      usleep(1000);
-    if (gettime_ms() > timeout_time)
-    {
-      // If still in header, just quit on timeout
-      close(sock);
-      return -1;
-    }
-  }
-
   // Got headers
   if (0)
     printf("Read %d header bytes (response code %d). Ready for async fetch.\n",
-           header_bytes, http_response);
-  return sock;
+           c->rx_offset, c->response_code);
+  return c->sock;
 }
 
+// Read the next line of the body of a response from http_get_async(),
+// without blocking. Returns 0 if there is a line, -1 if there isn't a
+// complete line yet, and 1 if the response has ended, in which case the
+// socket has been closed or returned to the connection pool.
 int http_read_next_line(int sock, char *line, int *len, int maxlen)
 {
-  set_nonblock(sock);
-  int r;
+  struct http_connection *c = http_pool_find(sock);
+  if (!c)
+    return 1;
   while ((*len) < maxlen)
   {
-    errno = 0;
-    r = read_nonblock(sock, &line[*len], 1);
+    unsigned char *b = (unsigned char *)&line[*len];
+    int r = http_read_body(c, b, 1, 0);
     if (r == 1)
     {
       if ((line[*len] == '\n') || (line[*len] == '\r'))
@@ -1096,13 +1606,13 @@ int http_read_next_line(int sock, char *line, int *len, int maxlen)
       else
         (*len)++;
     }
-    else
+    else if (r == -1)
       // Not enough data for a full line yet
       return -1;
-    if ((!r) && (!errno))
+    else
     {
-      // End of connection
-      close(sock);
+      // End of response
+      http_pool_release(c);
       return 1;
     }
   }
@@ -1112,3 +1622,19 @@ int http_read_next_line(int sock, char *line, int *len, int maxlen)
   line[maxlen - 1] = 0;
   return 0;
 }
+
+// Finish with a socket from http_get_async(). If the rest of the response
+// has already arrived, the connection can go back in the pool.
+void http_close_async(int sock)
+{
+  struct http_connection *c = http_pool_find(sock);
+  if (!c)
+  {
+    close(sock);
+    return;
+  }
+  unsigned char discard[1024];
+  while (http_read_body(c, discard, sizeof(discard), 0) > 0)
+    continue;
+  http_pool_release(c);
+}
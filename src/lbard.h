@@ -47,11 +47,117 @@ extern struct sync_state *sync_state;
 // 1 byte : size and meshms flag byte
 #define BAR_LENGTH (8+8+4+1)
 
-struct segment_list {
+/* Reassembly buffer for the manifest or body of a bundle being received.
+   Pieces are copied straight into data[] at their offset, and bitmap[] has one
+   bit set for each byte that we have received.  While the length of the stream
+   is unknown the buffer grows to fit; once it is known, the buffer is sized to
+   exactly that, and the stream is complete when bytes_received equals it. */
+struct reassembly_buffer {
   unsigned char *data;
-  int start_offset;
+  unsigned char *bitmap;
+  int size;
+  int bytes_received;
+  // Bytes before base are held elsewhere (in the older version of a journal
+  // bundle that we already have), so they count as received, but data and
+  // bitmap only cover [base,size).
+  int base;
+};
+
+// Bundles we receive are posted to servald in one go, so we limit their size
+// to limit memory consumption.
+#define MAX_IMPORT_BODY_LENGTH (5*1024*1024)
+// Nor is there any point holding more than that of a bundle we are receiving.
+#define MAX_REASSEMBLY_LENGTH MAX_IMPORT_BODY_LENGTH
+
+/* Rateless (fountain) coding of bundle bodies: see fountain.c.  Bodies of up
+   to FOUNTAIN_MAX_BLOCKS blocks can be sent as coded symbols, once a sender has
+   been all the way through the body once. */
+#define FOUNTAIN_BLOCK_SIZE 128
+#define FOUNTAIN_MAX_BLOCKS 256
+#define FOUNTAIN_MAX_SYMBOL 0xffff
+struct fountain_decoder {
   int length;
-  struct segment_list *prev,*next;
+  int blocks;
+  int rank;
+  // One row per block: blocks coefficients followed by FOUNTAIN_BLOCK_SIZE bytes
+  int row_len;
+  unsigned char *rows;
+  unsigned char *have;
+};
+
+/* Delta transfer of new versions of bundles: see delta.c.  Each whole block of
+   the body is described by a 4 byte rolling checksum and 4 bytes of hash. */
+#define DELTA_BLOCK_SIZE 512
+#define DELTA_SIGNATURE_LEN 8
+#define DELTA_MAX_REQUESTS 3
+#define DELTA_REQUEST_INTERVAL 5000
+
+/* A bundle that we are receiving, from one or more peers.  Pieces of the same
+   bundle version from every peer go into the one set of buffers.  Each peer's
+   partial_bundle for it refers to the assembly, which is freed once no
+   partials refer to it any more. */
+#define MAX_ASSEMBLY_SOURCES 8
+/* The fields of a manifest that changed from an older version of a journal
+   bundle, waiting for the body so that the filehash can be worked out, and
+   the whole manifest rebuilt. */
+#define MANIFEST_DIGEST_LEN 4
+struct manifest_delta {
+  unsigned char digest[MANIFEST_DIGEST_LEN];
+  unsigned char old_manifest[1024];
+  int old_manifest_len;		// -1 while we are fetching it
+  unsigned char delta[256];
+  int delta_len;
+};
+
+struct bundle_assembly {
+  char bid_prefix[8*2+1];
+  long long version;
+  int refs;
+  struct bundle_assembly *next;
+
+  struct reassembly_buffer manifest;
+  int manifest_length;
+
+  struct reassembly_buffer body;
+  int body_length;
+
+  // SID prefixes of the peers whose pieces we have used
+  unsigned char sources[MAX_ASSEMBLY_SOURCES][4];
+  int source_count;
+  long long last_source_time;
+
+  /* Once the body has failed verification against the filehash, we only take
+     pieces from one peer at a time, so that we can tell which peer is sending
+     bad data, and stop accepting pieces from it. */
+  int verify_failures;
+  int single_source;
+  unsigned char rejected[MAX_ASSEMBLY_SOURCES][4];
+  int rejected_count;
+
+  // Coded symbols of the body received so far, if any
+  struct fountain_decoder *fountain;
+
+  // Changed fields of the manifest, if we were sent only those
+  struct manifest_delta *manifest_delta;
+
+  // Set if we couldn't get the start of the body of a journal bundle from the
+  // older version we have, so that we need to be sent the whole thing
+  int journal_base_failed;
+  int journal_base_fetching;
+
+  // Asking for block signatures of the body, so that we can use the parts of
+  // an older version that we have (if delta_mode is set)
+  int delta_requests;
+  long long delta_request_time;
+  int delta_signatures_seen;
+  // The body of the older version, fetched once for the whole assembly, and
+  // the 'd' messages (from the first block number on) that arrived before it
+  unsigned char *delta_old_body;
+  int delta_old_len;
+  int delta_old_fetching;
+  int delta_old_failed;
+  unsigned char *delta_pending_sigs;
+  int delta_pending_len;
 };
 
 struct partial_bundle {
@@ -60,12 +166,26 @@ struct partial_bundle {
   long long bundle_version;
 
   int recent_bytes;
-  
-  struct segment_list *manifest_segments;
-  int manifest_length;
 
-  struct segment_list *body_segments;
-  int body_length;
+  struct bundle_assembly *assembly;
+};
+
+/* Pieces can name the bundle they belong to by a one byte session handle,
+   instead of the BID prefix and version.  Each sender hands out its own
+   handles, and binds them to a bundle with an 'l' message.  A check byte (the
+   first byte of the BID) in each compact piece guards against a receiver using
+   a binding that the sender has since reused. */
+#define MAX_SESSION_HANDLES 256
+struct session_binding {
+  int valid;
+  unsigned char bid_bin[8];
+  long long version;
+};
+
+struct tx_queue_entry {
+  int bundle;
+  unsigned int priority;
+  unsigned int serial;
 };
 
 struct peer_state {
@@ -75,6 +195,9 @@ struct peer_state {
   // random 32 bit instance ID, used to work out when LBARD has died and restarted
   // on a peer, so that we can restart the sync process.
   unsigned int instance_id;
+  // LBARD_CAP_* bits from the peer's 'C' messages: the newer messages it
+  // understands
+  int capabilities;
   
   unsigned char *last_message;
   time_t last_message_time;
@@ -105,16 +228,55 @@ struct peer_state {
 #define MAX_CACHE_ERRORS 5
   int tx_cache_errors;
 
-  /* Bundles we want to send to this peer
-     In theory, we can have a relatively short queue, since we intend to rebuild the
-     tree periodically. Thus any bundles received will cause the new sync process to
-     not insert those in the TX queue, and thus allow the transfer of the next 
-     MAX_TXQUEUE_LEN highest priority bundles. */
-#define MAX_TXQUEUE_LEN 10
-  int tx_queue_len; 
-  int tx_queue_bundles[MAX_TXQUEUE_LEN];
-  unsigned int tx_queue_priorities[MAX_TXQUEUE_LEN];
-  int tx_queue_overflow;
+  /* What the peer last told us it lacks of the body of tx_bundle, from a
+     selective acknowledgement: the ranges [tx_sack_start[i],tx_sack_end[i]),
+     and everything from tx_sack_tail on.  The peer has everything else, and
+     the manifest up to tx_sack_manifest_offset. */
+#define MAX_SACK_BYTES 44
+#define MAX_SACK_RANGES (MAX_SACK_BYTES/2)
+  int tx_sack_valid;
+  int tx_sack_bundle;
+  int tx_sack_manifest_offset;
+  int tx_sack_ranges;
+  int tx_sack_start[MAX_SACK_RANGES];
+  int tx_sack_end[MAX_SACK_RANGES];
+  int tx_sack_tail;
+
+  // Set once we have been through the whole body of tx_bundle, so that we can
+  // send coded symbols instead of going round again (if fountain_mode is set).
+  int tx_bundle_repair;
+
+  // Whether we have bound a session handle to tx_bundle for this peer yet
+  int tx_session_bound;
+  int tx_session_bundle;
+  int tx_session_handle;
+
+  // Attempts at sending only the changed fields of the manifest of tx_bundle
+  // (a journal bundle), instead of the whole thing
+#define MANIFEST_DELTA_TRIES 4
+  int tx_manifest_delta_tries;
+
+  // Set when the peer has asked for the block signatures of the body of
+  // tx_bundle, along with the next block to sign
+  int tx_delta_pending;
+  int tx_delta_block;
+
+  /* Bundles we want to send to this peer (other than tx_bundle), as a max-heap
+     on priority. The queue grows to hold every bundle that the sync tree tells
+     us the peer lacks. tx_queue_slots[] maps a bundle number to its place in the
+     heap plus one (zero if it isn't queued), so that bundles can be removed
+     when the peer gets them some other way. */
+  struct tx_queue_entry *tx_queue;
+  int tx_queue_len;
+  int tx_queue_alloc;
+  // Orders entries of equal priority by when they were queued
+  unsigned int tx_queue_serial;
+  int *tx_queue_slots;
+  int tx_queue_slots_alloc;
+  // How far we have got through the bundles the sync tree says this peer
+  // lacks, when refilling an empty TX queue, and when we last got to the end
+  sync_cursor_t tx_cursor;
+  time_t tx_cursor_pass_time;
 #endif
   // Bundles this peer is transferring.
   // The bundle prioritisation algorithm means that the peer may announce pieces
@@ -122,11 +284,14 @@ struct peer_state {
   // deferred due to the arrival of a smaller bundle, or the arrival of a peer
   // for whom that peer has bundles with the new peer as the recipient.
   // So we need to carry state for some plurality of bundles being announced.
-  // Note that we don't (currently) build bundles from announcements by multiple
-  // peers, as a small protection against malicious nodes offering fake bundle
-  // pieces that will result in the crypto checksums failing at the end.
+  // The pieces themselves are assembled together with those from other peers
+  // (see struct bundle_assembly).
 #define MAX_BUNDLES_IN_FLIGHT 16
   struct partial_bundle partials[MAX_BUNDLES_IN_FLIGHT];  
+
+  // The session handles this peer has bound for us (MAX_SESSION_HANDLES of
+  // them, allocated when the first is bound)
+  struct session_binding *rx_sessions;
 };
 
 struct recent_bundle {
@@ -154,12 +319,13 @@ extern int message_buffer_length;
 
 struct bundle_record {
   int index; // position in array of bundles
-  
-  char *service;
-  char *bid_hex;
+
+  // Service names are interned, so must not be freed or modified.
+  // See bundle_intern_service()
+  const char *service;
+  char bid_hex[32*2+1];
   unsigned char bid_bin[32];
   long long version;
-  char *author;
   int originated_here_p;
 #ifdef SYNC_BY_BAR
 #define TRANSMIT_NOW_TIMEOUT 2
@@ -169,9 +335,19 @@ struct bundle_record {
   sync_key_t sync_key;
 #endif
   long long length;
-  char *filehash;
-  char *sender;
-  char *recipient;
+
+  // These fields are stored in binary form, and are only valid if the
+  // corresponding BUNDLE_HAS_* flag is set in fields_present.
+  // Use bundle_field_hex() to obtain them as strings.
+#define BUNDLE_HAS_AUTHOR 0x01
+#define BUNDLE_HAS_FILEHASH 0x02
+#define BUNDLE_HAS_SENDER 0x04
+#define BUNDLE_HAS_RECIPIENT 0x08
+  unsigned char fields_present;
+  unsigned char author[32];
+  unsigned char filehash[64];
+  unsigned char sender[32];
+  unsigned char recipient[32];
 
   // The last time we announced this bundle in full.
   time_t last_announced_time;
@@ -186,6 +362,10 @@ struct bundle_record {
   
   long long last_priority;
   int num_peers_that_dont_have_it;
+
+  // Next (older) bundle sharing the same 8-byte BID prefix in the bundle index,
+  // or -1 if this is the last one.
+  int next_with_same_prefix;
 };
 
 // New unified BAR + optional bundle record for BAR tree structure
@@ -235,23 +415,68 @@ typedef struct bundle_node {
   
 extern unsigned int my_instance_id;
 
+// Newer message types that a peer understands, as advertised in the 'C'
+// message that it sends along with its instance ID.  Older peers understand
+// none of them, and don't send 'C'.
+#define LBARD_CAP_SACK 0x01	// 'a' selective acknowledgements
+#define LBARD_CAP_SESSIONS 0x02	// 'l' session handles, 'h' and 'j'/'k' pieces
+#define LBARD_CAP_MANIFEST_DELTA 0x04	// 'm' changed fields of a manifest
+#define LBARD_CAP_PACKED_SYNC 0x08	// 's' bit-packed sync tree records
+#define LBARD_CAP_CODED_SYMBOLS 0x10	// 'f' coded symbols of a body
+#define LBARD_CAP_DELTA 0x20	// 'D' requests for, and 'd' block signatures
+#define LBARD_CAPABILITIES (LBARD_CAP_SACK|LBARD_CAP_SESSIONS\
+			    |LBARD_CAP_MANIFEST_DELTA|LBARD_CAP_PACKED_SYNC\
+			    |LBARD_CAP_CODED_SYMBOLS|LBARD_CAP_DELTA)
+int peers_have_capability(int capability);
+int peer_has_capability(struct peer_state *p,int capability);
+
 #define MAX_PEERS 1024
 extern struct peer_state *peer_records[MAX_PEERS];
 extern int peer_count;
 
-#define MAX_BUNDLES 10000
-extern struct bundle_record bundles[MAX_BUNDLES];
+// The bundle list grows as required. Bundle numbers never change, but the
+// array can move when it grows, so keep bundle numbers, not pointers.
+extern struct bundle_record *bundles;
 extern int bundle_count;
 
+// The sync tree refers to bundles by their number, rather than by pointer,
+// so that the bundle list can be reallocated.
+#define BUNDLE_KEY_CONTEXT(B) ((void *)(intptr_t)(B))
+#define BUNDLE_FROM_KEY_CONTEXT(C) ((int)(intptr_t)(C))
+
 extern char *bid_of_cached_bundle;
 extern long long cached_version;
-// extern int cached_manifest_len;
-// extern unsigned char *cached_manifest;
+extern int cached_manifest_len;
+extern unsigned char *cached_manifest;
 extern int cached_manifest_encoded_len;
 extern unsigned char *cached_manifest_encoded;
+// cached_body holds cached_body_window_len bytes of the body, starting at
+// cached_body_offset. cached_body_len is the length of the whole body.
 extern int cached_body_len;
+extern int cached_body_offset;
+extern int cached_body_window_len;
 extern unsigned char *cached_body;
 
+// Bytes of recently sent bundles to keep in the bundle cache, in addition to
+// the one currently being sent. Can be set with cachesize=<bytes>
+#define BUNDLE_CACHE_DEFAULT_BUDGET (4*1024*1024)
+extern long long bundle_cache_budget;
+extern long long bundle_cache_hits;
+extern long long bundle_cache_misses;
+extern long long bundle_cache_evictions;
+long long bundle_cache_memory_usage();
+
+// Fetches from servald in the background (see bundle_cache.c)
+typedef void (*bundle_fetch_done_t)(void *context,unsigned char *data,int len,
+				    long long offset,long long total_len,
+				    char *servald_server,char *credential);
+int bundle_fetch_start(char *bid_hex,int manifest,long long offset,int length,
+		       bundle_fetch_done_t done,void *context);
+void bundle_fetch_cancel(void *context);
+int bundle_fetch_service(char *servald_server,char *credential);
+long long bundle_fetch_next_service_time();
+extern int bundle_fetch_socket;
+
 extern FILE *debug_file;
 extern int debug_radio;
 extern int debug_pieces;
@@ -268,6 +493,8 @@ extern int debug_bundlelog;
 extern int debug_noprioritisation;
 extern int radio_silence_count;
 extern int meshms_only;
+extern int fountain_mode;
+extern int delta_mode;
 extern long long min_version;
 extern int time_slave;
 extern long long start_time;
@@ -279,6 +506,21 @@ int saw_piece(char *peer_prefix,int for_me,
 	      int is_manifest_piece,unsigned char *piece,
 
 	      char *prefix, char *servald_server, char *credential);
+int saw_coded_piece(char *peer_prefix,int for_me,
+		    char *bid_prefix, unsigned char *bid_prefix_bin,
+		    long long version,int body_length,int symbol,
+		    unsigned char *payload,
+		    char *prefix, char *servald_server, char *credential);
+int saw_manifest_delta(char *peer_prefix,int for_me,
+		       char *bid_prefix, unsigned char *bid_prefix_bin,
+		       long long version,unsigned char *digest,
+		       unsigned char *delta,int delta_len,
+		       char *prefix, char *servald_server, char *credential);
+int saw_delta_signatures(char *peer_prefix,
+			 char *bid_prefix, unsigned char *bid_prefix_bin,
+			 long long version,int body_length,
+			 int first_block,int count,unsigned char *sigs,
+			 char *prefix, char *servald_server, char *credential);
 int saw_length(char *peer_prefix,char *bid_prefix,long long version,
 	       int body_length);
 int saw_message(unsigned char *msg,int len,char *my_sid,
@@ -290,15 +532,66 @@ int parse_json_line(char *line,char fields[][8192],int num_fields);
 int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
 			  unsigned char *body_data,int body_length,
 			  char *servald_server,char *credential);
+int rhizome_import_result(unsigned char *manifest_data,int manifest_length,
+			  unsigned char *body_data,int body_length,
+			  int result_code);
+int rhizome_queue_import(unsigned char *manifest_data,int manifest_length,
+			 unsigned char *body_data,int body_length,
+			 char *peer_prefix,char *bid,char *bid_prefix,
+			 long long version);
+int rhizome_import_service(char *servald_server,char *credential);
+long long rhizome_import_next_service_time();
+extern int rhizome_import_socket;
+extern int rhizome_import_count;
+extern int rhizome_imports_done;
+extern int rhizome_imports_failed;
+int saw_bundle_import_result(char *peer_prefix,char *bid,char *bid_prefix,
+			     long long version,int insert_result);
 int prime_bundle_cache(int bundle_number,char *prefix,
 		       char *servald_server, char *credential);
+int prime_bundle_cache_window(int bundle_number,int body_offset,char *prefix,
+			      char *servald_server, char *credential);
 int hex_byte_value(char *hexstring);
 int find_highest_priority_bundle();
 int find_highest_priority_bar();
 int find_peer_by_prefix(char *peer_prefix);
 int clear_partial(struct partial_bundle *p);
 int dump_partial(struct partial_bundle *p);
-int merge_segments(struct segment_list **s);
+int reassembly_set_size(struct reassembly_buffer *r,int size);
+int reassembly_set_base(struct reassembly_buffer *r,int base);
+int reassembly_fill_base(struct reassembly_buffer *r,unsigned char *data);
+struct bundle_assembly *assembly_get(char *bid_prefix,long long version);
+void assembly_release(struct bundle_assembly *a);
+int assembly_accept_source(struct bundle_assembly *a,unsigned char *sid_prefix_bin);
+int assembly_body_filehash(struct bundle_assembly *a,char *hash_hex);
+int assembly_verify_body(struct bundle_assembly *a,
+			 unsigned char *manifest,int manifest_len);
+void assembly_reject_body(struct bundle_assembly *a);
+int assembly_clear_partials(struct bundle_assembly *a);
+extern int assembly_count;
+int fountain_block_count(int length);
+int fountain_suitable(int length);
+int fountain_encode(unsigned char *body,int length,int symbol,unsigned char *out);
+struct fountain_decoder *fountain_decoder_new(int length);
+void fountain_decoder_free(struct fountain_decoder *d);
+int fountain_add_symbol(struct fountain_decoder *d,int symbol,unsigned char *payload);
+int fountain_add_received_blocks(struct fountain_decoder *d,
+				 struct reassembly_buffer *r);
+int fountain_decoded(struct fountain_decoder *d);
+int fountain_recover(struct fountain_decoder *d,struct reassembly_buffer *r);
+int delta_block_count(int length);
+int delta_sign_block(unsigned char *block,unsigned char *out);
+int delta_match_blocks(unsigned char *old,int old_len,
+		       struct reassembly_buffer *r,int body_length,
+		       int first_block,int count,unsigned char *sigs);
+extern int assembly_verify_failures;
+int reassembly_add(struct reassembly_buffer *r,int stream_length,
+		   int offset,int bytes,unsigned char *data);
+int reassembly_has_byte(struct reassembly_buffer *r,int offset);
+int reassembly_next_run(struct reassembly_buffer *r,int from,int *start,int *end);
+int reassembly_first_missing_byte(struct reassembly_buffer *r,int from);
+int reassembly_complete(struct reassembly_buffer *r,int stream_length);
+void reassembly_free(struct reassembly_buffer *r);
 int free_peer(struct peer_state *p);
 int peer_note_bar(struct peer_state *p,
 		  char *bid_prefix,long long version, char *recipient_prefix,
@@ -319,6 +612,14 @@ ssize_t read_nonblock(int fd, void *buf, size_t len);
 int http_get_simple(char *server_and_port, char *auth_token,
 		    char *path, FILE *outfile, int timeout_ms,
 		    long long *last_read_time);
+int http_get_buffer(char *server_and_port, char *auth_token,
+		    char *path, unsigned char **buffer, int *buffer_len,
+		    int timeout_ms, long long *last_read_time);
+int http_get_buffer_range(char *server_and_port, char *auth_token,
+			  char *path, long long range_start, int range_length,
+			  unsigned char **buffer, int *buffer_len,
+			  long long *total_length,
+			  int timeout_ms, long long *last_read_time);
 int http_post_bundle(char *server_and_port, char *auth_token,
 		     char *path,
 		     unsigned char *manifest_data, int manifest_length,
@@ -329,7 +630,7 @@ int generate_progress_string(struct partial_bundle *partial,
 			     char *progress,int progress_size);
 int show_progress();
 int request_wanted_content_from_peers(int *offset,int mtu, unsigned char *msg_out);
-int dump_segment_list(struct segment_list *s);
+int dump_reassembly_buffer(struct reassembly_buffer *r);
 
 int serial_setup_port_with_speed(int fd,int speed);
 int status_dump();
@@ -353,6 +654,7 @@ int register_bundle(char *service,
 		    char *filehash,
 		    char *sender,
 		    char *recipient);
+int bundle_flush_sync_keys();
 long long size_byte_to_length(unsigned char size_byte);
 char *bundle_recipient_if_known(char *bid_prefix);
 int rhizome_log(char *service,
@@ -372,6 +674,13 @@ int manifest_binary_to_text(unsigned char *bin_in, int len_in,
 int manifest_get_field(unsigned char *manifest, int manifest_len,
 		       char *fieldname,
 		       char *field_value);
+int manifest_digest(unsigned char *manifest,int manifest_len,
+		    unsigned char *digest_out);
+int manifest_delta_encode(unsigned char *manifest,int manifest_len,
+			  unsigned char *delta_out,int *delta_len);
+int manifest_delta_apply(unsigned char *old_manifest,int old_len,
+			 unsigned char *delta,int delta_len,char *filehash,
+			 unsigned char *manifest_out,int *len_out);
 int monitor_log(char *sender_prefix, char *recipient_prefix,char *msg);
 int bytes_to_prefix(unsigned char *bytes_in,char *prefix_out);
 int saw_timestamp(char *sender_prefix,int stratum, struct timeval *tv);
@@ -386,7 +695,18 @@ int append_bytes(int *offset,int mtu,unsigned char *msg_out,
 int sync_tree_receive_message(struct peer_state *p, unsigned char *msg);
 int lookup_bundle_by_sync_key(uint8_t bundle_sync_key[KEY_LEN]);
 int peer_queue_bundle_tx(struct peer_state *p,struct bundle_record *b, int priority);
+int peer_queue_pop(struct peer_state *p,int *priority);
+int peer_queue_remove(struct peer_state *p,int bundle);
+void peer_queue_free(struct peer_state *p);
 int sync_parse_ack(struct peer_state *p,unsigned char *msg);
+int sync_parse_sack(struct peer_state *p,unsigned char *msg);
+extern long long manifest_bytes_after_sack;
+int sync_parse_session_rebind(struct peer_state *p,unsigned char *msg);
+int sync_schedule_session_rebind(int peer,int handle);
+int sync_parse_delta_request(struct peer_state *p,unsigned char *msg);
+int sync_schedule_delta_request(int peer,int partial);
+int saw_session_binding(char *peer_prefix,int handle,unsigned char *bid_prefix_bin,
+			long long version);
 int http_post_meshms(char *server_and_port, char *auth_token,
 		     char *message,char *sender,char *recipient,
 		     int timeout_ms);
@@ -407,6 +727,7 @@ int bundle_calculate_tree_key(sync_key_t *sync_key,
 int urandombytes(unsigned char *buf, size_t len);
 int active_peer_count();
 int sync_dequeue_bundle(struct peer_state *p,int bundle);
+int sync_requeue_missing_bundles(struct peer_state *p);
 int meshms_parse_command(int argc,char **argv);
 int http_list_meshms_conversations(char *server_and_port, char *auth_token,
 				   char *participant,int timeout_ms);
@@ -428,9 +749,30 @@ int progress_log_bundle_receipt(char *bid_prefix, long long version);
 int http_get_async(char *server_and_port, char *auth_token,
 		   char *path, int timeout_ms);
 int http_read_next_line(int sock, char *line, int *len, int maxlen);
+void http_close_async(int sock);
+int http_post_bundle_async(char *server_and_port, char *auth_token,
+			   char *path,
+			   unsigned char *manifest_data, int manifest_length,
+			   unsigned char *body_data, int body_length);
+int http_async_continue(int sock, int *http_response);
+int http_async_events(int sock);
+int http_get_buffer_async(char *server_and_port, char *auth_token,
+			  char *path, long long range_start, int range_length);
+int http_get_buffer_continue(int sock, int *http_response,
+			     unsigned char **buffer, int *buffer_len,
+			     long long *total_length);
+extern int http_connections_opened;
+extern int http_connections_reused;
 int load_rhizome_db_async(char *servald_server,
 			  char *credential, char *token);
-
+long long load_rhizome_db_next_service_time();
+extern int load_rhizome_db_socket;
+
+int bundle_index_first(unsigned char *bid_prefix_bin);
+const char *bundle_intern_service(char *service);
+char *bundle_field_hex(struct bundle_record *b,int field,char *hex_out);
+long long bundle_store_memory_usage();
+int lookup_bundle_by_prefix_hex(char *prefix);
 int lookup_bundle_by_prefix_bin_and_version_exact(unsigned char *prefix, long long version);
 int lookup_bundle_by_prefix_bin_and_version_or_older(unsigned char *prefix, long long version);
 int lookup_bundle_by_prefix_bin_and_version_or_newer(unsigned char *prefix, long long version);
@@ -451,6 +793,7 @@ int saw_packet(unsigned char *packet_data,int packet_bytes,
 	       char *my_sid_hex,char *prefix,
 	       char *servald_server,char *credential);
 int radio_ready();
+long long radio_next_service_time();
 int hf_radio_ready();
 int hf_radio_pause_for_turnaround();
 int hf_radio_send_now();
@@ -40,6 +40,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <fcntl.h>
 #include <time.h>
 #include <sys/time.h>
+#include <poll.h>
 
 #include "sync.h"
 #include "lbard.h"
@@ -124,6 +125,78 @@ int urandombytes(unsigned char *buf, size_t len)
 
 long long start_time=0;
 
+// Upper bound on how long we sleep when nothing is scheduled, so that any
+// timer we don't know about still gets looked at from time to time.
+#define MAX_IDLE_WAIT_MS 1000
+
+/*
+  Sleep until there is something for the main loop to do: bytes from the
+  radio, bundle list data, an import response or bundle bytes from servald,
+  an HTTP connection, a UDP time packet, or the next of our timers falling due.
+*/
+int wait_for_work(int serialfd,int httpsocket,int timesocket)
+{
+  long long now=gettime_ms();
+  long long next=now+MAX_IDLE_WAIT_MS;
+  long long t;
+
+  // Next packet transmission.  If the radio isn't ready yet (HF turnaround),
+  // then radio_next_service_time() tells us when to look again instead.
+  t=last_message_update_time+message_update_interval;
+  if (t<=now&&(!monitor_mode)&&(!radio_ready()))
+    t=(last_status_time+1)*1000LL;
+  if (t<next) next=t;
+
+  t=radio_next_service_time();
+  if (t<next) next=t;
+
+  t=load_rhizome_db_next_service_time();
+  if (t<next) next=t;
+
+  t=rhizome_import_next_service_time();
+  if (t<next) next=t;
+
+  t=bundle_fetch_next_service_time();
+  if (t<next) next=t;
+
+  t=(last_summary_time+1)*1000LL;
+  if (t<next) next=t;
+
+  int timeout=next-now;
+  if (timeout<0) timeout=0;
+
+  struct pollfd fds[6];
+  int fd_count=0;
+  if (serialfd>=0) {
+    fds[fd_count].fd=serialfd; fds[fd_count++].events=POLLIN;
+  }
+  if (load_rhizome_db_socket>=0) {
+    fds[fd_count].fd=load_rhizome_db_socket; fds[fd_count++].events=POLLIN;
+  }
+  if (rhizome_import_socket>=0) {
+    fds[fd_count].fd=rhizome_import_socket;
+    fds[fd_count++].events=http_async_events(rhizome_import_socket);
+  }
+  if (bundle_fetch_socket>=0) {
+    fds[fd_count].fd=bundle_fetch_socket;
+    fds[fd_count++].events=http_async_events(bundle_fetch_socket);
+  }
+  if (httpsocket>=0) {
+    fds[fd_count].fd=httpsocket; fds[fd_count++].events=POLLIN;
+  }
+  if (timesocket>=0) {
+    fds[fd_count].fd=timesocket; fds[fd_count++].events=POLLIN;
+  }
+
+  int r=poll(fds,fd_count,timeout);
+  if (r<0&&errno!=EINTR) {
+    perror("poll");
+    // Don't spin if poll() itself is failing.
+    usleep(10000);
+  }
+  return r;
+}
+
 int main(int argc, char **argv)
 {
   fprintf(stderr,"Version 20160927.1311.1\n");
@@ -215,6 +288,11 @@ int main(int argc, char **argv)
 	fprintf(stderr,"Only bundles newer than epoch+%lld msec (%s) will be carried.\n",
 		(long long)min_version,stringtime);
       }
+      else if (!strncasecmp("cachesize=",argv[n],10)) {
+	bundle_cache_budget=strtoll(&argv[n][10],NULL,10);
+	fprintf(stderr,"Keeping up to %lld bytes of recently sent bundles in memory.\n",
+		bundle_cache_budget);
+      }
       else if (!strcasecmp("rebootwhenstuck",argv[n])) reboot_when_stuck=1;
       else if (!strcasecmp("timeslave",argv[n])) time_slave=1;
       else if (!strcasecmp("timemaster",argv[n])) time_server=1;
@@ -237,6 +315,8 @@ int main(int argc, char **argv)
       else if (!strcasecmp("bundlelog",argv[n])) debug_bundlelog=1;
       else if (!strcasecmp("nopriority",argv[n])) debug_noprioritisation=1;
       else if (!strcasecmp("nohttpd",argv[n])) http_server=0;
+      else if (!strcasecmp("fountain",argv[n])) fountain_mode=1;
+      else if (!strcasecmp("delta",argv[n])) delta_mode=1;
       else {
 	fprintf(stderr,"Illegal mode '%s'\n",argv[n]);
 	exit(-3);
@@ -333,6 +413,10 @@ int main(int argc, char **argv)
     load_rhizome_db_async(servald_server,
 			  credential, token);
 
+    rhizome_import_service(servald_server,credential);
+
+    bundle_fetch_service(servald_server,credential);
+
     switch (radio_get_type()) {
     case RADIO_RFD900: uhf_serviceloop(serialfd); break;
     case RADIO_BARRETT_HF: hf_serviceloop(serialfd); break;
@@ -342,6 +426,46 @@ int main(int argc, char **argv)
       fprintf(stderr,"ERROR: Connected to unknown radio type.\n");
       exit(-1);
     }
+
+    // Check for time packets
+    if (timesocket!=-1)
+      {
+	unsigned char msg[1024];
+	int r;
+	while((r=recvfrom(timesocket,msg,1024,0,NULL,0))>0) {
+	  int offset=0;
+	  if (r==(1+1+8+3)) {
+	    // see rxmessages.c for more explanation
+	    offset++;
+	    int stratum=msg[offset++];
+	    struct timeval tv;
+	    bzero(&tv,sizeof (struct timeval));
+	    for(int i=0;i<8;i++) tv.tv_sec|=msg[offset++]<<(i*8);
+	    for(int i=0;i<3;i++) tv.tv_usec|=msg[offset++]<<(i*8);
+	    // ethernet delay is typically 0.1 - 5ms, so assume 5ms
+	    tv.tv_usec+=5000;
+	    saw_timestamp("          UDP",stratum,&tv);
+	  }
+	}
+      }
+    
+    if (httpsocket!=-1)
+      {
+	struct sockaddr cliaddr;
+	socklen_t addrlen=sizeof(cliaddr);
+	int s=accept(httpsocket,&cliaddr,&addrlen);
+	if (s!=-1) {
+	  // HTTP request socket
+	  printf("HTTP Socket connection\n");
+	  // Process socket
+	  // XXX This is synchronous to keep things simple,
+	  // which is why we only take one new connection per pass
+	  // of the main loop.  We also don't allow the request
+	  // to linger: if it doesn't contain the request almost immediately,
+	  // we reject it with a timeout error.
+	  http_process(&cliaddr,servald_server,credential,my_sid_hex,s);
+	}
+      }
     
     // Deal gracefully with clocks that run backwards from time to time.
     if (last_message_update_time>gettime_ms())
@@ -394,44 +518,7 @@ int main(int argc, char **argv)
 	  }
 	  // printf("--- Sent %d time announcement packets.\n",i);
 	}
-	  
-	// Check for time packet
-	if (timesocket!=-1)
-	  {
-	    unsigned char msg[1024];
-	    int offset=0;
-	    int r=recvfrom(timesocket,msg,1024,0,NULL,0);
-	    if (r==(1+1+8+3)) {
-	      // see rxmessages.c for more explanation
-	      offset++;
-	      int stratum=msg[offset++];
-	      struct timeval tv;
-	      bzero(&tv,sizeof (struct timeval));
-	      for(int i=0;i<8;i++) tv.tv_sec|=msg[offset++]<<(i*8);
-	      for(int i=0;i<3;i++) tv.tv_usec|=msg[offset++]<<(i*8);
-	      // ethernet delay is typically 0.1 - 5ms, so assume 5ms
-	      tv.tv_usec+=5000;
-	      saw_timestamp("          UDP",stratum,&tv);
-	    }
-	  }	
-	}
-	if (httpsocket!=-1)
-	  {
-	    struct sockaddr cliaddr;
-	    socklen_t addrlen;
-	    int s=accept(httpsocket,&cliaddr,&addrlen);
-	    if (s!=-1) {
-	      // HTTP request socket
-	      printf("HTTP Socket connection\n");
-	      // Process socket
-	      // XXX This is synchronous to keep things simple,
-	      // which is part of why we only check every second or so
-	      // for one new connection.  We also don't allow the request
-	      // to linger: if it doesn't contain the request almost immediately,
-	      // we reject it with a timeout error.
-	      http_process(&cliaddr,servald_server,credential,my_sid_hex,s);
-	    }
-	  }
+      }
 
 	if ((!monitor_mode)&&(radio_ready())) {
 	  update_my_message(serialfd,
@@ -441,7 +528,8 @@ int main(int argc, char **argv)
 	
 	  // Vary next update time by upto 250ms, to prevent radios getting lock-stepped.
 	  last_message_update_time=gettime_ms()+(random()%message_update_interval_randomness);
-	}
+	} else if (monitor_mode)
+	  last_message_update_time=gettime_ms();
 	
 	// Update the state file to help debug things
 	// (but not too often, since it is SLOW on the MR3020s
@@ -458,11 +546,11 @@ int main(int argc, char **argv)
       system("reboot");
     }
     
-    usleep(10000);
-
     if (time(0)>last_summary_time) {
       last_summary_time=time(0);
       show_progress();
     }    
+
+    wait_for_work(serialfd,httpsocket,timesocket);
   }
 }
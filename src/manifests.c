@@ -41,6 +41,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "sync.h"
 #include "lbard.h"
 #include "util.h"
+#include "sha512.h"
 
 // Table of fields and transformations
 struct manifest_field {
@@ -364,14 +365,115 @@ int manifest_text_to_binary(unsigned char *text_in, int len_in,
 }
 
 #ifdef TEST
+// A MeshMS2 journal manifest, with a signature block that depends on seed
+int test_journal_manifest(long long version,long long filesize,int seed,
+			  unsigned char *out)
+{
+  char filehash[129];
+  for(int i=0;i<128;i++) filehash[i]="0123456789ABCDEF"[(seed*7+i*13)&15];
+  filehash[128]=0;
+  int len=snprintf((char *)out,1024,
+		   "service=MeshMS2\n"
+		   "id=6A7E5B1F2C3D4E5F60718293A4B5C6D7E8F90A1B2C3D4E5F6071829304152637\n"
+		   "version=%lld\n"
+		   "filesize=%lld\n"
+		   "filehash=%s\n"
+		   "tail=0\n"
+		   "sender=1F2E3D4C5B6A79887766554433221100FFEEDDCCBBAA99887766554433221100\n"
+		   "recipient=00112233445566778899AABBCCDDEEFF0011223344556677889900AABBCCDDEE\n"
+		   "crypt=1\n"
+		   "date=%lld\n",
+		   version,filesize,filehash,version/1000);
+  // Signature block
+  out[len++]=0;
+  out[len++]=0x17;
+  for(int i=0;i<96;i++) out[len++]=(seed*31+i*17)&0xff;
+  return len;
+}
+
+/* Send the delta of new_manifest to a peer that has old_manifest, and check
+   that it rebuilds new_manifest exactly. */
+int test_manifest_delta(char *name,unsigned char *old_manifest,int old_len,
+			unsigned char *new_manifest,int new_len)
+{
+  unsigned char delta[1024];
+  int delta_len=0;
+  unsigned char rebuilt[1024];
+  int rebuilt_len=0;
+  char filehash[1024];
+  int failed=0;
+  manifest_get_field(new_manifest,new_len,"filehash",filehash);
+  if (manifest_delta_encode(new_manifest,new_len,delta,&delta_len)
+      ||manifest_delta_apply(old_manifest,old_len,delta,delta_len,filehash,
+			     rebuilt,&rebuilt_len))
+    failed=1;
+  else if ((rebuilt_len!=new_len)||bcmp(rebuilt,new_manifest,new_len))
+    failed=1;
+  printf("Manifest delta, %s: %d bytes instead of %d, %s\n",
+	 name,delta_len,new_len,failed?"FAILED to rebuild":"rebuilt exactly");
+  return failed;
+}
+
+// A delta that can't be used must be refused, not turned into a manifest
+int test_bad_manifest_delta(char *name,unsigned char *old_manifest,int old_len,
+			    unsigned char *delta,int delta_len)
+{
+  unsigned char rebuilt[1024];
+  int rebuilt_len=0;
+  int failed=!manifest_delta_apply(old_manifest,old_len,delta,delta_len,NULL,
+				   rebuilt,&rebuilt_len);
+  printf("Manifest delta, %s: %s\n",name,failed?"FAILED, accepted":"refused");
+  return failed;
+}
+
+int test_manifest_deltas(void)
+{
+  unsigned char old_manifest[1024];
+  unsigned char new_manifest[1024];
+  int old_len=test_journal_manifest(1500000000000LL,1000,1,old_manifest);
+  int failed=0;
+
+  if (test_manifest_delta("unchanged",old_manifest,old_len,old_manifest,old_len))
+    failed=1;
+
+  int new_len=test_journal_manifest(1500000060000LL,1234,2,new_manifest);
+  if (test_manifest_delta("new version and filesize",old_manifest,old_len,
+			  new_manifest,new_len))
+    failed=1;
+
+  // An unknown binary token
+  unsigned char bad_token[]={0xa0,0x01,'\n',0xff,0x01,'\n',0};
+  if (test_bad_manifest_delta("unknown token",old_manifest,old_len,
+			      bad_token,sizeof(bad_token)))
+    failed=1;
+  // A line that isn't KEY=VALUE
+  unsigned char *no_value=(unsigned char *)"version=2\nnonsense\n";
+  if (test_bad_manifest_delta("line without a value",old_manifest,old_len,
+			      no_value,strlen((char *)no_value)))
+    failed=1;
+  // More lines than a delta can have
+  unsigned char many_lines[1024];
+  int many_len=0;
+  for(int i=0;i<20;i++)
+    many_len+=sprintf((char *)&many_lines[many_len],"tail=%d\n",i);
+  if (test_bad_manifest_delta("too many lines",old_manifest,old_len,
+			      many_lines,many_len))
+    failed=1;
+
+  return failed;
+}
+
 int main(int argc,char **argv)
 {
-  if (argc!=2) {
-    fprintf(stderr,"Test manifest binary representation conversion code.\n");
-    fprintf(stderr,"usage: manifesttest <manifest>\n");
+  if (argc>2) {
+    fprintf(stderr,"Test manifest binary representation conversion code, and manifest deltas.\n");
+    fprintf(stderr,"usage: manifesttest [manifest]\n");
     exit(-1);
   }
 
+  if (test_manifest_deltas()) return 1;
+  if (argc<2) return 0;
+
   FILE *f=fopen(argv[1],"r");
   if (!f) {
     fprintf(stderr,"Could not read from '%s'\n",argv[1]);
@@ -413,3 +515,179 @@ int manifest_get_field(unsigned char *manifest, int manifest_len,
   }
   return -1;
 }
+
+/*
+  Manifest deltas.
+  When a journal bundle (such as a MeshMS2 conversation) grows, only a few
+  fields of its manifest change, and it gets a new signature.  A peer that
+  has an older version can rebuild the new manifest from its own copy, if we
+  send it just those fields and the signature block.  The filehash is left
+  out, as the peer can work it out from the body once it has it.  The rebuilt
+  manifest is checked against a digest of the real one, and if it doesn't
+  match, the whole manifest has to be sent instead.
+*/
+char *manifest_delta_fields[]={"version","filesize","filehash","tail","date",NULL};
+
+int manifest_digest(unsigned char *manifest,int manifest_len,
+		    unsigned char *digest_out)
+{
+  sha512nfo s;
+  sha512_init(&s);
+  sha512_write(&s,manifest,manifest_len);
+  uint8_t *hash=sha512_result(&s);
+  bcopy(hash,digest_out,MANIFEST_DIGEST_LEN);
+  return 0;
+}
+
+// Length of the text part of a manifest, i.e., up to the signature block
+static int manifest_text_part_len(unsigned char *manifest,int manifest_len)
+{
+  for(int offset=0;offset<manifest_len;offset++)
+    if (!manifest[offset]) return offset;
+  return manifest_len;
+}
+
+// Find the end of the line starting at offset, and the length of its key
+// (or -1 if it isn't a KEY=VALUE line)
+static int manifest_line_end(unsigned char *manifest,int offset,int text_len,
+			     int *key_len)
+{
+  *key_len=-1;
+  int end;
+  for(end=offset;(end<text_len)&&(manifest[end]!='\n');end++)
+    if ((*key_len<0)&&(manifest[end]=='=')) *key_len=end-offset;
+  // Include the \n
+  if (end<text_len) end++;
+  return end;
+}
+
+static int manifest_is_delta_field(unsigned char *key,int key_len)
+{
+  for(int f=0;manifest_delta_fields[f];f++)
+    if ((strlen(manifest_delta_fields[f])==key_len)
+	&&(!strncasecmp((char *)key,manifest_delta_fields[f],key_len)))
+      return 1;
+  return 0;
+}
+
+/*
+  Produce the binary encoded delta of a text manifest: the lines of the fields
+  that change from one version of a journal to the next (other than the
+  filehash), and the signature block.
+ */
+int manifest_delta_encode(unsigned char *manifest,int manifest_len,
+			  unsigned char *delta_out,int *delta_len)
+{
+  if (manifest_len>1024) return -1;
+
+  unsigned char text[1024];
+  int text_len=0;
+  int text_part_len=manifest_text_part_len(manifest,manifest_len);
+  int offset=0;
+  while(offset<text_part_len) {
+    int key_len;
+    int end=manifest_line_end(manifest,offset,text_part_len,&key_len);
+    if ((key_len>0)&&manifest_is_delta_field(&manifest[offset],key_len)
+	&&strncasecmp((char *)&manifest[offset],"filehash=",9)) {
+      bcopy(&manifest[offset],&text[text_len],end-offset);
+      text_len+=end-offset;
+    }
+    offset=end;
+  }
+  bcopy(&manifest[text_part_len],&text[text_len],manifest_len-text_part_len);
+  text_len+=manifest_len-text_part_len;
+
+  // If the binary encoding fails, the text is copied out as is, which is still
+  // fine to decode.
+  manifest_text_to_binary(text,text_len,delta_out,delta_len);
+  return 0;
+}
+
+/*
+  Rebuild a manifest from an older version of it, a delta, and the filehash of
+  the new body (or NULL if it is empty): the fields in the delta replace the
+  ones of the same name, where they were, any others are added on the end,
+  and the signature block is replaced.
+ */
+#define MAX_DELTA_LINES 16
+int manifest_delta_apply(unsigned char *old_manifest,int old_len,
+			 unsigned char *delta,int delta_len,char *filehash,
+			 unsigned char *manifest_out,int *len_out)
+{
+  unsigned char changes[1024];
+  int changes_len;
+  if (manifest_binary_to_text(delta,delta_len,changes,&changes_len)) return -1;
+  int changes_text_len=manifest_text_part_len(changes,changes_len);
+
+  // Put the filehash in with the other changed fields
+  if (filehash) {
+    char line[256];
+    int line_len=snprintf(line,sizeof(line),"filehash=%s\n",filehash);
+    if ((changes_len+line_len)>1024) return -1;
+    memmove(&changes[changes_text_len+line_len],&changes[changes_text_len],
+	    changes_len-changes_text_len);
+    bcopy(line,&changes[changes_text_len],line_len);
+    changes_len+=line_len;
+    changes_text_len+=line_len;
+  }
+
+  // Index the lines of the delta
+  int line_start[MAX_DELTA_LINES];
+  int line_end[MAX_DELTA_LINES];
+  int line_key_len[MAX_DELTA_LINES];
+  int line_used[MAX_DELTA_LINES];
+  int lines=0;
+  int offset=0;
+  while(offset<changes_text_len) {
+    if (lines>=MAX_DELTA_LINES) return -1;
+    line_start[lines]=offset;
+    line_end[lines]=manifest_line_end(changes,offset,changes_text_len,
+				      &line_key_len[lines]);
+    if (line_key_len[lines]<=0) return -1;
+    line_used[lines]=0;
+    offset=line_end[lines++];
+  }
+
+  int out_len=0;
+  int old_text_len=manifest_text_part_len(old_manifest,old_len);
+  offset=0;
+  while(offset<old_text_len) {
+    int key_len;
+    int end=manifest_line_end(old_manifest,offset,old_text_len,&key_len);
+    unsigned char *line=&old_manifest[offset];
+    int line_len=end-offset;
+    if ((key_len>0)&&manifest_is_delta_field(&old_manifest[offset],key_len)) {
+      // Use the new value of this field, or drop it if it has gone
+      line_len=0;
+      for(int l=0;l<lines;l++)
+	if ((line_key_len[l]==key_len)
+	    &&(!strncasecmp((char *)&changes[line_start[l]],
+			    (char *)&old_manifest[offset],key_len))) {
+	  line=&changes[line_start[l]];
+	  line_len=line_end[l]-line_start[l];
+	  line_used[l]=1;
+	  break;
+	}
+    }
+    if ((out_len+line_len)>1024) return -1;
+    bcopy(line,&manifest_out[out_len],line_len);
+    out_len+=line_len;
+    offset=end;
+  }
+  for(int l=0;l<lines;l++)
+    if (!line_used[l]) {
+      int line_len=line_end[l]-line_start[l];
+      if ((out_len+line_len)>1024) return -1;
+      bcopy(&changes[line_start[l]],&manifest_out[out_len],line_len);
+      out_len+=line_len;
+    }
+
+  // And the new signature block
+  if ((out_len+changes_len-changes_text_len)>1024) return -1;
+  bcopy(&changes[changes_text_len],&manifest_out[out_len],
+	changes_len-changes_text_len);
+  out_len+=changes_len-changes_text_len;
+
+  *len_out=out_len;
+  return 0;
+}
@@ -40,86 +40,411 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "sync.h"
 #include "lbard.h"
+#include "util.h"
+#include "sha512.h"
 
 
 int clear_partial(struct partial_bundle *p)
 {
-  while(p->manifest_segments) {
-    struct segment_list *s=p->manifest_segments;
-    p->manifest_segments=s->next;
-    if (s->data) free(s->data); s->data=NULL;
-    free(s);
-    s=NULL;
-  }
-  while(p->body_segments) {
-    struct segment_list *s=p->body_segments;
-    p->body_segments=s->next;
-    if (s->data) free(s->data); s->data=NULL;
-    free(s);
-    s=NULL;
-  }
+  if (p->assembly) assembly_release(p->assembly);
+  if (p->bid_prefix) free(p->bid_prefix);
 
   bzero(p,sizeof(struct partial_bundle));
   return -1;
 }
 
-int dump_segment_list(struct segment_list *s)
+void reassembly_free(struct reassembly_buffer *r)
 {
-  if (!s) return 0;
-  while(s) {
-    fprintf(stderr,"    [%d,%d)\n",s->start_offset,s->start_offset+s->length);
-    s=s->next;
+  free(r->data);
+  r->data=NULL;
+  free(r->bitmap);
+  r->bitmap=NULL;
+  r->size=0;
+  r->bytes_received=0;
+  r->base=0;
+}
+
+/* Resize the buffer to hold exactly size bytes.  While the stream length is
+   unknown, this is used to grow the buffer as pieces arrive.  Once the length
+   is known, the buffer is set to exactly that, so that it is allocated only
+   once, and so that completeness is a simple count of received bytes. */
+int reassembly_set_size(struct reassembly_buffer *r,int size)
+{
+  if (size==r->size) return 0;
+  if ((size<r->base)||(size>MAX_REASSEMBLY_LENGTH)) return -1;
+
+  int held=size-r->base;
+  unsigned char *d=realloc(r->data,held?held:1);
+  if (!d) return -1;
+  r->data=d;
+
+  int old_bitmap_bytes=(r->size-r->base+7)>>3;
+  int bitmap_bytes=(held+7)>>3;
+  unsigned char *b=realloc(r->bitmap,bitmap_bytes?bitmap_bytes:1);
+  if (!b) return -1;
+  r->bitmap=b;
+
+  if (size>r->size) {
+    bzero(&b[old_bitmap_bytes],bitmap_bytes-old_bitmap_bytes);
+  } else {
+    // Shrinking: forget anything that was beyond the end
+    if (held&7) b[bitmap_bytes-1]&=(1<<(held&7))-1;
+    r->bytes_received=r->base;
+    for(int i=0;i<bitmap_bytes;i++)
+      r->bytes_received+=__builtin_popcount(b[i]);
   }
+
+  r->size=size;
+  return 0;
+}
+
+/* Note that the first base bytes of the stream are held elsewhere, so that we
+   need neither receive nor store them.  Only for a buffer that has nothing in
+   it yet. */
+int reassembly_set_base(struct reassembly_buffer *r,int base)
+{
+  if (r->bytes_received||(base<0)||(base>MAX_REASSEMBLY_LENGTH)) return -1;
+  reassembly_free(r);
+  r->base=base;
+  r->size=base;
+  r->bytes_received=base;
+  return 0;
+}
+
+// Mark [start,end) as received, and return how many of those bytes are new.
+static int reassembly_mark(unsigned char *bitmap,int start,int end)
+{
+  int new_bytes=0;
+
+  // Ragged start, whole bytes of bitmap, then ragged end
+  while((start<end)&&(start&7)) {
+    if (!(bitmap[start>>3]&(1<<(start&7)))) {
+      bitmap[start>>3]|=1<<(start&7);
+      new_bytes++;
+    }
+    start++;
+  }
+  while(end-start>=8) {
+    new_bytes+=8-__builtin_popcount(bitmap[start>>3]);
+    bitmap[start>>3]=0xff;
+    start+=8;
+  }
+  while(start<end) {
+    if (!(bitmap[start>>3]&(1<<(start&7)))) {
+      bitmap[start>>3]|=1<<(start&7);
+      new_bytes++;
+    }
+    start++;
+  }
+  return new_bytes;
+}
+
+/* Copy a received piece into place. stream_length is the length of the
+   stream, or -1 if we don't yet know it. Returns the number of bytes that we
+   didn't already have, or -1 if the piece doesn't fit. */
+int reassembly_add(struct reassembly_buffer *r,int stream_length,
+		   int offset,int bytes,unsigned char *data)
+{
+  if ((offset<0)||(bytes<0)) return -1;
+  int end=offset+bytes;
+
+  if (stream_length>=0) {
+    if (end>stream_length) return -1;
+    if (reassembly_set_size(r,stream_length)) return -1;
+  } else if (end>r->size) {
+    // Length not yet known, so grow geometrically
+    int new_size=r->size?r->size*2:1024;
+    while(new_size<end) new_size*=2;
+    if (new_size>MAX_REASSEMBLY_LENGTH) new_size=end;
+    if (reassembly_set_size(r,new_size)) return -1;
+  }
+
+  // We already have anything before the base
+  if (offset<r->base) {
+    if (end<=r->base) return 0;
+    data+=r->base-offset;
+    offset=r->base;
+  }
+  if (end<=offset) return 0;
+  bcopy(data,&r->data[offset-r->base],end-offset);
+  int new_bytes=reassembly_mark(r->bitmap,offset-r->base,end-r->base);
+  r->bytes_received+=new_bytes;
+  return new_bytes;
+}
+
+int reassembly_has_byte(struct reassembly_buffer *r,int offset)
+{
+  if ((offset<0)||(offset>=r->size)) return 0;
+  if (offset<r->base) return 1;
+  offset-=r->base;
+  return (r->bitmap[offset>>3]>>(offset&7))&1;
+}
+
+// Scan from offset for the first byte whose received state is want
+static int reassembly_scan(struct reassembly_buffer *r,int offset,int want)
+{
+  if (offset<r->base) {
+    if (want) return offset;
+    offset=r->base;
+  }
+  unsigned char skip=want?0x00:0xff;
+  while(offset<r->size) {
+    int bit=offset-r->base;
+    if (!(bit&7)&&(r->bitmap[bit>>3]==skip)) {
+      offset+=8;
+      continue;
+    }
+    if (reassembly_has_byte(r,offset)==want) return offset;
+    offset++;
+  }
+  return r->size;
+}
+
+/* Find the first run of received bytes at or after from.
+   Returns 0 and sets [*start,*end) if there is one, -1 otherwise. */
+int reassembly_next_run(struct reassembly_buffer *r,int from,int *start,int *end)
+{
+  if (from<0) from=0;
+  int s=reassembly_scan(r,from,1);
+  if (s>=r->size) return -1;
+  *start=s;
+  *end=reassembly_scan(r,s,0);
+  return 0;
+}
+
+int reassembly_first_missing_byte(struct reassembly_buffer *r,int from)
+{
+  if (from<0) from=0;
+  if (from>=r->size) return from;
+  return reassembly_scan(r,from,0);
+}
+
+// O(1) completeness test
+int reassembly_complete(struct reassembly_buffer *r,int stream_length)
+{
+  if (stream_length<0) return 0;
+  return r->bytes_received==stream_length;
+}
+
+int dump_reassembly_buffer(struct reassembly_buffer *r)
+{
+  int start,end=0;
+  while(!reassembly_next_run(r,end,&start,&end))
+    fprintf(stderr,"    [%d,%d)\n",start,end);
   return 0;
 }
 
 int dump_partial(struct partial_bundle *p)
 {
+  struct bundle_assembly *a=p->assembly;
   fprintf(stderr,"Progress receiving BID=%s* version %lld:\n",
 	  p->bid_prefix,p->bundle_version);
+  if (!a) return 0;
   fprintf(stderr,"  manifest is %d bytes long, and body %d bytes long.\n",
-	  p->manifest_length,p->body_length);
+	  a->manifest_length,a->body_length);
   fprintf(stderr,"  Manifest pieces received:\n");
-  dump_segment_list(p->manifest_segments);
+  dump_reassembly_buffer(&a->manifest);
   fprintf(stderr,"  Body pieces received:\n");
-  dump_segment_list(p->body_segments);
+  dump_reassembly_buffer(&a->body);
+  return 0;
+}
+
+// Forget what has been received, but keep the buffer for reuse.
+static void reassembly_clear(struct reassembly_buffer *r)
+{
+  if (r->bitmap) bzero(r->bitmap,(r->size-r->base+7)>>3);
+  r->bytes_received=r->base;
+}
+
+/* Bring in the bytes before the base, so that the whole stream is in the
+   buffer.  data is a malloc()'d buffer that starts with them, which we take
+   over (even if we fail), so that they needn't be copied. */
+int reassembly_fill_base(struct reassembly_buffer *r,unsigned char *data)
+{
+  if (!r->base) { free(data); return 0; }
+
+  int size=r->size;
+  int bitmap_bytes=(size+7)>>3;
+  unsigned char *d=realloc(data,size?size:1);
+  unsigned char *b=calloc(bitmap_bytes?bitmap_bytes:1,1);
+  if ((!d)||(!b)) {
+    free(d?d:data); free(b);
+    return -1;
+  }
+  if (size>r->base) bcopy(r->data,&d[r->base],size-r->base);
+  int start,end=0;
+  while(!reassembly_next_run(r,end,&start,&end))
+    reassembly_mark(b,start,end);
+
+  free(r->data);
+  free(r->bitmap);
+  r->data=d;
+  r->bitmap=b;
+  r->base=0;
+  return 0;
+}
+
+/* Bundles being received, hashed on the first byte of the BID prefix, so that
+   pieces of the same bundle from different peers end up in the same place. */
+#define ASSEMBLY_BUCKETS 256
+struct bundle_assembly *assembly_buckets[ASSEMBLY_BUCKETS];
+int assembly_count=0;
+int assembly_verify_failures=0;
+
+static int assembly_bucket(char *bid_prefix)
+{
+  char hex[3]={bid_prefix[0],bid_prefix[1],0};
+  return strtol(hex,NULL,16)&(ASSEMBLY_BUCKETS-1);
+}
+
+// Find or create the assembly for this bundle version, and take a reference
+struct bundle_assembly *assembly_get(char *bid_prefix,long long version)
+{
+  int bucket=assembly_bucket(bid_prefix);
+  struct bundle_assembly *a;
+  for(a=assembly_buckets[bucket];a;a=a->next)
+    if ((a->version==version)&&(!strcasecmp(a->bid_prefix,bid_prefix))) {
+      a->refs++;
+      return a;
+    }
+
+  a=calloc(1,sizeof(struct bundle_assembly));
+  if (!a) return NULL;
+  snprintf(a->bid_prefix,sizeof(a->bid_prefix),"%s",bid_prefix);
+  a->version=version;
+  a->manifest_length=-1;
+  a->body_length=-1;
+  a->refs=1;
+  a->next=assembly_buckets[bucket];
+  assembly_buckets[bucket]=a;
+  assembly_count++;
+  return a;
+}
+
+void assembly_release(struct bundle_assembly *a)
+{
+  if (--a->refs>0) return;
+
+  struct bundle_assembly **l=&assembly_buckets[assembly_bucket(a->bid_prefix)];
+  while(*l&&(*l!=a)) l=&(*l)->next;
+  if (*l) *l=a->next;
+  reassembly_free(&a->manifest);
+  reassembly_free(&a->body);
+  fountain_decoder_free(a->fountain);
+  free(a->manifest_delta);
+  free(a->delta_old_body);
+  free(a->delta_pending_sigs);
+  free(a);
+  assembly_count--;
+}
+
+// Release every peer's partial that refers to this assembly, and so the assembly.
+int assembly_clear_partials(struct bundle_assembly *a)
+{
+  int refs=a->refs;
+  for(int peer=0;peer<peer_count;peer++)
+    for(int i=0;i<MAX_BUNDLES_IN_FLIGHT;i++)
+      if (peer_records[peer]->partials[i].assembly==a) {
+	clear_partial(&peer_records[peer]->partials[i]);
+	if (!--refs) return 0;
+      }
   return 0;
 }
 
-int merge_segments(struct segment_list **s)
-{
-  if (!s) return -1;
-  if (!(*s)) return -1;
-
-  // Segments are sorted in descending order
-  while((*s)&&(*s)->next) {
-    struct segment_list *me=*s;
-    struct segment_list *next=(*s)->next;
-    if (me->start_offset<=(next->start_offset+next->length)) {
-      // Merge this piece onto the end of the next piece
-      if (debug_pieces)
-	printf("Merging [%d..%d) and [%d..%d)\n",
-		me->start_offset,me->start_offset+me->length,
-		next->start_offset,next->start_offset+next->length);
-      int extra_bytes
-	=(me->start_offset+me->length)-(next->start_offset+next->length);
-      int new_length=next->length+extra_bytes;
-      next->data=realloc(next->data,new_length);
-      assert(next->data);
-      bcopy(&me->data[me->length-extra_bytes],&next->data[next->length],
-	    extra_bytes);
-      next->length=new_length;
-
-      // Excise redundant segment from list
-      *s=next;
-      next->prev=me->prev;
-      if (me->prev) me->prev->next=next;
-
-      // Free redundant segment.
-      free(me->data); me->data=NULL;
-      free(me); me=NULL;
-    } else 
-      s=&(*s)->next;
+static int assembly_find_sid(unsigned char list[][4],int count,unsigned char *sid)
+{
+  for(int i=0;i<count;i++)
+    if (!memcmp(list[i],sid,4)) return i;
+  return -1;
+}
+
+// How long we wait for the one peer we are taking pieces from before we give up
+// on it and let another peer take over.
+#define ASSEMBLY_SOURCE_TIMEOUT 15000
+
+/* Decide whether to use a piece from this peer, and note it as a source.
+   Returns 0 if the piece should be used, -1 if it should be ignored. */
+int assembly_accept_source(struct bundle_assembly *a,unsigned char *sid_prefix_bin)
+{
+  if (assembly_find_sid(a->rejected,a->rejected_count,sid_prefix_bin)>=0)
+    return -1;
+
+  long long now=gettime_ms();
+  if (assembly_find_sid(a->sources,a->source_count,sid_prefix_bin)>=0) {
+    a->last_source_time=now;
+    return 0;
+  }
+
+  if (a->single_source&&a->source_count) {
+    // We are only taking pieces from one peer.
+    if ((now-a->last_source_time)<ASSEMBLY_SOURCE_TIMEOUT) return -1;
+    // It has gone quiet, so start again with this peer.
+    reassembly_clear(&a->manifest);
+    reassembly_clear(&a->body);
+    a->source_count=0;
   }
+
+  // If we run out of room we still use the pieces, we just can't blame the
+  // peer if the body turns out to be bad.
+  if (a->source_count<MAX_ASSEMBLY_SOURCES)
+    memcpy(a->sources[a->source_count++],sid_prefix_bin,4);
+  a->last_source_time=now;
+  return 0;
+}
+
+// Work out the filehash of a completed body, as hex
+int assembly_body_filehash(struct bundle_assembly *a,char *hash_hex)
+{
+  sha512nfo s;
+  sha512_init(&s);
+  sha512_write(&s,a->body.data,a->body_length);
+  uint8_t *hash=sha512_result(&s);
+
+  for(int i=0;i<SHA512_HASH_LENGTH;i++)
+    snprintf(&hash_hex[i*2],3,"%02X",hash[i]);
   return 0;
 }
+
+/* Check a completed body against the filehash in the manifest, so that bad
+   pieces from one peer don't spoil the bundle for everyone.
+   Returns 0 if the body is good (or can't be checked), -1 if not. */
+int assembly_verify_body(struct bundle_assembly *a,
+			 unsigned char *manifest,int manifest_len)
+{
+  char filehash[1024];
+
+  // Empty payloads have no filehash
+  if (!a->body_length) return 0;
+  if (manifest_get_field(manifest,manifest_len,"filehash",filehash)) return 0;
+
+  char hash_hex[SHA512_HASH_LENGTH*2+1];
+  assembly_body_filehash(a,hash_hex);
+  if (!strcasecmp(hash_hex,filehash)) return 0;
+
+  printf("Bundle %s*/%lld failed verification: filehash is %s, but body hashes to %s\n",
+	 a->bid_prefix,a->version,filehash,hash_hex);
+  return -1;
+}
+
+/* The body didn't match the filehash, so throw it away.  If we know which peer
+   sent it, stop accepting pieces from that peer.  Otherwise, we can't tell
+   which peer is at fault, so take pieces from only one peer at a time from now
+   on, until we find one that sends a good copy. */
+void assembly_reject_body(struct bundle_assembly *a)
+{
+  a->verify_failures++;
+  assembly_verify_failures++;
+
+  if ((a->source_count==1)&&(a->rejected_count<MAX_ASSEMBLY_SOURCES)) {
+    memcpy(a->rejected[a->rejected_count++],a->sources[0],4);
+    printf("Ignoring pieces of %s*/%lld from %02x%02x%02x%02x* from now on.\n",
+	   a->bid_prefix,a->version,
+	   a->sources[0][0],a->sources[0][1],a->sources[0][2],a->sources[0][3]);
+  }
+  a->single_source=1;
+  a->source_count=0;
+  reassembly_clear(&a->manifest);
+  reassembly_clear(&a->body);
+  fountain_decoder_free(a->fountain);
+  a->fountain=NULL;
+}
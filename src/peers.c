@@ -54,7 +54,11 @@ int free_peer(struct peer_state *p)
   free(p->versions); p->versions=NULL;
   free(p->size_bytes); p->size_bytes=NULL;
   free(p->insert_failures); p->insert_failures=NULL;
+#else
+  peer_queue_free(p);
 #endif
+  for(int i=0;i<MAX_BUNDLES_IN_FLIGHT;i++) clear_partial(&p->partials[i]);
+  free(p->rx_sessions); p->rx_sessions=NULL;
   sync_free_peer_state(sync_state, p);
   free(p);
   return 0;
@@ -136,6 +140,27 @@ int find_peer_by_prefix(char *peer_prefix)
   return -1;
 }
 
+/* Whether every peer we have heard from lately understands messages that need
+   this capability.  Packets are heard by every peer in range, and an older peer
+   gives up on the rest of a packet when it sees a message type it doesn't know,
+   so this goes for messages meant for one peer, too. */
+int peers_have_capability(int capability)
+{
+  time_t now=time(0);
+  for(int peer=0;peer<peer_count;peer++)
+    if (((now-peer_records[peer]->last_message_time)<=PEER_KEEPALIVE_INTERVAL)
+	&&(!(peer_records[peer]->capabilities&capability)))
+      return 0;
+  return 1;
+}
+
+// Whether we can send a message that needs this capability on behalf of peer p.
+int peer_has_capability(struct peer_state *p,int capability)
+{
+  if (!(p->capabilities&capability)) return 0;
+  return peers_have_capability(capability);
+}
+
 #ifdef SYNC_BY_BAR
 // The most interesting bundle a peer has is the smallest MeshMS bundle, if any, or
 // else the smallest bundle that it has, but that we do not have.
@@ -370,60 +395,34 @@ int request_wanted_content_from_peers(int *offset,int mtu, unsigned char *msg_ou
 		// interesting.
 		// Our approach to requesting missing parts is simple:
 		// 1. Request missing stuff from the start, if any.
-		// 2. Else, request from the end of the first segment, so that we will tend
-		// to merge segments.
-		struct segment_list *s=peer_records[peer]->partials[i].manifest_segments;
-		while(s&&s->next) s=s->next;
-		if ((!s)||(s->start_offset||(s->length<peer_records[peer]->partials[i].manifest_length)||peer_records[peer]->partials[i].manifest_length<0))
+		// 2. Else, request from the end of the first run, so that we will tend
+		// to fill the gaps.
+		struct partial_bundle *partial=&peer_records[peer]->partials[i];
+		struct bundle_assembly *a=partial->assembly;
+		if (!a) break;
+		if (!reassembly_complete(&a->manifest,a->manifest_length))
 		  {
+		    int first_missing=reassembly_first_missing_byte(&a->manifest,0);
 		    if (debug_pull) {
-		      printf("We need manifest bytes...\n");
-		      dump_segment_list(peer_records[peer]->partials[i].manifest_segments);
+		      printf("We need manifest bytes @ %d...\n",first_missing);
+		      dump_reassembly_buffer(&a->manifest);
 		    }
-		    if ((!s)||s->start_offset) {
-		      // We are missing bytes at the beginning
-		      return request_segment(peer,
-					     peer_records[peer]->partials[i].bid_prefix,
-					     peer_records[peer]->partials[i].body_length,
-					     0,1 /* manifest */,offset,mtu,msg_out);
-		    } else if (s) {
-		      if (debug_pull) {
-			printf("We need manifest bytes...\n");
-			dump_segment_list(peer_records[peer]->partials[i].manifest_segments);
-		      }
-		      return request_segment(peer,
-					     peer_records[peer]->partials[i].bid_prefix,
-					     peer_records[peer]->partials[i].body_length,
-
-					     (s->start_offset+s->length),
-					     1 /* manifest */,offset,mtu,msg_out);
-		    }
-		  }
-		s=peer_records[peer]->partials[i].body_segments;
-		if (debug_pull) dump_segment_list(s);
-		while(s&&s->next) s=s->next;
-		if ((!s)||s->start_offset) {
-		  // We are missing bytes at the beginning
-		  if (debug_pull) {
-		    printf("We need body bytes at the start (start_offset=%d)...\n",
-			    s?s->start_offset:-1);
-		    dump_segment_list(peer_records[peer]->partials[i].body_segments);
+		    return request_segment(peer,
+					   partial->bid_prefix,
+					   a->body_length,
+					   first_missing,
+					   1 /* manifest */,offset,mtu,msg_out);
 		  }
-		  return request_segment(peer,
-					 peer_records[peer]->partials[i].bid_prefix,
-					 peer_records[peer]->partials[i].body_length,
-					 0,
-					 0 /* not manifest */,offset,mtu,msg_out);
-		} else if (s) {
+		{
+		  int first_missing=reassembly_first_missing_byte(&a->body,0);
 		  if (debug_pull) {
-		    printf("We need body bytes @ %d...\n",
-			    s->start_offset+s->length);
-		    dump_segment_list(peer_records[peer]->partials[i].body_segments);
+		    printf("We need body bytes @ %d...\n",first_missing);
+		    dump_reassembly_buffer(&a->body);
 		  }
 		  return request_segment(peer,
-					 peer_records[peer]->partials[i].bid_prefix,
-					 peer_records[peer]->partials[i].body_length,
-					 (s->start_offset+s->length),
+					 partial->bid_prefix,
+					 a->body_length,
+					 first_missing,
 					 0 /* not manifest */,offset,mtu,msg_out);
 		}		
 	      }
@@ -469,10 +468,10 @@ int peer_queue_list_dump(struct peer_state *p)
 	 (p->tx_bundle>-1)?
 	 bundles[p->tx_bundle].bid_hex:"",
 	 p->tx_bundle_priority);
-  printf("& %d more queued\n",p->tx_queue_len);
+  printf("& %d more queued (in heap order)\n",p->tx_queue_len);
   for(int i=0;i<p->tx_queue_len;i++) {
-    int bundle=p->tx_queue_bundles[i];
-    int priority=p->tx_queue_priorities[i];
+    int bundle=p->tx_queue[i].bundle;
+    int priority=p->tx_queue[i].priority;
     printf("  & bundle=%d, bid=%s*, priority=%d\n",	   
 	   bundle,bundles[bundle].bid_hex,priority);
 
@@ -480,47 +479,130 @@ int peer_queue_list_dump(struct peer_state *p)
   return 0;
 }
 
+/* The TX queue is a binary max-heap of bundles, ordered by priority, and then
+   by the order in which they were queued. */
+static int tx_queue_before(struct tx_queue_entry *a,struct tx_queue_entry *b)
+{
+  if (a->priority!=b->priority) return a->priority>b->priority;
+  // Serial numbers wrap, so compare them by difference.
+  return (int)(a->serial-b->serial)<0;
+}
+
+static void tx_queue_place(struct peer_state *p,int slot,struct tx_queue_entry *e)
+{
+  p->tx_queue[slot]=*e;
+  p->tx_queue_slots[e->bundle]=slot+1;
+}
+
+static void tx_queue_sift(struct peer_state *p,int slot)
+{
+  struct tx_queue_entry e=p->tx_queue[slot];
+
+  // Up...
+  while(slot>0) {
+    int parent=(slot-1)/2;
+    if (!tx_queue_before(&e,&p->tx_queue[parent])) break;
+    tx_queue_place(p,slot,&p->tx_queue[parent]);
+    slot=parent;
+  }
+  // ... or down
+  while(1) {
+    int child=slot*2+1;
+    if (child>=p->tx_queue_len) break;
+    if ((child+1<p->tx_queue_len)
+	&&tx_queue_before(&p->tx_queue[child+1],&p->tx_queue[child]))
+      child++;
+    if (!tx_queue_before(&p->tx_queue[child],&e)) break;
+    tx_queue_place(p,slot,&p->tx_queue[child]);
+    slot=child;
+  }
+  tx_queue_place(p,slot,&e);
+}
+
+static int tx_queue_remove_slot(struct peer_state *p,int slot)
+{
+  int bundle=p->tx_queue[slot].bundle;
+  p->tx_queue_slots[bundle]=0;
+  p->tx_queue_len--;
+  if (slot<p->tx_queue_len) {
+    // Fill the hole with the last entry, and let it find its place
+    tx_queue_place(p,slot,&p->tx_queue[p->tx_queue_len]);
+    tx_queue_sift(p,slot);
+  }
+  return bundle;
+}
+
 int peer_queue_bundle_tx(struct peer_state *p,struct bundle_record *b, int priority)
 {
-  // Find point of insertion
-  int i;
-  for(i=0;i<p->tx_queue_len;i++) 
-    if (p->tx_queue_priorities[i]<priority) { break; }
-
-  if (i<MAX_TXQUEUE_LEN) {    
-    // Shift rest of list down
-    if (i<(p->tx_queue_len-1)) {
-      bcopy(&p->tx_queue_priorities[i],
-	    &p->tx_queue_priorities[i+1],
-	    sizeof(int)*(p->tx_queue_len-i-1));
-      bcopy(&p->tx_queue_bundles[i],
-	    &p->tx_queue_bundles[i+1],
-	    sizeof(int)*(p->tx_queue_len-i-1));
-    }
-    
-    // Write new entry
-    p->tx_queue_bundles[i]=b->index;
-    p->tx_queue_priorities[i]=priority;
-    if (i>=p->tx_queue_len)
-      p->tx_queue_len=i+1;
-
-    // printf("After queueing new bundle:\n"); fflush(stdout);
-    // peer_queue_list_dump(p);
-    
+  int bundle=b->index;
+  
+  if (bundle>=p->tx_queue_slots_alloc) {
+    int new_alloc=p->tx_queue_slots_alloc?p->tx_queue_slots_alloc:1024;
+    while(new_alloc<=bundle) new_alloc*=2;
+    int *new_slots=realloc(p->tx_queue_slots,new_alloc*sizeof(int));
+    if (!new_slots) return -1;
+    bzero(&new_slots[p->tx_queue_slots_alloc],
+	  (new_alloc-p->tx_queue_slots_alloc)*sizeof(int));
+    p->tx_queue_slots=new_slots;
+    p->tx_queue_slots_alloc=new_alloc;
+  }
+
+  int slot=p->tx_queue_slots[bundle]-1;
+  if (slot>=0) {
+    // Already queued: it might have changed priority
+    p->tx_queue[slot].priority=priority;
+    tx_queue_sift(p,slot);
     return 0;
-  } else {
-    // Fail on insertion if the queue is already full of higher priority stuff.
-    
-    /* Remember that TX queue has overflowed, so that when the TX queue is 
-       empitied, we know that we need to re-sync our tree with them to
-       rediscover the bundles that should be sent.
-       XXX - Eventually this will be replaced with Jeremy's new sync tree
-       enumeration code, that will allow us to rediscover the missing bundles,
-       without throwing away all sync state.
-    */
-    
-    p->tx_queue_overflow=1;
-    return -1;
   }
+
+  if (p->tx_queue_len>=p->tx_queue_alloc) {
+    int new_alloc=p->tx_queue_alloc?p->tx_queue_alloc*2:16;
+    struct tx_queue_entry *new_queue
+      =realloc(p->tx_queue,new_alloc*sizeof(struct tx_queue_entry));
+    if (!new_queue) return -1;
+    p->tx_queue=new_queue;
+    p->tx_queue_alloc=new_alloc;
+  }
+
+  struct tx_queue_entry e;
+  e.bundle=bundle;
+  e.priority=priority;
+  e.serial=p->tx_queue_serial++;
+  slot=p->tx_queue_len++;
+  tx_queue_place(p,slot,&e);
+  tx_queue_sift(p,slot);
+
+  // printf("After queueing new bundle:\n"); fflush(stdout);
+  // peer_queue_list_dump(p);
+    
+  return 0;
+}
+
+// Take the highest priority bundle off the TX queue. Returns -1 if the queue
+// is empty.
+int peer_queue_pop(struct peer_state *p,int *priority)
+{
+  if (!p->tx_queue_len) return -1;
+  if (priority) *priority=p->tx_queue[0].priority;
+  return tx_queue_remove_slot(p,0);
+}
+
+// Remove a bundle from the TX queue. Returns -1 if it wasn't queued.
+int peer_queue_remove(struct peer_state *p,int bundle)
+{
+  if ((bundle<0)||(bundle>=p->tx_queue_slots_alloc)) return -1;
+  int slot=p->tx_queue_slots[bundle]-1;
+  if (slot<0) return -1;
+  tx_queue_remove_slot(p,slot);
+  return 0;
+}
+
+void peer_queue_free(struct peer_state *p)
+{
+  free(p->tx_queue); p->tx_queue=NULL;
+  free(p->tx_queue_slots); p->tx_queue_slots=NULL;
+  p->tx_queue_len=0;
+  p->tx_queue_alloc=0;
+  p->tx_queue_slots_alloc=0;
 }
 
@@ -48,7 +48,7 @@ int message_buffer_length=0;
 
 
 int generate_segment_progress_string(int stream_length,
-				     struct segment_list *s, char *progress)
+				     struct reassembly_buffer *r, char *progress)
 {
   // Apply some sanity when dealing with manifests where we don't know the length yet.
   if (stream_length<1) stream_length=1024;
@@ -58,20 +58,20 @@ int generate_segment_progress_string(int stream_length,
   for(bin=0;bin<10;bin++) progress[bin]=' ';
   
 
-  
-  while(s) {
+  int start,end=0;
+  while(!reassembly_next_run(r,end,&start,&end)) {
     int bin;
 
     for(bin=0;bin<10;bin++) {
       int start_of_bin=stream_length*bin/10;
       int end_of_bin=stream_length*(bin+1)/10-1;
-      if ((s->start_offset<=start_of_bin)
-	  &&((s->start_offset+s->length-1)>=end_of_bin))
+      if ((start<=start_of_bin)
+	  &&((end-1)>=end_of_bin))
 	{
 	  progress[bin]='#';
 	}
-      else if ((s->start_offset>=start_of_bin)
-	       &&((s->start_offset+s->length-1)<end_of_bin)) {
+      else if ((start>=start_of_bin)
+	       &&((end-1)<end_of_bin)) {
 	switch(progress[bin]) {
 	case ' ': progress[bin]='.'; break;
 	case '.': progress[bin]=':'; break;
@@ -81,7 +81,6 @@ int generate_segment_progress_string(int stream_length,
 	}
       }
     }
-    s=s->next;
   }
   return 0;
 }
@@ -95,35 +94,29 @@ int generate_progress_string(struct partial_bundle *partial,
 
   // Draw up template
   snprintf(progress,80,"M          /B           ");
+
+  struct bundle_assembly *a=partial->assembly;
+  if (!a) return -1;
   
-  generate_segment_progress_string(partial->manifest_length,partial->manifest_segments,
+  generate_segment_progress_string(a->manifest_length,&a->manifest,
 				   &progress[1]);
-  generate_segment_progress_string(partial->body_length,partial->body_segments,
+  generate_segment_progress_string(a->body_length,&a->body,
 				   &progress[13]);
 
 
-  int manifest_bytes =0,body_bytes=0;
-  struct segment_list *s=partial->manifest_segments;
-  while(s) {
-    manifest_bytes+=s->length;
-    s=s->next;
-  }
-  s=partial->body_segments;
-  while(s) {
-    body_bytes+=s->length;
-    s=s->next;
-  }
+  int manifest_bytes=a->manifest.bytes_received;
+  int body_bytes=a->body.bytes_received;
 
   if (partial->recent_bytes)
     snprintf(&progress[24],54," %d/%d, %d/%d  [%d since last report]",
-	     manifest_bytes,partial->manifest_length,
-	     body_bytes,partial->body_length,
+	     manifest_bytes,a->manifest_length,
+	     body_bytes,a->body_length,
 	     partial->recent_bytes
 	     );
   else
     snprintf(&progress[24],54," %d/%d, %d/%d",
-	     manifest_bytes,partial->manifest_length,
-	     body_bytes,partial->body_length
+	     manifest_bytes,a->manifest_length,
+	     body_bytes,a->body_length
 	     );
   
   partial->recent_bytes=0;
@@ -347,6 +347,25 @@ int saw_packet(unsigned char *packet_data, int packet_bytes,
   }
 }
 
+/*
+  Report the time (in ms) by which the radio driver next needs its service
+  loop called, even if nothing arrives on the serial port.  The UHF and RF95
+  drivers only have the 4 second congestion update.  The HF drivers work in
+  whole seconds (call schedule, link probes and turnaround pauses), so it is
+  enough to look again at the next second boundary.
+*/
+long long radio_next_service_time()
+{
+  switch (radio_get_type())
+  {
+  case RADIO_RFD900:
+  case RADIO_RF95:
+    return congestion_update_time;
+  default:
+    return (time(0) + 1) * 1000LL;
+  }
+}
+
 int radio_ready()
 {
   if (radio_get_type() == RADIO_RFD900)
@@ -41,9 +41,6 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "sync.h"
 #include "lbard.h"
 
-extern struct bundle_record bundles[MAX_BUNDLES];
-extern int bundle_count;
-
 #ifdef SYNC_BY_BAR
 int peer_has_this_bundle_or_newer(int peer,char *bid_or_bidprefix, long long version)
 {
@@ -200,12 +197,14 @@ int calculate_stored_bundle_priority(int i,int versus)
   // Start with intrinsic priority of the bundle based on size, service,
   // who it is addressed to, and whether we have had problems inserting it
   // into rhizome.
+  char recipient[64*2+1];
   long long this_bundle_priority=
     calculate_bundle_intrinsic_priority(bundles[i].bid_hex,
 					bundles[i].length,
 					bundles[i].version,
-					bundles[i].service,
-					bundles[i].recipient,
+					(char *)bundles[i].service,
+					bundle_field_hex(&bundles[i],BUNDLE_HAS_RECIPIENT,
+							 recipient),
 					0 /* it is a bundle in rhizome, so
 					     insert_failures is meaningless here. */
 					);
@@ -37,6 +37,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "sync.h"
 #include "lbard.h"
@@ -105,7 +106,7 @@ int load_rhizome_db_async(char *servald_server,
 {
   // Make sure we have a socket, and that it isn't stale
   if (load_rhizome_db_socket_timeout<gettime_ms()) {
-    if (load_rhizome_db_socket>=0) close(load_rhizome_db_socket);
+    if (load_rhizome_db_socket>=0) http_close_async(load_rhizome_db_socket);
     load_rhizome_db_socket=-1;
   }
   if (load_rhizome_db_socket<0) {
@@ -125,8 +126,9 @@ int load_rhizome_db_async(char *servald_server,
 
     if (load_rhizome_db_line[0]=='}') {
       // End of JSON
-      close(load_rhizome_db_socket);
+      http_close_async(load_rhizome_db_socket);
       load_rhizome_db_socket=-1;
+      bundle_flush_sync_keys();
       return 0;
     }
     
@@ -160,11 +162,14 @@ int load_rhizome_db_async(char *servald_server,
       // Reset timeout
       load_rhizome_db_socket_timeout=gettime_ms()+5000;
       break;
-    case 1: // end of connection, socket already closed
+    case 1: // end of response, socket already closed or back in the pool
       load_rhizome_db_socket=-1;
+      bundle_flush_sync_keys();
       return 0;
       break;
     case -1: // EAGAIN, so keep trying, but return for now
+      // Add the bundles we have seen so far to the sync tree in one go
+      bundle_flush_sync_keys();
       return 0;
       break;
     }
@@ -173,6 +178,15 @@ int load_rhizome_db_async(char *servald_server,
 }
 
 
+/* Time (in ms) at which load_rhizome_db_async() next has something to do
+   that isn't triggered by data arriving on load_rhizome_db_socket:
+   either giving up on a stale connection, or opening a new one. */
+long long load_rhizome_db_next_service_time()
+{
+  if (load_rhizome_db_socket>=0) return load_rhizome_db_socket_timeout;
+  return load_rhizome_db_last_socket_open+5000;
+}
+
 int hex_byte_value(char *hexstring)
 {
   char hex[3];
@@ -182,6 +196,39 @@ int hex_byte_value(char *hexstring)
   return strtoll(hex,NULL,16);
 }
 
+// Report the outcome of an import, keeping a copy of any bundle that servald
+// rejected if debug_insert is set. Returns 0 if the bundle was accepted.
+int rhizome_import_result(unsigned char *manifest_data,int manifest_length,
+			  unsigned char *body_data,int body_length,
+			  int result_code)
+{
+  if(result_code<200|| result_code>202) {
+    printf("POST bundle to rhizome failed: http result = %d\n",result_code);
+
+    if (debug_insert) {
+      char filename[1024];
+      snprintf(filename,1024,"/tmp/lbard.rejected.manifest");
+      FILE *f=fopen(filename,"w");
+      if (f) { fwrite(manifest_data,manifest_length,1,f); fclose(f); }
+      snprintf(filename,1024,"/tmp/lbard.rejected.body");
+      f=fopen(filename,"w");
+      if (f) { fwrite(body_data,body_length,1,f); fclose(f); }
+      snprintf(filename,1024,"/tmp/lbard.rejected.result");
+      f=fopen(filename,"w");
+      if (f) {
+	fprintf(f,"http result code = %d\n",result_code);
+	fclose(f);
+      }
+    }
+    return -1;
+  }
+  else
+    printf("http result code = %d\n",result_code);
+    
+  
+  return 0;
+}
+
 int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
 			  unsigned char *body_data,int body_length,
 			  char *servald_server,char *credential)
@@ -218,33 +265,137 @@ int rhizome_update_bundle(unsigned char *manifest_data,int manifest_length,
 				   body_data,body_length,
 				   15000);  
   
-  if(result_code<200|| result_code>202) {
-    printf("POST bundle to rhizome failed: http result = %d\n",result_code);
+  return rhizome_import_result(manifest_data,manifest_length,
+			       body_data,body_length,result_code);
+}
 
-    if (debug_insert) {
-      char filename[1024];
-      snprintf(filename,1024,"/tmp/lbard.rejected.manifest");
-      FILE *f=fopen(filename,"w");
-      if (f) { fwrite(manifest_data,manifest_length,1,f); fclose(f); }
-      snprintf(filename,1024,"/tmp/lbard.rejected.body");
-      f=fopen(filename,"w");
-      if (f) { fwrite(body_data,body_length,1,f); fclose(f); }
-      snprintf(filename,1024,"/tmp/lbard.rejected.result");
-      f=fopen(filename,"w");
-      if (f) {
-	fprintf(f,"http result code = %d\n",result_code);
-	fclose(f);
-      }
-    }
+
+/*
+  Bundles we receive are imported into Rhizome in the background, so that a
+  slow servald can't stop us reading from the radio. rhizome_queue_import()
+  takes a copy of a completed bundle, and rhizome_import_service() is called
+  from the main loop to post them to servald one at a time. The result is
+  passed back to saw_bundle_import_result() once servald has answered.
+*/
+#define RHIZOME_IMPORT_QUEUE_LEN 8
+#define RHIZOME_IMPORT_TIMEOUT 15000
+// Connection problems (as opposed to servald rejecting the bundle) get
+// another go, as a pooled connection may have gone stale.
+#define RHIZOME_IMPORT_ATTEMPTS 2
+
+struct rhizome_import {
+  unsigned char *manifest;
+  int manifest_length;
+  unsigned char *body;
+  int body_length;
+
+  char peer_prefix[32*2+1];
+  char bid[32*2+1];
+  char bid_prefix[32*2+1];
+  long long version;
+
+  int attempts;
+};
+
+struct rhizome_import rhizome_imports[RHIZOME_IMPORT_QUEUE_LEN];
+int rhizome_import_count=0;
+int rhizome_import_socket=-1;
+long long rhizome_import_timeout=0;
+int rhizome_imports_failed=0;
+int rhizome_imports_done=0;
+
+int rhizome_queue_import(unsigned char *manifest_data,int manifest_length,
+			 unsigned char *body_data,int body_length,
+			 char *peer_prefix,char *bid,char *bid_prefix,
+			 long long version)
+{
+  if (rhizome_import_count>=RHIZOME_IMPORT_QUEUE_LEN) {
+    printf("Rhizome import queue is full: dropping bundle %s*/%lld\n",
+	   bid_prefix,version);
     return -1;
   }
-  else
-    printf("http result code = %d\n",result_code);
-    
-  
+  struct rhizome_import *im=&rhizome_imports[rhizome_import_count];
+  bzero(im,sizeof(struct rhizome_import));
+  im->manifest=malloc(manifest_length);
+  im->body=malloc(body_length?body_length:1);
+  if ((!im->manifest)||(!im->body)) {
+    free(im->manifest); free(im->body);
+    return -1;
+  }
+  bcopy(manifest_data,im->manifest,manifest_length);
+  bcopy(body_data,im->body,body_length);
+  im->manifest_length=manifest_length;
+  im->body_length=body_length;
+  snprintf(im->peer_prefix,sizeof(im->peer_prefix),"%s",peer_prefix);
+  snprintf(im->bid,sizeof(im->bid),"%s",bid?bid:"");
+  snprintf(im->bid_prefix,sizeof(im->bid_prefix),"%s",bid_prefix);
+  im->version=version;
+  rhizome_import_count++;
+  return 0;
+}
+
+void rhizome_import_finished(int result_code)
+{
+  struct rhizome_import *im=&rhizome_imports[0];
+
+  if ((result_code==-1)&&(im->attempts<RHIZOME_IMPORT_ATTEMPTS))
+    // Leave it at the head of the queue to try again.
+    return;
+
+  int insert_result=rhizome_import_result(im->manifest,im->manifest_length,
+					  im->body,im->body_length,result_code);
+  if (insert_result) rhizome_imports_failed++; else rhizome_imports_done++;
+  saw_bundle_import_result(im->peer_prefix,im->bid,im->bid_prefix,im->version,
+			   insert_result);
+
+  free(im->manifest);
+  free(im->body);
+  rhizome_import_count--;
+  memmove(&rhizome_imports[0],&rhizome_imports[1],
+	  rhizome_import_count*sizeof(struct rhizome_import));
+}
+
+int rhizome_import_service(char *servald_server,char *credential)
+{
+  if (!rhizome_import_count) return 0;
+  struct rhizome_import *im=&rhizome_imports[0];
+
+  if (rhizome_import_socket<0) {
+    printf("Submitting rhizome bundle: manifest len=%d, body len=%d\n",
+	   im->manifest_length,im->body_length);
+    im->attempts++;
+    rhizome_import_timeout=gettime_ms()+RHIZOME_IMPORT_TIMEOUT;
+    rhizome_import_socket=http_post_bundle_async(servald_server,credential,
+						 "/rhizome/import",
+						 im->manifest,im->manifest_length,
+						 im->body,im->body_length);
+    if (rhizome_import_socket<0) {
+      rhizome_import_finished(-1);
+      return -1;
+    }
+  }
+
+  int result_code=-1;
+  if (!http_async_continue(rhizome_import_socket,&result_code)) {
+    if (gettime_ms()<rhizome_import_timeout) return 0;
+    printf("Timeout importing bundle %s*/%lld\n",im->bid_prefix,im->version);
+    http_close_async(rhizome_import_socket);
+    result_code=-1;
+  }
+  rhizome_import_socket=-1;
+  rhizome_import_finished(result_code);
   return 0;
 }
 
+// When rhizome_import_service() next needs calling, if nothing happens on
+// rhizome_import_socket before then.
+long long rhizome_import_next_service_time()
+{
+  if (rhizome_import_socket>=0) return rhizome_import_timeout;
+  if (rhizome_import_count) return gettime_ms();
+  return LLONG_MAX;
+}
+
 
 int manifest_extract_bid(unsigned char *manifest_data,char *bid_hex)
 {
@@ -59,9 +59,15 @@ int saw_length(char *peer_prefix,char *bid_prefix,long long version,
       if (spare_record==-1) spare_record=i;
     } else {
       if (!strcasecmp(peer_records[peer]->partials[i].bid_prefix,bid_prefix))
-	if (peer_records[peer]->partials[i].bundle_version==version)
+	if ((peer_records[peer]->partials[i].bundle_version==version)
+	    &&peer_records[peer]->partials[i].assembly)
 	  {
-	    peer_records[peer]->partials[i].body_length=body_length;
+	    struct bundle_assembly *a=peer_records[peer]->partials[i].assembly;
+	    // Now that we know how big it is, allocate the whole buffer, and
+	    // only believe the length if we can
+	    if ((body_length<0)||reassembly_set_size(&a->body,body_length))
+	      return -1;
+	    a->body_length=body_length;
 	    return 0;
 	  }
     }
@@ -69,23 +75,67 @@ int saw_length(char *peer_prefix,char *bid_prefix,long long version,
   return -1;
 }
 
-int saw_piece(char *peer_prefix,int for_me,
-	      char *bid_prefix, unsigned char *bid_prefix_bin,
-	      long long version,
-	      long long piece_offset,int piece_bytes,int is_end_piece,
-	      int is_manifest_piece,unsigned char *piece,
-
-	      char *prefix, char *servald_server, char *credential)
+int saw_session_binding(char *peer_prefix,int handle,unsigned char *bid_prefix_bin,
+			long long version)
 {
-  int next_byte_would_be_useful=0;
-  
   int peer=find_peer_by_prefix(peer_prefix);
   if (peer<0) return -1;
+  struct peer_state *p=peer_records[peer];
+
+  if (!p->rx_sessions) {
+    p->rx_sessions=calloc(MAX_SESSION_HANDLES,sizeof(struct session_binding));
+    if (!p->rx_sessions) return -1;
+  }
+  struct session_binding *b=&p->rx_sessions[handle&(MAX_SESSION_HANDLES-1)];
+  b->valid=1;
+  bcopy(bid_prefix_bin,b->bid_bin,8);
+  b->version=version;
+  return 0;
+}
 
-  if (debug_pieces) printf("Saw a piece of BID=%s* from SID=%s*\n",
-			    bid_prefix,peer_prefix);
+/*
+  Called once we know whether a bundle we received was accepted by Rhizome.
+  As imports happen in the background, the peer might have gone away by now.
+*/
+int saw_bundle_import_result(char *peer_prefix,char *bid,char *bid_prefix,
+			     long long version,int insert_result)
+{
+  if (insert_result) {
+    // Failed to insert, so mark this bundle for deprioritisation, so that we
+    // don't just keep asking for it.
+#ifdef SYNC_BY_BAR
+    int peer=find_peer_by_prefix(peer_prefix);
+    if ((peer>=0)&&bid[0]) {
+      int bundle=bid_to_peer_bundle_index(peer,bid);
+      if (peer_records[peer]->insert_failures[bundle]<255)
+	peer_records[peer]->insert_failures[bundle]++;
+    }
+#endif
+  } else {
+    // Insert succeeded, so clear any failure deprioritisation (although it
+    // shouldn't matter).
+#ifdef SYNC_BY_BAR
+    int peer=find_peer_by_prefix(peer_prefix);
+    if ((peer>=0)&&bid[0]) {
+      int bundle=bid_to_peer_bundle_index(peer,bid);
+      peer_records[peer]->insert_failures[bundle]=0;
+    }
+#endif
+    progress_log_bundle_receipt(bid_prefix,version);
+  }
+  return 0;
+}
 
-  int bundle_number=-1;
+/* Find (or make) the partial record for the bundle that a piece from this peer
+   belongs to, and make sure that it has an assembly for this version.
+   Returns the slot in the peer's partials, -2 if the piece should be ignored,
+   or -1 on error.  If we have an older version of a journal bundle,
+   bundle_number is set to it. */
+static int saw_piece_find_partial(int peer,char *peer_prefix,
+				  char *bid_prefix,unsigned char *bid_prefix_bin,
+				  long long version,int *bundle_number)
+{
+  *bundle_number=-1;
 
   // Send an ack immediately if we already have this bundle (or newer), so that the
   // sender knows that they can start sending something else.
@@ -101,31 +151,31 @@ int saw_piece(char *peer_prefix,int for_me,
 	    "We recently received %s* version %lld - ignoring piece.\n",
 	    bid_prefix,version);
     sync_tell_peer_we_have_bundle_by_id(peer,bid_prefix_bin,version);
-    return 0;
+    return -2;
     
   }
-  for(int i=0;i<bundle_count;i++) {
-    if (!strncasecmp(bid_prefix,bundles[i].bid_hex,strlen(bid_prefix))) {
-      if (debug_pieces) printf("We have version %lld of BID=%s*.  %s is offering us version %lld\n",
-	      bundles[i].version,bid_prefix,peer_prefix,version);
-      if (version<=bundles[i].version) {
-	// We have this version already: mark it for announcement to sender,
-	// and then return immediately.
+  // The bundle index lists the highest version of each BID prefix first
+  for(int i=bundle_index_first(bid_prefix_bin);i!=-1;
+      i=bundles[i].next_with_same_prefix) {
+    if (debug_pieces) printf("We have version %lld of BID=%s*.  %s is offering us version %lld\n",
+			     bundles[i].version,bid_prefix,peer_prefix,version);
+    if (version<=bundles[i].version) {
+      // We have this version already: mark it for announcement to sender,
+      // and then return immediately.
 #ifdef SYNC_BY_BAR
-	bundles[i].announce_bar_now=1;
+      bundles[i].announce_bar_now=1;
 #endif
-	fprintf(stderr,"We already have %s* version %lld - ignoring piece.\n",
-		bid_prefix,version);
-	sync_tell_peer_we_have_this_bundle(peer,i);
-	return 0;
-      } else {
-	// We have an older version.
-	// Remember the bundle number so that we can pre-fetch the body we have
-	// for incremental journal transfers
-	if (version<0x100000000LL) {
-	  bundle_number=i;
-	}	
-      }
+      fprintf(stderr,"We already have %s* version %lld - ignoring piece.\n",
+	      bid_prefix,version);
+      sync_tell_peer_we_have_this_bundle(peer,i);
+      return -2;
+    } else {
+      // We have an older version.
+      // Remember the bundle number so that we can pre-fetch the body we have
+      // for incremental journal transfers
+      if (version<0x100000000LL) {
+	*bundle_number=i;
+      }	
     }
   }
 
@@ -137,10 +187,8 @@ int saw_piece(char *peer_prefix,int for_me,
     } else {
       if (!strcasecmp(peer_records[peer]->partials[i].bid_prefix,bid_prefix))
 	{
-	  if (debug_pieces) printf("Saw another piece for BID=%s* from SID=%s: ",
+	  if (debug_pieces) printf("Saw another piece for BID=%s* from SID=%s\n",
 			 bid_prefix,peer_prefix);
-	  if (debug_pieces) printf("[%lld..%lld)\n",
-			 piece_offset,piece_offset+piece_bytes);
 
 	  break;
 	}
@@ -180,278 +228,683 @@ int saw_piece(char *peer_prefix,int for_me,
     // Now prepare the partial record
     peer_records[peer]->partials[i].bid_prefix=strdup(bid_prefix);
     peer_records[peer]->partials[i].bundle_version=version;
-    peer_records[peer]->partials[i].manifest_length=-1;
-    peer_records[peer]->partials[i].body_length=-1;
   }
 
+  struct partial_bundle *partial=&peer_records[peer]->partials[i];
+
+  // Pieces of this bundle from every peer are assembled together
+  if (partial->assembly&&(partial->bundle_version!=version)) {
+    // Peer has moved on to a newer version
+    assembly_release(partial->assembly);
+    partial->assembly=NULL;
+    partial->bundle_version=version;
+  }
+  if (!partial->assembly) {
+    partial->assembly=assembly_get(bid_prefix,version);
+    if (!partial->assembly) {
+      clear_partial(partial);
+      return -1;
+    }
+  }
+
+  if (assembly_accept_source(partial->assembly,
+			     peer_records[peer]->sid_prefix_bin)) {
+    if (debug_pieces)
+      printf("Not using piece of %s*/%lld from %s*.\n",
+	     bid_prefix,version,peer_prefix);
+    return -2;
+  }
+
+  return i;
+
+}
+
+// Find a peer that is receiving the bundle that this is the assembly of
+static int assembly_find_partial(struct bundle_assembly *a,int *peer,int *i)
+{
+  for(*peer=0;*peer<peer_count;(*peer)++)
+    for(*i=0;*i<MAX_BUNDLES_IN_FLIGHT;(*i)++)
+      if (peer_records[*peer]->partials[*i].assembly==a) return 0;
+  return -1;
+}
+
+static int saw_piece_check_complete(int peer,int i,char *peer_prefix,
+				    char *bid_prefix,long long version,
+				    char *servald_server,char *credential);
+
+// We couldn't get the bytes we had of a journal bundle, so forget them, so
+// that the sender sends us the lot.
+static void saw_piece_journal_base_failed(struct bundle_assembly *a)
+{
+  printf("Could not fetch the %d bytes we had of %s* from Rhizome.\n",
+	 a->body.base,a->bid_prefix);
+  reassembly_free(&a->body);
+  a->journal_base_failed=1;
+  int peer,i;
+  if (!assembly_find_partial(a,&peer,&i)) sync_schedule_progress_report(peer,i);
+}
+
+/* The start of the body of the older version of a journal bundle has arrived
+   from servald.  This is called from the main loop, not while we are handling
+   a packet. */
+static void saw_piece_journal_base(void *context,unsigned char *data,int len,
+				   long long offset,long long total_len,
+				   char *servald_server,char *credential)
+{
+  struct bundle_assembly *a=context;
+  a->journal_base_fetching=0;
+
+  if (a->body.base) {
+    int base=a->body.base;
+    if (data&&(!offset)&&(len>=base)) {
+      int failed=reassembly_fill_base(&a->body,data);
+      data=NULL;
+      if (failed) saw_piece_journal_base_failed(a);
+      else {
+	if (debug_pieces)
+	  printf("Filled in %d bytes from old version of journal bundle %s*.\n",
+		 base,a->bid_prefix);
+	int peer,i;
+	if (!assembly_find_partial(a,&peer,&i))
+	  saw_piece_check_complete(peer,i,peer_records[peer]->sid_prefix,
+				   a->bid_prefix,a->version,
+				   servald_server,credential);
+      }
+    } else saw_piece_journal_base_failed(a);
+  }
+  free(data);
+  assembly_release(a);
+}
+
+/* We have all the new bytes of a journal bundle, so fetch the ones that we
+   already had from Rhizome in the background, so that we have the whole body
+   to check and import. */
+static int saw_piece_fetch_journal_base(struct bundle_assembly *a)
+{
+  int base=a->body.base;
+
+  // Any older version of the journal that is at least that long will do
+  int bundle;
+  for(bundle=bundle_index_first(bid_prefix_hex_to_bin(a->bid_prefix));
+      bundle!=-1;bundle=bundles[bundle].next_with_same_prefix)
+    if ((bundles[bundle].version<a->version)&&(bundles[bundle].length>=base))
+      break;
+
+  if (bundle>-1) {
+    // The fetch holds a reference, so that the assembly outlives it
+    assembly_get(a->bid_prefix,a->version);
+    if (!bundle_fetch_start(bundles[bundle].bid_hex,0,0,base,
+			    saw_piece_journal_base,a)) {
+      a->journal_base_fetching=1;
+      return 0;
+    }
+    assembly_release(a);
+  }
+
+  saw_piece_journal_base_failed(a);
+  return -1;
+}
+
+/* Rebuild the manifest from the delta we were sent, now that we have the body
+   to work out the filehash from.  If it doesn't match what the sender has, we
+   ask for the whole manifest. */
+static int saw_piece_rebuild_manifest(int peer,int i)
+{
+  struct bundle_assembly *a=peer_records[peer]->partials[i].assembly;
+  struct manifest_delta *d=a->manifest_delta;
+  a->manifest_delta=NULL;
+
+  char filehash[128+1];
+  assembly_body_filehash(a,filehash);
+  unsigned char manifest[1024];
+  int manifest_len=0;
+  unsigned char check[MANIFEST_DIGEST_LEN];
+  if (manifest_delta_apply(d->old_manifest,d->old_manifest_len,
+			   d->delta,d->delta_len,
+			   a->body_length?filehash:NULL,
+			   manifest,&manifest_len)
+      ||manifest_digest(manifest,manifest_len,check)
+      ||bcmp(check,d->digest,MANIFEST_DIGEST_LEN)) {
+    printf("Could not rebuild manifest of %s*/%lld from delta.\n",
+	   a->bid_prefix,a->version);
+    free(d);
+    sync_schedule_progress_report(peer,i);
+    return -1;
+  }
+  free(d);
+
+  unsigned char manifest_encoded[1024];
+  int manifest_encoded_len=0;
+  if (manifest_text_to_binary(manifest,manifest_len,
+			      manifest_encoded,&manifest_encoded_len)) {
+    // Failed to binary encode manifest, so just copy it, as the sender would
+    bcopy(manifest,manifest_encoded,manifest_len);
+    manifest_encoded_len=manifest_len;
+  }
+  a->manifest_length=manifest_encoded_len;
+  if (reassembly_add(&a->manifest,a->manifest_length,
+		     0,manifest_encoded_len,manifest_encoded)<0)
+    return -1;
+  if (debug_pieces)
+    printf("Rebuilt %d byte manifest of %s*/%lld from delta.\n",
+	   manifest_encoded_len,a->bid_prefix,a->version);
+  return 0;
+}
+
+/* Check if we have the whole bundle now, and if so, hand it over for import.
+   Returns 1 if the bundle is dealt with (including if it failed verification),
+   0 if we are still waiting for more of it. */
+static int saw_piece_check_complete(int peer,int i,char *peer_prefix,
+				    char *bid_prefix,long long version,
+				    char *servald_server,char *credential)
+{
+  struct bundle_assembly *a=peer_records[peer]->partials[i].assembly;
+
+  if (a->body.base&&reassembly_complete(&a->body,a->body_length)) {
+    // We have all the new bytes, and are waiting for the ones we had
+    if (!a->journal_base_fetching) saw_piece_fetch_journal_base(a);
+    return 0;
+  }
+
+  if (a->manifest_delta&&reassembly_complete(&a->body,a->body_length)) {
+    // Still waiting for the older manifest to rebuild it from
+    if (a->manifest_delta->old_manifest_len<0) return 0;
+    if (saw_piece_rebuild_manifest(peer,i)) return 0;
+  }
+
+  if (!(reassembly_complete(&a->manifest,a->manifest_length)
+	&&reassembly_complete(&a->body,a->body_length)))
+    return 0;
+
+  // We have every byte of the manifest and body.
+  printf(">>> We have the entire bundle %s*/%lld now.\n",
+	 bid_prefix,version);
+
+  // First, reconstitute the manifest from the binary encoded format
+  unsigned char manifest[1024];
+  int manifest_len;
+
+  int insert_result=-999;
+
+  char bid[32*2+1];
+  if (manifest_extract_bid(a->manifest.data,bid))
+    bid[0]=0;
+
+  int manifest_bad=manifest_binary_to_text(a->manifest.data,a->manifest_length,
+					   manifest,&manifest_len);
+
+  // Check the body against the manifest before going any further, in case
+  // a peer sent us bad pieces.  If it is bad, we start over, without
+  // (knowingly) using that peer's pieces.
+  if ((!manifest_bad)&&assembly_verify_body(a,manifest,manifest_len)) {
+    assembly_reject_body(a);
+    return 1;
+  }
+
+  // Tell peer we have the whole thing now.
+  sync_tell_peer_we_have_the_bundle_of_this_partial(peer,i);
+
+  if (!manifest_bad) {      
+    // Hand the bundle over to be imported in the background, so that we
+    // can keep listening to the radio while servald digests it.
+    // saw_bundle_import_result() will be told how it went.
+    insert_result=
+      rhizome_queue_import(manifest,manifest_len,
+			   a->body.data,a->body_length,
+			   peer_prefix,bid,
+			   peer_records[peer]->partials[i].bid_prefix,
+			   peer_records[peer]->partials[i].bundle_version);
+
+    if (debug_bundlelog) {
+      // Write details of bundle to a log file for monitoring
+      // This is used for rhizome velocity experiments.  For that purpose,
+      // we like to know the name of the bundle we are looking for, so we include
+      // it in the message.
+      FILE *bundlelogfile=fopen("bundles_received.log","a");
+      if (bundlelogfile) {
+	char bid[1024];
+	char filename[1024];
+	char message[1024];
+	char filesize[1024];
+	manifest_get_field(manifest,manifest_len,"name",filename);
+	manifest_get_field(manifest,manifest_len,"id",bid);
+	manifest_get_field(manifest,manifest_len,"filesize",filesize);
+	snprintf(message,1024,"T+%lldms:%s:%s:%s:%s\n",
+		 (long long)(gettime_ms()-start_time),
+		 my_sid_hex,bid,filename,filesize);
+	fprintf(bundlelogfile,"%s",message);
+	fclose(bundlelogfile);
+      }
+    }
+
+    // Take note of the bundle, so that we can tell any peer who is trying to
+    // send it to us, that we have recently received it.  This is irrespective
+    // of whether it inserted correctly. The reasoning behind this, is that we
+    // don't want a peer to get stuck sending the same bundle over and over
+    // again.  It is better to send something else, and work through all the
+    // bundles that need sending first. Then after that, if we restart our sync
+    // process periodically, we will catch any straglers. It still isn't perfect,
+    // but it's a start.
+    sync_remember_recently_received_bundle
+      (peer_records[peer]->partials[i].bid_prefix,
+       peer_records[peer]->partials[i].bundle_version);
+
+
+  }
+  if (insert_result)
+    // We couldn't even queue it for import
+    saw_bundle_import_result(peer_prefix,bid,
+			     peer_records[peer]->partials[i].bid_prefix,
+			     peer_records[peer]->partials[i].bundle_version,
+			     insert_result);
+  // Now release this bundle for every peer that was sending it to us.
+  assembly_clear_partials(a);
+
+  return 1;
+}
+
+int saw_piece(char *peer_prefix,int for_me,
+	      char *bid_prefix, unsigned char *bid_prefix_bin,
+	      long long version,
+	      long long piece_offset,int piece_bytes,int is_end_piece,
+	      int is_manifest_piece,unsigned char *piece,
+
+	      char *prefix, char *servald_server, char *credential)
+{
+  int next_byte_would_be_useful=0;
+  int opened_hole=0;
+  
+  int peer=find_peer_by_prefix(peer_prefix);
+  if (peer<0) return -1;
+
+  if (debug_pieces) printf("Saw a piece of BID=%s* from SID=%s*: [%lld..%lld)\n",
+			    bid_prefix,peer_prefix,
+			    piece_offset,piece_offset+piece_bytes);
+
+  int bundle_number;
+  int i=saw_piece_find_partial(peer,peer_prefix,bid_prefix,bid_prefix_bin,
+			       version,&bundle_number);
+  if (i==-2) return 0;
+  if (i<0) return -1;
+  struct partial_bundle *partial=&peer_records[peer]->partials[i];
+  struct bundle_assembly *a=partial->assembly;
+
   int piece_end=piece_offset+piece_bytes;
 
-  // Note stream length if this is an end piece or journal bundle
+  // Note stream length if this is an end piece or journal bundle, but only
+  // keep it once the piece has fitted
+  int manifest_length=a->manifest_length;
+  int body_length=a->body_length;
   if (is_end_piece) {
     if (is_manifest_piece)
-      peer_records[peer]->partials[i].manifest_length=piece_end;
+      manifest_length=piece_end;
     else
-      peer_records[peer]->partials[i].body_length=piece_end;
+      body_length=piece_end;
   }
   if (version<0x100000000LL) {
     // Journal bundle, so body_length = version
-    peer_records[peer]->partials[i].body_length=version;
+    if (version>MAX_REASSEMBLY_LENGTH) return -1;
+    body_length=version;
   }
 
-  if ((bundle_number>-1)
-      &&(!peer_records[peer]->partials[i].body_segments)) {
+  if ((bundle_number>-1)&&(!a->journal_base_failed)
+      &&(!a->body.bytes_received)) {
     // This is a bundle that for which we already have a previous version, and
-    // for which we as yet have no body segments.  So fetch from Rhizome the content
-    // that we do have, and prepopulate the body segment.
-    if (!prime_bundle_cache(bundle_number,my_sid_hex,servald_server,credential)) {
-      struct segment_list *s=calloc(1,sizeof(struct segment_list));
-      assert(s);
-      s->data=malloc(cached_body_len);
-      assert(s->data);
-      bcopy(cached_body,s->data,cached_body_len);
-      s->start_offset=0;
-      s->length=cached_body_len;
-      peer_records[peer]->partials[i].body_segments=s;
+    // for which we as yet have no body bytes.  We only need the new bytes on
+    // the end, so note that we already hold the rest in Rhizome, and tell the
+    // sender, so that it can skip straight to the new bytes.  We only fetch
+    // what we have from Rhizome once the new bytes have all arrived.
+    if (reassembly_set_base(&a->body,bundles[bundle_number].length)) {
       if (debug_pieces)
-	printf("Preloaded %d bytes from old version of journal bundle.\n",
-		cached_body_len);
-    } else {
+	printf("Failed to note the %lld bytes we have of old version of journal bundle.\n",
+	       bundles[bundle_number].length);
+      return -1;
+    }
+    if (debug_pieces)
+      printf("Already have %lld bytes from old version of journal bundle.\n",
+	     bundles[bundle_number].length);
+    sync_schedule_progress_report(peer,i);
+  }
+
+  if (delta_mode&&(version>=0x100000000LL)&&(!a->delta_signatures_seen)
+      &&peer_has_capability(peer_records[peer],LBARD_CAP_DELTA)
+      &&(a->delta_requests<DELTA_MAX_REQUESTS)
+      &&(gettime_ms()>=a->delta_request_time+DELTA_REQUEST_INTERVAL)) {
+    // If we have an older version of this bundle, ask the sender for the
+    // signatures of the blocks of the body, so that we can use whatever
+    // blocks of the old body that haven't changed (see delta.c).
+    int old=lookup_bundle_by_prefix_bin_and_version_or_older(bid_prefix_bin,
+							     version-1);
+    if ((old>-1)&&(bundles[old].length>=DELTA_BLOCK_SIZE)) {
       if (debug_pieces)
-	printf("Failed to preload bytes from old version of journal bundle. XFER will likely fail due to far end thinking it can skip the bytes we already have, so ignoring current piece.\n");
+	printf("Asking for block signatures of %s*/%lld, as we have version %lld.\n",
+	       bid_prefix,version,bundles[old].version);
+      a->delta_requests++;
+      a->delta_request_time=gettime_ms();
+      sync_schedule_delta_request(peer,i);
+    }
+  }
+
+  // Now we have the right assembly, copy the piece into place.
+  struct reassembly_buffer *r=is_manifest_piece?&a->manifest:&a->body;
+  int stream_length=is_manifest_piece?manifest_length:body_length;
+  int new_bytes=reassembly_add(r,stream_length,piece_offset,piece_bytes,piece);
+  if (new_bytes<0) {
+    if (debug_pieces)
+      printf("Piece [%lld..%lld) doesn't fit in %s of length %d: ignoring it.\n",
+	     piece_offset,piece_offset+piece_bytes,
+	     is_manifest_piece?"manifest":"payload",stream_length);
+    return -1;
+  }
+  a->manifest_length=manifest_length;
+  a->body_length=body_length;
+  if (new_bytes) {
+    message_buffer_length+=
+      snprintf(&message_buffer[message_buffer_length],
+	       message_buffer_size-message_buffer_length,
+	       "Received %s",bid_prefix);
+    message_buffer_length+=
+      snprintf(&message_buffer[message_buffer_length],
+	       message_buffer_size-message_buffer_length,
+	       "* version %lld %s segment [%lld,%d)\n",
+	       version,
+	       is_manifest_piece?"manifest":"payload",
+	       piece_offset,piece_end);
+
+    // If the byte after this piece is new to us too, there is no need to tell
+    // the peer to change where they are sending from in the bundle.
+    if (!reassembly_has_byte(r,piece_end)) next_byte_would_be_useful=1;
+
+    // But if we have just missed the piece before this one, tell the peer
+    // straight away, so that it can fill the hole, rather than finding out
+    // only once it has come back around to the start.
+    if ((!is_manifest_piece)&&(piece_offset>0)
+	&&(!reassembly_has_byte(r,piece_offset-1)))
+      opened_hole=1;
+  }
+
+  partial->recent_bytes += piece_bytes;
+  
+  // Check if we have the whole bundle now
+  if (!saw_piece_check_complete(peer,i,peer_prefix,bid_prefix,version,
+				 servald_server,credential))
+    if ((!next_byte_would_be_useful)||opened_hole)
+      sync_schedule_progress_report(peer,i);
+  
+  return 0;
+}
+
+/* A coded symbol of the body of a bundle (see fountain.c).  Symbols from any
+   peer, and whichever peer they were meant for, all go towards decoding the
+   body, along with whatever whole blocks have arrived as ordinary pieces. */
+int saw_coded_piece(char *peer_prefix,int for_me,
+		    char *bid_prefix, unsigned char *bid_prefix_bin,
+		    long long version,int body_length,int symbol,
+		    unsigned char *payload,
+		    char *prefix, char *servald_server, char *credential)
+{
+  int peer=find_peer_by_prefix(peer_prefix);
+  if (peer<0) return -1;
+
+  if (debug_pieces) printf("Saw coded symbol #%d of BID=%s* from SID=%s*\n",
+			   symbol,bid_prefix,peer_prefix);
+
+  int bundle_number;
+  int i=saw_piece_find_partial(peer,peer_prefix,bid_prefix,bid_prefix_bin,
+			       version,&bundle_number);
+  if (i==-2) return 0;
+  if (i<0) return -1;
+  struct bundle_assembly *a=peer_records[peer]->partials[i].assembly;
+
+  if ((body_length<0)||(body_length>MAX_REASSEMBLY_LENGTH)) return -1;
+  if ((a->body_length>=0)&&(a->body_length!=body_length)) return -1;
+  // Coded symbols cover the whole body, so are no use to us if we are only
+  // receiving the end of a journal bundle.
+  if (a->body.base) return 0;
+
+  // Only believe the length once we have somewhere to put the body, and
+  // something to decode it with.
+  if (reassembly_set_size(&a->body,body_length)) return -1;
+  if ((!reassembly_complete(&a->body,body_length))&&(!a->fountain)) {
+    a->fountain=fountain_decoder_new(body_length);
+    if (!a->fountain) return -1;
+  }
+  a->body_length=body_length;
+
+  if (!reassembly_complete(&a->body,a->body_length)) {
+    fountain_add_received_blocks(a->fountain,&a->body);
+    if (fountain_add_symbol(a->fountain,symbol,payload)>0)
+      peer_records[peer]->partials[i].recent_bytes+=FOUNTAIN_BLOCK_SIZE;
+    if (fountain_decoded(a->fountain)) {
+      if (debug_pieces)
+	printf("Decoded body of %s*/%lld from %d coded blocks.\n",
+	       bid_prefix,version,a->fountain->blocks);
+      fountain_recover(a->fountain,&a->body);
+      fountain_decoder_free(a->fountain);
+      a->fountain=NULL;
+    }
+  }
+
+  // The sender only goes back over the manifest if we ask.
+  if (!saw_piece_check_complete(peer,i,peer_prefix,bid_prefix,version,
+				 servald_server,credential))
+    if (!reassembly_complete(&a->manifest,a->manifest_length))
+      sync_schedule_progress_report(peer,i);
+
+  return 0;
+}
+
+/* Match the signatures of blocks first_block onwards against the older body
+   we fetched, and tell the sender what it no longer needs to send us. */
+static int saw_delta_match(int peer,int i,int first_block,int count,
+			   unsigned char *sigs,
+			   char *servald_server,char *credential)
+{
+  struct bundle_assembly *a=peer_records[peer]->partials[i].assembly;
+  int filled=delta_match_blocks(a->delta_old_body,a->delta_old_len,&a->body,
+				a->body_length,first_block,count,sigs);
+  if (filled<0) return -1;
+  if (debug_pieces)
+    printf("Found %d bytes of %s*/%lld in older version.\n",
+	   filled,a->bid_prefix,a->version);
+
+  if (!saw_piece_check_complete(peer,i,peer_records[peer]->sid_prefix,
+				a->bid_prefix,a->version,
+				servald_server,credential))
+    if (filled>0) sync_schedule_progress_report(peer,i);
+  return filled;
+}
+
+/* The body of the older version of a bundle that we have been sent block
+   signatures for has arrived from servald.  This is called from the main loop,
+   not while we are handling a packet.  We keep it for any more signatures,
+   and match the ones that came while we were waiting. */
+static void saw_delta_old_body(void *context,unsigned char *data,int len,
+			       long long offset,long long total_len,
+			       char *servald_server,char *credential)
+{
+  struct bundle_assembly *a=context;
+  a->delta_old_fetching=0;
+  unsigned char *pending=a->delta_pending_sigs;
+  int pending_len=a->delta_pending_len;
+  a->delta_pending_sigs=NULL;
+  a->delta_pending_len=0;
+
+  if ((!data)||offset) {
+    free(data);
+    a->delta_old_failed=1;
+  } else {
+    a->delta_old_body=data;
+    a->delta_old_len=len;
+    int peer,i;
+    for(int ofs=0;ofs<pending_len;) {
+      int first_block=pending[ofs]|(pending[ofs+1]<<8);
+      int count=pending[ofs+2];
+      ofs+=3;
+      if ((!a->body.base)&&(!assembly_find_partial(a,&peer,&i)))
+	saw_delta_match(peer,i,first_block,count,&pending[ofs],
+			servald_server,credential);
+      ofs+=count*DELTA_SIGNATURE_LEN;
+    }
+  }
+  free(pending);
+  assembly_release(a);
+}
+
+/* Signatures of blocks of the body of a bundle, of which we have an older
+   version.  Any blocks of the old body that match go straight into the
+   assembly, so that the sender need only send us the rest.  Like coded
+   symbols, these are of use to us whichever peer asked for them. */
+int saw_delta_signatures(char *peer_prefix,
+			 char *bid_prefix, unsigned char *bid_prefix_bin,
+			 long long version,int body_length,
+			 int first_block,int count,unsigned char *sigs,
+			 char *prefix, char *servald_server, char *credential)
+{
+  int peer=find_peer_by_prefix(peer_prefix);
+  if (peer<0) return -1;
+  if (!delta_mode) return 0;
+
+  if (debug_pieces)
+    printf("Saw signatures of blocks %d..%d of BID=%s* from SID=%s*\n",
+	   first_block,first_block+count-1,bid_prefix,peer_prefix);
+
+  int bundle_number;
+  int i=saw_piece_find_partial(peer,peer_prefix,bid_prefix,bid_prefix_bin,
+			       version,&bundle_number);
+  if (i==-2) return 0;
+  if (i<0) return -1;
+  struct bundle_assembly *a=peer_records[peer]->partials[i].assembly;
+
+  if ((body_length<0)||(body_length>MAX_REASSEMBLY_LENGTH)) return -1;
+  if ((a->body_length>=0)&&(a->body_length!=body_length)) return -1;
+  if (a->body.base) return 0;
+  a->body_length=body_length;
+  a->delta_signatures_seen=1;
+  if (a->delta_old_failed) return -1;
+
+  if (a->delta_old_body)
+    return saw_delta_match(peer,i,first_block,count,sigs,
+			   servald_server,credential)<0?-1:0;
+
+  // We need the whole of the body that we already have to search, which we
+  // fetch once, in the background, rather than hold up the radio.
+  if (!a->delta_old_fetching) {
+    int old=lookup_bundle_by_prefix_bin_and_version_or_older(bid_prefix_bin,
+							     version-1);
+    if ((old<0)||(bundles[old].length>MAX_REASSEMBLY_LENGTH)) {
+      a->delta_old_failed=1;
+      return -1;
+    }
+    // The fetch holds a reference, so that the assembly outlives it
+    assembly_get(a->bid_prefix,a->version);
+    if (bundle_fetch_start(bundles[old].bid_hex,0,0,-1,saw_delta_old_body,a)) {
+      assembly_release(a);
       return -1;
     }
+    a->delta_old_fetching=1;
   }
 
-  // Now we have the right partial, we need to look for the right segment to add this
-  // piece to, if any.
-  struct segment_list **s;
-  if (is_manifest_piece) s=&peer_records[peer]->partials[i].manifest_segments;
-  else s=&peer_records[peer]->partials[i].body_segments;
+  // Keep the signatures until it arrives
+  int bytes=3+count*DELTA_SIGNATURE_LEN;
+  unsigned char *p=realloc(a->delta_pending_sigs,a->delta_pending_len+bytes);
+  if (!p) return -1;
+  a->delta_pending_sigs=p;
+  p=&p[a->delta_pending_len];
+  p[0]=first_block&0xff;
+  p[1]=(first_block>>8)&0xff;
+  p[2]=count;
+  bcopy(sigs,&p[3],count*DELTA_SIGNATURE_LEN);
+  a->delta_pending_len+=bytes;
+  return 0;
+}
 
-  /*
-    The segment lists are maintained in reverse order, since pieces will generally
-    arrive in ascending address order.
-  */
-  int segment_start;
-  int segment_end;
-  while(1) {
-    if (*s) {
-      segment_start=(*s)->start_offset;
-      segment_end=segment_start+(*s)->length;
+/* The manifest of the older version of a bundle that we were sent a manifest
+   delta for has arrived from servald.  This is called from the main loop, not
+   while we are handling a packet. */
+static void saw_manifest_delta_old_manifest(void *context,unsigned char *data,
+					    int len,long long offset,
+					    long long total_len,
+					    char *servald_server,char *credential)
+{
+  struct bundle_assembly *a=context;
+  struct manifest_delta *d=a->manifest_delta;
+  int peer,i;
+  int have_partial=!assembly_find_partial(a,&peer,&i);
+
+  if (d&&(d->old_manifest_len<0)) {
+    if (data&&(len<=sizeof(d->old_manifest))) {
+      bcopy(data,d->old_manifest,len);
+      d->old_manifest_len=len;
+      if (have_partial)
+	saw_piece_check_complete(peer,i,peer_records[peer]->sid_prefix,
+				 a->bid_prefix,a->version,
+				 servald_server,credential);
     } else {
-      segment_start=-1; segment_end=-1;
-    }
-    
-    if ((!(*s))||(segment_end<piece_offset)) {
-      // Create a new segment before the current one
-
-      if (debug_pieces) printf("Inserting piece [%lld..%lld) before [%d..%d)\n",
-		     piece_offset,piece_offset+piece_bytes,
-		     segment_start,segment_end);
-
-      struct segment_list *ns=calloc(1,sizeof(struct segment_list));
-      assert(ns);
-
-      // Link into the list
-      ns->next=*s;
-      if (*s) ns->prev=(*s)->prev; else ns->prev=NULL;
-      if (*s) (*s)->prev=ns;
-      *s=ns;
-
-      // Set start and ends and allocate and copy in piece data
-      ns->start_offset=piece_offset;
-      ns->length=piece_bytes;
-      ns->data=malloc(piece_bytes);
-      bcopy(piece,ns->data,piece_bytes);
-
-      // This is data that is new, and the next byte would also be new, so
-      // no need to tell the peer to change where they are sending from in the bundle.
-      next_byte_would_be_useful=1;
-      
-      break;
-    } else if ((segment_start<=piece_offset)&&(segment_end>=piece_end)) {
-      // Piece fits entirely within a current segment, i.e., is not new data
-      break;
-    } else if (piece_end<segment_start) {
-      // Piece ends before this segment starts, so proceed down the list further.
       if (debug_pieces)
-	printf("Piece [%lld..%lld) comes before [%d..%d)\n",
-		piece_offset,piece_offset+piece_bytes,
-		segment_start,segment_end);
-      
-      s=&(*s)->next;
-    } else {
-      // Segment should abutt or overlap with new piece.
-      // Pieces can be different sizes, so it is possible to extend both directions
-      // at once.
+	printf("Can't fetch old manifest for delta of %s*/%lld.\n",
+	       a->bid_prefix,a->version);
+      // Ask the sender for the whole manifest instead
+      free(d);
+      a->manifest_delta=NULL;
+      if (have_partial) sync_schedule_progress_report(peer,i);
+    }
+  }
+  free(data);
+  assembly_release(a);
+}
 
-      // New piece and existing segment should overlap or adjoin.  Otherwise abort.
-      int piece_start=piece_offset;
-      assert( ((segment_start>=piece_start)&&(segment_start<=piece_end))
-	      ||((segment_end>=piece_start)&&(segment_end<=piece_end))
-	      );      
+int saw_manifest_delta(char *peer_prefix,int for_me,
+		       char *bid_prefix, unsigned char *bid_prefix_bin,
+		       long long version,unsigned char *digest,
+		       unsigned char *delta,int delta_len,
+		       char *prefix, char *servald_server, char *credential)
+{
+  int peer=find_peer_by_prefix(peer_prefix);
+  if (peer<0) return -1;
 
-      {
-	message_buffer_length+=
-	  snprintf(&message_buffer[message_buffer_length],
-		   message_buffer_size-message_buffer_length,
-		   "Received %s",bid_prefix);
-	message_buffer_length+=
-	  snprintf(&message_buffer[message_buffer_length],
-		   message_buffer_size-message_buffer_length,
-		   "* version %lld %s segment [%d,%d)\n",
-		   version,
-		   is_manifest_piece?"manifest":"payload",
-		   piece_start,piece_start+piece_bytes);
-      }
-            
-      if (piece_start<segment_start) {
-	// Need to stick bytes on the start
-	int extra_bytes=segment_start-piece_start;
-	int new_length=(*s)->length+extra_bytes;
-	unsigned char *d=malloc(new_length);
-        assert(d);
-	bcopy(piece,d,extra_bytes);
-	bcopy((*s)->data,&d[extra_bytes],(*s)->length);
-	(*s)->start_offset=piece_start;
-	(*s)->length=new_length;
-	free((*s)->data); (*s)->data=d;
-      }
-      if (piece_end>segment_end) {
-	// Need to sick bytes on the end
-	int extra_bytes=piece_end-segment_end;
-	int new_length=(*s)->length+extra_bytes;
-	(*s)->data=realloc((*s)->data,new_length);
-        assert((*s)->data);
-	bcopy(&piece[piece_bytes-extra_bytes],&(*s)->data[(*s)->length],
-	      extra_bytes);
-	(*s)->length=new_length;
-
-	// We have extended beyond the end, so the next byte is most likely
-	// useful, unless it happens to extend to the start of the next segment.
-	// XXX - We are ignoring that case for now, as worst it will cause only
-	// one wasted packet.  But it would be nice to detect this situation.
-	next_byte_would_be_useful=1;
-      }
-      
-      break;
-    } 
-  }
+  if (debug_pieces) printf("Saw %d byte manifest delta of BID=%s* from SID=%s*\n",
+			   delta_len,bid_prefix,peer_prefix);
 
-  merge_segments(&peer_records[peer]->partials[i].manifest_segments);
-  merge_segments(&peer_records[peer]->partials[i].body_segments);
+  int bundle_number;
+  int i=saw_piece_find_partial(peer,peer_prefix,bid_prefix,bid_prefix_bin,
+			       version,&bundle_number);
+  if (i==-2) return 0;
+  if (i<0) return -1;
+  struct bundle_assembly *a=peer_records[peer]->partials[i].assembly;
 
-  peer_records[peer]->partials[i].recent_bytes += piece_bytes;
-  
-  // Check if we have the whole bundle now
-  // XXX - this breaks when we have nothing about the bundle, because then we think the length is zero, so we think we have it all, when really we have none.
-  if (peer_records[peer]->partials[i].manifest_segments
-      &&peer_records[peer]->partials[i].body_segments
-      &&(!peer_records[peer]->partials[i].manifest_segments->next)
-      &&(!peer_records[peer]->partials[i].body_segments->next)
-      &&(peer_records[peer]->partials[i].manifest_segments->start_offset==0)
-      &&(peer_records[peer]->partials[i].body_segments->start_offset==0)
-      &&(peer_records[peer]->partials[i].manifest_segments->length
-	 ==peer_records[peer]->partials[i].manifest_length)
-      &&(peer_records[peer]->partials[i].body_segments->length
-	 ==peer_records[peer]->partials[i].body_length))
-    {
-      // We have a single segment for body and manifest that span the complete
-      // size.
-      printf(">>> We have the entire bundle %s*/%lld now.\n",
-	     bid_prefix,version);
-
-      // First, reconstitute the manifest from the binary encoded format
-      unsigned char manifest[1024];
-      int manifest_len;
-
-      int insert_result=-999;
-
-      // Tell peer we have the whole thing now.
-      // (next_byte_would_be_useful is asserted so that we don't send two
-      // reports).
-      next_byte_would_be_useful=1;
-      sync_tell_peer_we_have_the_bundle_of_this_partial(peer,i);
-      
-      if (!manifest_binary_to_text
-	  (peer_records[peer]->partials[i].manifest_segments->data,
-	   peer_records[peer]->partials[i].manifest_length,
-	   manifest,&manifest_len)) {      
-	insert_result=
-	  rhizome_update_bundle(manifest,manifest_len,
-				peer_records[peer]->partials[i].body_segments->data,
-				peer_records[peer]->partials[i].body_length,
-				servald_server,credential);
-
-	if (debug_bundlelog) {
-	  // Write details of bundle to a log file for monitoring
-	  // This is used for rhizome velocity experiments.  For that purpose,
-	  // we like to know the name of the bundle we are looking for, so we include
-	  // it in the message.
-	  FILE *bundlelogfile=fopen("bundles_received.log","a");
-	  if (bundlelogfile) {
-	    char bid[1024];
-	    char filename[1024];
-	    char message[1024];
-	    char filesize[1024];
-	    manifest_get_field(manifest,manifest_len,"name",filename);
-	    manifest_get_field(manifest,manifest_len,"id",bid);
-	    manifest_get_field(manifest,manifest_len,"filesize",filesize);
-	    snprintf(message,1024,"T+%lldms:%s:%s:%s:%s\n",
-		     (long long)(gettime_ms()-start_time),
-		     my_sid_hex,bid,filename,filesize);
-	    fprintf(bundlelogfile,"%s",message);
-	    fclose(bundlelogfile);
-	  }
-	}
-	
-	// Take note of the bundle, so that we can tell any peer who is trying to
-	// send it to us, that we have recently received it.  This is irrespective
-	// of whether it inserted correctly. The reasoning behind this, is that we
-	// don't want a peer to get stuck sending the same bundle over and over
-	// again.  It is better to send something else, and work through all the
-	// bundles that need sending first. Then after that, if we restart our sync
-	// process periodically, we will catch any straglers. It still isn't perfect,
-	// but it's a start.
-	sync_remember_recently_received_bundle
-	  (peer_records[peer]->partials[i].bid_prefix,
-	   peer_records[peer]->partials[i].bundle_version);
-					       
-	
-      }
-      if (insert_result) {
-	// Failed to insert, so mark this bundle for deprioritisation, so that we
-	// don't just keep asking for it.
-	char bid[32*2+1];
-	if (!manifest_extract_bid(peer_records[peer]->partials[i].manifest_segments->data,
-				  bid)) {
-#ifdef SYNC_BY_BAR
-	  int bundle=bid_to_peer_bundle_index(peer,bid);
-	  if (peer_records[peer]->insert_failures[bundle]<255)
-	    peer_records[peer]->insert_failures[bundle]++;
-#endif
-	}
-      } else {
-	// Insert succeeded, so clear any failure deprioritisation (although it
-	// shouldn't matter).
-	char bid[32*2+1];
-	if (!manifest_extract_bid(peer_records[peer]->partials[i].manifest_segments->data,
-				  bid)) {
-#ifdef SYNC_BY_BAR
-	  int bundle=bid_to_peer_bundle_index(peer,bid);
-	  peer_records[peer]->insert_failures[bundle]=0;
-#endif
-	}
-	progress_log_bundle_receipt(peer_records[peer]->partials[i].bid_prefix,
-				    peer_records[peer]->partials[i].bundle_version);
-      }
-      // Now release this partial.
-      clear_partial(&peer_records[peer]->partials[i]);
+  if (a->manifest_delta
+      ||((a->manifest_length>0)
+	 &&reassembly_complete(&a->manifest,a->manifest_length)))
+    return 0;
+
+  // We need the manifest of the older version that we have to rebuild it
+  // from, which we fetch in the background, rather than hold up the radio.
+  struct manifest_delta *d=NULL;
+  if ((bundle_number>=0)&&(delta_len<=sizeof(a->manifest_delta->delta)))
+    d=calloc(1,sizeof(struct manifest_delta));
+  if (d) {
+    bcopy(digest,d->digest,MANIFEST_DIGEST_LEN);
+    d->old_manifest_len=-1;
+    bcopy(delta,d->delta,delta_len);
+    d->delta_len=delta_len;
+    // The fetch holds a reference, so that the assembly outlives it
+    assembly_get(a->bid_prefix,a->version);
+    if (bundle_fetch_start(bundles[bundle_number].bid_hex,1,0,-1,
+			   saw_manifest_delta_old_manifest,a)) {
+      assembly_release(a);
+      free(d);
+      d=NULL;
     }
-  else 
-    if (!next_byte_would_be_useful)
-      sync_schedule_progress_report(peer,i);
-  
+  }
+  if (!d) {
+    if (debug_pieces)
+      printf("Can't use manifest delta of %s*/%lld.\n",bid_prefix,version);
+    // Ask the sender for the whole manifest
+    if (for_me) sync_schedule_progress_report(peer,i);
+    return -1;
+  }
+  a->manifest_delta=d;
   return 0;
 }
 
@@ -538,6 +991,14 @@ int saw_message(unsigned char *msg,int len,char *my_sid,
       sync_parse_ack(p,&msg[offset]);
       offset+=15;
       break;
+    case 'a':
+      /* Acknowledgement of progress of bundle transfer, with a list of
+	 the ranges that are still missing */
+      if (len-offset<16) return -3;
+      if (len-offset<(16+msg[offset+15])) return -3;
+      sync_parse_sack(p,&msg[offset]);
+      offset+=16+msg[offset+15];
+      break;
     case 'B':
       offset++;
       if (len-offset<BAR_LENGTH) {
@@ -634,6 +1095,12 @@ int saw_message(unsigned char *msg,int len,char *my_sid,
 	}
       }
       break;
+    case 'C':
+      // Which of the newer message types the peer understands
+      offset++;
+      if (len-offset<1) return -3;
+      p->capabilities=msg[offset++];
+      break;
     case 'L':
       // Length of bundle announcement for receivers
       offset++;
@@ -666,6 +1133,92 @@ int saw_message(unsigned char *msg,int len,char *my_sid,
 
       saw_length(peer_prefix,bid_prefix,version,offset_compound);
       break;
+    case 'l':
+      // Session handle binding, and length of bundle
+      offset++;
+      if (len-offset<(1+8+8+4)) return -3;
+      {
+	int handle=msg[offset++];
+	bid_prefix_bin=&msg[offset];
+	snprintf(bid_prefix,8*2+1,"%02x%02x%02x%02x%02x%02x%02x%02x",
+		 msg[offset+0],msg[offset+1],msg[offset+2],msg[offset+3],
+		 msg[offset+4],msg[offset+5],msg[offset+6],msg[offset+7]);
+	offset+=8;
+	version=0;
+	for(int i=0;i<8;i++) version|=((long long)msg[offset+i])<<(i*8LL);
+	offset+=8;
+	offset_compound=0;
+	for(int i=0;i<4;i++) offset_compound|=((long long)msg[offset+i])<<(i*8LL);
+	offset+=4;
+
+	if (monitor_mode)
+	  {
+	    char sender_prefix[128];
+	    char monitor_log_buf[1024];
+	    sprintf(sender_prefix,"%s*",p->sid_prefix);
+	    snprintf(monitor_log_buf,sizeof(monitor_log_buf),
+		     "Session %d: BID=%s*, version 0x%010llx, length = %d bytes",
+		     handle,bid_prefix,version,offset_compound);
+	    monitor_log(sender_prefix,NULL,monitor_log_buf);
+	  }
+
+	saw_session_binding(peer_prefix,handle,bid_prefix_bin,version);
+	saw_length(peer_prefix,bid_prefix,version,offset_compound);
+      }
+      break;
+    case 'h':
+      // Request to bind a session handle again
+      if (len-offset<4) return -3;
+      if ((my_sid[0]==msg[offset+1])&&(my_sid[1]==msg[offset+2]))
+	sync_parse_session_rebind(p,&msg[offset]);
+      offset+=4;
+      break;
+    case 'J': case 'j': case 'K': case 'k':
+      // Compact piece, naming the bundle by a session handle
+      above_1mb=0;
+      is_end_piece=0;
+      if (!(msg[offset]&0x20)) above_1mb=1;
+      if (!(msg[offset]&0x01)) is_end_piece=1;
+      offset++;
+      if (len-offset<(1+1+4+(above_1mb?2:0))) return -3;
+      {
+	int handle=msg[offset];
+	int check=msg[offset+1];
+	offset+=2;
+	offset_compound=0;
+	for(int i=0;i<(above_1mb?6:4);i++)
+	  offset_compound|=((long long)msg[offset+i])<<(i*8LL);
+	offset+=4;
+	if (above_1mb) offset+=2;
+	piece_offset=(offset_compound&0xfffff)|((offset_compound>>12LL)&0xfff00000LL);
+	piece_bytes=(offset_compound>>20)&0x7ff;
+	piece_is_manifest=offset_compound&0x80000000;
+	if (len-offset<piece_bytes) return -3;
+
+	struct session_binding *b=
+	  p->rx_sessions?&p->rx_sessions[handle]:NULL;
+	if (b&&b->valid&&(b->bid_bin[0]==check)) {
+	  snprintf(bid_prefix,8*2+1,"%02x%02x%02x%02x%02x%02x%02x%02x",
+		   b->bid_bin[0],b->bid_bin[1],b->bid_bin[2],b->bid_bin[3],
+		   b->bid_bin[4],b->bid_bin[5],b->bid_bin[6],b->bid_bin[7]);
+	  saw_piece(peer_prefix,0,
+		    bid_prefix,b->bid_bin,
+		    b->version,piece_offset,piece_bytes,is_end_piece,
+		    piece_is_manifest,&msg[offset],
+		    prefix, servald_server,credential);
+	} else {
+	  // We don't know which bundle this is: ask the sender to tell us again
+	  if (debug_pieces)
+	    printf("Saw piece with unknown session handle %d from %s*\n",
+		   handle,peer_prefix);
+	  int peer=find_peer_by_prefix(peer_prefix);
+	  if ((peer>=0)
+	      &&peer_has_capability(peer_records[peer],LBARD_CAP_SESSIONS))
+	    sync_schedule_session_rebind(peer,handle);
+	}
+      }
+      offset+=piece_bytes;
+      break;
     case 'P': case 'p': case 'Q': case 'q':
       // Skip header character
       above_1mb=0;
@@ -720,6 +1273,119 @@ int saw_message(unsigned char *msg,int len,char *my_sid,
 
       offset+=piece_bytes;
 
+      break;
+    case 'f':
+      // Coded symbol of a bundle body
+      offset++;
+      if (len-offset<(2+8+8+4+2+FOUNTAIN_BLOCK_SIZE)) return -3;
+      if ((my_sid[0]!=msg[offset])||(my_sid[1]!=msg[offset+1])) for_me=0;
+      else for_me=1;
+      offset+=2;
+      bid_prefix_bin=&msg[offset];
+      snprintf(bid_prefix,8*2+1,"%02x%02x%02x%02x%02x%02x%02x%02x",
+	       msg[offset+0],msg[offset+1],msg[offset+2],msg[offset+3],
+	       msg[offset+4],msg[offset+5],msg[offset+6],msg[offset+7]);
+      offset+=8;
+      version=0;
+      for(int i=0;i<8;i++) version|=((long long)msg[offset+i])<<(i*8LL);
+      offset+=8;
+      {
+	int body_length=msg[offset]|(msg[offset+1]<<8)
+	  |(msg[offset+2]<<16)|(msg[offset+3]<<24);
+	offset+=4;
+	int symbol=msg[offset]|(msg[offset+1]<<8);
+	offset+=2;
+
+	if (monitor_mode)
+	  {
+	    char sender_prefix[128];
+	    char monitor_log_buf[1024];
+	    sprintf(sender_prefix,"%s*",p->sid_prefix);
+	    snprintf(monitor_log_buf,sizeof(monitor_log_buf),
+		     "Coded symbol #%d of bundle: BID=%s*, body length %d.",
+		     symbol,bid_prefix,body_length);
+	    monitor_log(sender_prefix,NULL,monitor_log_buf);
+	  }
+
+	saw_coded_piece(peer_prefix,for_me,
+			bid_prefix,bid_prefix_bin,
+			version,body_length,symbol,&msg[offset],
+			prefix,servald_server,credential);
+      }
+      offset+=FOUNTAIN_BLOCK_SIZE;
+      break;
+    case 'D':
+      // Request for signatures of the blocks of the body of a bundle
+      if (len-offset<(1+2+8)) return -3;
+      if ((my_sid[0]==msg[offset+1])&&(my_sid[1]==msg[offset+2]))
+	sync_parse_delta_request(p,&msg[offset]);
+      offset+=1+2+8;
+      break;
+    case 'd':
+      // Signatures of the blocks of the body of a bundle
+      offset++;
+      if (len-offset<(8+8+4+2+1)) return -3;
+      bid_prefix_bin=&msg[offset];
+      snprintf(bid_prefix,8*2+1,"%02x%02x%02x%02x%02x%02x%02x%02x",
+	       msg[offset+0],msg[offset+1],msg[offset+2],msg[offset+3],
+	       msg[offset+4],msg[offset+5],msg[offset+6],msg[offset+7]);
+      offset+=8;
+      version=0;
+      for(int i=0;i<8;i++) version|=((long long)msg[offset+i])<<(i*8LL);
+      offset+=8;
+      {
+	int body_length=msg[offset]|(msg[offset+1]<<8)
+	  |(msg[offset+2]<<16)|(msg[offset+3]<<24);
+	offset+=4;
+	int first_block=msg[offset]|(msg[offset+1]<<8);
+	offset+=2;
+	int count=msg[offset++];
+	if (len-offset<count*DELTA_SIGNATURE_LEN) return -3;
+
+	saw_delta_signatures(peer_prefix,bid_prefix,bid_prefix_bin,
+			     version,body_length,first_block,count,&msg[offset],
+			     prefix,servald_server,credential);
+	offset+=count*DELTA_SIGNATURE_LEN;
+      }
+      break;
+    case 'm':
+      // Fields of a manifest that changed from an older version of the bundle
+      offset++;
+      if (len-offset<(2+8+8+MANIFEST_DIGEST_LEN+1)) return -3;
+      if ((my_sid[0]!=msg[offset])||(my_sid[1]!=msg[offset+1])) for_me=0;
+      else for_me=1;
+      offset+=2;
+      bid_prefix_bin=&msg[offset];
+      snprintf(bid_prefix,8*2+1,"%02x%02x%02x%02x%02x%02x%02x%02x",
+	       msg[offset+0],msg[offset+1],msg[offset+2],msg[offset+3],
+	       msg[offset+4],msg[offset+5],msg[offset+6],msg[offset+7]);
+      offset+=8;
+      version=0;
+      for(int i=0;i<8;i++) version|=((long long)msg[offset+i])<<(i*8LL);
+      offset+=8;
+      {
+	unsigned char *digest=&msg[offset];
+	offset+=MANIFEST_DIGEST_LEN;
+	int delta_len=msg[offset++];
+	if (len-offset<delta_len) return -3;
+
+	if (monitor_mode)
+	  {
+	    char sender_prefix[128];
+	    char monitor_log_buf[1024];
+	    sprintf(sender_prefix,"%s*",p->sid_prefix);
+	    snprintf(monitor_log_buf,sizeof(monitor_log_buf),
+		     "Manifest delta of bundle: BID=%s*, version 0x%010llx, %d bytes.",
+		     bid_prefix,version,delta_len);
+	    monitor_log(sender_prefix,NULL,monitor_log_buf);
+	  }
+
+	saw_manifest_delta(peer_prefix,for_me,
+			   bid_prefix,bid_prefix_bin,
+			   version,digest,&msg[offset],delta_len,
+			   prefix,servald_server,credential);
+	offset+=delta_len;
+      }
       break;
     case 'R':
       // Request for a segment
@@ -808,7 +1474,7 @@ int saw_message(unsigned char *msg,int len,char *my_sid,
 #endif
       }
       break;
-    case 'S':
+    case 'S': case 's':
       // Sync-tree synchronisation message
 
       // process the message
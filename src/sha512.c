@@ -0,0 +1,169 @@
+/* This code is public-domain - it is based on the SHA-512 description
+ * in FIPS 180-4, in the same style as sha1.c.
+ * Rhizome uses SHA-512 of a payload as the filehash in its manifest.
+ */
+// gcc -Wall -DSHA512TEST -o sha512test sha512.c && ./sha512test
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sha512.h"
+
+/* code */
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+#define SHA512_ROR(x,n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+void sha512_init(sha512nfo *s) {
+	s->state[0] = 0x6a09e667f3bcc908ULL;
+	s->state[1] = 0xbb67ae8584caa73bULL;
+	s->state[2] = 0x3c6ef372fe94f82bULL;
+	s->state[3] = 0xa54ff53a5f1d36f1ULL;
+	s->state[4] = 0x510e527fade682d1ULL;
+	s->state[5] = 0x9b05688c2b3e6c1fULL;
+	s->state[6] = 0x1f83d9abfb41bd6bULL;
+	s->state[7] = 0x5be0cd19137e2179ULL;
+	s->byteCount = 0;
+	s->bufferOffset = 0;
+}
+
+static void sha512_hashBlock(sha512nfo *s, const uint8_t *block) {
+	uint64_t w[80];
+	uint64_t a, b, c, d, e, f, g, h;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = 0;
+		for (int j = 0; j < 8; j++)
+			w[i] = (w[i] << 8) | block[i * 8 + j];
+	}
+	for (i = 16; i < 80; i++) {
+		uint64_t s0 = SHA512_ROR(w[i-15], 1) ^ SHA512_ROR(w[i-15], 8) ^ (w[i-15] >> 7);
+		uint64_t s1 = SHA512_ROR(w[i-2], 19) ^ SHA512_ROR(w[i-2], 61) ^ (w[i-2] >> 6);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+
+	a = s->state[0]; b = s->state[1]; c = s->state[2]; d = s->state[3];
+	e = s->state[4]; f = s->state[5]; g = s->state[6]; h = s->state[7];
+	for (i = 0; i < 80; i++) {
+		uint64_t S1 = SHA512_ROR(e, 14) ^ SHA512_ROR(e, 18) ^ SHA512_ROR(e, 41);
+		uint64_t ch = (e & f) ^ (~e & g);
+		uint64_t t1 = h + S1 + ch + sha512_k[i] + w[i];
+		uint64_t S0 = SHA512_ROR(a, 28) ^ SHA512_ROR(a, 34) ^ SHA512_ROR(a, 39);
+		uint64_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint64_t t2 = S0 + maj;
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	s->state[0] += a; s->state[1] += b; s->state[2] += c; s->state[3] += d;
+	s->state[4] += e; s->state[5] += f; s->state[6] += g; s->state[7] += h;
+}
+
+void sha512_write(sha512nfo *s, const uint8_t *data, size_t len) {
+	s->byteCount += len;
+	// Top up a partly filled buffer first
+	while (len && s->bufferOffset) {
+		s->buffer[s->bufferOffset++] = *data++;
+		len--;
+		if (s->bufferOffset == SHA512_BLOCK_LENGTH) {
+			sha512_hashBlock(s, s->buffer);
+			s->bufferOffset = 0;
+		}
+	}
+	// Then hash whole blocks straight from the caller's data
+	while (len >= SHA512_BLOCK_LENGTH) {
+		sha512_hashBlock(s, data);
+		data += SHA512_BLOCK_LENGTH;
+		len -= SHA512_BLOCK_LENGTH;
+	}
+	// Keep any tail for next time (the buffer is empty if there is one)
+	if (len) {
+		memcpy(s->buffer, data, len);
+		s->bufferOffset = len;
+	}
+}
+
+uint8_t* sha512_result(sha512nfo *s) {
+	uint64_t bits = s->byteCount << 3;
+	int i;
+
+	// Pad to complete the last block, leaving 16 bytes for the length
+	s->buffer[s->bufferOffset++] = 0x80;
+	if (s->bufferOffset > SHA512_BLOCK_LENGTH - 16) {
+		memset(&s->buffer[s->bufferOffset], 0, SHA512_BLOCK_LENGTH - s->bufferOffset);
+		sha512_hashBlock(s, s->buffer);
+		s->bufferOffset = 0;
+	}
+	memset(&s->buffer[s->bufferOffset], 0, SHA512_BLOCK_LENGTH - 8 - s->bufferOffset);
+	// We never hash 2^64 bytes, so the top half of the length is zero
+	for (i = 0; i < 8; i++)
+		s->buffer[SHA512_BLOCK_LENGTH - 1 - i] = bits >> (i * 8);
+	sha512_hashBlock(s, s->buffer);
+
+	// Return state as big-endian bytes
+	for (i = 0; i < SHA512_HASH_LENGTH; i++)
+		s->hash[i] = s->state[i >> 3] >> (56 - (i & 7) * 8);
+	return s->hash;
+}
+
+#ifdef SHA512TEST
+#include <stdio.h>
+
+static void printHash(uint8_t* hash) {
+	int i;
+	for (i=0; i<SHA512_HASH_LENGTH; i++) {
+		printf("%02x", hash[i]);
+	}
+	printf("\n");
+}
+
+int main (int argc, char **argv) {
+	sha512nfo s;
+
+	// SHA tests
+	printf("Test: FIPS 180-2 C.1 and RFC3174 7.3 TEST1\n");
+	printf("Expect:ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f\n");
+	printf("Result:");
+	sha512_init(&s);
+	sha512_write(&s, (const uint8_t *)"abc", 3);
+	printHash(sha512_result(&s));
+	printf("\n\n");
+
+	printf("Test: Empty string\n");
+	printf("Expect:cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce47d0d13c5d85f2b0ff8318d2877eec2f63b931bd47417a81a538327af927da3e\n");
+	printf("Result:");
+	sha512_init(&s);
+	printHash(sha512_result(&s));
+	printf("\n\n");
+
+	printf("Test: 1,000,000 x 'a'\n");
+	printf("Expect:e718483d0ce769644e2e42c7bc15b4638e1f98b13b2044285632a803afa973ebde0ff244877ea60a4cb0432ce577c31beb009c5c2c49aa2e4eadb217ad8cc09b\n");
+	printf("Result:");
+	sha512_init(&s);
+	for (int i=0; i<1000000; i++) sha512_write(&s, (const uint8_t *)"a", 1);
+	printHash(sha512_result(&s));
+
+	return 0;
+}
+#endif /* SHA512TEST */
@@ -0,0 +1,24 @@
+/* header */
+
+#define SHA512_HASH_LENGTH 64
+#define SHA512_BLOCK_LENGTH 128
+
+typedef struct sha512nfo {
+        uint64_t state[SHA512_HASH_LENGTH/8];
+        uint64_t byteCount;
+        uint8_t buffer[SHA512_BLOCK_LENGTH];
+        uint8_t bufferOffset;
+        uint8_t hash[SHA512_HASH_LENGTH];
+} sha512nfo;
+
+/* public API - prototypes */
+
+/**
+ */
+void sha512_init(sha512nfo *s);
+/**
+ */
+void sha512_write(sha512nfo *s, const uint8_t *data, size_t len);
+/**
+ */
+uint8_t* sha512_result(sha512nfo *s);
@@ -84,8 +84,9 @@ int status_dump()
   fprintf(f,"<HTML>\n<HEAD>lbard version %s status dump @ T=%lldms</head><body>\n",
 	  VERSION_STRING,gettime_ms());
   
-  struct b order[bundle_count];
+  struct b *order=malloc(sizeof(struct b)*(bundle_count+1));
   int i,n;
+  if (!order) { fclose(f); return -1; }
   
   for (i=0;i<bundle_count;i++) {
     order[i].order=i;
@@ -106,6 +107,24 @@ int status_dump()
 	    bundles[i].num_peers_that_dont_have_it);
   }
   fprintf(f,"</table>\n");
+  free(order);
+  fprintf(f,"<p>Bundle list uses %lld bytes (%d bytes per bundle).</p>\n",
+	  bundle_store_memory_usage(),(int)sizeof(struct bundle_record));
+  size_t sync_in_use,sync_allocated;
+  sync_node_memory(sync_state,&sync_in_use,&sync_allocated);
+  fprintf(f,"<p>Sync tree nodes use %lld bytes (%lld bytes allocated).</p>\n",
+	  (long long)sync_in_use,(long long)sync_allocated);
+  fprintf(f,"<p>Bundle cache holds %lld bytes (budget %lld bytes): %lld hits, %lld misses, %lld evictions.</p>\n",
+	  bundle_cache_memory_usage(),bundle_cache_budget,
+	  bundle_cache_hits,bundle_cache_misses,bundle_cache_evictions);
+  fprintf(f,"<p>Servald HTTP connections: %d opened, %d reused.</p>\n",
+	  http_connections_opened,http_connections_reused);
+  fprintf(f,"<p>Rhizome imports: %d waiting, %d done, %d failed.</p>\n",
+	  rhizome_import_count,rhizome_imports_done,rhizome_imports_failed);
+  fprintf(f,"<p>Bundles being received: %d (%d bodies failed filehash verification).</p>\n",
+	  assembly_count,assembly_verify_failures);
+  fprintf(f,"<p>Manifest bytes resent after the receiver acknowledged all of the manifest: %lld.</p>\n",
+	  manifest_bytes_after_sack);
   fflush(f);
 
   fprintf(f,"<h2>Peer list</h2>\n<table border=1 padding=2 spacing=2><tr><th>Time since last message</th></tr>\n");
@@ -7,6 +7,27 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+
+#ifdef SYNC_ALT
+// A second copy of this code, built with a different PREFIX_STEP_BITS, so that
+// the test program can check that peers with different tree fan-outs interoperate.
+#define sync_alloc_state alt_sync_alloc_state
+#define sync_free_state alt_sync_free_state
+#define sync_free_peer_state alt_sync_free_peer_state
+#define sync_node_memory alt_sync_node_memory
+#define sync_add_key alt_sync_add_key
+#define sync_add_keys alt_sync_add_keys
+#define sync_key_exists alt_sync_key_exists
+#define sync_has_transmit_queued alt_sync_has_transmit_queued
+#define sync_peer_missing_keys alt_sync_peer_missing_keys
+#define sync_cursor_reset alt_sync_cursor_reset
+#define sync_build_message alt_sync_build_message
+#define sync_build_fixed_message alt_sync_build_fixed_message
+#define sync_recv_message alt_sync_recv_message
+#define sync_recv_fixed_message alt_sync_recv_fixed_message
+#define sync_tree_stats alt_sync_tree_stats
+#endif
 
 #include "sync.h"
 
@@ -29,9 +50,48 @@ static void *allocate(size_t length){
 
 #define KEY_LEN_BITS (KEY_LEN<<3)
 
-// Note PREFIX_STEP_BITS >1 hasn't been tested yet
+// Keys are handled as 64 bit words, with the leading bits of the key in the
+// most significant bits of the word.
+#if KEY_LEN != 8
+#error KEY_LEN must be 8
+#endif
+
+static inline uint64_t key_word(const sync_key_t *key)
+{
+  uint64_t word;
+  memcpy(&word, key->key, KEY_LEN);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+static inline void set_key_word(sync_key_t *key, uint64_t word)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  memcpy(key->key, &word, KEY_LEN);
+}
+
+// mask of the leading len bits of a key word
+static uint64_t prefix_mask(unsigned len)
+{
+  if (len >= KEY_LEN_BITS)
+    return ~0ULL;
+  return len ? ~0ULL << (KEY_LEN_BITS - len) : 0;
+}
+
+// return true if two keys have the same bits from offset up to (but not including) end
+static int key_bits_match(const sync_key_t *a, const sync_key_t *b, unsigned offset, unsigned end)
+{
+  return ((key_word(a) ^ key_word(b)) & prefix_mask(end) & ~prefix_mask(offset)) == 0;
+}
+
 #define NODE_CHILDREN (1<<PREFIX_STEP_BITS)
 #define INTERESTING_COUNT 16
+// Number of region summaries we track per peer
+#define MAX_REGION_REQUESTS 64
 
 typedef struct {
   uint8_t min_prefix_len:7;
@@ -41,7 +101,23 @@ typedef struct {
 }key_message_t;
 
 #define MESSAGE_FROM_KEY(K) {.key=*K, .prefix_len=KEY_LEN_BITS}
-#define MESSAGE_BYTES (KEY_LEN +2)
+// Older peers send each message as two header bytes and the key
+#define FIXED_MESSAGE_BYTES (KEY_LEN +2)
+
+/* Messages are now bit-packed, most significant bit first, and padded to a whole byte
+   at the end of the packet;
+     stored:1, leaf:1
+     leaf nodes: min_prefix_len:7
+     other nodes: prefix_len:6, min_prefix_len is the same:1, [min_prefix_len:6]
+     key:64
+   The prefix bits of the key can't be left out as implied, as a message doesn't otherwise
+   say where in the tree it belongs. Leaving out the leading bits that the message before
+   has too (saying how many takes 7 bits) made them longer in synctest, 73.4 bits on
+   average rather than 73.2, as messages queued together seldom share more than a few.
+*/
+#define LEAF_MESSAGE_BITS (2+7+KEY_LEN_BITS)
+#define NODE_MESSAGE_BITS (2+6+1+KEY_LEN_BITS)
+#define MIN_MESSAGE_BITS MIN_VAL(LEAF_MESSAGE_BITS, NODE_MESSAGE_BITS)
 
 // definitions for how we track the state of a set of keys
 
@@ -50,22 +126,69 @@ typedef struct {
 #define QUEUED 2
 #define DONT_SEND 3
 
+// Each peer is given one bit of a queued node's wanted_by mask, so that we can
+// share the space in each message fairly between the peers that need records.
+// With more peers than this, some peers share a bit.
+#define SYNC_PEER_SLOTS 32
+
 struct node{
   struct node *transmit_next;
   struct node *transmit_prev;
   key_message_t message;
   uint8_t send_state;
   uint8_t sent_count;
+  // which peer slots this node was queued for, while it is in the transmit loop
+  uint32_t wanted_by;
   void *context;
   struct node *children[NODE_CHILDREN];
 };
 
+// Nodes are allocated from slabs rather than individually, so that building and
+// discarding trees doesn't fragment the heap. Each tree (ours, and one per peer) has
+// its own arena, so that a whole peer tree can be discarded at once.
+// Slabs are aligned to their size, so that we can find the slab, and so the arena,
+// that a node belongs to from its address.
+#if PREFIX_STEP_BITS == 8
+#define SLAB_BYTES 65536
+#else
+#define SLAB_BYTES 4096
+#endif
+#define NODES_PER_SLAB ((SLAB_BYTES - 2*sizeof(void *))/sizeof(struct node))
+// Number of empty slabs we keep around for reuse, before returning them to the heap.
+#define MAX_SPARE_SLABS 16
+
+struct node_slab{
+  struct node_slab *next;
+  struct node_arena *arena;
+  struct node nodes[NODES_PER_SLAB];
+};
+
+#define SLAB_OF(NODE) ((struct node_slab *)((uintptr_t)(NODE) & ~(uintptr_t)(SLAB_BYTES-1)))
+
+struct node_arena{
+  struct node_slab *slabs;
+  struct node_slab *last_slab;
+  unsigned slab_count;
+  // number of nodes handed out from the first slab
+  unsigned slab_used;
+  struct node *free_list;
+  unsigned nodes_in_use;
+  // number of our nodes in the transmit loop
+  unsigned queued;
+};
+
 struct sync_peer_state{
   struct sync_peer_state *next;
   void *peer_context;
   unsigned send_count;
   unsigned recv_count;
+  struct node_arena arena;
   struct node *root;
+  // summaries of parts of the keyspace that don't line up with our tree nodes,
+  // that we have queued for this peer, linked via children[0]
+  struct node *requests;
+  unsigned request_count;
+  uint8_t slot;
 };
 
 struct sync_state{
@@ -81,53 +204,154 @@ struct sync_state{
   unsigned received_uninteresting;
   unsigned progress;
   struct sync_peer_state *peers;
+  struct node_arena arena;
   struct node *root;
   struct node *transmit_ptr;
+  // number of nodes in the transmit loop wanted by each peer slot
+  unsigned slot_queued[SYNC_PEER_SLOTS];
+  struct node_slab *spare_slabs;
+  unsigned spare_slab_count;
+  unsigned slab_count;
 };
 
+static struct node *alloc_node(struct sync_state *state, struct node_arena *arena)
+{
+  struct node *node;
+  if (arena->free_list){
+    node = arena->free_list;
+    arena->free_list = node->children[0];
+  }else{
+    if (!arena->slabs || arena->slab_used == NODES_PER_SLAB){
+      struct node_slab *slab = state->spare_slabs;
+      if (slab){
+	state->spare_slabs = slab->next;
+	state->spare_slab_count--;
+      }else{
+	void *mem = NULL;
+	int r = posix_memalign(&mem, SLAB_BYTES, SLAB_BYTES);
+	assert(r==0 && mem);
+	slab = mem;
+	state->slab_count++;
+      }
+      slab->arena = arena;
+      slab->next = arena->slabs;
+      arena->slabs = slab;
+      arena->slab_count++;
+      if (!arena->last_slab)
+	arena->last_slab = slab;
+      arena->slab_used = 0;
+    }
+    node = &arena->slabs->nodes[arena->slab_used++];
+  }
+  bzero(node, sizeof(struct node));
+  arena->nodes_in_use++;
+  return node;
+}
+
+// This node has just left the transmit loop, forget which peers wanted it
+static void left_transmit_loop(struct sync_state *state, struct node *node)
+{
+  SLAB_OF(node)->arena->queued--;
+  for (unsigned i=0;node->wanted_by;i++){
+    if (node->wanted_by & (1u<<i)){
+      node->wanted_by &= ~(1u<<i);
+      state->slot_queued[i]--;
+    }
+  }
+}
+
+// Remove this node from the transmit loop
+static void unlink_node(struct sync_state *state, struct node *node)
+{
+  if (!node->transmit_next)
+    return;
+  assert(node->transmit_prev);
+  left_transmit_loop(state, node);
+  
+  if (node->transmit_next == node){
+    assert(node->transmit_prev==node);
+    state->transmit_ptr = NULL;
+  }else{
+    if (state->transmit_ptr == node)
+      state->transmit_ptr = node->transmit_prev;
+    node->transmit_next->transmit_prev = node->transmit_prev;
+    node->transmit_prev->transmit_next = node->transmit_next;
+  }
+  node->transmit_next = NULL;
+  node->transmit_prev = NULL;
+}
+
+// Release all nodes in this arena at once, keeping the slabs for reuse.
+static void drop_arena(struct sync_state *state, struct node_arena *arena)
+{
+  if (!arena->slabs)
+    return;
+  
+  // Any of these nodes that are waiting to be sent must leave the transmit loop first
+  struct node *node = state->transmit_ptr;
+  while(arena->queued){
+    struct node *next = node->transmit_next;
+    if (SLAB_OF(node)->arena == arena)
+      unlink_node(state, node);
+    node = next;
+  }
+  
+  arena->last_slab->next = state->spare_slabs;
+  state->spare_slabs = arena->slabs;
+  state->spare_slab_count += arena->slab_count;
+  while(state->spare_slab_count > MAX_SPARE_SLABS){
+    struct node_slab *slab = state->spare_slabs;
+    state->spare_slabs = slab->next;
+    state->spare_slab_count--;
+    state->slab_count--;
+    free(slab);
+  }
+  bzero(arena, sizeof(struct node_arena));
+}
+
 
 
 // XOR the source key into the destination key
 // the leading prefix_len bits of the source key will be copied, the remaining bits will be XOR'd
 static void sync_xor(const sync_key_t *src_key, key_message_t *dest_key)
 {
-  unsigned i=0;
-  
   assert(dest_key->prefix_len < KEY_LEN_BITS);
   
-  // Assign whole prefix bytes
-  for(;i<(dest_key->prefix_len>>3);i++)
-    dest_key->key.key[i] = src_key->key[i];
-    
-  if (dest_key->prefix_len&7){
-    // Mix assignment and xor for the byte of overlap
-    uint8_t mask = (0xFF00>>(dest_key->prefix_len&7)) & 0xFF;
-    dest_key->key.key[i] = (mask & src_key->key[i]) | (dest_key->key.key[i] ^ src_key->key[i]);
-    i++;
-  }
-  
-  // Xor whole remaining bytes
-  for (;i<KEY_LEN;i++)
-    dest_key->key.key[i] ^= src_key->key[i];
+  uint64_t mask = prefix_mask(dest_key->prefix_len);
+  uint64_t src = key_word(src_key);
+  set_key_word(&dest_key->key, (src & mask) | ((key_word(&dest_key->key) ^ src) & ~mask));
 }
 
 #define sync_xor_node(N,K) sync_xor((K), &(N)->message)
 
-// return len bits from the key, starting at offset
-static uint8_t sync_get_bits(uint8_t offset, uint8_t len, const sync_key_t *key)
+// return len bits from a key word, starting at offset
+static uint8_t word_get_bits(uint8_t offset, uint8_t len, uint64_t word)
 {
-  assert(len <= 8);
-  assert(offset+len < KEY_LEN_BITS);
-  unsigned start_byte = (offset>>3);
-  uint16_t context = key->key[start_byte] <<8;
-  if (start_byte+1 < KEY_LEN)
-    context |= key->key[start_byte+1];
-  return (context >> (16 - (offset & 7) - len)) & ((1<<len) -1);
+  assert(len > 0 && len <= 8);
+  assert(offset+len <= KEY_LEN_BITS);
+  return (word << offset) >> (KEY_LEN_BITS - len);
 }
 
+#define sync_get_bits(OFFSET,LEN,KEY) word_get_bits((OFFSET), (LEN), key_word(KEY))
+
 #define MIN_VAL(X,Y) ((X)<(Y)?(X):(Y))
 #define MAX_VAL(X,Y) ((X)<(Y)?(Y):(X))
 
+// return the number of leading bits (up to len) that two keys have in common
+static uint8_t common_prefix_bits(const sync_key_t *a, const sync_key_t *b, uint8_t len)
+{
+  uint64_t diff = key_word(a) ^ key_word(b);
+  if (!diff)
+    return len;
+  return MIN_VAL((unsigned)__builtin_clzll(diff), len);
+}
+
+// zero the bits of a message that follow the prefix
+static void clear_xor_bits(key_message_t *message)
+{
+  set_key_word(&message->key, key_word(&message->key) & prefix_mask(message->prefix_len));
+}
+
 // Compare two keys, returning zero if they represent the same set of leaf nodes.
 static int cmp_message(const key_message_t *first, const key_message_t *second)
 {
@@ -135,23 +359,18 @@ static int cmp_message(const key_message_t *first, const key_message_t *second)
   uint8_t first_xor_begin = (first->prefix_len == KEY_LEN_BITS)?first->min_prefix_len:first->prefix_len;
   uint8_t second_xor_begin = (second->prefix_len == KEY_LEN_BITS)?second->min_prefix_len:second->prefix_len;
   uint8_t xor_begin_offset = MAX_VAL(first_xor_begin, second_xor_begin);
-  int ret=0;
+  uint64_t first_word = key_word(&first->key);
+  uint64_t second_word = key_word(&second->key);
   
-  // TODO at least we can compare before common_prefix_len and after xor_begin_offset
-  // But we aren't comparing the bits in the middle
-      
+  // TODO we aren't comparing the bits between common_prefix_len and xor_begin_offset
   if (common_prefix_len < xor_begin_offset){
-    if (common_prefix_len>=8 && memcmp(&first->key, &second->key, common_prefix_len>>3)!=0)
-      ret = -1;
-    else{
-      uint8_t xor_begin_byte = (xor_begin_offset+7)>>3;
-      if (xor_begin_byte < KEY_LEN && memcmp(&first->key.key[xor_begin_byte], &second->key.key[xor_begin_byte], KEY_LEN - xor_begin_byte)!=0)
-	ret = -1;
-    }
-  }else{
-    ret = memcmp(&first->key, &second->key, KEY_LEN);
+    // compare whole bytes of the common prefix, and of the xor'd bits
+    uint64_t mask = prefix_mask(common_prefix_len & ~7) | ~prefix_mask((xor_begin_offset+7) & ~7);
+    return ((first_word ^ second_word) & mask) ? -1 : 0;
   }
-  return ret;
+  if (first_word == second_word)
+    return 0;
+  return first_word < second_word ? -1 : 1;
 }
 
 // XOR all existing children of *node, into this destination key.
@@ -168,7 +387,7 @@ static void xor_children(struct node *node, key_message_t *dest)
 }
 
 // Add a new key into the state tree, XOR'ing the key into each parent node
-static struct node *add_key(struct node **root, const sync_key_t *key, void *context, uint8_t stored)
+static struct node *add_key(struct sync_state *state, struct node_arena *arena, struct node **root, const sync_key_t *key, void *context, uint8_t stored)
 {
   uint8_t prefix_len = 0;
   struct node **node = root;
@@ -195,16 +414,18 @@ static struct node *add_key(struct node **root, const sync_key_t *key, void *con
     }
     
     // this node represents a range of prefix bits
-    uint8_t node_child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &(*node)->message.key);
-    
-    // if the prefix matches the key, keep searching.
-    if (child_index == node_child_index){
-      prefix_len += PREFIX_STEP_BITS;
+    // if the whole range matches the key, keep searching.
+    uint8_t common = common_prefix_bits(&(*node)->message.key, key, (*node)->message.prefix_len);
+    if (common >= (*node)->message.prefix_len){
+      prefix_len = (*node)->message.prefix_len;
       continue;
     }
+    prefix_len = common - common % PREFIX_STEP_BITS;
+    child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, key);
+    uint8_t node_child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &(*node)->message.key);
     
     // if there is a mismatch in the range of prefix bits, we need to create a new node to represent the new range.
-    struct node *parent = allocate(sizeof(struct node));
+    struct node *parent = alloc_node(state, arena);
     parent->message.min_prefix_len = min_prefix_len;
     parent->message.prefix_len = prefix_len;
     parent->message.stored = stored;
@@ -222,7 +443,7 @@ static struct node *add_key(struct node **root, const sync_key_t *key, void *con
     *node = parent;
   }
   // create final leaf node
-  *node = allocate(sizeof(struct node));
+  *node = alloc_node(state, arena);
   (*node)->message.key = *key;
   (*node)->message.min_prefix_len = min_prefix_len;
   (*node)->message.prefix_len = KEY_LEN_BITS;
@@ -231,34 +452,23 @@ static struct node *add_key(struct node **root, const sync_key_t *key, void *con
   return (*node);
 }
 
-// Recursively free the memory used by this tree
-static void free_node(struct sync_state *state, struct node *node)
+// Return a single node to the free list of its arena
+static void release_node(struct sync_state *state, struct node_arena *arena, struct node *node)
 {
   if (!node)
     return;
   
-  for (unsigned i=0;i<NODE_CHILDREN;i++)
-    free_node(state, node->children[i]);
-  
   if (node->transmit_next){
     assert(state);
-    assert(node->transmit_prev);
-    
-    if (node->transmit_next == node){
-      assert(node->transmit_prev==node);
-      state->transmit_ptr = NULL;
-    }else{
-      if (state->transmit_ptr == node)
-	state->transmit_ptr = node->transmit_prev;
-      node->transmit_next->transmit_prev = node->transmit_prev;
-      node->transmit_prev->transmit_next = node->transmit_next;
-    }
+    unlink_node(state, node);
   }
   
-  free(node);
+  node->children[0] = arena->free_list;
+  arena->free_list = node;
+  arena->nodes_in_use--;
 }
 
-static void remove_key(struct sync_state *state, struct node **root, const sync_key_t *key)
+static void remove_key(struct sync_state *state, struct node_arena *arena, struct node **root, const sync_key_t *key)
 {
   uint8_t prefix_len = 0;
   struct node **node = root;
@@ -269,9 +479,8 @@ static void remove_key(struct sync_state *state, struct node **root, const sync_
     
     // this node represents a range of prefix bits
     if (prefix_len < (*node)->message.prefix_len){
-      uint8_t node_child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &(*node)->message.key);
-      assert(child_index == node_child_index);
-      prefix_len += PREFIX_STEP_BITS;
+      assert(key_bits_match(key, &(*node)->message.key, prefix_len, (*node)->message.prefix_len));
+      prefix_len = (*node)->message.prefix_len;
       continue;
     }
     
@@ -290,7 +499,7 @@ static void remove_key(struct sync_state *state, struct node **root, const sync_
     prefix_len += PREFIX_STEP_BITS;
   }
   
-  free_node(state, (*node));
+  release_node(state, arena, (*node));
   *node = NULL;
   
   if (!parent)
@@ -313,7 +522,7 @@ static void remove_key(struct sync_state *state, struct node **root, const sync_
   *node = NULL;
   c->message.min_prefix_len = (*parent)->message.min_prefix_len;
   
-  free_node(state, *parent);
+  release_node(state, arena, *parent);
   
   *parent = c;
 }
@@ -331,18 +540,16 @@ static const struct node * find_message(const struct node *node, const key_messa
     if (node->message.prefix_len == KEY_LEN_BITS)
       return NULL;
     
-    uint8_t child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &message->key);
-    
+    // skip the range of prefix bits this node represents in one hit
     if (prefix_len < node->message.prefix_len){
-      // TODO optimise this case by comparing all possible prefix bits in one hit
-      uint8_t node_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &node->message.key);
-      if (node_index != child_index)
-	return NULL;
-    }else{
-      node = node->children[child_index];
-      if (!node)
+      if (!key_bits_match(&message->key, &node->message.key, prefix_len, node->message.prefix_len))
 	return NULL;
+      prefix_len = node->message.prefix_len;
     }
+    
+    node = node->children[sync_get_bits(prefix_len, PREFIX_STEP_BITS, &message->key)];
+    if (!node)
+      return NULL;
     prefix_len+=PREFIX_STEP_BITS;
   }
 }
@@ -358,13 +565,67 @@ int sync_has_transmit_queued(const struct sync_state *state)
   return state->transmit_ptr?1:0;
 }
 
+// collect up to max keys below this peer node that the peer lacks, from the key "from" onwards
+static void peer_collect_missing(const struct node *node, uint64_t from, sync_key_t *keys, void **key_contexts,
+				 unsigned max, unsigned *count)
+{
+  if (!node || *count >= max)
+    return;
+  
+  // skip this whole part of the tree if it is all before where we are up to
+  uint64_t word = key_word(&node->message.key);
+  if ((word | ~prefix_mask(node->message.prefix_len)) < from)
+    return;
+  
+  if (node->message.prefix_len == KEY_LEN_BITS){
+    // stored peer keys are the ones we know they need
+    if (node->message.stored){
+      keys[*count] = node->message.key;
+      if (key_contexts)
+	key_contexts[*count] = node->context;
+      (*count)++;
+    }
+    return;
+  }
+  for (unsigned i=0;i<NODE_CHILDREN;i++)
+    peer_collect_missing(node->children[i], from, keys, key_contexts, max, count);
+}
+
+unsigned sync_peer_missing_keys(const struct sync_state *state, void *peer_context, sync_cursor_t *cursor,
+				sync_key_t *keys, void **key_contexts, unsigned max)
+{
+  if (cursor->finished || !max)
+    return 0;
+  
+  const struct sync_peer_state *peer_state = state->peers;
+  while(peer_state && peer_state->peer_context != peer_context)
+    peer_state = peer_state->next;
+  
+  unsigned count=0;
+  if (peer_state)
+    peer_collect_missing(peer_state->root, key_word(&cursor->next), keys, key_contexts, max, &count);
+  
+  // carry on from just after the last key next time
+  uint64_t last = count ? key_word(&keys[count-1]) : 0;
+  if (count < max || last == ~0ULL)
+    cursor->finished = 1;
+  else
+    set_key_word(&cursor->next, last+1);
+  return count;
+}
+
+void sync_cursor_reset(sync_cursor_t *cursor)
+{
+  bzero(cursor, sizeof(sync_cursor_t));
+}
+
 // returns NULL if the node already exists
-static struct node * add_key_if_missing(struct node **root, const key_message_t *message, uint8_t stored)
+static struct node * add_key_if_missing(struct sync_state *state, struct node_arena *arena, struct node **root, const key_message_t *message, uint8_t stored)
 {
   assert(message->prefix_len == KEY_LEN_BITS);
   if (find_message(*root, message)!=NULL)
     return NULL;
-  return add_key(root, &message->key, NULL, stored);
+  return add_key(state, arena, root, &message->key, NULL, stored);
 }
 
 void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context)
@@ -379,31 +640,318 @@ void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context
   
   state->key_count++;
   state->progress=0;
-  add_key(&state->root, key, context, 1);
+  add_key(state, &state->arena, &state->root, key, context, 1);
   
   struct sync_peer_state *peer_state = state->peers;
   while(peer_state){
     if (find_message(peer_state->root, &message)){
-      remove_key(state, &peer_state->root, key);
+      remove_key(state, &peer_state->arena, &peer_state->root, key);
       peer_state->recv_count--;
     }
     peer_state = peer_state->next;
   }
 }
 
+/* Adding many keys at once (e.g. the whole bundle list at start up).
+   The new keys are sorted, so that each group of keys that goes below one node of
+   our tree is a contiguous range, and each node is XOR'd with the whole range at
+   once, rather than once per key. Any part of the tree that is entirely new is
+   built bottom-up.
+*/
+struct key_entry{
+  uint64_t word;
+  const sync_key_t *key;
+  void *context;
+};
+
+// sort entries by key, a byte at a time, keeping entries with the same key in
+// the order they were given
+static void sort_key_entries(struct key_entry *entries, unsigned count)
+{
+  struct key_entry *temp = allocate(sizeof(struct key_entry)*count);
+  struct key_entry *from = entries, *to = temp;
+  for (unsigned shift=0;shift<KEY_LEN_BITS;shift+=8){
+    unsigned offsets[257];
+    bzero(offsets, sizeof offsets);
+    for (unsigned i=0;i<count;i++)
+      offsets[((from[i].word>>shift)&0xFF)+1]++;
+    // nothing to do if every key has the same byte here
+    if (offsets[((from[0].word>>shift)&0xFF)+1] == count)
+      continue;
+    for (unsigned b=0;b<256;b++)
+      offsets[b+1]+=offsets[b];
+    for (unsigned i=0;i<count;i++)
+      to[offsets[(from[i].word>>shift)&0xFF]++] = from[i];
+    struct key_entry *swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != entries)
+    memcpy(entries, from, sizeof(struct key_entry)*count);
+  free(temp);
+}
+
+// XOR of all the keys in entries [lo, hi), given the running XOR of the entries
+#define RANGE_XOR(XORS,LO,HI) ((XORS)[HI] ^ (XORS)[LO])
+
+// entries [lo, hi) are sorted and share their leading prefix_len bits, so all of
+// those that go below the same child as entries[lo] come first
+static unsigned child_range_end(const struct key_entry *entries, unsigned lo, unsigned hi, uint8_t prefix_len)
+{
+  uint8_t child_index = word_get_bits(prefix_len, PREFIX_STEP_BITS, entries[lo].word);
+  lo++;
+  while(lo < hi){
+    unsigned mid = (lo + hi)/2;
+    if (word_get_bits(prefix_len, PREFIX_STEP_BITS, entries[mid].word) == child_index)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// build a new subtree holding entries [lo, hi)
+static struct node *build_subtree(struct sync_state *state, const struct key_entry *entries,
+				  const uint64_t *xors, unsigned lo, unsigned hi, uint8_t min_prefix_len)
+{
+  struct node *node = alloc_node(state, &state->arena);
+  node->message.min_prefix_len = min_prefix_len;
+  node->message.stored = 1;
+  
+  if (hi - lo == 1){
+    node->message.key = *entries[lo].key;
+    node->message.prefix_len = KEY_LEN_BITS;
+    node->context = entries[lo].context;
+    return node;
+  }
+  
+  // the keys are sorted, so the first and last have the fewest prefix bits in common
+  unsigned common = __builtin_clzll(entries[lo].word ^ entries[hi-1].word);
+  uint8_t prefix_len = common - common % PREFIX_STEP_BITS;
+  uint64_t mask = prefix_mask(prefix_len);
+  node->message.prefix_len = prefix_len;
+  set_key_word(&node->message.key, (entries[lo].word & mask) | (RANGE_XOR(xors, lo, hi) & ~mask));
+  
+  while(lo < hi){
+    uint8_t child_index = word_get_bits(prefix_len, PREFIX_STEP_BITS, entries[lo].word);
+    unsigned end = child_range_end(entries, lo, hi, prefix_len);
+    node->children[child_index] = build_subtree(state, entries, xors, lo, end, prefix_len + PREFIX_STEP_BITS);
+    lo = end;
+  }
+  return node;
+}
+
+static void merge_keys(struct sync_state *state, struct node **node, const struct key_entry *entries,
+		       const uint64_t *xors, unsigned lo, unsigned hi, uint8_t min_prefix_len);
+
+// merge the entries [lo, hi) into the children of this node, split at prefix_len
+static void merge_children(struct sync_state *state, struct node *node, const struct key_entry *entries,
+			   const uint64_t *xors, unsigned lo, unsigned hi, uint8_t prefix_len)
+{
+  while(lo < hi){
+    uint8_t child_index = word_get_bits(prefix_len, PREFIX_STEP_BITS, entries[lo].word);
+    unsigned end = child_range_end(entries, lo, hi, prefix_len);
+    merge_keys(state, &node->children[child_index], entries, xors, lo, end, prefix_len + PREFIX_STEP_BITS);
+    lo = end;
+  }
+}
+
+// merge entries [lo, hi), none of which are already in the tree, into the subtree at *node
+static void merge_keys(struct sync_state *state, struct node **node, const struct key_entry *entries,
+		       const uint64_t *xors, unsigned lo, unsigned hi, uint8_t min_prefix_len)
+{
+  if (!*node){
+    *node = build_subtree(state, entries, xors, lo, hi, min_prefix_len);
+    return;
+  }
+  
+  // the prefix bits that all of the new keys have in common with this node
+  uint64_t node_word = key_word(&(*node)->message.key);
+  uint64_t diff = (node_word ^ entries[lo].word) | (node_word ^ entries[hi-1].word);
+  unsigned common = diff ? __builtin_clzll(diff) : KEY_LEN_BITS;
+  
+  if (common >= (*node)->message.prefix_len){
+    // all of the new keys go below this node
+    uint64_t mask = prefix_mask((*node)->message.prefix_len);
+    set_key_word(&(*node)->message.key, node_word ^ (RANGE_XOR(xors, lo, hi) & ~mask));
+    
+    if ((*node)->send_state == SENT)
+      (*node)->send_state = NOT_SENT;
+    if ((*node)->send_state == QUEUED && (*node)->sent_count>0)
+      (*node)->send_state = DONT_SEND;
+    (*node)->sent_count=0;
+    
+    merge_children(state, *node, entries, xors, lo, hi, (*node)->message.prefix_len);
+    return;
+  }
+  
+  // the new keys differ from this node within the range of prefix bits that it
+  // represents, so we need to create a new node to represent the new range.
+  uint8_t prefix_len = common - common % PREFIX_STEP_BITS;
+  struct node *parent = alloc_node(state, &state->arena);
+  parent->message.min_prefix_len = min_prefix_len;
+  parent->message.prefix_len = prefix_len;
+  parent->message.stored = 1;
+  parent->children[word_get_bits(prefix_len, PREFIX_STEP_BITS, node_word)] = *node;
+  (*node)->message.min_prefix_len = prefix_len + PREFIX_STEP_BITS;
+  *node = parent;
+  
+  merge_children(state, parent, entries, xors, lo, hi, prefix_len);
+  
+  // xor all the existing children of this node, we can't assume the prefix bits are right in the existing node.
+  xor_children(parent, &parent->message);
+}
+
+static int find_key_entry(const struct key_entry *entries, unsigned count, uint64_t word)
+{
+  unsigned lo=0, hi=count;
+  while(lo < hi){
+    unsigned mid = (lo + hi)/2;
+    if (entries[mid].word == word)
+      return 1;
+    if (entries[mid].word < word)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  return 0;
+}
+
+// collect the keys below this peer node that are among the new entries
+static void peer_find_new_keys(const struct node *node, const struct key_entry *entries, unsigned count,
+			       sync_key_t *found, unsigned *found_count)
+{
+  if (!node)
+    return;
+  if (node->message.prefix_len == KEY_LEN_BITS){
+    if (find_key_entry(entries, count, key_word(&node->message.key)))
+      found[(*found_count)++] = node->message.key;
+    return;
+  }
+  for (unsigned i=0;i<NODE_CHILDREN;i++)
+    peer_find_new_keys(node->children[i], entries, count, found, found_count);
+}
+
+void sync_add_keys(struct sync_state *state, const sync_key_t *keys, void *const *key_contexts, unsigned count)
+{
+  struct key_entry *entries = allocate(sizeof(struct key_entry)*(count+1));
+  unsigned new_count=0;
+  
+  for (unsigned i=0;i<count;i++){
+    void *context = key_contexts ? key_contexts[i] : NULL;
+    key_message_t message = MESSAGE_FROM_KEY(&keys[i]);
+    struct node *node = (struct node *)find_message(state->root, &message);
+    if (node){
+      node->message.stored = 1;
+      node->context = context;
+      continue;
+    }
+    entries[new_count].word = key_word(&keys[i]);
+    entries[new_count].key = &keys[i];
+    entries[new_count].context = context;
+    new_count++;
+  }
+  
+  if (new_count){
+    sort_key_entries(entries, new_count);
+    
+    // if a key is given more than once, the last context given wins
+    unsigned unique=0;
+    for (unsigned i=0;i<new_count;i++){
+      if (i+1 < new_count && entries[i+1].word == entries[i].word)
+	continue;
+      entries[unique++] = entries[i];
+    }
+    new_count = unique;
+    
+    uint64_t *xors = allocate(sizeof(uint64_t)*(new_count+1));
+    for (unsigned i=0;i<new_count;i++)
+      xors[i+1] = xors[i] ^ entries[i].word;
+    
+    merge_keys(state, &state->root, entries, xors, 0, new_count, 0);
+    free(xors);
+    
+    state->key_count+=new_count;
+    state->progress=0;
+    
+    // we no longer need to ask any peer for these keys
+    sync_key_t *found = allocate(sizeof(sync_key_t)*new_count);
+    struct sync_peer_state *peer_state = state->peers;
+    while(peer_state){
+      unsigned found_count=0;
+      peer_find_new_keys(peer_state->root, entries, new_count, found, &found_count);
+      for (unsigned i=0;i<found_count;i++){
+	remove_key(state, &peer_state->arena, &peer_state->root, &found[i]);
+	peer_state->recv_count--;
+      }
+      peer_state = peer_state->next;
+    }
+    free(found);
+  }
+  free(entries);
+}
+
+// Pick the peer slot used by the fewest other peers
+static uint8_t alloc_slot(struct sync_state *state)
+{
+  unsigned users[SYNC_PEER_SLOTS];
+  bzero(users, sizeof users);
+  for (struct sync_peer_state *peer = state->peers; peer; peer = peer->next)
+    users[peer->slot]++;
+  uint8_t slot = 0;
+  for (unsigned i=1;i<SYNC_PEER_SLOTS;i++)
+    if (users[i] < users[slot])
+      slot = i;
+  return slot;
+}
+
+// Stop giving queued nodes a share of each message for this peer slot, if no peer uses it now
+static void forget_slot(struct sync_state *state, uint8_t slot)
+{
+  for (struct sync_peer_state *peer = state->peers; peer; peer = peer->next)
+    if (peer->slot == slot)
+      return;
+  struct node *node = state->transmit_ptr;
+  while(node && state->slot_queued[slot]){
+    if (node->wanted_by & (1u<<slot)){
+      node->wanted_by &= ~(1u<<slot);
+      state->slot_queued[slot]--;
+    }
+    node = node->transmit_next;
+    if (node == state->transmit_ptr)
+      break;
+  }
+}
+
 void sync_free_peer_state(struct sync_state *state, void *peer_context){
   struct sync_peer_state **peer_state = &state->peers;
   while(*peer_state){
     if ((*peer_state)->peer_context == peer_context){
       struct sync_peer_state *free_peer = (*peer_state);
-      free_node(state, free_peer->root);
+      drop_arena(state, &free_peer->arena);
       *peer_state = free_peer->next;
+      forget_slot(state, free_peer->slot);
       free(free_peer);
       return;
     }
+    peer_state = &(*peer_state)->next;
   }
 }
 
+void sync_node_memory(const struct sync_state *state, size_t *in_use, size_t *allocated)
+{
+  unsigned nodes = state->arena.nodes_in_use;
+  const struct sync_peer_state *peer_state = state->peers;
+  while(peer_state){
+    nodes += peer_state->arena.nodes_in_use;
+    peer_state = peer_state->next;
+  }
+  if (in_use)
+    *in_use = nodes * sizeof(struct node);
+  if (allocated)
+    *allocated = state->slab_count * sizeof(struct node_slab);
+}
+
 struct sync_state* sync_alloc_state(void *context, peer_has has, peer_does_not_have has_not, peer_now_has now_has){
   struct sync_state *state = allocate(sizeof (struct sync_state));
   state->context = context;
@@ -415,59 +963,156 @@ struct sync_state* sync_alloc_state(void *context, peer_has has, peer_does_not_h
 
 // clear all memory used by this state
 void sync_free_state(struct sync_state *state){
-  while(state->transmit_ptr){
-    struct node *p = state->transmit_ptr;
-    state->transmit_ptr = state->transmit_ptr->transmit_next;
-    p->transmit_next=NULL;
-    p->transmit_prev=NULL;
-  }
+  while(state->transmit_ptr)
+    unlink_node(state, state->transmit_ptr);
   
-  free_node(NULL, state->root);
+  drop_arena(state, &state->arena);
     
   while(state->peers){
     struct sync_peer_state *peer_state = state->peers;
     
-    free_node(NULL, peer_state->root);
+    drop_arena(state, &peer_state->arena);
     
     state->peers = peer_state->next;
     free(peer_state);
   }
   
+  while(state->spare_slabs){
+    struct node_slab *slab = state->spare_slabs;
+    state->spare_slabs = slab->next;
+    free(slab);
+  }
+  
   free(state);
 }
 
-static void copy_message(uint8_t *buff, const key_message_t *message)
+// write the low len bits of value into the packet buffer
+static void put_bits(uint8_t *buff, size_t *bit_offset, uint8_t len, uint64_t value)
+{
+  while(len){
+    uint8_t used = *bit_offset & 7;
+    uint8_t n = MIN_VAL(8 - used, len);
+    if (!used)
+      buff[*bit_offset>>3] = 0;
+    buff[*bit_offset>>3] |= ((value >> (len - n)) & ((1<<n)-1)) << (8 - used - n);
+    *bit_offset += n;
+    len -= n;
+  }
+}
+
+static uint64_t get_bits(const uint8_t *buff, size_t *bit_offset, uint8_t len)
+{
+  uint64_t value = 0;
+  while(len){
+    uint8_t used = *bit_offset & 7;
+    uint8_t n = MIN_VAL(8 - used, len);
+    value = (value << n) | ((buff[*bit_offset>>3] >> (8 - used - n)) & ((1<<n)-1));
+    *bit_offset += n;
+    len -= n;
+  }
+  return value;
+}
+
+static unsigned message_bits(const key_message_t *message, uint8_t fixed)
+{
+  if (fixed)
+    return FIXED_MESSAGE_BYTES<<3;
+  if (message->prefix_len == KEY_LEN_BITS)
+    return LEAF_MESSAGE_BITS;
+  if (message->min_prefix_len == message->prefix_len)
+    return NODE_MESSAGE_BITS;
+  return NODE_MESSAGE_BITS + 6;
+}
+
+static void encode_message(uint8_t *buff, size_t *bit_offset, const key_message_t *message, uint8_t fixed)
 {
-  if (message){
-    buff[0] = (message->stored?0x80:0) | (message->min_prefix_len & 0x7f);
-    buff[1] = message->prefix_len;
-    memcpy(&buff[2], &message->key.key[0], KEY_LEN);
+  if (fixed){
+    // whole bytes, so always byte aligned
+    uint8_t *p = &buff[*bit_offset>>3];
+    p[0] = (message->stored?0x80:0) | (message->min_prefix_len & 0x7f);
+    p[1] = message->prefix_len;
+    memcpy(&p[2], &message->key.key[0], KEY_LEN);
+    *bit_offset += FIXED_MESSAGE_BYTES<<3;
+    return;
+  }
+  put_bits(buff, bit_offset, 1, message->stored);
+  if (message->prefix_len == KEY_LEN_BITS){
+    put_bits(buff, bit_offset, 1, 1);
+    put_bits(buff, bit_offset, 7, message->min_prefix_len);
   }else{
-    bzero(buff, MESSAGE_BYTES);
-    buff[0] = 0x80;
+    put_bits(buff, bit_offset, 1, 0);
+    put_bits(buff, bit_offset, 6, message->prefix_len);
+    if (message->min_prefix_len == message->prefix_len){
+      put_bits(buff, bit_offset, 1, 1);
+    }else{
+      put_bits(buff, bit_offset, 1, 0);
+      put_bits(buff, bit_offset, 6, message->min_prefix_len);
+    }
   }
+  put_bits(buff, bit_offset, KEY_LEN_BITS, key_word(&message->key));
 }
 
-// prepare a network packet buffer, with as many queued outgoing messages that we can fit
-size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
+// returns -1 if the packet ends part way through a message
+static int decode_message(const uint8_t *buff, size_t len, size_t *bit_offset, key_message_t *message)
+{
+  size_t bits = len<<3;
+  bzero(message, sizeof *message);
+  if (*bit_offset + MIN_MESSAGE_BITS > bits)
+    return -1;
+  message->stored = get_bits(buff, bit_offset, 1);
+  if (get_bits(buff, bit_offset, 1)){
+    message->prefix_len = KEY_LEN_BITS;
+    message->min_prefix_len = get_bits(buff, bit_offset, 7);
+  }else{
+    message->prefix_len = get_bits(buff, bit_offset, 6);
+    if (get_bits(buff, bit_offset, 1)){
+      message->min_prefix_len = message->prefix_len;
+    }else{
+      if (*bit_offset + 6 + KEY_LEN_BITS > bits)
+	return -1;
+      message->min_prefix_len = get_bits(buff, bit_offset, 6);
+    }
+  }
+  set_key_word(&message->key, get_bits(buff, bit_offset, KEY_LEN_BITS));
+  return 0;
+}
+
+/* Go once around the transmit loop, adding queued nodes to the packet buffer.
+   If leaves_only is set, skip over anything but leaf nodes.
+   If share is non-zero, only send nodes wanted by a peer slot that has been sent fewer than
+   share records in this packet so far, leaving the rest in the loop for later.
+   If fixed is set, use the older fixed length format. */
+static void build_records(struct sync_state *state, uint8_t *buff, size_t len, size_t *bit_offset,
+			  uint8_t leaves_only, unsigned share, unsigned *slot_sent, uint8_t fixed)
 {
-  size_t offset=0;
-  state->sent_messages++;
-  state->progress++;
-  
   struct node *tail = state->transmit_ptr;
   
-  while(tail && offset + MESSAGE_BYTES<=len){
+  while(tail && *bit_offset + MIN_MESSAGE_BITS <= len<<3){
     struct node *head = tail->transmit_next;
     assert(head->transmit_prev == tail);
     
     if (head->send_state == QUEUED){
-      copy_message(&buff[offset], &head->message);
-      offset+=MESSAGE_BYTES;
-      head->sent_count++;
-      state->sent_record_count++;
-      if (head->sent_count>=SYNC_MAX_RETRIES)
-	head->send_state = SENT;
+      uint8_t send = 1;
+      if (*bit_offset + message_bits(&head->message, fixed) > len<<3)
+	send = 0;
+      else if (leaves_only && head->message.prefix_len != KEY_LEN_BITS)
+	send = 0;
+      else if (share){
+	send = 0;
+	for (unsigned i=0;i<SYNC_PEER_SLOTS && !send;i++)
+	  if ((head->wanted_by & (1u<<i)) && slot_sent[i] < share)
+	    send = 1;
+      }
+      if (send){
+	encode_message(buff, bit_offset, &head->message, fixed);
+	head->sent_count++;
+	state->sent_record_count++;
+	for (unsigned i=0;i<SYNC_PEER_SLOTS;i++)
+	  if (head->wanted_by & (1u<<i))
+	    slot_sent[i]++;
+	if (head->sent_count>=SYNC_MAX_RETRIES)
+	  head->send_state = SENT;
+      }
     }
     
     if (head->send_state == QUEUED){
@@ -477,6 +1122,7 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
       struct node *next = head->transmit_next;
       head->transmit_next = NULL;
       head->transmit_prev = NULL;
+      left_transmit_loop(state, head);
       
       if (head == tail || next == head){
 	// transmit loop is now empty
@@ -495,24 +1141,67 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
   }
   
   state->transmit_ptr = tail;
+}
+
+// prepare a network packet buffer, with as many queued outgoing messages that we can fit
+// Keys go before summaries, as they are what the peers are actually waiting for. And when
+// several peers are waiting for records, each gets an even share of the packet first,
+// so that one peer with a long backlog doesn't hold up the rest.
+static size_t build_message(struct sync_state *state, uint8_t *buff, size_t len, uint8_t fixed)
+{
+  size_t bit_offset=0;
+  state->sent_messages++;
+  state->progress++;
+  
+  unsigned waiting=0;
+  for (unsigned i=0;i<SYNC_PEER_SLOTS;i++)
+    if (state->slot_queued[i])
+      waiting++;
+  
+  unsigned share = 0;
+  if (waiting>1)
+    share = ((len<<3)/(fixed ? FIXED_MESSAGE_BYTES<<3 : NODE_MESSAGE_BITS) + waiting-1)/waiting;
+  
+  unsigned slot_sent[SYNC_PEER_SLOTS];
+  bzero(slot_sent, sizeof slot_sent);
+  build_records(state, buff, len, &bit_offset, 1, share, slot_sent, fixed);
+  if (share)
+    build_records(state, buff, len, &bit_offset, 0, share, slot_sent, fixed);
+  // then fill any space that is left, in queue order
+  build_records(state, buff, len, &bit_offset, 0, 0, slot_sent, fixed);
   
   // If we don't have anything else to send, always send our root tree node
-  if(offset + MESSAGE_BYTES<=len && offset==0){
+  // (or an empty root node, if we have no keys at all)
+  key_message_t empty_root = {.stored=1};
+  const key_message_t *root = state->root ? &state->root->message : &empty_root;
+  if(bit_offset + message_bits(root, fixed) <= len<<3 && bit_offset==0){
     state->sent_root++;
-    copy_message(&buff[offset], state->root ? &state->root->message : NULL);
-    offset+=MESSAGE_BYTES;
+    encode_message(buff, &bit_offset, root, fixed);
     state->sent_record_count++;
   }
   
+  return (bit_offset+7)>>3;
+}
+
+size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len)
+{
+  return build_message(state, buff, len, 0);
+}
 
-  return offset;
+size_t sync_build_fixed_message(struct sync_state *state, uint8_t *buff, size_t len)
+{
+  return build_message(state, buff, len, 1);
 }
 
-// Add a tree node into our transmission queue
+// Add a tree node into our transmission queue, on behalf of this peer
 // the node can be added to the head or tail of the list.
-static void queue_node(struct sync_state *state, struct node *node, uint8_t head)
+static void queue_node(struct sync_state *state, struct sync_peer_state *peer, struct node *node, uint8_t head)
 {
   node->send_state = QUEUED;
+  if (!(node->wanted_by & (1u<<peer->slot))){
+    node->wanted_by |= 1u<<peer->slot;
+    state->slot_queued[peer->slot]++;
+  }
   if (node->transmit_next)
     return;
   
@@ -520,6 +1209,7 @@ static void queue_node(struct sync_state *state, struct node *node, uint8_t head
     state->progress=0;
   
   // insert this node into the transmit loop
+  SLAB_OF(node)->arena->queued++;
   if (!state->transmit_ptr){
     state->transmit_ptr = node;
     node->transmit_next = node;
@@ -545,14 +1235,14 @@ static unsigned peer_is_missing(struct sync_state *state, struct sync_peer_state
       // peer has now received this key?
       if (state->now_has)
 	state->now_has(state->context, peer->peer_context, node->context, &node->message.key);
-      remove_key(state, &peer->root, &node->message.key);
+      remove_key(state, &peer->arena, &peer->root, &node->message.key);
       peer->send_count --;
       return 1;
     }
     return 0;
   }
   
-  add_key(&peer->root, &node->message.key, node->context, 1);
+  add_key(state, &peer->arena, &peer->root, &node->message.key, node->context, 1);
   peer->send_count ++;
   state->progress=0;
   if (state->has_not)
@@ -568,7 +1258,7 @@ static void peer_missing_leaf_nodes(
 {
   if (node->message.prefix_len == KEY_LEN_BITS){
     if (peer_is_missing(state, peer, node, allow_remove))
-      queue_node(state, node, 1);
+      queue_node(state, peer, node, 1);
   }else{
     for (unsigned i=0;i<NODE_CHILDREN;i++){
       if (i!=except && node->children[i])
@@ -577,22 +1267,62 @@ static void peer_missing_leaf_nodes(
   }
 }
 
+// forget any region requests that this key answers
+static void peer_answered_requests(struct sync_state *state, struct sync_peer_state *peer_state, const sync_key_t *key)
+{
+  struct node **node = &peer_state->requests;
+  while(*node){
+    struct node *request = *node;
+    if (common_prefix_bits(&request->message.key, key, request->message.prefix_len) == request->message.prefix_len){
+      *node = request->children[0];
+      release_node(state, &peer_state->arena, request);
+      peer_state->request_count--;
+    }else
+      node = &request->children[0];
+  }
+}
+
 static void peer_add_key(struct sync_state *state, struct sync_peer_state *peer_state, const key_message_t *message)
 {
   if (message->prefix_len != KEY_LEN_BITS || !message->stored)
     return;
     
-  struct node *node = add_key_if_missing(&peer_state->root, message, 0);
+  struct node *node = add_key_if_missing(state, &peer_state->arena, &peer_state->root, message, 0);
   
   if (node){
     //Yay, they told us something we didn't know.
     state->progress=0;
     peer_state->recv_count++;
+    if (peer_state->requests)
+      peer_answered_requests(state, peer_state, &message->key);
     
     if (state->has)
       state->has(state->context, peer_state->peer_context, &message->key);
-    queue_node(state, node, 0);
+    queue_node(state, peer_state, node, 0);
+  }else{
+    // We already knew they had this key, and we still don't.
+    // Our previous request may have been lost, so ask again.
+    node = (struct node *)find_message(peer_state->root, message);
+    if (node && !node->message.stored)
+      queue_node(state, peer_state, node, 0);
+  }
+}
+
+// queue our requests for every key below this peer node that they have and we don't
+static unsigned peer_requeue_wanted(struct sync_state *state, struct sync_peer_state *peer_state, struct node *peer_node)
+{
+  if (!peer_node)
+    return 0;
+  if (peer_node->message.prefix_len == KEY_LEN_BITS){
+    if (peer_node->message.stored)
+      return 0;
+    queue_node(state, peer_state, peer_node, 0);
+    return 1;
   }
+  unsigned ret=0;
+  for (unsigned i=0;i<NODE_CHILDREN;i++)
+    ret+=peer_requeue_wanted(state, peer_state, peer_node->children[i]);
+  return ret;
 }
 
 /*
@@ -614,7 +1344,7 @@ static unsigned peer_has_received_all(struct sync_state *state, struct sync_peer
     if (peer_node->message.stored){
       if (state->now_has)
 	state->now_has(state->context, peer_state->peer_context, peer_node->context, &peer_node->message.key);
-      remove_key(state, &peer_state->root, &peer_node->message.key);
+      remove_key(state, &peer_state->arena, &peer_state->root, &peer_node->message.key);
       peer_state->send_count --;
       ret=1;
     }
@@ -649,18 +1379,18 @@ static struct node * remove_differences(struct sync_peer_state *peer_state, key_
 	return NULL;
     }
     
-    uint8_t child_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &message->key);
-    
     if (prefix_len < peer_node->message.prefix_len){
-      // TODO optimise this case by comparing all possible prefix bits in one hit
-      uint8_t node_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &peer_node->message.key);
-      if (node_index != child_index)
+      // skip the range of prefix bits this node represents in one hit
+      uint8_t end = MIN_VAL(peer_node->message.prefix_len, message->prefix_len);
+      if (!key_bits_match(&message->key, &peer_node->message.key, prefix_len, end))
 	return NULL; // no match
-    }else{
-      peer_node = peer_node->children[child_index];
-      if (!peer_node)
-	return NULL;
+      prefix_len = end;
+      continue;
     }
+    
+    peer_node = peer_node->children[sync_get_bits(prefix_len, PREFIX_STEP_BITS, &message->key)];
+    if (!peer_node)
+      return NULL;
     prefix_len+=PREFIX_STEP_BITS;
   }
   
@@ -676,6 +1406,192 @@ static struct node * remove_differences(struct sync_peer_state *peer_state, key_
   return peer_node;
 }
 
+/* Peers built with a smaller PREFIX_STEP_BITS than ours can send us summaries of
+   parts of the keyspace that don't line up with the nodes in our tree. i.e., the
+   region covers some, but not all, of the children of one of our nodes.
+   The following functions deal with all the nodes of a tree that fall within such
+   a region.
+*/
+
+// returns 1 if this whole node is within the region described by the leading
+// prefix_len bits of *region, 0 if some of its children might be, or -1 if none are.
+static int node_in_region(const struct node *node, const key_message_t *region)
+{
+  uint8_t len = MIN_VAL(node->message.prefix_len, region->prefix_len);
+  if (common_prefix_bits(&node->message.key, &region->key, len) < len)
+    return -1;
+  return node->message.prefix_len >= region->prefix_len ? 1 : 0;
+}
+
+// XOR all keys within the region into dest
+static void xor_region(struct node *node, const key_message_t *region, key_message_t *dest)
+{
+  if (!node)
+    return;
+  switch(node_in_region(node, region)){
+    case 1:
+      xor_children(node, dest);
+      break;
+    case 0:
+      for (unsigned i=0;i<NODE_CHILDREN;i++)
+	xor_region(node->children[i], region, dest);
+      break;
+  }
+}
+
+// Queue our summary of the region described by the leading prefix_len bits of this message.
+// A blank summary asks the peer for every key in the region, otherwise a peer using a smaller
+// step can compare it against their own tree and drill down to the keys that differ.
+static void peer_send_region(struct sync_state *state, struct sync_peer_state *peer_state, const key_message_t *message, uint8_t prefix_len)
+{
+  key_message_t region = *message;
+  region.prefix_len = prefix_len;
+  region.min_prefix_len = prefix_len;
+  region.stored = 1;
+  clear_xor_bits(&region);
+  xor_region(state->root, &region, &region);
+  
+  struct node *node = peer_state->requests;
+  while(node && (node->message.prefix_len != prefix_len || common_prefix_bits(&node->message.key, &region.key, prefix_len) < prefix_len))
+    node = node->children[0];
+  if (!node){
+    // forget the oldest summary if we are tracking too many
+    if (peer_state->request_count >= MAX_REGION_REQUESTS){
+      struct node **last = &peer_state->requests;
+      while((*last)->children[0])
+	last = &(*last)->children[0];
+      release_node(state, &peer_state->arena, *last);
+      *last = NULL;
+      peer_state->request_count--;
+    }
+    node = alloc_node(state, &peer_state->arena);
+    node->children[0] = peer_state->requests;
+    peer_state->requests = node;
+    peer_state->request_count++;
+  }
+  node->message = region;
+  node->sent_count = 0;
+  queue_node(state, peer_state, node, 0);
+}
+
+// queue transmission of our nodes that exactly cover the region
+static unsigned queue_region(struct sync_state *state, struct sync_peer_state *peer_state, struct node *node, const key_message_t *region)
+{
+  unsigned ret=0;
+  if (!node)
+    return 0;
+  switch(node_in_region(node, region)){
+    case 1:
+      queue_node(state, peer_state, node, 0);
+      return 1;
+    case 0:
+      for (unsigned i=0;i<NODE_CHILDREN;i++)
+	ret+=queue_region(state, peer_state, node->children[i], region);
+      break;
+  }
+  return ret;
+}
+
+// the peer doesn't know any of the keys in this region
+static void missing_region(struct sync_state *state, struct sync_peer_state *peer_state, struct node *node, const key_message_t *region)
+{
+  if (!node)
+    return;
+  switch(node_in_region(node, region)){
+    case 1:
+      peer_missing_leaf_nodes(state, peer_state, node, NODE_CHILDREN, 1);
+      break;
+    case 0:
+      for (unsigned i=0;i<NODE_CHILDREN;i++)
+	missing_region(state, peer_state, node->children[i], region);
+      break;
+  }
+}
+
+// the peer has received all of the keys we sent them in this region
+static unsigned received_region(struct sync_state *state, struct sync_peer_state *peer_state, struct node *peer_node, const key_message_t *region)
+{
+  unsigned ret=0;
+  if (!peer_node)
+    return 0;
+  switch(node_in_region(peer_node, region)){
+    case 1:
+      ret = peer_has_received_all(state, peer_state, peer_node);
+      break;
+    case 0:{
+      // duplicate the child pointers, as removing keys may free this peer node.
+      struct node *children[NODE_CHILDREN];
+      memcpy(children, peer_node->children, sizeof(children));
+      for (unsigned i=0;i<NODE_CHILDREN;i++)
+	ret+=received_region(state, peer_state, children[i], region);
+      break;
+    }
+  }
+  return ret;
+}
+
+// The peer has no keys that share the leading min_prefix_len bits of this message,
+// without also sharing all of its prefix_len bits.
+static void missing_siblings(struct sync_state *state, struct sync_peer_state *peer_state, struct node *node, const key_message_t *message)
+{
+  if (!node)
+    return;
+  uint8_t len = MIN_VAL(node->message.prefix_len, message->prefix_len);
+  uint8_t common = common_prefix_bits(&node->message.key, &message->key, len);
+  if (common < MIN_VAL(len, message->min_prefix_len) || common >= message->prefix_len)
+    return;
+  if (node->message.prefix_len == KEY_LEN_BITS){
+    if (peer_is_missing(state, peer_state, node, 0))
+      queue_node(state, peer_state, node, 1);
+  }else{
+    for (unsigned i=0;i<NODE_CHILDREN;i++)
+      missing_siblings(state, peer_state, node->children[i], message);
+  }
+}
+
+static int recv_unaligned_key(struct sync_state *state, struct sync_peer_state *peer_state, const key_message_t *message)
+{
+  // remove information that we have already learnt about this peer
+  key_message_t peer_message = *message;
+  if (message->stored)
+    xor_region(peer_state->root, message, &peer_message);
+  
+  if (message->stored && message->min_prefix_len < message->prefix_len)
+    missing_siblings(state, peer_state, state->root, message);
+  
+  key_message_t our_message = *message;
+  clear_xor_bits(&our_message);
+  xor_region(state->root, message, &our_message);
+  
+  if (cmp_message(message, &our_message)==0){
+    if (message->stored && received_region(state, peer_state, peer_state->root, message)==0)
+      state->received_uninteresting++;
+    return 0;
+  }
+  
+  // Nothing to do if we understand the rest of the differences
+  if (cmp_message(&peer_message, &our_message)==0){
+    state->received_uninteresting++;
+    return 0;
+  }
+  
+  uint8_t is_blank = 1;
+  for (unsigned i=(peer_message.prefix_len>>3)+1;i<KEY_LEN && is_blank;i++)
+    if (peer_message.key.key[i])
+      is_blank = 0;
+  
+  if (is_blank){
+    // This peer doesn't know any keys in this region
+    missing_region(state, peer_state, state->root, message);
+  }else{
+    // send them our nodes within this region, and our summary of the whole region
+    // so that they can find the part of it that differs.
+    queue_region(state, peer_state, state->root, message);
+    peer_send_region(state, peer_state, message, message->prefix_len);
+  }
+  return 0;
+}
+
 // Proccess one incoming tree record.
 static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state, const key_message_t *message)
 {
@@ -684,6 +1600,9 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
     return -1;
   
   state->received_record_count++;
+  
+  if (state->root && message->prefix_len % PREFIX_STEP_BITS)
+    return recv_unaligned_key(state, peer_state, message);
   /* Possible outcomes;
     key is an exact match for part of our tree
       Yay, nothing to do.
@@ -740,7 +1659,9 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
     
     // Nothing to do if we understand the rest of the differences
     if (cmp_message(&peer_message, &node->message)==0){
-      state->received_uninteresting++;
+      // other than repeating any requests they don't seem to have heard
+      if (peer_requeue_wanted(state, peer_state, peer_node)==0)
+	state->received_uninteresting++;
       return 0;
     }
     
@@ -752,7 +1673,7 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
 	peer_missing_leaf_nodes(state, peer_state, node, NODE_CHILDREN, 1);
       }else if (node->message.prefix_len > peer_message.prefix_len){
 	// reply with our matching node
-	queue_node(state, node, 1);
+	queue_node(state, peer_state, node, 1);
       }else{
 	// compare their node to our tree, test if we can easily detect a part of our tree they don't know
 	// Note, this only works if there are an odd number of different leaf nodes
@@ -773,52 +1694,63 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
 	  }
 	  if (test_node->message.prefix_len == KEY_LEN_BITS)
 	    break;
-	  uint8_t child_index = sync_get_bits(test_prefix, PREFIX_STEP_BITS, &test_message.key);
+	  // An even number of missing keys below one child will have cleared the prefix bits
+	  // we would use to find it, so compare against each child directly.
+	  for (unsigned i=0;i<NODE_CHILDREN;i++){
+	    if (test_node->children[i] && cmp_message(&test_message, &test_node->children[i]->message)==0){
+	      peer_missing_leaf_nodes(state, peer_state, test_node->children[i], NODE_CHILDREN, 1);
+	      return 0;
+	    }
+	  }
 	  if (test_prefix<test_node->message.prefix_len){
-	    // TODO optimise this case by comparing all possible prefix bits in one hit
-	    uint8_t node_index = sync_get_bits(test_prefix, PREFIX_STEP_BITS, &test_node->message.key);
-	    if (node_index != child_index)
+	    // skip the range of prefix bits this node represents in one hit
+	    if (!key_bits_match(&test_message.key, &test_node->message.key, test_prefix, test_node->message.prefix_len))
 	      break; // no match
-	  }else{
-	    test_node = test_node->children[child_index];
+	    test_prefix = test_node->message.prefix_len;
 	  }
+	  test_node = test_node->children[sync_get_bits(test_prefix, PREFIX_STEP_BITS, &test_message.key)];
 	  test_prefix+=PREFIX_STEP_BITS;
 	}
 	
 	// queue the transmission of all child nodes of this node
 	for (unsigned i=0;i<NODE_CHILDREN;i++){
 	  if (node->children[i])
-	    queue_node(state, node->children[i], 0);
+	    queue_node(state, peer_state, node->children[i], 0);
 	}
+#if PREFIX_STEP_BITS > 1
+	// Our children can't tell them about the slots where we have no child at all,
+	// so send this node too. They will reply with their own children.
+	queue_node(state, peer_state, node, 0);
+#endif
       }
       return 0;
     }
     
-    // which branch of the tree should we look at next
-    uint8_t key_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &peer_message.key);
-  
     // if our node represents a large range of the keyspace, find the first prefix bit that differs
-    while (prefix_len < node->message.prefix_len && prefix_len < peer_message.prefix_len){
-      // check the next step bits
-      uint8_t existing_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &node->message.key);
-      if (key_index != existing_index){
+    if (prefix_len < node->message.prefix_len && prefix_len < peer_message.prefix_len){
+      uint8_t end = MIN_VAL(node->message.prefix_len, peer_message.prefix_len);
+      uint8_t differs_at = common_prefix_bits(&node->message.key, &peer_message.key, end);
+      if (differs_at < end){
 	// If the prefix of our node differs from theirs, they don't have any of these keys
 	// send them all
-	if (prefix_len >= peer_message.min_prefix_len && peer_message.stored){
+	// (the peer may use a smaller step than us, so check the exact bit that differs)
+	if (differs_at >= peer_message.min_prefix_len && peer_message.stored){
 	  peer_missing_leaf_nodes(state, peer_state, node, NODE_CHILDREN, 0);
 	  
 	  if (peer_message.prefix_len != KEY_LEN_BITS)
 	    // and after they have added all these missing keys, they need to know 
 	    // this summary node so they can be reminded to send this key or it's children again.
-	    queue_node(state, node, 0);
+	    queue_node(state, peer_state, node, 0);
 	}
 	
 	if (peer_message.prefix_len == KEY_LEN_BITS)
 	  peer_add_key(state, peer_state, &peer_message);
+	else if (message->stored)
+	  // we don't have any of the keys below their node either, tell them so.
+	  peer_send_region(state, peer_state, message, message->prefix_len);
 	return 0;
       }
-      prefix_len += PREFIX_STEP_BITS;
-      key_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &peer_message.key);
+      prefix_len = end;
     }
     
     if (message->prefix_len <= prefix_len)
@@ -826,6 +1758,9 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
     
     assert(prefix_len == node->message.prefix_len);
     
+    // which branch of the tree should we look at next
+    uint8_t key_index = sync_get_bits(prefix_len, PREFIX_STEP_BITS, &peer_message.key);
+    
     if (peer_message.min_prefix_len <= node->message.prefix_len && peer_message.stored){
       // send all keys to the other party, except for the child @key_index
       // they don't have any of these siblings
@@ -837,10 +1772,13 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
       // we know nothing about this key
       if (peer_message.prefix_len == KEY_LEN_BITS){
 	peer_add_key(state, peer_state, &peer_message);
+      }else if (message->stored){
+	// they have keys here and we have none, tell them so.
+	peer_send_region(state, peer_state, message, prefix_len + PREFIX_STEP_BITS);
       }else{
 	// hopefully the other party will tell us something,
 	// and we won't get stuck in a loop talking about the same node.
-	queue_node(state, node, 0);
+	queue_node(state, peer_state, node, 0);
       }
       return 0;
     }
@@ -855,8 +1793,7 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
   }
 }
 
-// Process all incoming messages from this packet buffer
-int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len)
+static struct sync_peer_state *find_peer_state(struct sync_state *state, void *peer_context)
 {
   assert(peer_context);
   
@@ -868,14 +1805,39 @@ int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_
   if (!peer_state){
     peer_state = allocate(sizeof(struct sync_peer_state));
     peer_state->peer_context = peer_context;
+    peer_state->slot = alloc_slot(state);
     peer_state->next = state->peers;
     state->peers = peer_state;
   }
+  return peer_state;
+}
+
+// Process all incoming messages from this packet buffer
+int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len)
+{
+  struct sync_peer_state *peer_state = find_peer_state(state, peer_context);
+  
+  size_t bit_offset=0;
+  // anything less than a whole message is just padding
+  while(bit_offset + MIN_MESSAGE_BITS <= len<<3){
+    key_message_t message;
+    if (decode_message(buff, len, &bit_offset, &message)==-1)
+      return -1;
+    if (recv_key(state, peer_state, &message)==-1)
+      return -1;
+  }
+  return 0;
+}
+
+// Process all incoming messages from a packet buffer in the older fixed length format
+int sync_recv_fixed_message(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len)
+{
+  struct sync_peer_state *peer_state = find_peer_state(state, peer_context);
   
   size_t offset=0;
-  if (len%MESSAGE_BYTES)
+  if (len%FIXED_MESSAGE_BYTES)
     return -1;
-  while(offset + MESSAGE_BYTES<=len){
+  while(offset + FIXED_MESSAGE_BYTES<=len){
     const uint8_t *p = &buff[offset];
     key_message_t message;
     bzero(&message, sizeof message);
@@ -888,8 +1850,500 @@ int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_
     if (recv_key(state, peer_state, &message)==-1)
       return -1;
       
-    offset+=MESSAGE_BYTES;
+    offset+=FIXED_MESSAGE_BYTES;
+  }
+  return 0;
+}
+
+
+#if defined(TEST) || defined(SYNC_ALT)
+// Report the number of leaves in our tree, and their total and maximum depth
+void sync_tree_stats(const struct sync_state *state, unsigned *leaves, unsigned *total_depth, unsigned *max_depth)
+{
+  struct {
+    const struct node *node;
+    unsigned depth;
+  } stack[KEY_LEN_BITS * NODE_CHILDREN + 1];
+  unsigned sp=0;
+  
+  *leaves=0;
+  *total_depth=0;
+  *max_depth=0;
+  if (state->root){
+    stack[sp].node = state->root;
+    stack[sp++].depth = 1;
+  }
+  while(sp){
+    sp--;
+    const struct node *node = stack[sp].node;
+    unsigned depth = stack[sp].depth;
+    if (node->message.prefix_len == KEY_LEN_BITS){
+      (*leaves)++;
+      *total_depth+=depth;
+      if (depth > *max_depth)
+	*max_depth = depth;
+      continue;
+    }
+    for (unsigned i=0;i<NODE_CHILDREN;i++){
+      if (node->children[i]){
+	stack[sp].node = node->children[i];
+	stack[sp++].depth = depth+1;
+      }
+    }
+  }
+}
+#endif
+
+#ifdef TEST
+/* Simulate a group of peers that each hold most, but not all, of a set of keys,
+   and check that they all end up with every key.
+   A key is considered delivered to a peer as soon as another peer learns that it is
+   missing, which stands in for the transfer of the bundle itself.
+   Half of the peers can use a second copy of this code built with a different
+   PREFIX_STEP_BITS (see the synctest target in the Makefile).
+*/
+
+void sync_tree_stats(const struct sync_state *state, unsigned *leaves, unsigned *total_depth, unsigned *max_depth);
+
+#ifdef ALT_PREFIX_STEP_BITS
+struct sync_state* alt_sync_alloc_state(void *context, peer_has has, peer_does_not_have has_not, peer_now_has now_has);
+void alt_sync_free_state(struct sync_state *state);
+void alt_sync_free_peer_state(struct sync_state *state, void *peer_context);
+void alt_sync_node_memory(const struct sync_state *state, size_t *in_use, size_t *allocated);
+void alt_sync_add_key(struct sync_state *state, const sync_key_t *key, void *key_context);
+size_t alt_sync_build_message(struct sync_state *state, uint8_t *buff, size_t len);
+int alt_sync_recv_message(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len);
+size_t alt_sync_build_fixed_message(struct sync_state *state, uint8_t *buff, size_t len);
+int alt_sync_recv_fixed_message(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len);
+void alt_sync_tree_stats(const struct sync_state *state, unsigned *leaves, unsigned *total_depth, unsigned *max_depth);
+#endif
+
+struct test_api{
+  int step_bits;
+  struct sync_state* (*alloc_state)(void *context, peer_has has, peer_does_not_have has_not, peer_now_has now_has);
+  void (*free_state)(struct sync_state *state);
+  void (*free_peer_state)(struct sync_state *state, void *peer_context);
+  void (*node_memory)(const struct sync_state *state, size_t *in_use, size_t *allocated);
+  void (*add_key)(struct sync_state *state, const sync_key_t *key, void *key_context);
+  size_t (*build_message)(struct sync_state *state, uint8_t *buff, size_t len);
+  int (*recv_message)(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len);
+  size_t (*build_fixed_message)(struct sync_state *state, uint8_t *buff, size_t len);
+  int (*recv_fixed_message)(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len);
+  void (*tree_stats)(const struct sync_state *state, unsigned *leaves, unsigned *total_depth, unsigned *max_depth);
+};
+
+struct test_api test_apis[2]={
+  {PREFIX_STEP_BITS, sync_alloc_state, sync_free_state, sync_free_peer_state, sync_node_memory, sync_add_key,
+   sync_build_message, sync_recv_message, sync_build_fixed_message, sync_recv_fixed_message, sync_tree_stats},
+#ifdef ALT_PREFIX_STEP_BITS
+  {ALT_PREFIX_STEP_BITS, alt_sync_alloc_state, alt_sync_free_state, alt_sync_free_peer_state,
+   alt_sync_node_memory, alt_sync_add_key,
+   alt_sync_build_message, alt_sync_recv_message, alt_sync_build_fixed_message, alt_sync_recv_fixed_message,
+   alt_sync_tree_stats},
+#endif
+};
+
+#define TEST_MAX_PEERS 16
+#define TEST_PACKET_BYTES 190
+#define TEST_MAX_ROUNDS 200000
+
+struct test_peer{
+  struct test_api *api;
+  struct sync_state *state;
+  uint8_t *has;
+  unsigned *pending;
+  unsigned pending_count;
+};
+
+struct test_peer test_peers[TEST_MAX_PEERS];
+sync_key_t *test_keys;
+unsigned test_key_count;
+unsigned test_missing;
+
+static void test_has(void *context, void *peer_context, const sync_key_t *key)
+{
+}
+
+static void test_has_not(void *context, void *peer_context, void *key_context, const sync_key_t *key)
+{
+  struct test_peer *peer = peer_context;
+  unsigned key_number = (unsigned)(intptr_t)key_context;
+  if (!peer->has[key_number] && peer->pending_count < test_key_count)
+    peer->pending[peer->pending_count++] = key_number;
+}
+
+static void test_now_has(void *context, void *peer_context, void *key_context, const sync_key_t *key)
+{
+}
+
+static void test_add_key(struct test_peer *peer, unsigned key_number)
+{
+  peer->has[key_number]=1;
+  peer->api->add_key(peer->state, &test_keys[key_number], (void *)(intptr_t)key_number);
+}
+
+/* Check that going through the keys one peer knows another lacks, a few at a
+   time, gives the same keys in the same order as going through them all at once,
+   and that they are all keys that the first peer has, and that the other peer
+   lacked at the start (it may have since got them from a third peer, without the
+   first hearing about it yet).
+   Returns the number of keys, or -1 if any of that isn't so. */
+static int test_cursor(struct test_peer *peer, struct test_peer *other, const uint8_t *other_lacked)
+{
+  struct sync_state *state = peer->state;
+  void *peer_context = other;
+  sync_key_t *all = allocate(sizeof(sync_key_t)*(test_key_count+1));
+  void **all_contexts = allocate(sizeof(void *)*(test_key_count+1));
+  sync_key_t few[3];
+  sync_cursor_t cursor;
+  sync_cursor_reset(&cursor);
+  unsigned count = sync_peer_missing_keys(state, peer_context, &cursor, all, all_contexts, test_key_count+1);
+  int ret = count;
+  
+  for (unsigned i=1;i<count;i++)
+    if (memcmp(&all[i-1], &all[i], KEY_LEN)>=0)
+      ret = -1;
+  
+  for (unsigned i=0;i<count;i++){
+    unsigned key_number = (unsigned)(intptr_t)all_contexts[i];
+    if (key_number >= test_key_count
+	|| memcmp(&all[i], &test_keys[key_number], KEY_LEN)
+	|| !peer->has[key_number] || !other_lacked[key_number])
+      ret = -1;
+  }
+  
+  sync_cursor_reset(&cursor);
+  unsigned seen=0, n;
+  while((n = sync_peer_missing_keys(state, peer_context, &cursor, few, NULL, 3))>0){
+    for (unsigned i=0;i<n;i++,seen++)
+      if (seen >= count || memcmp(&few[i], &all[seen], KEY_LEN))
+	ret = -1;
+  }
+  if (seen != count)
+    ret = -1;
+  free(all);
+  free(all_contexts);
+  return ret;
+}
+
+// returns the number of rounds required, or -1 if the peers never converge
+static int test_run(unsigned peer_count, unsigned key_count, int have_percent, int mixed, unsigned seed)
+{
+  srandom(seed);
+  test_key_count = key_count;
+  test_keys = allocate(sizeof(sync_key_t)*key_count);
+  for (unsigned k=0;k<key_count;k++)
+    for (unsigned i=0;i<KEY_LEN;i++)
+      test_keys[k].key[i]=random();
+  
+  test_missing=0;
+  for (unsigned p=0;p<peer_count;p++){
+    struct test_peer *peer = &test_peers[p];
+    peer->api = &test_apis[(mixed && (p&1))?1:0];
+    peer->state = peer->api->alloc_state(NULL, test_has, test_has_not, test_now_has);
+    peer->has = allocate(key_count);
+    peer->pending = allocate(sizeof(unsigned)*key_count);
+    peer->pending_count = 0;
+    for (unsigned k=0;k<key_count;k++){
+      // every key starts with at least one peer
+      if ((random()%100) < have_percent || k%peer_count == p)
+	test_add_key(peer, k);
+      else
+	test_missing++;
+    }
   }
+  
+  unsigned missing_at_start = test_missing;
+  unsigned long long bytes=0;
+  int cursor_keys=0;
+  uint8_t *peer1_lacked = allocate(key_count);
+  for (unsigned k=0;k<key_count;k++)
+    peer1_lacked[k] = !test_peers[1].has[k];
+  int round;
+  for (round=0;round<TEST_MAX_ROUNDS && test_missing;round++){
+    // early on, check what peer 0 knows that peer 1 lacks
+    if (round < 64 && cursor_keys >= 0 && test_peers[0].api == &test_apis[0]){
+      int keys = test_cursor(&test_peers[0], &test_peers[1], peer1_lacked);
+      if (keys<0 || keys>cursor_keys)
+	cursor_keys = keys;
+    }
+
+    // early on, each peer keeps forgetting what it knows about the next one,
+    // sometimes while nodes from that peer's tree are still waiting to be sent
+    if (round%10 == 9 && round < 200)
+      for (unsigned p=0;p<peer_count;p++)
+	test_peers[p].api->free_peer_state(test_peers[p].state, &test_peers[(p+1)%peer_count]);
+    
+    // every so often, use the older fixed length format, as lbard does while
+    // a peer that doesn't understand the packed one is in range
+    uint8_t fixed = round%4 == 3;
+    struct test_peer *sender = &test_peers[round%peer_count];
+    uint8_t packet[TEST_PACKET_BYTES];
+    size_t len = fixed ? sender->api->build_fixed_message(sender->state, packet, sizeof packet)
+      : sender->api->build_message(sender->state, packet, sizeof packet);
+    bytes += len;
+    
+    for (unsigned p=0;p<peer_count;p++){
+      // lose 10% of packets
+      if (&test_peers[p]!=sender && random()%10){
+	if (fixed)
+	  test_peers[p].api->recv_fixed_message(test_peers[p].state, sender, packet, len);
+	else
+	  test_peers[p].api->recv_message(test_peers[p].state, sender, packet, len);
+      }
+    }
+    
+    for (unsigned p=0;p<peer_count;p++){
+      struct test_peer *peer = &test_peers[p];
+      for (unsigned i=0;i<peer->pending_count;i++){
+	if (!peer->has[peer->pending[i]]){
+	  test_add_key(peer, peer->pending[i]);
+	  test_missing--;
+	}
+      }
+      peer->pending_count=0;
+    }
+  }
+  
+  printf("%u peers (%s), %u keys, %u missing: ", peer_count,
+	 mixed?"mixed step sizes":"same step size", key_count, missing_at_start);
+  if (test_missing)
+    printf("FAILED to converge after %d rounds, %u keys still missing\n", round, test_missing);
+  else
+    printf("converged after %d rounds, %llu bytes sent\n", round, bytes);
+  if (cursor_keys<0)
+    printf("  FAILED to go through the keys peer 1 lacks, or a few at a time\n");
+  
+  for (unsigned p=0;p<peer_count;p++){
+    struct test_peer *peer = &test_peers[p];
+    if (p<2){
+      unsigned leaves, total_depth, max_depth;
+      size_t in_use, allocated;
+      peer->api->tree_stats(peer->state, &leaves, &total_depth, &max_depth);
+      peer->api->node_memory(peer->state, &in_use, &allocated);
+      printf("  peer %u: step=%d bits, %u leaves, depth avg %.1f max %u, node memory %zu bytes (%zu allocated)\n",
+	     p, peer->api->step_bits, leaves, leaves?total_depth*1.0/leaves:0, max_depth, in_use, allocated);
+    }
+    peer->api->free_state(peer->state);
+    free(peer->has);
+    free(peer->pending);
+  }
+  free(test_keys);
+  free(peer1_lacked);
+  return (test_missing || cursor_keys<0)?-1:round;
+}
+
+// returns 0 if the two trees have exactly the same nodes
+static int test_cmp_trees(const struct node *a, const struct node *b)
+{
+  if (!a || !b)
+    return a != b;
+  if (a->message.prefix_len != b->message.prefix_len
+    || a->message.min_prefix_len != b->message.min_prefix_len
+    || a->message.stored != b->message.stored
+    || a->context != b->context
+    || memcmp(&a->message.key, &b->message.key, KEY_LEN))
+    return 1;
+  for (unsigned i=0;i<NODE_CHILDREN;i++)
+    if (test_cmp_trees(a->children[i], b->children[i]))
+      return 1;
   return 0;
 }
 
+/* Check that adding keys in batches builds the same tree as adding them one at a
+   time, including when a batch repeats keys, or holds keys we already have. */
+static int test_batch(unsigned key_count, unsigned seed)
+{
+  srandom(seed);
+  sync_key_t *keys = allocate(sizeof(sync_key_t)*key_count);
+  void **contexts = allocate(sizeof(void *)*key_count);
+  for (unsigned k=0;k<key_count;k++){
+    for (unsigned i=0;i<KEY_LEN;i++)
+      keys[k].key[i]=random();
+    contexts[k] = (void *)(intptr_t)k;
+  }
+  // some keys share long prefixes
+  for (unsigned k=1;k<key_count;k+=7)
+    memcpy(keys[k].key, keys[k-1].key, 1+k%(KEY_LEN-1));
+  
+  struct sync_state *one = sync_alloc_state(NULL, NULL, NULL, NULL);
+  for (unsigned k=0;k<key_count;k++)
+    sync_add_key(one, &keys[k], contexts[k]);
+  
+  struct sync_state *batch = sync_alloc_state(NULL, NULL, NULL, NULL);
+  sync_add_keys(batch, keys, contexts, key_count);
+  
+  struct sync_state *merged = sync_alloc_state(NULL, NULL, NULL, NULL);
+  unsigned half = key_count/2;
+  sync_add_keys(merged, keys, contexts, half);
+  sync_add_keys(merged, &keys[half/2], &contexts[half/2], key_count - half/2);
+  sync_add_keys(merged, keys, contexts, 1);
+  
+  int failed = test_cmp_trees(one->root, batch->root) || one->key_count != batch->key_count
+    || test_cmp_trees(one->root, merged->root) || one->key_count != merged->key_count;
+  printf("%u keys added in batches: %s\n", key_count, failed?"FAILED, trees differ":"same tree");
+  
+  sync_free_state(one);
+  sync_free_state(batch);
+  sync_free_state(merged);
+  free(keys);
+  free(contexts);
+  return failed;
+}
+
+// Check that packets full of every kind of message decode to what was encoded
+static int test_encoding(unsigned packets, unsigned seed)
+{
+  srandom(seed);
+  unsigned messages=0, failed=0;
+  for (unsigned p=0;p<packets;p++){
+    uint8_t packet[TEST_PACKET_BYTES];
+    // one spare, for the message that no longer fits
+    key_message_t sent[TEST_PACKET_BYTES*8/MIN_MESSAGE_BITS+1];
+    size_t bit_offset=0;
+    unsigned count=0;
+    while(1){
+      key_message_t *message = &sent[count];
+      bzero(message, sizeof *message);
+      message->stored = random()&1;
+      if (random()&1){
+	message->prefix_len = KEY_LEN_BITS;
+	message->min_prefix_len = random()%(KEY_LEN_BITS+1);
+      }else{
+	message->prefix_len = random()%KEY_LEN_BITS;
+	message->min_prefix_len = (random()&1) ? message->prefix_len : random()%(message->prefix_len+1);
+      }
+      for (unsigned i=0;i<KEY_LEN;i++)
+	message->key.key[i]=random();
+      if (bit_offset + message_bits(message, 0) > sizeof(packet)<<3)
+	break;
+      encode_message(packet, &bit_offset, message, 0);
+      count++;
+    }
+    size_t len = (bit_offset+7)>>3;
+    
+    bit_offset=0;
+    unsigned received=0;
+    key_message_t message;
+    while(bit_offset + MIN_MESSAGE_BITS <= len<<3 && decode_message(packet, len, &bit_offset, &message)==0){
+      if (received >= count
+	|| message.stored != sent[received].stored
+	|| message.min_prefix_len != sent[received].min_prefix_len
+	|| message.prefix_len != sent[received].prefix_len
+	|| memcmp(&message.key, &sent[received].key, KEY_LEN))
+	failed++;
+      received++;
+    }
+    if (received != count)
+      failed++;
+    messages+=count;
+  }
+  printf("%u messages in %u packets encoded: %s\n", messages, packets, failed?"FAILED, decoded differently":"decoded the same");
+  return failed?1:0;
+}
+
+static double test_elapsed(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec)/1e9;
+}
+
+/* Time adding keys to a tree, looking up keys that are and aren't present, and
+   processing the records of two peers synchronising, who each lack 1% of the
+   keys. */
+static void test_bench(unsigned key_count, unsigned seed)
+{
+  struct timespec start;
+  srandom(seed);
+  sync_key_t *keys = allocate(sizeof(sync_key_t)*key_count*2);
+  for (unsigned k=0;k<key_count*2;k++)
+    for (unsigned i=0;i<KEY_LEN;i++)
+      keys[k].key[i]=random();
+  
+  struct sync_state *state = sync_alloc_state(NULL, NULL, NULL, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned k=0;k<key_count;k++)
+    sync_add_key(state, &keys[k], NULL);
+  double insert = test_elapsed(&start);
+  
+  struct sync_state *batch = sync_alloc_state(NULL, NULL, NULL, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  sync_add_keys(batch, keys, NULL, key_count);
+  double batch_insert = test_elapsed(&start);
+  sync_free_state(batch);
+  
+  // half of the lookups are of keys that we don't have
+  unsigned found=0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned r=0;r<4;r++)
+    for (unsigned k=0;k<key_count*2;k++)
+      found+=sync_key_exists(state, &keys[k]);
+  double lookup = test_elapsed(&start);
+  assert(found == key_count*4);
+  sync_free_state(state);
+  
+  struct sync_state *peers[2];
+  for (unsigned p=0;p<2;p++){
+    peers[p] = sync_alloc_state(NULL, NULL, NULL, NULL);
+    for (unsigned k=0;k<key_count;k++)
+      if (k%100 != p)
+	sync_add_key(peers[p], &keys[k], NULL);
+  }
+  unsigned long long records=0;
+  double recv=0;
+  for (unsigned round=0;round<TEST_MAX_ROUNDS;round++){
+    uint8_t packet[TEST_PACKET_BYTES];
+    size_t len = sync_build_message(peers[round&1], packet, sizeof packet);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sync_recv_message(peers[(round&1)^1], peers[round&1], packet, len);
+    recv+=test_elapsed(&start);
+    // stop once both have only their root node to say
+    if (!sync_has_transmit_queued(peers[0]) && !sync_has_transmit_queued(peers[1]) && round>1)
+      break;
+  }
+  for (unsigned p=0;p<2;p++){
+    records+=peers[p]->sent_record_count;
+    sync_free_state(peers[p]);
+  }
+  free(keys);
+  
+  printf("step=%d bits, %u keys: insert %.0f keys/s, batch insert %.0f keys/s, lookup %.0f keys/s, recv %.0f records/s (%llu records)\n",
+	 PREFIX_STEP_BITS, key_count, key_count/insert, key_count/batch_insert, key_count*8/lookup, records/recv, records);
+}
+
+int main(int argc,char **argv)
+{
+  if (argc>=3 && !strcmp(argv[1], "bench")){
+    test_bench(atoi(argv[2]), argc>3?atoi(argv[3]):1);
+    return 0;
+  }
+  if (argc<3){
+    fprintf(stderr,"Simulate synchronisation of sync trees between peers.\n");
+    fprintf(stderr,"usage: synctest <peers> <keys> [percentage of keys each peer has] [seed]\n");
+    fprintf(stderr,"       synctest bench <keys> [seed]\n");
+    exit(-3);
+  }
+  unsigned peer_count = atoi(argv[1]);
+  unsigned key_count = atoi(argv[2]);
+  int have_percent = argc>3?atoi(argv[3]):90;
+  unsigned seed = argc>4?atoi(argv[4]):1;
+  if (peer_count<2 || peer_count>TEST_MAX_PEERS){
+    fprintf(stderr,"Number of peers must be between 2 and %d\n",TEST_MAX_PEERS);
+    exit(-3);
+  }
+  
+  int failed=0;
+  if (test_encoding(1000, seed))
+    failed=1;
+  if (test_batch(key_count, seed))
+    failed=1;
+  if (test_run(peer_count, key_count, have_percent, 0, seed)<0)
+    failed=1;
+#ifdef ALT_PREFIX_STEP_BITS
+  if (test_run(peer_count, key_count, have_percent, 1, seed)<0)
+    failed=1;
+#endif
+  return failed;
+}
+#endif
@@ -2,13 +2,24 @@
 #define __SYNC_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 /*
 Synchronize two sets of keys, which are likely to contain many common values
 */
 
 #define KEY_LEN 8
+
+// Number of key bits consumed at each level of the tree, i.e., each node has
+// 1<<PREFIX_STEP_BITS children. Larger values give a shallower tree, so fewer
+// records are needed to find a difference, at the cost of larger nodes.
+// Peers built with different values can still synchronise.
+#ifndef PREFIX_STEP_BITS
 #define PREFIX_STEP_BITS 1
+#endif
+#if PREFIX_STEP_BITS!=1 && PREFIX_STEP_BITS!=2 && PREFIX_STEP_BITS!=4 && PREFIX_STEP_BITS!=8
+#error PREFIX_STEP_BITS must be 1, 2, 4 or 8
+#endif
 #define SYNC_MAX_RETRIES 1
 
 typedef struct {
@@ -17,6 +28,13 @@ typedef struct {
 
 struct sync_state;
 
+// Where we are up to in going through the keys that a peer lacks.
+// All zeros starts from the beginning.
+typedef struct {
+  sync_key_t next;
+  uint8_t finished;
+}sync_cursor_t;
+
 typedef void (*peer_has) (void *context, void *peer_context, const sync_key_t *key);
 typedef void (*peer_does_not_have) (void *context, void *peer_context, void *key_context, const sync_key_t *key);
 typedef void (*peer_now_has) (void *context, void *peer_context, void *key_context, const sync_key_t *key);
@@ -27,17 +45,34 @@ void sync_free_state(struct sync_state *state);
 // throw away all state related to peer
 void sync_free_peer_state(struct sync_state *state, void *peer_context);
 
+// report the bytes of tree nodes in use, and the bytes allocated for them
+void sync_node_memory(const struct sync_state *state, size_t *in_use, size_t *allocated);
+
 // tell the sync process that we now have key, with callback context
 // if the key is already present, the context will be updated
 void sync_add_key(struct sync_state *state, const sync_key_t *key, void *key_context);
+// add many keys at once, which is much faster than adding them one at a time
+// key_contexts may be NULL
+void sync_add_keys(struct sync_state *state, const sync_key_t *keys, void *const *key_contexts, unsigned count);
 int sync_key_exists(const struct sync_state *state, const sync_key_t *key);
 int sync_has_transmit_queued(const struct sync_state *state);
 
+// fill keys[] (and key_contexts[], if not NULL) with up to max more keys that this
+// peer is known to lack, in key order, carrying on from where the cursor is up to.
+// The trees may change between calls. Returns 0 once the cursor reaches the end.
+unsigned sync_peer_missing_keys(const struct sync_state *state, void *peer_context, sync_cursor_t *cursor,
+				sync_key_t *keys, void **key_contexts, unsigned max);
+void sync_cursor_reset(sync_cursor_t *cursor);
+
 // ask for a message to be inserted into buff, returns packet length
 size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len);
+// the same, in the older format with each record a fixed KEY_LEN+2 bytes.
+size_t sync_build_fixed_message(struct sync_state *state, uint8_t *buff, size_t len);
 
 // process a message received from a peer.
 int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len);
+// process a message from a peer that sends each record as a fixed KEY_LEN+2 bytes.
+int sync_recv_fixed_message(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len);
 
 
 #endif
@@ -207,6 +207,7 @@ int update_my_message(int serialfd,
     for(int i=0;i<3;i++)
       msg_out[offset++]=(tv.tv_usec>>(i*8))&0xff;    
   }
+  int announce_capabilities=0;
   if (!(random()%10)) {
     // Occassionally announce our instance (generation) ID
     // G + 4 random bytes = 5 bytes
@@ -215,6 +216,13 @@ int update_my_message(int serialfd,
     
     msg_out[offset++]='G';
     for(int i=0;i<4;i++) msg_out[offset++]=(my_instance_id>>(i*8))&0xff;
+
+    // Along with which of the newer message types we understand, at the end
+    // of the packet, since older peers give up on the rest of a packet at the
+    // first message type they don't know.
+    // C + capability bits = 2 bytes
+    announce_capabilities=1;
+    mtu-=2;
   }
 
 #ifdef SYNC_BY_BAR
@@ -249,6 +257,11 @@ int update_my_message(int serialfd,
 			    prefix,servald_server,credential);
 #endif
 
+  if (announce_capabilities) {
+    msg_out[offset++]='C';
+    msg_out[offset++]=LBARD_CAPABILITIES;
+  }
+
   // Increment message counter
   message_counter++;
 
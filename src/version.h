@@ -0,0 +1 @@
+#define VERSION_STRING "9ab3d96b9872b4c288404a7da6280b98"